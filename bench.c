@@ -0,0 +1,516 @@
+/* Clzip - LZMA lossless data compressor
+   Copyright (C) 2010-2021 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+   Benchmark of the hot paths of the encoder and decoder.
+   Usage: clzip_bench file...
+          clzip_bench --generate=text|binary|random size seed sample_file
+          clzip_bench --run=result_file command [argument...]
+
+   The files given are concatenated into one corpus in memory, which is
+   processed at every level from -0 to -9. Each level runs in a child
+   process, so that its peak RSS can be measured separately. Results are
+   written to stdout, one JSON object per line and per stage:
+
+   {"level":6,"stage":"decode","bytes":...,"seconds":...,"mb_per_s":...,
+    "cycles_per_byte":...}
+   {"level":6,"stage":"summary","in_size":...,"out_size":...,
+    "peak_rss_kib":...}
+
+   Stages: "crc32" and "range_coder" (literal coding of the corpus) are
+   level-independent; "match_finder" searches matches at every position;
+   "encode" is a complete compression; "sequence_optimizer" is "encode"
+   minus "match_finder" (the optimizer can't run without the match finder);
+   "decode" is LZd_decode_member on the output of "encode". "bytes" is always
+   the size of the uncompressed corpus. "cycles_per_byte" is null if no
+   cycle counter is available.
+
+   The other two modes serve testsuite/perf.sh. '--generate' writes to
+   stdout 'size' bytes (a number optionally followed by KiB or MiB) of a
+   synthetic corpus that only depends on its arguments: "text" strings
+   together the words of 'sample_file', mostly in their original order;
+   "binary" is a table of records with counters, small integers, flags
+   and words of 'sample_file'; "random" is incompressible. '--run' runs
+   a command, and writes to 'result_file' its elapsed time in seconds and
+   its peak RSS in KiB. Its exit status is that of the command.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define HAVE_RDTSC
+#include <x86intrin.h>
+#endif
+
+#include "lzip.h"
+#include "decoder.h"
+#include "encoder_base.h"
+#include "encoder.h"
+#include "fast_encoder.h"
+
+
+/* symbols required by the encoder and decoder, normally from main.c */
+int verbosity = 0;
+
+void * resize_buffer( void * buf, const unsigned min_size )
+  {
+  if( buf ) buf = realloc( buf, min_size );
+  else buf = malloc( min_size );
+  if( !buf ) { show_error( mem_msg, 0, false ); cleanup_and_fail( 1 ); }
+  return buf;
+  }
+
+void Pp_show_msg( struct Pretty_print * const pp, const char * const msg )
+  { if( pp && msg ) fprintf( stderr, "clzip_bench: %s\n", msg ); }
+
+void show_header( const unsigned dictionary_size )
+  { if( dictionary_size ) {} }
+
+void cleanup_and_fail( const int retval ) { exit( retval ); }
+
+void show_error( const char * const msg, const int errcode, const bool help )
+  {
+  if( msg && msg[0] )
+    fprintf( stderr, "clzip_bench: %s%s%s\n", msg,
+             ( errcode > 0 ) ? ": " : "",
+             ( errcode > 0 ) ? strerror( errcode ) : "" );
+  if( help ) {}
+  }
+
+void internal_error( const char * const msg )
+  {
+  fprintf( stderr, "clzip_bench: internal error: %s\n", msg );
+  exit( 3 );
+  }
+
+void show_cprogress( const unsigned long long cfile_size,
+                     const unsigned long long partial_size,
+                     const struct Matchfinder_base * const m,
+                     struct Pretty_print * const p )
+  { if( cfile_size || partial_size || m || p ) {} }
+
+void show_dprogress( const unsigned long long cfile_size,
+                     const unsigned long long partial_size,
+                     const struct Range_decoder * const d,
+                     struct Pretty_print * const p )
+  { if( cfile_size || partial_size || d || p ) {} }
+
+
+struct Timer
+  {
+  struct timespec start;
+  uint64_t start_cycles;
+  double seconds;
+  double cycles;			/* < 0 if not available */
+  };
+
+static void T_start( struct Timer * const t )
+  {
+  clock_gettime( CLOCK_MONOTONIC, &t->start );
+#ifdef HAVE_RDTSC
+  t->start_cycles = __rdtsc();
+#else
+  t->start_cycles = 0;
+#endif
+  }
+
+static void T_stop( struct Timer * const t )
+  {
+  struct timespec end;
+#ifdef HAVE_RDTSC
+  t->cycles = __rdtsc() - t->start_cycles;
+#else
+  t->cycles = -1;
+#endif
+  clock_gettime( CLOCK_MONOTONIC, &end );
+  t->seconds = ( end.tv_sec - t->start.tv_sec ) +
+               ( end.tv_nsec - t->start.tv_nsec ) / 1e9;
+  }
+
+
+static void print_stage( const int level, const char * const stage,
+                         const long long size, const double seconds,
+                         const double cycles )
+  {
+  printf( "{\"level\":%d,\"stage\":\"%s\",\"bytes\":%lld,\"seconds\":%.6f,"
+          "\"mb_per_s\":%.3f,\"cycles_per_byte\":", level, stage, size,
+          seconds, ( seconds > 0 ) ? size / seconds / 1e6 : 0.0 );
+  if( cycles >= 0 && size > 0 ) printf( "%.3f}\n", cycles / size );
+  else fputs( "null}\n", stdout );
+  }
+
+
+static uint8_t * read_corpus( const char * const names[], const int num_names,
+                              long long * const sizep )
+  {
+  uint8_t * buf = 0;
+  long long size = 0;
+  int i;
+  for( i = 0; i < num_names; ++i )
+    {
+    struct stat st;
+    FILE * const f = fopen( names[i], "rb" );
+    if( !f || fstat( fileno( f ), &st ) != 0 || !S_ISREG( st.st_mode ) ||
+        size + st.st_size > INT32_MAX / 2 )
+      { show_error( names[i], errno, false ); exit( 1 ); }
+    buf = (uint8_t *)resize_buffer( buf, size + st.st_size + 1 );
+    if( fread( buf + size, 1, st.st_size, f ) != (size_t)st.st_size )
+      { show_error( "Read error", errno, false ); exit( 1 ); }
+    size += st.st_size;
+    fclose( f );
+    }
+  *sizep = size;
+  return buf;
+  }
+
+
+static volatile uint32_t crc_sink;	/* keeps the result of bench_crc32 */
+
+static void bench_crc32( const uint8_t * const data, const long long size )
+  {
+  struct Timer t;
+  uint32_t crc = 0xFFFFFFFFU;
+  long long pos;
+  T_start( &t );
+  for( pos = 0; pos < size; pos += 1 << 20 )
+    CRC32_update_buf( &crc, data + pos, min( 1 << 20, size - pos ) );
+  T_stop( &t );
+  crc_sink = crc;
+  print_stage( -1, "crc32", size, t.seconds, t.cycles );
+  }
+
+
+/* Encode all the bytes of the corpus as literals. */
+static void bench_range_coder( const uint8_t * const data, const long long size )
+  {
+  struct FLZ_encoder fe;
+  struct Timer t;
+  long long pos;
+  if( !FLZe_init( &fe, 0, -1, data, size, -1 ) )
+    { show_error( mem_msg, 0, false ); exit( 1 ); }
+  T_start( &t );
+  for( pos = 0; pos < size; ++pos )
+    LZeb_encode_literal( &fe.eb, pos ? data[pos-1] : 0, data[pos] );
+  Re_flush( &fe.eb.renc );
+  T_stop( &t );
+  LZeb_free( &fe.eb );
+  print_stage( -1, "range_coder", size, t.seconds, t.cycles );
+  }
+
+
+static bool init_encoder( const int level, const uint8_t * const data,
+                          const long long size, struct LZ_encoder * const e,
+                          struct FLZ_encoder * const fe )
+  {
+  if( level == 0 ) return FLZe_init( fe, 0, -1, data, size, -1 );
+  return LZe_init( e, option_mapping[level].dictionary_size,
+                   option_mapping[level].match_len_limit,
+                   option_mapping[level].hash_chain, 0, -1, data, size, -1 );
+  }
+
+
+static void bench_level( const int level, const uint8_t * const data,
+                         const long long size )
+  {
+  const unsigned long long member_size = 0x0008000000000000ULL;
+  struct LZ_encoder * const e =
+    (struct LZ_encoder *)resize_buffer( 0, sizeof *e );
+  struct FLZ_encoder fe;
+  struct LZ_encoder_base * const eb = level ? &e->eb : &fe.eb;
+  struct Range_decoder rdec;
+  struct Timer mf, enc, dec;
+  struct rusage ru;
+  FILE * const tmp = tmpfile();
+  long long out_size;
+
+  /* match finder alone */
+  if( !tmp || !init_encoder( level, data, size, e, &fe ) )
+    { show_error( "Can't initialize encoder", errno, false ); exit( 1 ); }
+  if( level == 0 ) FLZe_reset_key4( &fe );
+  T_start( &mf );
+  while( !Mb_data_finished( &eb->mb ) )
+    {
+    if( level == 0 )
+      { int distance; FLZe_longest_match_len( &fe, &distance ); }
+    else LZe_get_match_pairs( e, e->pairs );
+    Mb_move_pos( &eb->mb );
+    }
+  T_stop( &mf );
+  LZeb_free( eb );
+  print_stage( level, "match_finder", size, mf.seconds, mf.cycles );
+
+  /* complete encoder */
+  if( !init_encoder( level, data, size, e, &fe ) )
+    { show_error( mem_msg, 0, false ); exit( 1 ); }
+  T_start( &enc );
+  while( true )
+    {
+    if( ( level == 0 && !FLZe_encode_member( &fe, member_size ) ) ||
+        ( level > 0 && !LZe_encode_member( e, member_size ) ) )
+      internal_error( "encoder error." );
+    if( Mb_data_finished( &eb->mb ) ) break;
+    if( level == 0 ) FLZe_reset( &fe ); else LZe_reset( e );
+    }
+  T_stop( &enc );
+  print_stage( level, "encode", size, enc.seconds, enc.cycles );
+  print_stage( level, "sequence_optimizer", size,
+               max( 0.0, enc.seconds - mf.seconds ),
+               ( enc.cycles >= 0 ) ? max( 0.0, enc.cycles - mf.cycles ) : -1 );
+  out_size = eb->renc.odata_size;
+  if( fwrite( eb->renc.odata, 1, out_size, tmp ) != (size_t)out_size ||
+      fflush( tmp ) != 0 )
+    { show_error( "Write error", errno, false ); exit( 1 ); }
+  LZeb_free( eb );
+  free( e );
+
+  /* decoder */
+  if( !Rd_init( &rdec, fileno( tmp ) ) )
+    { show_error( mem_msg, 0, false ); exit( 1 ); }
+  T_start( &dec );
+  Rd_set_block( &rdec, 0, out_size );
+  while( true )
+    {
+    struct LZ_decoder decoder;
+    Lzip_header header;
+    int result;
+    Rd_reset_member_position( &rdec );
+    if( Rd_read_data( &rdec, header, Lh_size ) != Lh_size ) break;
+    if( !LZd_init( &decoder, &rdec, Lh_get_dictionary_size( header ), -1 ) )
+      { show_error( mem_msg, 0, false ); exit( 1 ); }
+    result = LZd_decode_member( &decoder, 0 );
+    LZd_free( &decoder );
+    if( result != 0 ) { show_error( "Decoder error", 0, false ); exit( 2 ); }
+    }
+  T_stop( &dec );
+  Rd_free( &rdec );
+  fclose( tmp );
+  print_stage( level, "decode", size, dec.seconds, dec.cycles );
+
+  getrusage( RUSAGE_SELF, &ru );
+  printf( "{\"level\":%d,\"stage\":\"summary\",\"in_size\":%lld,"
+          "\"out_size\":%lld,\"peak_rss_kib\":%ld}\n",
+          level, size, out_size, ru.ru_maxrss );
+  }
+
+
+static uint32_t rng_state;
+
+/* xorshift32; the same sequence on every platform */
+static uint32_t rnd( void )
+  {
+  uint32_t x = rng_state;
+  x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+  return rng_state = x;
+  }
+
+
+static void put_le( uint8_t * const p, uint32_t value, const int size )
+  {
+  int i;
+  for( i = 0; i < size; ++i ) { p[i] = value; value >>= 8; }
+  }
+
+
+/* Split the sample into words at whitespace. Return the number of words. */
+static int split_words( uint8_t * const sample, const long long size,
+                        const uint8_t *** const wordsp, int ** const lensp )
+  {
+  const uint8_t ** words = 0;
+  int * lens = 0;
+  int num_words = 0;
+  long long pos = 0;
+  while( true )
+    {
+    long long end;
+    while( pos < size && sample[pos] <= ' ' ) ++pos;
+    if( pos >= size ) break;
+    for( end = pos; end < size && sample[end] > ' '; ++end ) {}
+    if( ( num_words & 1023 ) == 0 )
+      {
+      words = (const uint8_t **)resize_buffer( words,
+             ( num_words + 1024 ) * sizeof words[0] );
+      lens = (int *)resize_buffer( lens,
+             ( num_words + 1024 ) * sizeof lens[0] );
+      }
+    words[num_words] = sample + pos; lens[num_words++] = min( 64, end - pos );
+    pos = end;
+    }
+  *wordsp = words; *lensp = lens;
+  return num_words;
+  }
+
+
+/* Fill 'buf' with lines of words taken from the sample, continuing the
+   sample three times out of four and jumping to a random word otherwise,
+   so that phrases of the sample repeat at all distances. */
+static void generate_text( uint8_t * const buf, const long long size,
+                           const uint8_t * const words[], const int lens[],
+                           const int num_words )
+  {
+  long long pos = 0;
+  int column = 0, w = 0;
+  while( pos < size )
+    {
+    const int len = lens[w];
+    if( column > 0 )
+      buf[pos++] = ( column + len >= 72 ) ? '\n' : ' ';
+    if( pos > 0 && buf[pos-1] == '\n' ) column = 0;
+    if( pos + len > size ) { memset( buf + pos, ' ', size - pos ); break; }
+    memcpy( buf + pos, words[w], len ); pos += len; column += len + 1;
+    w = ( ( rnd() & 3 ) != 0 ) ? ( w + 1 ) % num_words :
+                                 (int)( rnd() % num_words );
+    }
+  }
+
+
+/* Records of 32 bytes: an identifier that grows in small steps, a
+   timestamp, a category code, a small count, a value that drifts, flags,
+   and a word of the sample padded with zeros. */
+static void generate_binary( uint8_t * const buf, const long long size,
+                             const uint8_t * const words[], const int lens[],
+                             const int num_words )
+  {
+  uint8_t record[32];
+  uint32_t id = 1000, stamp = 1600000000, value = 1 << 20;
+  long long pos;
+  for( pos = 0; pos < size; pos += 32 )
+    {
+    const int w = rnd() % num_words;
+    id += 1 + ( ( ( rnd() & 3 ) == 0 ) ? rnd() % 16 : 0U );
+    stamp += rnd() % 1000;
+    value += rnd() % 201 - 100;
+    put_le( record, id, 4 );
+    put_le( record + 4, stamp, 4 );
+    put_le( record + 8, 0x100 + 7 * ( rnd() % 12 ), 2 );
+    put_le( record + 10, rnd() % 300, 2 );
+    put_le( record + 12, value, 4 );
+    put_le( record + 16, rnd() & 0x01010101U, 4 );
+    memset( record + 20, 0, 12 );
+    memcpy( record + 20, words[w], min( 12, lens[w] ) );
+    memcpy( buf + pos, record, min( 32, size - pos ) );
+    }
+  }
+
+
+static int generate( const char * const kind, const char * const size_arg,
+                     const char * const seed_arg,
+                     const char * const sample_name )
+  {
+  const uint8_t ** words;
+  int * lens;
+  uint8_t * buf, * sample;
+  char * tail;
+  long long size = strtoll( size_arg, &tail, 10 ), sample_size;
+  int num_words;
+  if( strcmp( tail, "KiB" ) == 0 ) size <<= 10;
+  else if( strcmp( tail, "MiB" ) == 0 ) size <<= 20;
+  else if( tail[0] ) size = -1;
+  if( size <= 0 || size > INT32_MAX / 2 || ( strcmp( kind, "text" ) != 0 &&
+      strcmp( kind, "binary" ) != 0 && strcmp( kind, "random" ) != 0 ) )
+    { show_error( "Bad corpus kind or size.", 0, false ); return 1; }
+  rng_state = strtoul( seed_arg, 0, 10 ) * 2654435761U + 0x9E3779B9U;
+  if( rng_state == 0 ) rng_state = 1;
+  sample = read_corpus( &sample_name, 1, &sample_size );
+  num_words = split_words( sample, sample_size, &words, &lens );
+  if( num_words <= 0 )
+    { show_error( "The sample file contains no words.", 0, false ); return 1; }
+  buf = (uint8_t *)resize_buffer( 0, size );
+  if( strcmp( kind, "text" ) == 0 )
+    generate_text( buf, size, words, lens, num_words );
+  else if( strcmp( kind, "binary" ) == 0 )
+    generate_binary( buf, size, words, lens, num_words );
+  else
+    { long long pos; for( pos = 0; pos < size; ++pos ) buf[pos] = rnd() >> 24; }
+  if( fwrite( buf, 1, size, stdout ) != (size_t)size || fflush( stdout ) != 0 )
+    { show_error( "Write error", errno, false ); return 1; }
+  free( buf ); free( lens ); free( words ); free( sample );
+  return 0;
+  }
+
+
+/* Run a command and write its elapsed time and peak RSS to 'result_name'.
+   Only one child is waited for, so RUSAGE_CHILDREN measures just it. */
+static int run_timed( const char * const result_name, char * const argv[] )
+  {
+  struct Timer t;
+  struct rusage ru;
+  FILE * f;
+  int status;
+  pid_t pid;
+  T_start( &t );
+  pid = fork();
+  if( pid < 0 ) { show_error( "Can't fork", errno, false ); return 1; }
+  if( pid == 0 ) { execvp( argv[0], argv ); _exit( 127 ); }
+  if( waitpid( pid, &status, 0 ) != pid || !WIFEXITED( status ) ) return 1;
+  T_stop( &t );
+  getrusage( RUSAGE_CHILDREN, &ru );
+  f = fopen( result_name, "w" );
+  if( !f || fprintf( f, "%.6f %ld\n", t.seconds, ru.ru_maxrss ) < 0 ||
+      fclose( f ) != 0 )
+    { show_error( result_name, errno, false ); return 1; }
+  return WEXITSTATUS( status );
+  }
+
+
+int main( const int argc, const char * const argv[] )
+  {
+  long long size = 0;
+  uint8_t * data;
+  int level;
+
+  if( argc == 5 && strncmp( argv[1], "--generate=", 11 ) == 0 )
+    return generate( argv[1] + 11, argv[2], argv[3], argv[4] );
+  if( argc >= 3 && strncmp( argv[1], "--run=", 6 ) == 0 )
+    return run_timed( argv[1] + 6, (char **)argv + 2 );
+  if( argc < 2 || argv[1][0] == '-' )
+    { fputs( "Usage: clzip_bench file...\n"
+             "       clzip_bench --generate=text|binary|random size seed "
+             "sample_file\n"
+             "       clzip_bench --run=result_file command [argument...]\n",
+             stderr ); return 1; }
+  CRC32_init();
+  Dis_slots_init();
+  Prob_prices_init();
+  data = read_corpus( argv + 1, argc - 1, &size );
+
+  bench_crc32( data, size );
+  bench_range_coder( data, size );
+  fflush( stdout );
+  for( level = 0; level <= 9; ++level )
+    {
+    int status;
+    const pid_t pid = fork();
+    if( pid < 0 ) { show_error( "Can't fork", errno, false ); return 1; }
+    if( pid == 0 ) { bench_level( level, data, size ); fflush( stdout );
+                     _exit( 0 ); }
+    if( waitpid( pid, &status, 0 ) != pid ||
+        !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 ) return 1;
+    }
+  free( data );
+  return 0;
+  }
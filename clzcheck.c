@@ -0,0 +1,253 @@
+/* Clzcheck - Test program for the clzip library
+   Copyright (C) 2010-2021 Antonio Diaz Diaz.
+
+   This program is free software: you have unlimited permission
+   to copy, distribute, and modify it.
+
+   Usage: clzcheck filename.txt...
+          clzcheck -c level < file > file.lz
+          clzcheck -d < file.lz > file
+          clzcheck -r pos size file.lz > file
+
+   The first form compresses each file at every level, feeding and
+   draining the library in chunks of different sizes, decompresses the
+   result, and compares it with the original. The second and third forms
+   are filters, used by check.sh to compare the library with clzip. The
+   fourth form writes 'size' bytes of decompressed data starting at 'pos',
+   like 'clzip --range=pos,size'.
+   Exit status: 0 = OK, 1 = I/O or memory error, 2 = data error or the
+   round trip does not reproduce the input.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clzip.h"
+
+
+static struct CLZ_Dictionary * dictionary = 0;	/* used by pump if not 0 */
+
+/* These have the names of internal symbols of the library (crc32 is also
+   a function of zlib). The link fails if the library exports them. */
+int verbosity = 0;
+unsigned long crc32( unsigned long crc, const unsigned char * buf,
+                     unsigned len )
+  { if( buf ) crc += len; return crc; }
+
+static uint8_t * read_file( FILE * const f, long * const sizep )
+  {
+  long size = 0, capacity = 65536;
+  uint8_t * buf = (uint8_t *)malloc( capacity );
+  while( buf )
+    {
+    size += fread( buf + size, 1, capacity - size, f );
+    if( size < capacity ) break;
+    capacity *= 2;
+    buf = (uint8_t *)realloc( buf, capacity );
+    }
+  if( !buf || ferror( f ) )
+    { fputs( "clzcheck: Read error or not enough memory.\n", stderr );
+      exit( 1 ); }
+  *sizep = size;
+  return buf;
+  }
+
+
+/* Push 'insize' bytes through a new encoder (level >= 0) or decoder
+   (level < 0), writing and reading at most 'chunk' bytes at a time.
+   Return the output in a malloc'd buffer, or 0 if the library reports an
+   error, whose code is stored in '*errp'. */
+static uint8_t * pump( const int level, const uint8_t * const inbuf,
+                       const long insize, const int chunk,
+                       long * const outsizep, enum CLZ_Errno * const errp )
+  {
+  const bool compress = level >= 0;
+  struct CLZ_Encoder * const encoder =
+    compress ? CLZ_compress_open_dict( level, 0, dictionary ) : 0;
+  struct CLZ_Decoder * const decoder =
+    compress ? 0 : CLZ_decompress_open_dict( dictionary );
+  long inpos = 0, outsize = 0, capacity = 65536;
+  uint8_t * outbuf = (uint8_t *)malloc( capacity );
+  bool finished_in = false;
+
+  *errp = compress ? CLZ_compress_errno( encoder ) :
+                     CLZ_decompress_errno( decoder );
+  if( !outbuf || ( compress && !encoder ) || ( !compress && !decoder ) )
+    *errp = CLZ_mem_error;
+  while( *errp == CLZ_ok )
+    {
+    int rd;
+    if( inpos < insize )
+      {
+      const int size = ( insize - inpos < chunk ) ? insize - inpos : chunk;
+      const int wr = compress ?
+        CLZ_compress_write( encoder, inbuf + inpos, size ) :
+        CLZ_decompress_write( decoder, inbuf + inpos, size );
+      if( wr < 0 ) break;
+      inpos += wr;
+      }
+    else if( !finished_in )
+      {
+      if( ( compress ? CLZ_compress_finish( encoder ) :
+                       CLZ_decompress_finish( decoder ) ) < 0 ) break;
+      finished_in = true;
+      }
+    if( capacity - outsize < chunk )
+      {
+      capacity *= 2;
+      outbuf = (uint8_t *)realloc( outbuf, capacity );
+      if( !outbuf ) { *errp = CLZ_mem_error; break; }
+      }
+    rd = compress ? CLZ_compress_read( encoder, outbuf + outsize, chunk ) :
+                    CLZ_decompress_read( decoder, outbuf + outsize, chunk );
+    if( rd < 0 ) break;
+    outsize += rd;
+    if( compress ? CLZ_compress_finished( encoder ) == 1 :
+                   CLZ_decompress_finished( decoder ) == 1 ) break;
+    }
+  if( *errp == CLZ_ok )
+    *errp = compress ? CLZ_compress_errno( encoder ) :
+                       CLZ_decompress_errno( decoder );
+  if( compress ) CLZ_compress_close( encoder );
+  else CLZ_decompress_close( decoder );
+  if( *errp != CLZ_ok ) { free( outbuf ); return 0; }
+  *outsizep = outsize;
+  return outbuf;
+  }
+
+
+static int filter( const int level )
+  {
+  long insize, outsize;
+  enum CLZ_Errno err;
+  uint8_t * const inbuf = read_file( stdin, &insize );
+  uint8_t * const outbuf = pump( level, inbuf, insize, 4093, &outsize, &err );
+  free( inbuf );
+  if( !outbuf )
+    { fprintf( stderr, "clzcheck: %s\n", CLZ_strerror( err ) );
+      return ( err == CLZ_mem_error ) ? 1 : 2; }
+  if( fwrite( outbuf, 1, outsize, stdout ) != (size_t)outsize ||
+      fflush( stdout ) != 0 )
+    { fputs( "clzcheck: Write error.\n", stderr ); free( outbuf ); return 1; }
+  free( outbuf );
+  return 0;
+  }
+
+
+static int check_file( const char * const name )
+  {
+  static const int chunks[] = { 1, 17, 4096, 65536, 1 << 20 };
+  const int num_chunks = sizeof chunks / sizeof chunks[0];
+  FILE * const f = fopen( name, "rb" );
+  long insize;
+  uint8_t * inbuf;
+  int level, retval = 0;
+
+  if( !f ) { fprintf( stderr, "clzcheck: Can't open '%s'\n", name );
+             return 1; }
+  inbuf = read_file( f, &insize );
+  fclose( f );
+  for( level = 0; level <= 9 && retval == 0; ++level )
+    {
+    /* byte-sized chunks are slow; use them only with small inputs */
+    const int chunk = chunks[( level + ( insize > 100000 ) ) % num_chunks];
+    long lzsize, outsize;
+    enum CLZ_Errno err;
+    uint8_t * const lzbuf = pump( level, inbuf, insize, chunk, &lzsize, &err );
+    uint8_t * outbuf;
+    if( !lzbuf )
+      { fprintf( stderr, "clzcheck: level %d: compress: %s\n", level,
+                 CLZ_strerror( err ) ); retval = 2; break; }
+    outbuf = pump( -1, lzbuf, lzsize, chunks[( level + 2 ) % num_chunks],
+                   &outsize, &err );
+    if( !outbuf )
+      { fprintf( stderr, "clzcheck: level %d: decompress: %s\n", level,
+                 CLZ_strerror( err ) ); retval = 2; }
+    else if( outsize != insize || memcmp( inbuf, outbuf, insize ) != 0 )
+      { fprintf( stderr, "clzcheck: level %d: '%s' differs after round "
+                 "trip.\n", level, name ); retval = 2; }
+    free( outbuf );
+    free( lzbuf );
+    }
+  free( inbuf );
+  return retval;
+  }
+
+
+static int read_range( const long long pos, const int size,
+                       const char * const name )
+  {
+  FILE * const f = fopen( name, "rb" );
+  struct CLZ_Index * const index = f ? CLZ_index_open( fileno( f ) ) : 0;
+  uint8_t * const buf = (uint8_t *)malloc( size );
+  enum CLZ_Errno err = CLZ_mem_error;
+  int rd = -1;
+
+  if( !f ) { fprintf( stderr, "clzcheck: Can't open '%s'\n", name );
+             return 1; }
+  if( index && buf ) rd = CLZ_index_read( index, pos, buf, size );
+  if( rd < 0 && index ) err = CLZ_index_errno( index );
+  CLZ_index_close( index );
+  fclose( f );
+  if( rd < 0 )
+    { fprintf( stderr, "clzcheck: %s\n", CLZ_strerror( err ) ); free( buf );
+      return ( err == CLZ_mem_error || err == CLZ_bad_argument ) ? 1 : 2; }
+  if( fwrite( buf, 1, rd, stdout ) != (size_t)rd || fflush( stdout ) != 0 )
+    { fputs( "clzcheck: Write error.\n", stderr ); free( buf ); return 1; }
+  free( buf );
+  return 0;
+  }
+
+
+/* Load the preset dictionary used by all the coders from file 'name'. */
+static void load_dictionary( const char * const name )
+  {
+  FILE * const f = fopen( name, "rb" );
+  long size;
+  uint8_t * buf;
+  if( !f ) { fprintf( stderr, "clzcheck: Can't open '%s'\n", name );
+             exit( 1 ); }
+  buf = read_file( f, &size );
+  fclose( f );
+  dictionary = CLZ_dictionary_open( buf, size );
+  free( buf );
+  if( !dictionary )
+    { fputs( "clzcheck: Not enough memory.\n", stderr ); exit( 1 ); }
+  }
+
+
+int main( const int argc, const char * const argv[] )
+  {
+  int i, retval = 0;
+
+  if( ( argc == 3 || argc == 4 ) && strcmp( argv[1], "-c" ) == 0 &&
+      argv[2][0] >= '0' && argv[2][0] <= '9' && !argv[2][1] )
+    {
+    if( argc == 4 ) load_dictionary( argv[3] );
+    retval = filter( argv[2][0] - '0' );
+    CLZ_dictionary_close( dictionary );
+    return retval;
+    }
+  if( ( argc == 2 || argc == 3 ) && strcmp( argv[1], "-d" ) == 0 )
+    {
+    if( argc == 3 ) load_dictionary( argv[2] );
+    retval = filter( -1 );
+    CLZ_dictionary_close( dictionary );
+    return retval;
+    }
+  if( argc == 5 && strcmp( argv[1], "-r" ) == 0 )
+    return read_range( strtoll( argv[2], 0, 0 ), atoi( argv[3] ), argv[4] );
+  if( argc < 2 )
+    {
+    fputs( "Usage: clzcheck filename.txt...\n"
+           "       clzcheck -c level [dictionary] < file > file.lz\n"
+           "       clzcheck -d [dictionary] < file.lz > file\n"
+           "       clzcheck -r pos size file.lz > file\n", stderr );
+    return 1;
+    }
+  for( i = 1; i < argc && retval == 0; ++i ) retval = check_file( argv[i] );
+  return retval;
+  }
@@ -0,0 +1,131 @@
+/* Libclzip - In-memory streaming interface to the clzip coders
+   Copyright (C) 2010-2021 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+   Each encoder or decoder runs the same coders used by clzip in a thread
+   of its own. Data are pushed with *_write and pulled with *_read through
+   buffers owned by the caller. *_write never blocks; it returns the number
+   of bytes accepted, which may be 0 if the internal input buffer is full.
+   *_read blocks until some output is available, or the coder needs more
+   input, or the stream has ended; it returns the number of bytes read,
+   which is 0 if more input is needed. Call *_finish after writing the last
+   byte of input, then read until *_finished returns 1.
+   Functions returning int return -1 on error; call *_errno to know why.
+   The library never exits nor aborts the program on errors, including
+   running out of memory in the middle of a stream.
+   The encoders and decoders are independent and may be used concurrently
+   from different threads, but each one must be used by one thread at a
+   time.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+enum CLZ_Errno { CLZ_ok = 0, CLZ_bad_argument, CLZ_mem_error,
+                 CLZ_sequence_error, CLZ_header_error, CLZ_unexpected_eof,
+                 CLZ_data_error };
+
+const char * CLZ_strerror( const enum CLZ_Errno clz_errno );
+
+struct CLZ_Dictionary;
+struct CLZ_Encoder;
+struct CLZ_Decoder;
+
+/* A preset dictionary holds data similar to the data to be compressed,
+   which the encoder and the decoder take as preceding the data of every
+   member, as with 'clzip --preset-dict'. It mostly helps with small
+   inputs. The encoder indexes the dictionary again before each member,
+   which takes about as long as compressing it, so it should not be much
+   larger than needed. Data compressed with a dictionary can only be
+   decompressed with the same dictionary; the members record its CRC32,
+   and decoding them with another dictionary or without one (or decoding
+   other members with one) fails with CLZ_header_error. The data are
+   copied, and may be freed after the call. Returns 0 if 'size' is
+   negative or if there is not enough memory. A dictionary is never
+   modified; it may be shared by any number of encoders and decoders, used
+   concurrently, and must be closed after all of them. */
+struct CLZ_Dictionary * CLZ_dictionary_open( const uint8_t * const buffer,
+                                             const int size );
+int CLZ_dictionary_close( struct CLZ_Dictionary * const dictionary );
+
+/* 'level' is 0 to 9, as in 'clzip -0' to 'clzip -9'. 'member_size' limits
+   the size of the members produced; 0 means no limit. Returns 0 only if
+   there is not enough memory for the encoder; other errors are reported by
+   CLZ_compress_errno. */
+struct CLZ_Encoder * CLZ_compress_open( const int level,
+                                        const unsigned long long member_size );
+/* Like CLZ_compress_open, using 'dictionary' if it is not 0. */
+struct CLZ_Encoder *
+CLZ_compress_open_dict( const int level, const unsigned long long member_size,
+                        const struct CLZ_Dictionary * const dictionary );
+int CLZ_compress_close( struct CLZ_Encoder * const encoder );
+int CLZ_compress_finish( struct CLZ_Encoder * const encoder );
+int CLZ_compress_write( struct CLZ_Encoder * const encoder,
+                        const uint8_t * const buffer, const int size );
+int CLZ_compress_read( struct CLZ_Encoder * const encoder,
+                       uint8_t * const buffer, const int size );
+enum CLZ_Errno CLZ_compress_errno( struct CLZ_Encoder * const encoder );
+int CLZ_compress_finished( struct CLZ_Encoder * const encoder );
+unsigned long long CLZ_compress_total_in_size( struct CLZ_Encoder * const encoder );
+unsigned long long CLZ_compress_total_out_size( struct CLZ_Encoder * const encoder );
+
+/* The decoder accepts multimember data. Data following the last member
+   are ignored, as clzip does by default. */
+struct CLZ_Decoder * CLZ_decompress_open( void );
+struct CLZ_Decoder *
+CLZ_decompress_open_dict( const struct CLZ_Dictionary * const dictionary );
+int CLZ_decompress_close( struct CLZ_Decoder * const decoder );
+int CLZ_decompress_finish( struct CLZ_Decoder * const decoder );
+int CLZ_decompress_write( struct CLZ_Decoder * const decoder,
+                          const uint8_t * const buffer, const int size );
+int CLZ_decompress_read( struct CLZ_Decoder * const decoder,
+                         uint8_t * const buffer, const int size );
+enum CLZ_Errno CLZ_decompress_errno( struct CLZ_Decoder * const decoder );
+int CLZ_decompress_finished( struct CLZ_Decoder * const decoder );
+unsigned long long CLZ_decompress_total_in_size( struct CLZ_Decoder * const decoder );
+unsigned long long CLZ_decompress_total_out_size( struct CLZ_Decoder * const decoder );
+
+/* Random access to a seekable file in lzip format (a regular file, for
+   example) open on 'fd'. CLZ_index_open reads the headers and trailers of
+   all the members to locate their data, as 'clzip --range' does. It
+   returns 0 only if there is not enough memory for the index; other errors
+   are reported by CLZ_index_errno (CLZ_bad_argument if 'fd' can't be read
+   or is not seekable, CLZ_header_error if the file is not a valid lzip
+   file). Trailing data are ignored. 'fd' must stay open until the index is
+   closed. CLZ_index_read writes to 'buffer' the 'size' bytes of
+   decompressed data starting at 'pos', decoding only the members that
+   overlap them. It returns the number of bytes written, which is less than
+   'size' only if the range extends past the end of the data. It sets
+   CLZ_data_error if a member is corrupt, and CLZ_bad_argument if 'fd' can't
+   be read. The dictionary buffer is kept between reads, but each read
+   decodes from the start of the first member that overlaps it, so reading
+   large ranges is cheaper than reading many small ones. The interface
+   can't decode data compressed with a preset dictionary. */
+struct CLZ_Index;
+
+struct CLZ_Index * CLZ_index_open( const int fd );
+int CLZ_index_close( struct CLZ_Index * const index );
+long long CLZ_index_data_size( struct CLZ_Index * const index );
+int CLZ_index_read( struct CLZ_Index * const index, const long long pos,
+                    uint8_t * const buffer, const int size );
+enum CLZ_Errno CLZ_index_errno( struct CLZ_Index * const index );
+
+#ifdef __cplusplus
+}
+#endif
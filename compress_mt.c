@@ -0,0 +1,498 @@
+/* Clzip - LZMA lossless data compressor
+   Copyright (C) 2010-2021 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lzip.h"
+#include "encoder_base.h"
+#include "encoder.h"
+#include "fast_encoder.h"
+
+
+/* The input is split in blocks of data_size bytes. Each block is compressed
+   independently (as one or more members) by one of the worker threads.
+   Reading of blocks is serialized by 'imutex', and each worker waits for
+   its turn to write its compressed block, so that the members are written
+   in the same order as the data blocks were read. Memory use is bounded to
+   one input block and one compressed block per worker.
+
+   In chained mode (options->overlap >= 0) the whole input is coded as a
+   single member instead. Each block is read after a copy of the last
+   'overlap' bytes of the previous one, which the worker adds to its match
+   finder as a preset, so that the matches can reach across blocks. The
+   workers only parse their blocks, in parallel, discarding their output
+   and logging their decisions. Then, in turn, each worker codes the log
+   of its block with the shared Chain_coder, which keeps the state of the
+   member from block to block. A longer overlap finds more matches across
+   blocks but costs more time indexing it. Memory use grows by the
+   dictionary of the Chain_coder and by one log per worker.
+*/
+struct Chain_coder
+  {
+  struct LZ_encoder_base eb;	/* eb.mb is only a window on the data */
+  int reps[num_rep_distances];
+  State state;
+  uint8_t * window;		/* eb.mb.buffer, of window_size bytes */
+  int window_size;
+  struct Coder_stats stats;	/* symbols coded, if options->stats */
+  };
+
+struct Cshared			/* data shared by all the worker threads */
+  {
+  const struct Cmt_options * options;
+  pthread_mutex_t imutex;	/* protects the input fields below */
+  unsigned next_in_id;		/* id of next block to be read */
+  bool at_stream_end;		/* no more blocks to read */
+  uint8_t * tail;		/* chained mode: end of the last block read */
+  int tail_size;
+  pthread_mutex_t omutex;	/* protects options->stats and the fields below */
+  pthread_cond_t oturn;		/* next_out_id has changed */
+  unsigned next_out_id;		/* id of next block to be written */
+  unsigned long long in_size, out_size;
+  const char * error_msg;	/* set by the first worker that fails */
+  struct Chain_coder * chain;	/* used by the worker whose turn it is */
+  int infd, outfd;
+  };
+
+
+/* Start the member, with the data window empty. The byte before the data
+   is a zero, which gives the context of the first literal. */
+static struct Chain_coder * Cc_open( const struct Cmt_options * const options,
+                                     const int outfd )
+  {
+  struct Chain_coder * const cc =
+    (struct Chain_coder *)malloc( sizeof (struct Chain_coder) );
+  struct Matchfinder_base * const mb = cc ? &cc->eb.mb : 0;
+  int i;
+  if( !cc ) return 0;
+  cc->window_size = 1 + options->dictionary_size + options->data_size;
+  cc->window = (uint8_t *)table_alloc( cc->window_size );
+  if( !cc->window ) { free( cc ); return 0; }
+  if( !Re_init( &cc->eb.renc, options->dictionary_size, outfd, 0 ) )
+    { table_free( cc->window, cc->window_size ); free( cc ); return 0; }
+  cc->window[0] = 0;
+  mb->buffer = cc->window;
+  mb->partial_data_pos = -1ULL;
+  mb->pos = mb->stream_pos = 1;
+  mb->dictionary_size = options->dictionary_size;
+  mb->at_stream_end = false;
+  cc->eb.stats = options->stats ? &cc->stats : 0;
+  cc->eb.log = 0;
+  memset( cc->eb.lit_version, 0, sizeof cc->eb.lit_version );
+  LZeb_reset_coder( &cc->eb );
+  for( i = 0; i < num_rep_distances; ++i ) cc->reps[i] = 0;
+  cc->state = 0;
+  Cst_init( &cc->stats );
+  return cc;
+  }
+
+
+static void Cc_close( struct Chain_coder * const cc )
+  {
+  if( !cc ) return;
+  Re_free( &cc->eb.renc );
+  table_free( cc->window, cc->window_size );
+  free( cc );
+  }
+
+
+static void Cc_code_literal( struct Chain_coder * const cc )
+  {
+  struct Matchfinder_base * const mb = &cc->eb.mb;
+  const int pos_state = Mb_data_position( mb ) & pos_state_mask;
+  const uint8_t prev_byte = Mb_peek( mb, 1 );
+  const uint8_t cur_byte = Mb_peek( mb, 0 );
+  Re_encode_bit( &cc->eb.renc, &cc->eb.bm_match[cc->state][pos_state], 0 );
+  if( St_is_char( cc->state ) )
+    LZeb_encode_literal( &cc->eb, prev_byte, cur_byte );
+  else
+    LZeb_encode_matched( &cc->eb, prev_byte, cur_byte,
+                         Mb_peek( mb, cc->reps[0] + 1 ) );
+  cc->state = St_set_char( cc->state );
+  CRC32_update_byte( &cc->eb.crc, cur_byte );
+  if( cc->eb.stats ) ++cc->stats.literals;
+  ++mb->pos;
+  }
+
+
+/* Code a match found by a worker that did not know the rep distances of
+   the member at the start of its block. It is coded as a rep if its
+   distance is one of the reps here, and a short rep not at rep0 becomes
+   a literal. */
+static void Cc_code_match( struct Chain_coder * const cc, const int dis,
+                           const int len )
+  {
+  struct LZ_encoder_base * const eb = &cc->eb;
+  const int pos_state = Mb_data_position( &eb->mb ) & pos_state_mask;
+  const State state = cc->state;
+  int * const reps = cc->reps;
+  int rep = 0, i;
+  while( rep < num_rep_distances && reps[rep] != dis ) ++rep;
+  if( len == 1 && rep != 0 ) { Cc_code_literal( cc ); return; }
+  CRC32_update_buf( &eb->crc, Mb_ptr_to_current_pos( &eb->mb ), len );
+  Re_encode_bit( &eb->renc, &eb->bm_match[state][pos_state], 1 );
+  Re_encode_bit( &eb->renc, &eb->bm_rep[state], rep < num_rep_distances );
+  if( rep < num_rep_distances )			/* repeated match */
+    {
+    Re_encode_bit( &eb->renc, &eb->bm_rep0[state], rep != 0 );
+    if( rep == 0 )
+      Re_encode_bit( &eb->renc, &eb->bm_len[state][pos_state], len > 1 );
+    else
+      {
+      Re_encode_bit( &eb->renc, &eb->bm_rep1[state], rep > 1 );
+      if( rep > 1 )
+        Re_encode_bit( &eb->renc, &eb->bm_rep2[state], rep > 2 );
+      for( i = rep; i > 0; --i ) reps[i] = reps[i-1];
+      reps[0] = dis;
+      }
+    if( eb->stats ) Cst_add_rep( eb->stats, rep, len );
+    if( len == 1 ) cc->state = St_set_short_rep( state );
+    else
+      {
+      Re_encode_len( &eb->renc, &eb->rep_len_model, len, pos_state );
+      cc->state = St_set_rep( state );
+      }
+    }
+  else						/* match */
+    {
+    LZeb_encode_pair( eb, dis, len, pos_state );
+    if( eb->stats ) Cst_add_match( eb->stats, len, get_slot( dis ) );
+    for( i = num_rep_distances - 1; i > 0; --i ) reps[i] = reps[i-1];
+    reps[0] = dis;
+    cc->state = St_set_match( state );
+    }
+  eb->mb.pos += len;
+  }
+
+
+/* Append the 'size' bytes of 'buf' to the window, dropping the data older
+   than the dictionary if they don't fit, and code them as 'log' says. */
+static void Cc_code_block( struct Chain_coder * const cc,
+                           const uint8_t * const buf, const int size,
+                           const struct Op_log * const log )
+  {
+  struct Matchfinder_base * const mb = &cc->eb.mb;
+  long i;
+  int j;
+  if( mb->stream_pos + size > cc->window_size )
+    {
+    const int offset = mb->pos - mb->dictionary_size;
+    memmove( cc->window, cc->window + offset, mb->stream_pos - offset );
+    mb->partial_data_pos += offset;
+    mb->pos -= offset;
+    mb->stream_pos -= offset;
+    }
+  memcpy( cc->window + mb->stream_pos, buf, size );
+  mb->stream_pos += size;
+  for( i = 0; i < log->size; ++i )
+    {
+    const struct Lz_op op = log->ops[i];
+    if( op.dis >= 0 ) Cc_code_match( cc, op.dis, op.len );
+    else for( j = 0; j < op.len; ++j ) Cc_code_literal( cc );
+    }
+  if( mb->pos != mb->stream_pos )
+    internal_error( "log does not match block in Cc_code_block." );
+  }
+
+
+/* Discard the output of a worker that only parses. */
+static void discard_data( void * const arg, const uint8_t * const buf,
+                          const int size )
+  { (void)arg; (void)buf; (void)size; }
+
+
+static void Cs_set_error( struct Cshared * const cs, const char * const msg )
+  {
+  pthread_mutex_lock( &cs->omutex );
+  if( !cs->error_msg ) cs->error_msg = msg;
+  pthread_cond_broadcast( &cs->oturn );		/* wake up waiting workers */
+  pthread_mutex_unlock( &cs->omutex );
+  }
+
+
+/* Read next input block into '*bufp'. Return its size and store its id in
+   '*idp', or return -1 if there are no more blocks. In chained mode the
+   block is read after a copy of the tail of the previous block, whose size
+   is stored in '*prefixp'.
+*/
+static int Cs_read_block( struct Cshared * const cs, uint8_t ** const bufp,
+                          unsigned * const idp, int * const prefixp )
+  {
+  const int data_size = cs->options->data_size;
+  const int overlap = max( 0, cs->options->overlap );
+  int size = -1;
+  bool mem_error = false;
+  pthread_mutex_lock( &cs->imutex );
+  if( !cs->at_stream_end )
+    {
+    if( !*bufp ) *bufp = (uint8_t *)malloc( overlap + data_size );
+    if( !*bufp ) { cs->at_stream_end = true; mem_error = true; }
+    else
+      {
+      const int prefix = cs->tail_size;
+      memcpy( *bufp, cs->tail, prefix );
+      size = readblock( cs->infd, *bufp + prefix, data_size );
+      if( size != data_size && errno )
+        { show_error( "Read error", errno, false ); cleanup_and_fail( 1 ); }
+      if( size < data_size ) cs->at_stream_end = true;
+      /* an empty input produces one empty member; else skip empty blocks */
+      if( size > 0 || cs->next_in_id == 0 ) *idp = cs->next_in_id++;
+      else size = -1;
+      if( size > 0 && overlap > 0 )
+        {
+        cs->tail_size = min( overlap, prefix + size );
+        memcpy( cs->tail, *bufp + prefix + size - cs->tail_size,
+                cs->tail_size );
+        }
+      *prefixp = prefix;
+      }
+    }
+  pthread_mutex_unlock( &cs->imutex );
+  if( mem_error ) Cs_set_error( cs, mem_msg );
+  return size;
+  }
+
+
+/* Compress 'size' bytes from 'buf' as a sequence of members and return the
+   encoder containing the compressed data, or 0 if not enough memory.
+   The encoder in '*ep' or '*fep', if any, is reused; else a new one is
+   created there with 'preset', which must not change when reusing it.
+   If 'stats' is not 0, the encoder counts its work in it. If 'log' is not
+   0, the encoder adds its decisions to it and discards the compressed data.
+*/
+static struct LZ_encoder_base *
+compress_block( const struct Cmt_options * const options,
+                const struct Preset_dict * const preset,
+                const uint8_t * const buf, const int size,
+                struct LZ_encoder ** const ep, struct FLZ_encoder ** const fep,
+                struct Coder_stats * const stats, struct Op_log * const log )
+  {
+  struct LZ_encoder_base * eb = 0;
+  if( options->zero )
+    {
+    if( *fep )
+      {
+      if( !FLZe_reinit( *fep, -1, buf, size, -1 ) )
+        { free( *fep ); *fep = 0; return 0; }
+      }
+    else
+      {
+      struct FLZ_encoder * const fe =
+        (struct FLZ_encoder *)malloc( sizeof *fe );
+      if( !fe ) return 0;
+      if( !FLZe_init( fe, preset, -1, buf, size, -1 ) )
+        { free( fe ); return 0; }
+      *fep = fe;
+      }
+    eb = &(*fep)->eb;
+    }
+  else
+    {
+    if( *ep )
+      {
+      if( !LZe_reinit( *ep, -1, buf, size, -1 ) )
+        { free( *ep ); *ep = 0; return 0; }
+      }
+    else
+      {
+      struct LZ_encoder * const e = (struct LZ_encoder *)malloc( sizeof *e );
+      if( !e ) return 0;
+      if( !LZe_init( e, options->dictionary_size, options->match_len_limit,
+                     options->hash_chain, preset, -1, buf, size, -1 ) )
+        { free( e ); return 0; }
+      LZe_set_target_speed( e, options->target_speed );
+      *ep = e;
+      }
+    eb = &(*ep)->eb;
+    }
+  eb->stats = stats;
+  eb->log = log;
+  if( log ) { eb->renc.flush_fn = discard_data; log->size = 0; }
+
+  while( true )			/* encode one member per iteration */
+    {
+    if( ( *fep && !FLZe_encode_member( *fep, options->member_size ) ) ||
+        ( *ep && !LZe_encode_member( *ep, options->member_size ) ) )
+      internal_error( "encoder error in compress_block." );
+    if( Mb_data_finished( &eb->mb ) ) break;
+    if( *fep ) FLZe_reset( *fep ); else LZe_reset( *ep );
+    }
+  return eb;
+  }
+
+
+/* In chained mode the symbols and members are counted by the Chain_coder.
+   Take from the parse only the work of the match finder and the prices. */
+static void add_parse_stats( struct Coder_stats * const dst,
+                             const struct Coder_stats * const src )
+  {
+  dst->mf_searches += src->mf_searches;
+  dst->mf_cycles += src->mf_cycles;
+  dst->price_updates += src->price_updates;
+  dst->dis_price_updates += src->dis_price_updates;
+  dst->align_price_updates += src->align_price_updates;
+  }
+
+
+static void * cworker( void * arg )
+  {
+  struct Cshared * const cs = (struct Cshared *)arg;
+  const bool chained = ( cs->options->overlap >= 0 );
+  uint8_t * buf = 0;
+  struct LZ_encoder * e = 0;		/* reused for all the blocks */
+  struct FLZ_encoder * fe = 0;
+  struct Coder_stats stats, pstats;
+  struct Op_log log = { 0, 0, 0, false };
+  struct Preset_dict prefix_dict;	/* chained mode: tail of last block */
+  unsigned id;
+  int size, prefix = 0;
+  Cst_init( &stats );
+  while( ( size = Cs_read_block( cs, &buf, &id, &prefix ) ) >= 0 )
+    {
+    struct LZ_encoder_base * eb;
+    bool error;
+    prefix_dict.data = buf; prefix_dict.size = prefix;
+    prefix_dict.id = 0;			/* the worker output is discarded */
+    if( chained ) Cst_init( &pstats );
+    eb = compress_block( cs->options,
+                         chained ? &prefix_dict : cs->options->preset,
+                         buf + prefix, size, &e, &fe,
+                         cs->options->stats ? ( chained ? &pstats : &stats ) : 0,
+                         chained ? &log : 0 );
+    if( !eb || log.error )
+      { Cs_set_error( cs, "Not enough memory. Try a smaller dictionary size." );
+        break; }
+    if( chained && cs->options->stats ) add_parse_stats( &stats, &pstats );
+
+    pthread_mutex_lock( &cs->omutex );		/* wait for our turn */
+    while( cs->next_out_id != id && !cs->error_msg )
+      pthread_cond_wait( &cs->oturn, &cs->omutex );
+    error = ( cs->error_msg != 0 );
+    pthread_mutex_unlock( &cs->omutex );
+    if( !error )
+      {
+      int osize = 0;
+      if( chained ) Cc_code_block( cs->chain, buf + prefix, size, &log );
+      else
+        {
+        osize = eb->renc.odata_size;
+        if( writeblock( cs->outfd, eb->renc.odata, osize ) != osize )
+          { show_error( "Write error", errno, false ); cleanup_and_fail( 1 ); }
+        }
+      pthread_mutex_lock( &cs->omutex );
+      cs->in_size += size;
+      cs->out_size += osize;
+      ++cs->next_out_id;
+      pthread_cond_broadcast( &cs->oturn );
+      pthread_mutex_unlock( &cs->omutex );
+      }
+    if( error ) break;
+    }
+  if( cs->options->stats )
+    {
+    pthread_mutex_lock( &cs->omutex );
+    Cst_merge( cs->options->stats, &stats );
+    pthread_mutex_unlock( &cs->omutex );
+    }
+  if( e ) LZeb_free( &e->eb );
+  if( fe ) LZeb_free( &fe->eb );
+  free( e ); free( fe );
+  free( log.ops );
+  free( buf );
+  return 0;
+  }
+
+
+/* Return value: 0 = OK, 1 = error. */
+int compress_mt( const struct Cmt_options * const options,
+                 const int infd, const int outfd,
+                 struct Pretty_print * const pp,
+                 unsigned long long * const in_sizep,
+                 unsigned long long * const out_sizep )
+  {
+  struct Cshared cs;
+  pthread_t * const workers =
+    (pthread_t *)malloc( options->num_workers * sizeof (pthread_t) );
+  sigset_t mask, old_mask;
+  int i, num_started = 0, retval = 0;
+
+  if( !workers ) { Pp_show_msg( pp, mem_msg ); return 1; }
+  cs.options = options;
+  cs.next_in_id = 0;
+  cs.at_stream_end = false;
+  cs.tail = 0;
+  cs.tail_size = 0;
+  cs.chain = 0;
+  if( options->overlap >= 0 &&
+      ( !( cs.tail = (uint8_t *)malloc( max( 1, options->overlap ) ) ) ||
+        !( cs.chain = Cc_open( options, outfd ) ) ) )
+    { free( cs.tail ); free( workers );
+      Pp_show_msg( pp, "Not enough memory. Try a smaller dictionary size." );
+      return 1; }
+  cs.next_out_id = 0;
+  cs.in_size = 0;
+  cs.out_size = 0;
+  cs.error_msg = 0;
+  cs.infd = infd;
+  cs.outfd = outfd;
+  pthread_mutex_init( &cs.imutex, 0 );
+  pthread_mutex_init( &cs.omutex, 0 );
+  pthread_cond_init( &cs.oturn, 0 );
+
+  /* let the main thread alone handle the signals that delete the output */
+  sigemptyset( &mask );
+  sigaddset( &mask, SIGHUP );
+  sigaddset( &mask, SIGINT );
+  sigaddset( &mask, SIGTERM );
+  pthread_sigmask( SIG_BLOCK, &mask, &old_mask );
+  for( i = 0; i < options->num_workers; ++i )
+    {
+    if( pthread_create( &workers[i], 0, cworker, &cs ) != 0 ) break;
+    ++num_started;
+    }
+  pthread_sigmask( SIG_SETMASK, &old_mask, 0 );
+  if( num_started == 0 )
+    Cs_set_error( &cs, "Can't create worker threads." );
+
+  for( i = 0; i < num_started; ++i )
+    if( pthread_join( workers[i], 0 ) != 0 )
+      internal_error( "can't join worker threads." );
+  free( workers );
+  if( cs.chain && !cs.error_msg )		/* end the member */
+    {
+    LZeb_full_flush( &cs.chain->eb, cs.chain->state );
+    cs.out_size = Re_member_position( &cs.chain->eb.renc );
+    if( options->stats ) Cst_merge( options->stats, &cs.chain->stats );
+    }
+  Cc_close( cs.chain );
+  free( cs.tail );
+  if( cs.error_msg ) { Pp_show_msg( pp, cs.error_msg ); retval = 1; }
+  *in_sizep = cs.in_size;
+  *out_sizep = cs.out_size;
+  pthread_cond_destroy( &cs.oturn );
+  pthread_mutex_destroy( &cs.omutex );
+  pthread_mutex_destroy( &cs.imutex );
+  return retval;
+  }
@@ -0,0 +1,211 @@
+/* Clzip - LZMA lossless data compressor
+   Copyright (C) 2010-2021 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC32_PCLMUL
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__linux__) && \
+      defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC32_ARMV8
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#include "lzip.h"
+
+
+/* All the functions below operate on the raw (not inverted) crc, and
+   produce the same result as the bytewise algorithm using 'crc32_table'. */
+
+CRC32 crc32_table;
+static CRC32 crc32_slice[8];	/* crc32_slice[0] == crc32_table */
+
+typedef uint32_t Update_fn( uint32_t c, const uint8_t * buffer, int size );
+
+
+/* Slice-by-8. Reads the bytes one by one so that it does not depend on the
+   endianness or alignment; compilers usually merge the loads. */
+static uint32_t update_slice8( uint32_t c, const uint8_t * buffer, int size )
+  {
+  for( ; size >= 8; size -= 8, buffer += 8 )
+    {
+    c ^= buffer[0] | ( buffer[1] << 8 ) | ( buffer[2] << 16 ) |
+         ( (uint32_t)buffer[3] << 24 );
+    c = crc32_slice[7][c & 0xFF] ^ crc32_slice[6][(c >> 8) & 0xFF] ^
+        crc32_slice[5][(c >> 16) & 0xFF] ^ crc32_slice[4][c >> 24] ^
+        crc32_slice[3][buffer[4]] ^ crc32_slice[2][buffer[5]] ^
+        crc32_slice[1][buffer[6]] ^ crc32_slice[0][buffer[7]];
+    }
+  for( ; size > 0; --size, ++buffer )
+    c = crc32_table[(c^*buffer)&0xFF] ^ ( c >> 8 );
+  return c;
+  }
+
+static Update_fn * update_fn = update_slice8;
+
+
+#ifdef CRC32_PCLMUL
+/* Folding with carry-less multiplication, as described in "Fast CRC
+   Computation for Generic Polynomials Using PCLMULQDQ Instruction" by
+   V. Gopal et al. (Intel, 2009). 'size' must be a multiple of 16, >= 64. */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t fold_pclmul( const uint32_t c, const uint8_t * buffer,
+                             int size )
+  {
+  const __m128i k1k2 = _mm_set_epi64x( 0x01c6e41596LL, 0x0154442bd4LL );
+  const __m128i k3k4 = _mm_set_epi64x( 0x00ccaa009eLL, 0x01751997d0LL );
+  const __m128i k5k0 = _mm_set_epi64x( 0, 0x0163cd6124LL );
+  const __m128i poly = _mm_set_epi64x( 0x01f7011641LL, 0x01db710641LL );
+  const __m128i mask32 = _mm_setr_epi32( ~0, 0, ~0, 0 );
+  __m128i x1 = _mm_loadu_si128( (const __m128i *)( buffer + 0x00 ) );
+  __m128i x2 = _mm_loadu_si128( (const __m128i *)( buffer + 0x10 ) );
+  __m128i x3 = _mm_loadu_si128( (const __m128i *)( buffer + 0x20 ) );
+  __m128i x4 = _mm_loadu_si128( (const __m128i *)( buffer + 0x30 ) );
+  __m128i x5;
+  x1 = _mm_xor_si128( x1, _mm_cvtsi32_si128( c ) );
+  buffer += 64; size -= 64;
+
+  for( ; size >= 64; buffer += 64, size -= 64 )	/* fold 4 x 128 bits */
+    {
+    const __m128i x6 = _mm_clmulepi64_si128( x2, k1k2, 0x00 );
+    const __m128i x7 = _mm_clmulepi64_si128( x3, k1k2, 0x00 );
+    const __m128i x8 = _mm_clmulepi64_si128( x4, k1k2, 0x00 );
+    x5 = _mm_clmulepi64_si128( x1, k1k2, 0x00 );
+    x1 = _mm_clmulepi64_si128( x1, k1k2, 0x11 );
+    x2 = _mm_clmulepi64_si128( x2, k1k2, 0x11 );
+    x3 = _mm_clmulepi64_si128( x3, k1k2, 0x11 );
+    x4 = _mm_clmulepi64_si128( x4, k1k2, 0x11 );
+    x1 = _mm_xor_si128( _mm_xor_si128( x1, x5 ),
+           _mm_loadu_si128( (const __m128i *)( buffer + 0x00 ) ) );
+    x2 = _mm_xor_si128( _mm_xor_si128( x2, x6 ),
+           _mm_loadu_si128( (const __m128i *)( buffer + 0x10 ) ) );
+    x3 = _mm_xor_si128( _mm_xor_si128( x3, x7 ),
+           _mm_loadu_si128( (const __m128i *)( buffer + 0x20 ) ) );
+    x4 = _mm_xor_si128( _mm_xor_si128( x4, x8 ),
+           _mm_loadu_si128( (const __m128i *)( buffer + 0x30 ) ) );
+    }
+
+  /* fold into 128 bits */
+  x5 = _mm_clmulepi64_si128( x1, k3k4, 0x00 );
+  x1 = _mm_clmulepi64_si128( x1, k3k4, 0x11 );
+  x1 = _mm_xor_si128( _mm_xor_si128( x1, x2 ), x5 );
+  x5 = _mm_clmulepi64_si128( x1, k3k4, 0x00 );
+  x1 = _mm_clmulepi64_si128( x1, k3k4, 0x11 );
+  x1 = _mm_xor_si128( _mm_xor_si128( x1, x3 ), x5 );
+  x5 = _mm_clmulepi64_si128( x1, k3k4, 0x00 );
+  x1 = _mm_clmulepi64_si128( x1, k3k4, 0x11 );
+  x1 = _mm_xor_si128( _mm_xor_si128( x1, x4 ), x5 );
+
+  for( ; size >= 16; buffer += 16, size -= 16 )	/* fold 128 bits */
+    {
+    x5 = _mm_clmulepi64_si128( x1, k3k4, 0x00 );
+    x1 = _mm_clmulepi64_si128( x1, k3k4, 0x11 );
+    x1 = _mm_xor_si128( _mm_xor_si128( x1, x5 ),
+           _mm_loadu_si128( (const __m128i *)buffer ) );
+    }
+
+  /* fold 128 bits to 64 bits */
+  x2 = _mm_clmulepi64_si128( x1, k3k4, 0x10 );
+  x1 = _mm_xor_si128( _mm_srli_si128( x1, 8 ), x2 );
+  x2 = _mm_srli_si128( x1, 4 );
+  x1 = _mm_and_si128( x1, mask32 );
+  x1 = _mm_clmulepi64_si128( x1, k5k0, 0x00 );
+  x1 = _mm_xor_si128( x1, x2 );
+
+  /* Barrett reduction to 32 bits */
+  x2 = _mm_and_si128( x1, mask32 );
+  x2 = _mm_clmulepi64_si128( x2, poly, 0x10 );
+  x2 = _mm_and_si128( x2, mask32 );
+  x2 = _mm_clmulepi64_si128( x2, poly, 0x00 );
+  x1 = _mm_xor_si128( x1, x2 );
+  return _mm_extract_epi32( x1, 1 );
+  }
+
+static uint32_t update_pclmul( uint32_t c, const uint8_t * buffer, int size )
+  {
+  if( size >= 64 )
+    {
+    const int fsize = size & ~15;
+    c = fold_pclmul( c, buffer, fsize );
+    buffer += fsize; size -= fsize;
+    }
+  return update_slice8( c, buffer, size );
+  }
+#endif
+
+
+#ifdef CRC32_ARMV8
+#ifdef __clang__
+__attribute__((target("crc")))
+#else
+__attribute__((target("+crc")))
+#endif
+static uint32_t update_armv8( uint32_t c, const uint8_t * buffer, int size )
+  {
+  for( ; size > 0 && ( (uintptr_t)buffer & 7 ) != 0; --size, ++buffer )
+    c = __crc32b( c, *buffer );
+  for( ; size >= 8; size -= 8, buffer += 8 )
+    {
+    uint64_t word;
+    memcpy( &word, buffer, 8 );
+    c = __crc32d( c, word );
+    }
+  for( ; size > 0; --size, ++buffer )
+    c = __crc32b( c, *buffer );
+  return c;
+  }
+#endif
+
+
+void CRC32_init( void )
+  {
+  unsigned n;
+  int k;
+  for( n = 0; n < 256; ++n )
+    {
+    unsigned c = n;
+    for( k = 0; k < 8; ++k )
+      { if( c & 1 ) c = 0xEDB88320U ^ ( c >> 1 ); else c >>= 1; }
+    crc32_table[n] = c;
+    crc32_slice[0][n] = c;
+    }
+  for( n = 0; n < 256; ++n )
+    for( k = 1; k < 8; ++k )
+      { const uint32_t c = crc32_slice[k-1][n];
+        crc32_slice[k][n] = crc32_table[c & 0xFF] ^ ( c >> 8 ); }
+
+#ifdef CRC32_PCLMUL
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports( "pclmul" ) && __builtin_cpu_supports( "sse4.1" ) )
+    update_fn = update_pclmul;
+#endif
+#ifdef CRC32_ARMV8
+  if( getauxval( AT_HWCAP ) & HWCAP_CRC32 ) update_fn = update_armv8;
+#endif
+  }
+
+
+void CRC32_update_block( uint32_t * const crc, const uint8_t * const buffer,
+                         const int size )
+  { *crc = update_fn( *crc, buffer, size ); }
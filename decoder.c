@@ -28,6 +28,14 @@
 #include "lzip.h"
 #include "decoder.h"
 
+/* LZd_decode_symbol is instantiated four times; all the copies must be
+   inlined for the 'checked' and 'stats' arguments to be constant-folded. */
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
 
 /* Returns the number of bytes really read.
    If (returned value < size) and (errno == 0), means EOF was reached.
@@ -48,6 +56,26 @@ int readblock( const int fd, uint8_t * const buf, const int size )
   }
 
 
+/* Like readblock, but reads from offset 'pos' without changing the file
+   offset of 'fd'.
+*/
+int preadblock( const int fd, uint8_t * const buf, const int size,
+                const long long pos )
+  {
+  int sz = 0;
+  errno = 0;
+  while( sz < size )
+    {
+    const int n = pread( fd, buf + sz, size - sz, pos + sz );
+    if( n > 0 ) sz += n;
+    else if( n == 0 ) break;				/* EOF */
+    else if( errno != EINTR ) break;
+    errno = 0;
+    }
+  return sz;
+  }
+
+
 /* Returns the number of bytes really written.
    If (returned value < size), it is always an error.
 */
@@ -66,31 +94,107 @@ int writeblock( const int fd, const uint8_t * const buf, const int size )
   }
 
 
+/* Like writeblock, but writes at offset 'pos' without changing the file
+   offset of 'fd'.
+*/
+int pwriteblock( const int fd, const uint8_t * const buf, const int size,
+                 const long long pos )
+  {
+  int sz = 0;
+  errno = 0;
+  while( sz < size )
+    {
+    const int n = pwrite( fd, buf + sz, size - sz, pos + sz );
+    if( n > 0 ) sz += n;
+    else if( n < 0 && errno != EINTR ) break;
+    errno = 0;
+    }
+  return sz;
+  }
+
+
 bool Rd_read_block( struct Range_decoder * const rdec )
   {
   if( !rdec->at_stream_end )
     {
-    rdec->stream_pos = readblock( rdec->infd, rdec->buffer, rd_buffer_size );
-    if( rdec->stream_pos != rd_buffer_size && errno )
-      { show_error( "Read error", errno, false ); cleanup_and_fail( 1 ); }
+    if( rdec->read_fn )
+      rdec->stream_pos =
+        rdec->read_fn( rdec->read_arg, rdec->buffer, rd_buffer_size );
+    else
+      {
+      if( rdec->ipos < 0 )
+        rdec->stream_pos = readblock( rdec->infd, rdec->buffer, rd_buffer_size );
+      else
+        {
+        const int size = min( rd_buffer_size, rdec->iend - rdec->ipos );
+        rdec->stream_pos = preadblock( rdec->infd, rdec->buffer, size, rdec->ipos );
+        rdec->ipos += rdec->stream_pos;
+        }
+      if( rdec->stream_pos != rd_buffer_size && errno )
+        { show_error( "Read error", errno, false ); cleanup_and_fail( 1 ); }
+      }
     rdec->at_stream_end = ( rdec->stream_pos < rd_buffer_size );
     rdec->partial_member_pos += rdec->pos;
     rdec->pos = 0;
-    show_dprogress( 0, 0, 0, 0 );
+    if( rdec->ipos < 0 ) show_dprogress( 0, 0, 0, 0 );
     }
   return rdec->pos < rdec->stream_pos;
   }
 
 
+/* Read the preset id that follows 'header' if the member was coded with a
+   preset dictionary, and check that 'preset' (0 if none) is the one needed.
+   Must be called right after reading the header, and before decoding.
+   Return value: 0 = OK, 1 = wrong or missing preset, 2 = unexpected EOF.
+   On error, the reason is written to 'msg', of preset_msg_size bytes. */
+int Rd_check_preset( struct Range_decoder * const rdec,
+                     const Lzip_header header,
+                     const struct Preset_dict * const preset,
+                     char * const msg )
+  {
+  uint8_t buf[preset_id_size];
+  uint32_t id = 0;
+  int i;
+  if( !Lh_has_preset( header ) )
+    {
+    if( !preset ) return 0;
+    snprintf( msg, preset_msg_size,
+              "Member was not compressed with a preset dictionary." );
+    return 1;
+    }
+  if( Rd_read_data( rdec, buf, preset_id_size ) != preset_id_size )
+    { snprintf( msg, preset_msg_size, "File ends unexpectedly at member "
+                "header." ); return 2; }
+  for( i = preset_id_size - 1; i >= 0; --i ) id = ( id << 8 ) | buf[i];
+  if( preset && preset->id == id ) return 0;
+  if( !preset )
+    snprintf( msg, preset_msg_size, "Member needs preset dictionary %08X.",
+              id );
+  else
+    snprintf( msg, preset_msg_size, "Member needs preset dictionary %08X, "
+              "not %08X.", id, preset->id );
+  return 1;
+  }
+
+
 void LZd_flush_data( struct LZ_decoder * const d )
   {
   if( d->pos > d->stream_pos )
     {
     const int size = d->pos - d->stream_pos;
+    /* write only the part of the data inside [outskip, outend) */
+    const unsigned long long dpos = d->partial_data_pos + d->stream_pos;
+    const unsigned long long wbegin = max( dpos, d->outskip );
+    const unsigned long long wend = min( dpos + size, d->outend );
     CRC32_update_buf( &d->crc, d->buffer + d->stream_pos, size );
-    if( d->outfd >= 0 &&
-        writeblock( d->outfd, d->buffer + d->stream_pos, size ) != size )
-      { show_error( "Write error", errno, false ); cleanup_and_fail( 1 ); }
+    if( wbegin < wend )
+      {
+      const uint8_t * const wbuf = d->buffer + d->stream_pos + ( wbegin - dpos );
+      const int wsize = wend - wbegin;
+      if( d->flush_fn ) d->flush_fn( d->flush_arg, wbuf, wsize );
+      else if( d->outfd >= 0 && writeblock( d->outfd, wbuf, wsize ) != wsize )
+        { show_error( "Write error", errno, false ); cleanup_and_fail( 1 ); }
+      }
     if( d->pos >= d->dictionary_size )
       { d->partial_data_pos += d->pos; d->pos = 0; d->pos_wrapped = true; }
     d->stream_pos = d->pos;
@@ -112,7 +216,7 @@ static bool LZd_verify_trailer( struct LZ_decoder * const d,
   if( size < Lt_size )
     {
     error = true;
-    if( verbosity >= 0 )
+    if( pp && verbosity >= 0 )
       {
       Pp_show_msg( pp, 0 );
       fprintf( stderr, "Trailer truncated at trailer position %d;"
@@ -125,7 +229,7 @@ static bool LZd_verify_trailer( struct LZ_decoder * const d,
   if( td_crc != LZd_crc( d ) )
     {
     error = true;
-    if( verbosity >= 0 )
+    if( pp && verbosity >= 0 )
       {
       Pp_show_msg( pp, 0 );
       fprintf( stderr, "CRC mismatch; stored %08X, computed %08X\n",
@@ -136,7 +240,7 @@ static bool LZd_verify_trailer( struct LZ_decoder * const d,
   if( td_size != data_size )
     {
     error = true;
-    if( verbosity >= 0 )
+    if( pp && verbosity >= 0 )
       {
       Pp_show_msg( pp, 0 );
       fprintf( stderr, "Data size mismatch; stored %llu (0x%llX), computed %llu (0x%llX)\n",
@@ -147,7 +251,7 @@ static bool LZd_verify_trailer( struct LZ_decoder * const d,
   if( tm_size != member_size )
     {
     error = true;
-    if( verbosity >= 0 )
+    if( pp && verbosity >= 0 )
       {
       Pp_show_msg( pp, 0 );
       fprintf( stderr, "Member size mismatch; stored %llu (0x%llX), computed %llu (0x%llX)\n",
@@ -155,7 +259,8 @@ static bool LZd_verify_trailer( struct LZ_decoder * const d,
       }
     }
   if( error ) return false;
-  if( verbosity >= 2 )
+  if( d->stats ) Cst_add_member( d->stats, data_size, member_size );
+  if( pp && verbosity >= 2 )
     {
     if( verbosity >= 4 ) show_header( d->dictionary_size );
     if( data_size == 0 || member_size == 0 )
@@ -173,138 +278,158 @@ static bool LZd_verify_trailer( struct LZ_decoder * const d,
   }
 
 
-/* Return value: 0 = OK, 1 = decoder error, 2 = unexpected EOF,
-                 3 = trailer error, 4 = unknown marker found. */
-int LZd_decode_member( struct LZ_decoder * const d,
-                       struct Pretty_print * const pp )
+/* Decode one literal, match or marker, keeping the reps and the state in
+   'rep' and '*statep'. Return -1 if more symbols follow, else the return
+   value of LZd_decode_member. If 'checked' is false, Rd_fast_ok( rdec )
+   must be true. The symbol is counted in 'stats' if it is not 0. */
+static ALWAYS_INLINE int
+LZd_decode_symbol( struct LZ_decoder * const d, struct Pretty_print * const pp,
+                   unsigned rep[4], State * const statep, const bool checked,
+                   struct Coder_stats * const stats )
   {
   struct Range_decoder * const rdec = d->rdec;
-  Bit_model bm_literal[1<<literal_context_bits][0x300];
-  Bit_model bm_match[states][pos_states];
-  Bit_model bm_rep[states];
-  Bit_model bm_rep0[states];
-  Bit_model bm_rep1[states];
-  Bit_model bm_rep2[states];
-  Bit_model bm_len[states][pos_states];
-  Bit_model bm_dis_slot[len_states][1<<dis_slot_bits];
-  Bit_model bm_dis[modeled_distances-end_dis_model+1];
-  Bit_model bm_align[dis_align_size];
-  struct Len_model match_len_model;
-  struct Len_model rep_len_model;
-  unsigned rep0 = 0;		/* rep[0-3] latest four distances */
-  unsigned rep1 = 0;		/* used for efficient coding of */
-  unsigned rep2 = 0;		/* repeated distances */
-  unsigned rep3 = 0;
-  State state = 0;
-
-  Bm_array_init( bm_literal[0], (1 << literal_context_bits) * 0x300 );
-  Bm_array_init( bm_match[0], states * pos_states );
-  Bm_array_init( bm_rep, states );
-  Bm_array_init( bm_rep0, states );
-  Bm_array_init( bm_rep1, states );
-  Bm_array_init( bm_rep2, states );
-  Bm_array_init( bm_len[0], states * pos_states );
-  Bm_array_init( bm_dis_slot[0], len_states * (1 << dis_slot_bits) );
-  Bm_array_init( bm_dis, modeled_distances - end_dis_model + 1 );
-  Bm_array_init( bm_align, dis_align_size );
-  Lm_init( &match_len_model );
-  Lm_init( &rep_len_model );
-
-  Rd_load( rdec );
-  while( !Rd_finished( rdec ) )
+  struct LZd_state * const st = d->st;
+  State state = *statep;
+  int len, i;				/* i = index of the rep used */
+  const int pos_state = LZd_data_position( d ) & pos_state_mask;
+  if( Rd_decode_bit( rdec, &st->bm_match[state][pos_state], checked ) == 0 )
+    {						/* 1st bit */
+    /* literal byte */
+    Bit_model * const bm = st->bm_literal[get_lit_state(LZd_peek_prev( d ))];
+    if( St_is_char( state ) )
+      {
+      *statep = state - ( ( state < 4 ) ? state : 3 );
+      LZd_put_byte( d, Rd_decode_tree8( rdec, bm, checked ) );
+      }
+    else
+      {
+      *statep = state - ( ( state < 10 ) ? 3 : 6 );
+      LZd_put_byte( d, Rd_decode_matched( rdec, bm, LZd_peek( d, rep[0] ),
+                                          checked ) );
+      }
+    if( stats ) ++stats->literals;
+    return -1;
+    }
+  /* match or repeated match */
+  if( Rd_decode_bit( rdec, &st->bm_rep[state], checked ) != 0 )	/* 2nd bit */
     {
-    int len;
-    const int pos_state = LZd_data_position( d ) & pos_state_mask;
-    if( Rd_decode_bit( rdec, &bm_match[state][pos_state] ) == 0 ) /* 1st bit */
+    if( Rd_decode_bit( rdec, &st->bm_rep0[state], checked ) == 0 ) /* 3rd bit */
       {
-      /* literal byte */
-      Bit_model * const bm = bm_literal[get_lit_state(LZd_peek_prev( d ))];
-      if( St_is_char( state ) )
-        {
-        state -= ( state < 4 ) ? state : 3;
-        LZd_put_byte( d, Rd_decode_tree8( rdec, bm ) );
-        }
-      else
-        {
-        state -= ( state < 10 ) ? 3 : 6;
-        LZd_put_byte( d, Rd_decode_matched( rdec, bm, LZd_peek( d, rep0 ) ) );
-        }
-      continue;
+      if( Rd_decode_bit( rdec, &st->bm_len[state][pos_state], checked ) == 0 )
+        { *statep = St_set_short_rep( state );		/* 4th bit */
+          LZd_put_byte( d, LZd_peek( d, rep[0] ) );
+          if( stats ) Cst_add_rep( stats, 0, 1 );
+          return -1; }
+      i = 0;
       }
-    /* match or repeated match */
-    if( Rd_decode_bit( rdec, &bm_rep[state] ) != 0 )		/* 2nd bit */
+    else
       {
-      if( Rd_decode_bit( rdec, &bm_rep0[state] ) == 0 )		/* 3rd bit */
-        {
-        if( Rd_decode_bit( rdec, &bm_len[state][pos_state] ) == 0 ) /* 4th bit */
-          { state = St_set_short_rep( state );
-            LZd_put_byte( d, LZd_peek( d, rep0 ) ); continue; }
-        }
+      unsigned distance;
+      if( Rd_decode_bit( rdec, &st->bm_rep1[state], checked ) == 0 ) /* 4th */
+        { distance = rep[1]; i = 1; }
       else
         {
-        unsigned distance;
-        if( Rd_decode_bit( rdec, &bm_rep1[state] ) == 0 )	/* 4th bit */
-          distance = rep1;
+        if( Rd_decode_bit( rdec, &st->bm_rep2[state], checked ) == 0 ) /* 5th */
+          { distance = rep[2]; i = 2; }
         else
-          {
-          if( Rd_decode_bit( rdec, &bm_rep2[state] ) == 0 )	/* 5th bit */
-            distance = rep2;
-          else
-            { distance = rep3; rep3 = rep2; }
-          rep2 = rep1;
-          }
-        rep1 = rep0;
-        rep0 = distance;
+          { distance = rep[3]; rep[3] = rep[2]; i = 3; }
+        rep[2] = rep[1];
         }
-      state = St_set_rep( state );
-      len = min_match_len + Rd_decode_len( rdec, &rep_len_model, pos_state );
+      rep[1] = rep[0];
+      rep[0] = distance;
       }
-    else					/* match */
+    *statep = St_set_rep( state );
+    len = min_match_len +
+          Rd_decode_len( rdec, &st->rep_len_model, pos_state, checked );
+    if( stats ) Cst_add_rep( stats, i, len );
+    }
+  else					/* match */
+    {
+    unsigned distance, dis_slot;
+    len = min_match_len +
+          Rd_decode_len( rdec, &st->match_len_model, pos_state, checked );
+    distance = dis_slot =
+      Rd_decode_tree6( rdec, st->bm_dis_slot[get_len_state(len)], checked );
+    if( dis_slot >= start_dis_model )
       {
-      unsigned distance;
-      len = min_match_len + Rd_decode_len( rdec, &match_len_model, pos_state );
-      distance = Rd_decode_tree6( rdec, bm_dis_slot[get_len_state(len)] );
-      if( distance >= start_dis_model )
+      const int direct_bits = ( dis_slot >> 1 ) - 1;
+      distance = ( 2 | ( dis_slot & 1 ) ) << direct_bits;
+      if( dis_slot < end_dis_model )
+        distance += Rd_decode_tree_reversed( rdec,
+                    st->bm_dis + ( distance - dis_slot ), direct_bits,
+                    checked );
+      else
         {
-        const unsigned dis_slot = distance;
-        const int direct_bits = ( dis_slot >> 1 ) - 1;
-        distance = ( 2 | ( dis_slot & 1 ) ) << direct_bits;
-        if( dis_slot < end_dis_model )
-          distance += Rd_decode_tree_reversed( rdec,
-                      bm_dis + ( distance - dis_slot ), direct_bits );
-        else
+        distance += Rd_decode( rdec, direct_bits - dis_align_bits, checked )
+                    << dis_align_bits;
+        distance += Rd_decode_tree_reversed4( rdec, st->bm_align, checked );
+        if( distance == 0xFFFFFFFFU )		/* marker found */
           {
-          distance +=
-            Rd_decode( rdec, direct_bits - dis_align_bits ) << dis_align_bits;
-          distance += Rd_decode_tree_reversed4( rdec, bm_align );
-          if( distance == 0xFFFFFFFFU )		/* marker found */
+          Rd_normalize( rdec, checked );
+          LZd_flush_data( d );
+          if( len == min_match_len )		/* End Of Stream marker */
             {
-            Rd_normalize( rdec );
-            LZd_flush_data( d );
-            if( len == min_match_len )		/* End Of Stream marker */
-              {
-              if( LZd_verify_trailer( d, pp ) ) return 0; else return 3;
-              }
-            if( len == min_match_len + 1 )	/* Sync Flush marker */
-              {
-              Rd_load( rdec ); continue;
-              }
-            if( verbosity >= 0 )
-              {
-              Pp_show_msg( pp, 0 );
-              fprintf( stderr, "Unsupported marker code '%d'\n", len );
-              }
-            return 4;
+            if( LZd_verify_trailer( d, pp ) ) return 0; else return 3;
             }
+          if( len == min_match_len + 1 )	/* Sync Flush marker */
+            {
+            Rd_load( rdec ); return -1;
+            }
+          if( pp && verbosity >= 0 )
+            {
+            Pp_show_msg( pp, 0 );
+            fprintf( stderr, "Unsupported marker code '%d'\n", len );
+            }
+          return 4;
           }
         }
-      rep3 = rep2; rep2 = rep1; rep1 = rep0; rep0 = distance;
-      state = St_set_match( state );
-      if( rep0 >= d->dictionary_size || ( rep0 >= d->pos && !d->pos_wrapped ) )
-        { LZd_flush_data( d ); return 1; }
       }
-    LZd_copy_block( d, rep0, len );
+    if( stats ) Cst_add_match( stats, len, dis_slot );
+    rep[3] = rep[2]; rep[2] = rep[1]; rep[1] = rep[0]; rep[0] = distance;
+    *statep = St_set_match( state );
+    if( rep[0] >= d->dictionary_size ||
+        ( rep[0] >= d->pos && !d->pos_wrapped ) )
+      { LZd_flush_data( d ); return 1; }
+    }
+  LZd_copy_block( d, rep[0], len );
+  return -1;
+  }
+
+
+/* Symbols are decoded by the unchecked variant of LZd_decode_symbol while
+   enough input is buffered, and by the checked one near the end of each
+   block of input. Instantiated once without stats, so that the counters
+   cost nothing unless --stats is given. */
+static ALWAYS_INLINE int
+LZd_decode_symbols( struct LZ_decoder * const d, struct Pretty_print * const pp,
+                    unsigned rep[4], State * const statep,
+                    struct Coder_stats * const stats )
+  {
+  struct Range_decoder * const rdec = d->rdec;
+  int result;
+  do {
+    if( Rd_fast_ok( rdec ) )
+      result = LZd_decode_symbol( d, pp, rep, statep, false, stats );
+    else if( !Rd_finished( rdec ) )
+      result = LZd_decode_symbol( d, pp, rep, statep, true, stats );
+    else { LZd_flush_data( d ); result = 2; }
     }
-  LZd_flush_data( d );
-  return 2;
+  while( result < 0 );
+  return result;
+  }
+
+
+/* Return value: 0 = OK, 1 = decoder error, 2 = unexpected EOF,
+                 3 = trailer error, 4 = unknown marker found.
+   If pp is 0, no messages are printed. */
+int LZd_decode_member( struct LZ_decoder * const d,
+                       struct Pretty_print * const pp )
+  {
+  unsigned rep[4] = { 0, 0, 0, 0 };	/* latest four distances */
+  State state = 0;
+
+  LZds_reset( d->st );
+  Rd_load( d->rdec );
+  if( !d->stats ) return LZd_decode_symbols( d, pp, rep, &state, 0 );
+  return LZd_decode_symbols( d, pp, rep, &state, d->stats );
   }
@@ -25,7 +25,11 @@ struct Range_decoder
   int stream_pos;		/* when reached, a new block must be read */
   uint32_t code;
   uint32_t range;
+  long long ipos;		/* if >= 0, read from infd with pread at ipos */
+  long long iend;		/* end of data to be read with pread */
   int infd;			/* input file descriptor */
+  Read_fn * read_fn;		/* input function, or 0 to use infd */
+  void * read_arg;
   bool at_stream_end;
   };
 
@@ -40,11 +44,30 @@ static inline bool Rd_init( struct Range_decoder * const rdec, const int ifd )
   rdec->stream_pos = 0;
   rdec->code = 0;
   rdec->range = 0xFFFFFFFFU;
+  rdec->ipos = -1;
+  rdec->iend = 0;
   rdec->infd = ifd;
+  rdec->read_fn = 0;
+  rdec->read_arg = 0;
   rdec->at_stream_end = false;
   return true;
   }
 
+/* Read only the 'size' bytes starting at offset 'pos' of infd, using pread.
+   The file offset of infd is not changed, so that several range decoders
+   can share the same file descriptor.
+*/
+static inline void Rd_set_block( struct Range_decoder * const rdec,
+                                 const long long pos, const long long size )
+  {
+  rdec->partial_member_pos = 0;
+  rdec->pos = 0;
+  rdec->stream_pos = 0;
+  rdec->ipos = pos;
+  rdec->iend = pos + size;
+  rdec->at_stream_end = false;
+  }
+
 static inline void Rd_free( struct Range_decoder * const rdec )
   { free( rdec->buffer ); }
 
@@ -88,21 +111,35 @@ static inline void Rd_load( struct Range_decoder * const rdec )
   rdec->code &= rdec->range;	/* make sure that first byte is discarded */
   }
 
-static inline void Rd_normalize( struct Range_decoder * const rdec )
+/* The decoding functions below take a 'checked' argument. If it is false,
+   the caller guarantees that at least rd_min_available bytes remain in the
+   buffer, and input bytes are fetched without testing for the end of the
+   buffer. Pass it as a constant so that each variant gets its own code. */
+enum { rd_min_available = 64 };		/* > bytes read by any one symbol */
+
+static inline bool Rd_fast_ok( const struct Range_decoder * const rdec )
+  { return rdec->stream_pos - rdec->pos >= rd_min_available; }
+
+static inline void Rd_normalize( struct Range_decoder * const rdec,
+                                 const bool checked )
   {
   if( rdec->range <= 0x00FFFFFFU )
-    { rdec->range <<= 8; rdec->code = (rdec->code << 8) | Rd_get_byte( rdec ); }
+    {
+    rdec->range <<= 8;
+    rdec->code = (rdec->code << 8) |
+                 ( checked ? Rd_get_byte( rdec ) : rdec->buffer[rdec->pos++] );
+    }
   }
 
 static inline unsigned Rd_decode( struct Range_decoder * const rdec,
-                                  const int num_bits )
+                                  const int num_bits, const bool checked )
   {
   unsigned symbol = 0;
   int i;
   for( i = num_bits; i > 0; --i )
     {
     bool bit;
-    Rd_normalize( rdec );
+    Rd_normalize( rdec, checked );
     rdec->range >>= 1;
 /*    symbol <<= 1; */
 /*    if( rdec->code >= rdec->range ) { rdec->code -= rdec->range; symbol |= 1; } */
@@ -114,10 +151,11 @@ static inline unsigned Rd_decode( struct Range_decoder * const rdec,
   }
 
 static inline unsigned Rd_decode_bit( struct Range_decoder * const rdec,
-                                      Bit_model * const probability )
+                                      Bit_model * const probability,
+                                      const bool checked )
   {
   uint32_t bound;
-  Rd_normalize( rdec );
+  Rd_normalize( rdec, checked );
   bound = ( rdec->range >> bit_model_total_bits ) * *probability;
   if( rdec->code < bound )
     {
@@ -135,46 +173,51 @@ static inline unsigned Rd_decode_bit( struct Range_decoder * const rdec,
   }
 
 static inline unsigned Rd_decode_tree3( struct Range_decoder * const rdec,
-                                        Bit_model bm[] )
+                                        Bit_model bm[], const bool checked )
   {
-  unsigned symbol = 2 | Rd_decode_bit( rdec, &bm[1] );
-  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol] );
-  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol] );
+  unsigned symbol = 2 | Rd_decode_bit( rdec, &bm[1], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
   return symbol & 7;
   }
 
 static inline unsigned Rd_decode_tree6( struct Range_decoder * const rdec,
-                                        Bit_model bm[] )
+                                        Bit_model bm[], const bool checked )
   {
-  unsigned symbol = 2 | Rd_decode_bit( rdec, &bm[1] );
-  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol] );
-  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol] );
-  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol] );
-  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol] );
-  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol] );
+  unsigned symbol = 2 | Rd_decode_bit( rdec, &bm[1], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
   return symbol & 0x3F;
   }
 
 static inline unsigned Rd_decode_tree8( struct Range_decoder * const rdec,
-                                        Bit_model bm[] )
+                                        Bit_model bm[], const bool checked )
   {
-  unsigned symbol = 1;
-  int i;
-  for( i = 0; i < 8; ++i )
-    symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol] );
+  unsigned symbol = 2 | Rd_decode_bit( rdec, &bm[1], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
+  symbol = ( symbol << 1 ) | Rd_decode_bit( rdec, &bm[symbol], checked );
   return symbol & 0xFF;
   }
 
 static inline unsigned
 Rd_decode_tree_reversed( struct Range_decoder * const rdec,
-                         Bit_model bm[], const int num_bits )
+                         Bit_model bm[], const int num_bits,
+                         const bool checked )
   {
   unsigned model = 1;
   unsigned symbol = 0;
   int i;
   for( i = 0; i < num_bits; ++i )
     {
-    const unsigned bit = Rd_decode_bit( rdec, &bm[model] );
+    const unsigned bit = Rd_decode_bit( rdec, &bm[model], checked );
     model <<= 1; model += bit;
     symbol |= ( bit << i );
     }
@@ -182,24 +225,27 @@ Rd_decode_tree_reversed( struct Range_decoder * const rdec,
   }
 
 static inline unsigned
-Rd_decode_tree_reversed4( struct Range_decoder * const rdec, Bit_model bm[] )
+Rd_decode_tree_reversed4( struct Range_decoder * const rdec, Bit_model bm[],
+                          const bool checked )
   {
-  unsigned symbol = Rd_decode_bit( rdec, &bm[1] );
-  symbol += Rd_decode_bit( rdec, &bm[2+symbol] ) << 1;
-  symbol += Rd_decode_bit( rdec, &bm[4+symbol] ) << 2;
-  symbol += Rd_decode_bit( rdec, &bm[8+symbol] ) << 3;
+  unsigned symbol = Rd_decode_bit( rdec, &bm[1], checked );
+  symbol += Rd_decode_bit( rdec, &bm[2+symbol], checked ) << 1;
+  symbol += Rd_decode_bit( rdec, &bm[4+symbol], checked ) << 2;
+  symbol += Rd_decode_bit( rdec, &bm[8+symbol], checked ) << 3;
   return symbol;
   }
 
 static inline unsigned Rd_decode_matched( struct Range_decoder * const rdec,
-                                          Bit_model bm[], unsigned match_byte )
+                                          Bit_model bm[], unsigned match_byte,
+                                          const bool checked )
   {
   unsigned symbol = 1;
   unsigned mask = 0x100;
   while( true )
     {
     const unsigned match_bit = ( match_byte <<= 1 ) & mask;
-    const unsigned bit = Rd_decode_bit( rdec, &bm[symbol+match_bit+mask] );
+    const unsigned bit =
+      Rd_decode_bit( rdec, &bm[symbol+match_bit+mask], checked );
     symbol <<= 1; symbol += bit;
     if( symbol > 0xFF ) return symbol & 0xFF;
     mask &= ~(match_bit ^ (bit << 8));	/* if( match_bit != bit ) mask = 0; */
@@ -208,26 +254,77 @@ static inline unsigned Rd_decode_matched( struct Range_decoder * const rdec,
 
 static inline unsigned Rd_decode_len( struct Range_decoder * const rdec,
                                       struct Len_model * const lm,
-                                      const int pos_state )
+                                      const int pos_state, const bool checked )
   {
-  if( Rd_decode_bit( rdec, &lm->choice1 ) == 0 )
-    return Rd_decode_tree3( rdec, lm->bm_low[pos_state] );
-  if( Rd_decode_bit( rdec, &lm->choice2 ) == 0 )
-    return len_low_symbols + Rd_decode_tree3( rdec, lm->bm_mid[pos_state] );
-  return len_low_symbols + len_mid_symbols + Rd_decode_tree8( rdec, lm->bm_high );
+  if( Rd_decode_bit( rdec, &lm->choice1, checked ) == 0 )
+    return Rd_decode_tree3( rdec, lm->bm_low[pos_state], checked );
+  if( Rd_decode_bit( rdec, &lm->choice2, checked ) == 0 )
+    return len_low_symbols +
+           Rd_decode_tree3( rdec, lm->bm_mid[pos_state], checked );
+  return len_low_symbols + len_mid_symbols +
+         Rd_decode_tree8( rdec, lm->bm_high, checked );
+  }
+
+
+/* Probability models of LZd_decode_member. They live with the output
+   buffer instead of on the stack, so that they are allocated once and
+   reused by all the members decoded with the same LZ_decoder, and start on
+   a cache line. They are reset at the start of every member; a member is
+   always decoded by a single call. The models used by (nearly) every symbol
+   go first so that they share a few cache lines; bm_literal, which is
+   24 KiB, goes last. */
+struct LZd_state
+  {
+  Bit_model bm_match[states][pos_states];
+  Bit_model bm_rep[states];
+  Bit_model bm_rep0[states];
+  Bit_model bm_len[states][pos_states];
+  Bit_model bm_rep1[states];
+  Bit_model bm_rep2[states];
+  struct Len_model match_len_model;
+  struct Len_model rep_len_model;
+  Bit_model bm_dis_slot[len_states][1<<dis_slot_bits];
+  Bit_model bm_align[dis_align_size];
+  Bit_model bm_dis[modeled_distances-end_dis_model+1];
+  Bit_model bm_literal[1<<literal_context_bits][0x300];
+  };
+
+enum { lzd_state_align = 64 };
+
+static inline void LZds_reset( struct LZd_state * const st )
+  {
+  Bm_array_init( st->bm_match[0], states * pos_states );
+  Bm_array_init( st->bm_rep, states );
+  Bm_array_init( st->bm_rep0, states );
+  Bm_array_init( st->bm_len[0], states * pos_states );
+  Bm_array_init( st->bm_rep1, states );
+  Bm_array_init( st->bm_rep2, states );
+  Lm_init( &st->match_len_model );
+  Lm_init( &st->rep_len_model );
+  Bm_array_init( st->bm_dis_slot[0], len_states * (1 << dis_slot_bits) );
+  Bm_array_init( st->bm_align, dis_align_size );
+  Bm_array_init( st->bm_dis, modeled_distances - end_dis_model + 1 );
+  Bm_array_init( st->bm_literal[0], (1 << literal_context_bits) * 0x300 );
   }
 
 
 struct LZ_decoder
   {
   unsigned long long partial_data_pos;
+  struct LZd_state * st;	/* in the same allocation as buffer */
   struct Range_decoder * rdec;
   unsigned dictionary_size;
   uint8_t * buffer;		/* output buffer */
+  unsigned buffer_size;		/* allocated size, >= dictionary_size */
   unsigned pos;			/* current pos in buffer */
   unsigned stream_pos;		/* first byte not yet written to file */
   uint32_t crc;
+  unsigned long long outskip;	/* data before this position are not written */
+  unsigned long long outend;	/* data from this position are not written */
+  Flush_fn * flush_fn;		/* output function, or 0 to use outfd */
+  void * flush_arg;
   int outfd;			/* output file descriptor */
+  struct Coder_stats * stats;	/* counters for --stats, or 0 */
   bool pos_wrapped;
   };
 
@@ -250,57 +347,123 @@ static inline void LZd_put_byte( struct LZ_decoder * const d, const uint8_t b )
   if( ++d->pos >= d->dictionary_size ) LZd_flush_data( d );
   }
 
-static inline void LZd_copy_block( struct LZ_decoder * const d,
-                                   const unsigned distance, unsigned len )
+static inline void copy8( uint8_t * const dst, const uint8_t * const src )
+  { uint64_t t; memcpy( &t, src, 8 ); memcpy( dst, &t, 8 ); }
+
+static inline void copy16( uint8_t * const dst, const uint8_t * const src )
+  { uint8_t t[16]; memcpy( t, src, 16 ); memcpy( dst, t, 16 ); }
+
+/* Copy 'len' bytes from 'src' to 'dst', byte after byte as far as the
+   result is concerned, for dst > src; the areas may overlap. Nothing is
+   written past dst + len because the bytes there may be history still in
+   use. The last word is stored at dst + len - width, overlapping the
+   previous one, instead of finishing with a byte loop. */
+static inline void copy_forward( uint8_t * dst, const uint8_t * src,
+                                 unsigned len )
   {
-  unsigned lpos = d->pos, i = lpos - distance - 1;
-  bool fast, fast2;
-  if( lpos > distance )
-    {
-    fast = ( len < d->dictionary_size - lpos );
-    fast2 = ( fast && len <= lpos - i );
-    }
-  else
+  unsigned dist = dst - src, k = 0;
+  if( len <= 16 && ( len < 8 || dist < 8 ) )	/* most matches are short */
+    { for( ; k < len; ++k ) dst[k] = src[k]; return; }
+  if( dist < 8 )			/* short period; replicate the pattern */
     {
-    i += d->dictionary_size;
-    fast = ( len < d->dictionary_size - i );	/* (i == pos) may happen */
-    fast2 = ( fast && len <= i - lpos );
+    if( dist == 1 ) { memset( dst, *src, len ); return; }
+    while( dist < 8 ) dist += dst - src;	/* a multiple of the period */
+    for( ; k < dist; ++k ) dst[k] = src[k];
+    src = dst; dst += dist; len -= dist; k = 0;	/* now dist >= 8 */
+    if( len < 8 ) { for( ; k < len; ++k ) dst[k] = src[k]; return; }
     }
-  if( fast )					/* no wrap */
+  if( dist >= 16 && len >= 16 )
     {
-    d->pos += len;
-    if( fast2 )					/* no wrap, no overlap */
-      memcpy( d->buffer + lpos, d->buffer + i, len );
-    else
-      for( ; len > 0; --len ) d->buffer[lpos++] = d->buffer[i++];
+    for( ; k + 16 <= len; k += 16 ) copy16( dst + k, src + k );
+    if( k < len ) copy16( dst + len - 16, src + len - 16 );
+    return;
     }
-  else for( ; len > 0; --len )
+  for( ; k + 8 <= len; k += 8 ) copy8( dst + k, src + k );
+  if( k < len ) copy8( dst + len - 8, src + len - 8 );
+  }
+
+/* Copy in at most three segments, split where the source or the
+   destination reach the end of the circular buffer. */
+static inline void LZd_copy_block( struct LZ_decoder * const d,
+                                   const unsigned distance, unsigned len )
+  {
+  unsigned lpos = d->pos, i = lpos - distance - 1;
+  if( lpos <= distance ) i += d->dictionary_size;	/* (i == pos) may happen */
+  while( true )
     {
-    d->buffer[d->pos] = d->buffer[i];
-    if( ++d->pos >= d->dictionary_size ) LZd_flush_data( d );
-    if( ++i >= d->dictionary_size ) i = 0;
+    const unsigned rest = d->dictionary_size - max( lpos, i );
+    const unsigned size = min( len, rest );
+    if( i < lpos ) copy_forward( d->buffer + lpos, d->buffer + i, size );
+    else memmove( d->buffer + lpos, d->buffer + i, size );
+    d->pos = lpos += size;
+    len -= size;
+    if( lpos >= d->dictionary_size ) { LZd_flush_data( d ); lpos = d->pos; }
+    if( len == 0 ) break;
+    i += size; if( i >= d->dictionary_size ) i = 0;
     }
   }
 
-static inline bool LZd_init( struct LZ_decoder * const d,
-                             struct Range_decoder * const rde,
-                             const unsigned dict_size, const int ofd )
+/* Prepare a decoder to decode a new member, reusing its buffer if it is
+   large enough, but not more than twice as large as needed, so that the
+   memory used by a large dictionary is not kept for the small dictionaries
+   that follow. 'd' must have been initialized with LZd_init, or have
+   'buffer' and 'buffer_size' set to 0. On error, the buffer is freed.
+   The buffer is followed by the (aligned) coding state. */
+static inline bool LZd_reinit( struct LZ_decoder * const d,
+                               struct Range_decoder * const rde,
+                               const unsigned dict_size, const int ofd )
   {
   d->partial_data_pos = 0;
   d->rdec = rde;
   d->dictionary_size = dict_size;
-  d->buffer = (uint8_t *)malloc( d->dictionary_size );
-  if( !d->buffer ) return false;
+  if( d->buffer_size < dict_size || d->buffer_size / 2 > dict_size )
+    {
+    free( d->buffer );
+    d->buffer = (uint8_t *)malloc( dict_size + lzd_state_align - 1 +
+                                   sizeof (struct LZd_state) );
+    d->buffer_size = d->buffer ? dict_size : 0;
+    if( !d->buffer ) return false;
+    }
+  d->st = (struct LZd_state *)( ( (uintptr_t)( d->buffer + d->buffer_size ) +
+            lzd_state_align - 1 ) & ~(uintptr_t)( lzd_state_align - 1 ) );
   d->pos = 0;
   d->stream_pos = 0;
   d->crc = 0xFFFFFFFFU;
+  d->outskip = 0;
+  d->outend = -1ULL;
+  d->flush_fn = 0;
+  d->flush_arg = 0;
   d->outfd = ofd;
+  d->stats = 0;
   d->pos_wrapped = false;
   /* prev_byte of first byte; also for LZd_peek( 0 ) on corrupt file */
   d->buffer[d->dictionary_size-1] = 0;
   return true;
   }
 
+static inline bool LZd_init( struct LZ_decoder * const d,
+                             struct Range_decoder * const rde,
+                             const unsigned dict_size, const int ofd )
+  {
+  d->buffer = 0;
+  d->buffer_size = 0;
+  return LZd_reinit( d, rde, dict_size, ofd );
+  }
+
+/* Place the preset before the data of the member, after LZd_reinit. The
+   encoder uses at most dictionary_size - 1 bytes of it and the dictionary
+   size of the member covers both the preset used and the data, so that
+   this is never less than what the encoder used. The preset is neither
+   written nor included in the CRC or in the data size. */
+static inline void LZd_load_preset( struct LZ_decoder * const d,
+                                    const struct Preset_dict * const preset )
+  {
+  const unsigned size = min( (unsigned)preset->size, d->dictionary_size - 1 );
+  memcpy( d->buffer, preset->data + preset->size - size, size );
+  d->partial_data_pos = -(unsigned long long)size;
+  d->pos = d->stream_pos = size;
+  }
+
 static inline void LZd_free( struct LZ_decoder * const d )
   { free( d->buffer ); }
 
@@ -313,3 +476,9 @@ LZd_data_position( const struct LZ_decoder * const d )
 
 int LZd_decode_member( struct LZ_decoder * const d,
                        struct Pretty_print * const pp );
+
+enum { preset_msg_size = 80 };
+int Rd_check_preset( struct Range_decoder * const rdec,
+                     const Lzip_header header,
+                     const struct Preset_dict * const preset,
+                     char * const msg );
@@ -0,0 +1,373 @@
+/* Clzip - LZMA lossless data compressor
+   Copyright (C) 2010-2021 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lzip.h"
+#include "decoder.h"
+#include "lzip_index.h"
+
+
+/* The members of a seekable file are located with Li_init_cached, and then
+   decoded independently by the worker threads, each one reading its
+   member with pread. If the output is a regular file, each worker writes
+   its data with pwrite at the position of the member in the decompressed
+   file. Else the data of each member are written in order; a worker that
+   is not yet allowed to write keeps up to 'pending_limit' bytes in memory
+   and then waits for its turn.
+   If a member fails, the data decoded from it before the error are written
+   after those of the previous members, and nothing else is written after
+   them, as the serial decoder does. (In pwrite mode the output is
+   truncated after the data of the failed member).
+   If 'mem_limit' is not 0, the dictionary buffers of the workers may not
+   use more than 'mem_limit' bytes in total. A worker only takes the next
+   member when there is room for its dictionary; it frees its own buffer
+   while waiting. Members are taken (and so reserved) in order, so that a
+   worker waiting for its turn to write never waits for memory held by
+   a later member. At least one member is always being decoded.
+*/
+enum { pending_limit = 1 << 25 };	/* 32 MiB */
+
+struct Dshared			/* data shared by all the worker threads */
+  {
+  const struct Lzip_index * li;
+  pthread_mutex_t mutex;	/* protects the variables below */
+  pthread_cond_t oturn;		/* next_out or bad_member have changed */
+  long next_member;		/* next member to be decoded */
+  long next_out;		/* member allowed to write (ordered mode) */
+  long bad_member;		/* first member that failed, or li->members */
+  long long bad_opos;		/* end of the data of bad_member (pwrite) */
+  pthread_cond_t mem_free;	/* mem_in_use has decreased */
+  unsigned long long mem_limit;	/* 0 = no limit */
+  unsigned long long mem_in_use;	/* sum of the dictionary buffers */
+  bool mem_error;
+  long long obase;		/* if >= 0, pwrite output at obase + dpos */
+  struct Coder_stats * stats;	/* if not 0, collect stats in the workers */
+  const struct Preset_dict * preset;	/* or 0 */
+  int infd, outfd;		/* outfd < 0 means testing */
+  };
+
+struct Dworker
+  {
+  struct Dshared * ds;
+  uint8_t * pending;		/* data waiting for our turn to be written */
+  int pending_size;
+  int pending_capacity;
+  unsigned long long mem_held;	/* reserved for the dictionary buffer */
+  long member;			/* member being decoded */
+  long long opos;		/* next output position (pwrite mode) */
+  struct Coder_stats stats;	/* added to ds->stats at the end */
+  bool my_turn;
+  bool discard;			/* a previous member failed; drop the data */
+  };
+
+
+/* Return the next member to be decoded by 'w', or -1 if none is left.
+   Reserve the growth of the dictionary buffer of 'd' needed by it. */
+static long Ds_next_member( struct Dshared * const ds, struct Dworker * const w,
+                            struct LZ_decoder * const d )
+  {
+  long i = -1;
+  pthread_mutex_lock( &ds->mutex );
+  while( ds->next_member < ds->bad_member && !ds->mem_error )
+    {
+    const unsigned dict_size = Li_dictionary_size( ds->li, ds->next_member );
+    const unsigned long long need =
+      ( w->mem_held < dict_size ) ? dict_size - w->mem_held : 0;
+    if( ds->mem_limit == 0 || ds->mem_in_use + need <= ds->mem_limit ||
+        ds->mem_in_use == w->mem_held )	/* nobody else holds memory */
+      {
+      i = ds->next_member++;
+      ds->mem_in_use += need; w->mem_held += need;
+      break;
+      }
+    if( w->mem_held > 0 )		/* give back our buffer, then wait */
+      {
+      ds->mem_in_use -= w->mem_held; w->mem_held = 0;
+      LZd_free( d ); d->buffer = 0; d->buffer_size = 0;
+      pthread_cond_broadcast( &ds->mem_free );
+      }
+    else pthread_cond_wait( &ds->mem_free, &ds->mutex );
+    }
+  pthread_mutex_unlock( &ds->mutex );
+  return i;
+  }
+
+
+static void Ds_release_memory( struct Dshared * const ds,
+                               struct Dworker * const w )
+  {
+  pthread_mutex_lock( &ds->mutex );
+  ds->mem_in_use -= w->mem_held; w->mem_held = 0;
+  pthread_cond_broadcast( &ds->mem_free );
+  pthread_mutex_unlock( &ds->mutex );
+  }
+
+
+static void Ds_set_bad_member( struct Dshared * const ds, const long i,
+                               const bool mem_error, const long long opos )
+  {
+  pthread_mutex_lock( &ds->mutex );
+  if( mem_error ) ds->mem_error = true;
+  else if( ds->bad_member > i ) { ds->bad_member = i; ds->bad_opos = opos; }
+  pthread_cond_broadcast( &ds->oturn );		/* wake up waiting workers */
+  pthread_cond_broadcast( &ds->mem_free );
+  pthread_mutex_unlock( &ds->mutex );
+  }
+
+
+static void Dw_write( const struct Dworker * const w,
+                      const uint8_t * const buf, const int size )
+  {
+  if( writeblock( w->ds->outfd, buf, size ) != size )
+    { show_error( "Write error", errno, false ); cleanup_and_fail( 1 ); }
+  }
+
+
+/* Wait until the previous members have been written, then write the
+   pending data. If a previous member fails, discard the data instead. */
+static void Dw_wait_turn( struct Dworker * const w )
+  {
+  struct Dshared * const ds = w->ds;
+  pthread_mutex_lock( &ds->mutex );
+  while( ds->next_out != w->member && ds->bad_member > w->member &&
+         !ds->mem_error )
+    pthread_cond_wait( &ds->oturn, &ds->mutex );
+  w->my_turn = ( ds->next_out == w->member );
+  pthread_mutex_unlock( &ds->mutex );
+  if( !w->my_turn ) w->discard = true;
+  else if( w->pending_size > 0 ) Dw_write( w, w->pending, w->pending_size );
+  w->pending_size = 0;
+  }
+
+
+static void ordered_flush( void * const arg, const uint8_t * const buf,
+                           const int size )
+  {
+  struct Dworker * const w = (struct Dworker *)arg;
+  if( w->discard ) return;
+  if( !w->my_turn && w->pending_size + size > pending_limit )
+    Dw_wait_turn( w );
+  if( w->discard ) return;
+  if( w->my_turn ) { Dw_write( w, buf, size ); return; }
+  if( w->pending_size + size > w->pending_capacity )
+    {
+    const int new_capacity =
+      min( pending_limit, max( 2 * w->pending_capacity, w->pending_size + size ) );
+    w->pending = (uint8_t *)resize_buffer( w->pending, new_capacity );
+    w->pending_capacity = new_capacity;
+    }
+  memcpy( w->pending + w->pending_size, buf, size );
+  w->pending_size += size;
+  }
+
+
+static void positioned_flush( void * const arg, const uint8_t * const buf,
+                              const int size )
+  {
+  struct Dworker * const w = (struct Dworker *)arg;
+  if( pwriteblock( w->ds->outfd, buf, size, w->opos ) != size )
+    { show_error( "Write error", errno, false ); cleanup_and_fail( 1 ); }
+  w->opos += size;
+  }
+
+
+static void * dworker( void * arg )
+  {
+  struct Dworker * const w = (struct Dworker *)arg;
+  struct Dshared * const ds = w->ds;
+  const bool ordered = ( ds->outfd >= 0 && ds->obase < 0 );
+  struct Range_decoder rdec;
+  struct LZ_decoder decoder;		/* reused for all the members */
+  long i;
+  decoder.buffer = 0; decoder.buffer_size = 0;
+  if( !Rd_init( &rdec, ds->infd ) )
+    { Ds_set_bad_member( ds, 0, true, 0 ); return 0; }
+
+  while( ( i = Ds_next_member( ds, w, &decoder ) ) >= 0 )
+    {
+    const struct Block * const mb = Li_mblock( ds->li, i );
+    Lzip_header header;
+    char msg[preset_msg_size];
+    int result, size;
+    w->member = i;
+    w->opos = ds->obase + Li_dblock( ds->li, i )->pos;
+    Rd_set_block( &rdec, mb->pos, mb->size );
+    size = Rd_read_data( &rdec, header, Lh_size );
+    if( size != Lh_size || !Lh_verify_magic( header ) ||
+        !Lh_accept_version( header, ds->preset != 0 ) ||
+        Rd_check_preset( &rdec, header, ds->preset, msg ) != 0 )
+      { Ds_set_bad_member( ds, i, false, w->opos ); break; }
+    if( !LZd_reinit( &decoder, &rdec, Li_dictionary_size( ds->li, i ), -1 ) )
+      { Ds_set_bad_member( ds, i, true, 0 ); break; }
+    if( ds->preset ) LZd_load_preset( &decoder, ds->preset );
+    w->pending_size = 0;
+    w->my_turn = false;
+    w->discard = false;
+    if( ds->stats ) decoder.stats = &w->stats;
+    if( ds->outfd >= 0 )
+      {
+      decoder.flush_fn = ordered ? ordered_flush : positioned_flush;
+      decoder.flush_arg = w;
+      }
+    result = LZd_decode_member( &decoder, 0 );
+    if( result != 0 )		/* write the data decoded before the error */
+      { if( ordered && !w->my_turn && !w->discard ) Dw_wait_turn( w );
+        Ds_set_bad_member( ds, i, false, w->opos ); break; }
+    if( ordered )
+      {
+      if( !w->my_turn && !w->discard ) Dw_wait_turn( w );
+      if( w->discard ) break;
+      pthread_mutex_lock( &ds->mutex );
+      ++ds->next_out;
+      pthread_cond_broadcast( &ds->oturn );
+      pthread_mutex_unlock( &ds->mutex );
+      }
+    }
+  Ds_release_memory( ds, w );
+  LZd_free( &decoder );
+  Rd_free( &rdec );
+  return 0;
+  }
+
+
+/* Decompress or test a seekable multimember file using 'num_workers'
+   threads and at most 'mem_limit' bytes of dictionary buffers (0 = no
+   limit). 'filename' is used to find the sidecar index, if any.
+   'preset' is the preset dictionary of all the members, or 0.
+   If 'stats' is not 0, the stats of the workers are added to it.
+   Return -1 if the file is not suitable for parallel decoding
+   (regular file without trailing data, 2 or more members), so that the
+   caller may decode it serially.
+   Return value: 0 = OK, 1 = error already reported, 2 = the member starting
+   at '*bad_posp' failed; its data up to the error have been written, and
+   the caller must decode it again, without output, to report why.
+*/
+int decompress_mt( const int num_workers,
+                   const unsigned long long mem_limit,
+                   const int infd, const int outfd, const char * const filename,
+                   struct Pretty_print * const pp, const bool ignore_trailing,
+                   const bool loose_trailing, const bool testing,
+                   const struct Preset_dict * const preset,
+                   struct Coder_stats * const stats,
+                   long long * const bad_posp )
+  {
+  struct Lzip_index li;
+  struct Dshared ds;
+  struct Dworker * workers;
+  pthread_t * threads;
+  struct stat st;
+  sigset_t mask, old_mask;
+  int i, num_started = 0, worker_count, retval = 0;
+
+  if( fstat( infd, &st ) != 0 || !S_ISREG( st.st_mode ) ||
+      lseek( infd, 0, SEEK_CUR ) != 0 ) return -1;
+  if( !Li_init_cached( &li, infd, filename, ignore_trailing, loose_trailing,
+                       preset != 0 ) ||
+      li.members < 2 || Li_file_size( &li ) != Li_cdata_size( &li ) )
+    {
+    Li_free( &li );
+    if( lseek( infd, 0, SEEK_SET ) == 0 ) return -1;
+    show_error( "Can't rewind input file", errno, false ); return 1;
+    }
+  worker_count = min( num_workers, li.members );
+  workers = (struct Dworker *)malloc( worker_count * sizeof workers[0] );
+  threads = (pthread_t *)malloc( worker_count * sizeof threads[0] );
+  if( !workers || !threads )
+    { free( threads ); free( workers ); Li_free( &li );
+      Pp_show_msg( pp, mem_msg ); return 1; }
+
+  ds.li = &li;
+  ds.next_member = 0;
+  ds.next_out = 0;
+  ds.bad_member = li.members;
+  ds.bad_opos = 0;
+  ds.mem_limit = mem_limit;
+  ds.mem_in_use = 0;
+  ds.mem_error = false;
+  ds.obase = -1;
+  ds.stats = stats;
+  ds.preset = preset;
+  ds.infd = infd;
+  ds.outfd = testing ? -1 : outfd;
+  if( !testing && fstat( outfd, &st ) == 0 && S_ISREG( st.st_mode ) &&
+      !( fcntl( outfd, F_GETFL ) & O_APPEND ) )
+    ds.obase = lseek( outfd, 0, SEEK_CUR );
+  pthread_mutex_init( &ds.mutex, 0 );
+  pthread_cond_init( &ds.oturn, 0 );
+  pthread_cond_init( &ds.mem_free, 0 );
+  if( verbosity >= 1 ) Pp_show_msg( pp, 0 );
+
+  /* let the main thread alone handle the signals that delete the output */
+  sigemptyset( &mask );
+  sigaddset( &mask, SIGHUP );
+  sigaddset( &mask, SIGINT );
+  sigaddset( &mask, SIGTERM );
+  pthread_sigmask( SIG_BLOCK, &mask, &old_mask );
+  for( i = 0; i < worker_count; ++i )
+    {
+    workers[i].ds = &ds;
+    workers[i].pending = 0;
+    workers[i].pending_size = 0;
+    workers[i].pending_capacity = 0;
+    workers[i].mem_held = 0;
+    Cst_init( &workers[i].stats );
+    if( pthread_create( &threads[i], 0, dworker, &workers[i] ) != 0 ) break;
+    ++num_started;
+    }
+  pthread_sigmask( SIG_SETMASK, &old_mask, 0 );
+  if( num_started == 0 ) Ds_set_bad_member( &ds, 0, true, 0 );
+
+  for( i = 0; i < num_started; ++i )
+    {
+    if( pthread_join( threads[i], 0 ) != 0 )
+      internal_error( "can't join worker threads." );
+    free( workers[i].pending );
+    if( stats ) Cst_merge( stats, &workers[i].stats );
+    }
+  if( ds.mem_error ) { Pp_show_msg( pp, mem_msg ); retval = 1; }
+  else if( ds.bad_member < li.members )
+    {
+    *bad_posp = Li_mblock( &li, ds.bad_member )->pos; retval = 2;
+    if( ds.obase >= 0 && ( ftruncate( outfd, ds.bad_opos ) != 0 ||
+        lseek( outfd, ds.bad_opos, SEEK_SET ) < 0 ) )
+      { show_error( "Can't truncate output file", errno, false ); retval = 1; }
+    }
+  else if( ds.obase >= 0 &&
+           lseek( outfd, ds.obase + Li_udata_size( &li ), SEEK_SET ) < 0 )
+    { show_error( "Can't seek output file", errno, false ); retval = 1; }
+  else if( verbosity >= 1 )
+    fputs( testing ? "ok\n" : "done\n", stderr );
+  pthread_cond_destroy( &ds.mem_free );
+  pthread_cond_destroy( &ds.oturn );
+  pthread_mutex_destroy( &ds.mutex );
+  free( threads ); free( workers );
+  Li_free( &li );
+  return retval;
+  }
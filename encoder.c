@@ -22,16 +22,123 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "lzip.h"
 #include "encoder_base.h"
 #include "encoder.h"
 
 
-CRC32 crc32;
+const struct Lzma_options option_mapping[10] =
+  {
+  { 1 << 16,  16, false },	/* -0 */
+  { 1 << 20,   5, true  },	/* -1 */
+  { 3 << 19,   6, true  },	/* -2 */
+  { 1 << 21,   8, true  },	/* -3 */
+  { 3 << 20,  12, false },	/* -4 */
+  { 1 << 22,  20, false },	/* -5 */
+  { 1 << 23,  36, false },	/* -6 */
+  { 1 << 24,  68, false },	/* -7 */
+  { 3 << 23, 132, false },	/* -8 */
+  { 1 << 25, 273, false } };	/* -9 */
+
+
+/* Hash chain match finder. pos_array[cyclic_pos] links each position to
+   the previous position with the same 4-byte hash. Only one entry needs to
+   be updated per byte, which makes skipping bytes much cheaper than with
+   the binary tree, at the cost of finding fewer (and sometimes shorter)
+   matches within the same number of cycles.
+*/
+static int LZe_get_match_pairs_hc( struct LZ_encoder * const e,
+                                   struct Pair * pairs )
+  {
+  int32_t * const chain = e->eb.mb.pos_array;
+  int maxlen = 3;			/* only used if pairs != 0 */
+  int num_pairs = 0;
+  const int cyclic_pos = e->eb.mb.cyclic_pos;
+  const int pos1 = e->eb.mb.pos + 1;
+  const int min_pos = ( e->eb.mb.pos > e->eb.mb.dictionary_size ) ?
+                        e->eb.mb.pos - e->eb.mb.dictionary_size : 0;
+  const uint8_t * const data = Mb_ptr_to_current_pos( &e->eb.mb );
+  int count, key2, key3, key4, newpos1;
+  unsigned tmp;
+  int len_limit = e->match_len_limit;
 
+  if( len_limit > Mb_available_bytes( &e->eb.mb ) )
+    {
+    len_limit = Mb_available_bytes( &e->eb.mb );
+    if( len_limit < 4 ) return 0;
+    }
 
-int LZe_get_match_pairs( struct LZ_encoder * const e, struct Pair * pairs )
+  tmp = crc32_table[data[0]] ^ data[1];
+  key2 = tmp & ( num_prev_positions2 - 1 );
+  tmp ^= (unsigned)data[2] << 8;
+  key3 = num_prev_positions2 + ( tmp & ( num_prev_positions3 - 1 ) );
+  key4 = num_prev_positions2 + num_prev_positions3 +
+         ( ( tmp ^ ( crc32_table[data[3]] << 5 ) ) & e->eb.mb.key4_mask );
+
+  if( pairs )
+    {
+    const int np2 = e->eb.mb.prev_positions[key2];
+    const int np3 = e->eb.mb.prev_positions[key3];
+    if( np2 > min_pos && e->eb.mb.buffer[np2-1] == data[0] )
+      {
+      pairs[0].dis = e->eb.mb.pos - np2;
+      pairs[0].len = maxlen = 2;
+      num_pairs = 1;
+      }
+    if( np2 != np3 && np3 > min_pos && e->eb.mb.buffer[np3-1] == data[0] )
+      {
+      maxlen = 3;
+      pairs[num_pairs++].dis = e->eb.mb.pos - np3;
+      }
+    if( num_pairs > 0 )
+      {
+      const int delta = pairs[num_pairs-1].dis + 1;
+      maxlen = match_len( data, delta, maxlen, len_limit );
+      pairs[num_pairs-1].len = maxlen;
+      if( maxlen < 3 ) maxlen = 3;
+      if( maxlen >= len_limit ) pairs = 0;	/* done. now just skip */
+      }
+    }
+
+  e->eb.mb.prev_positions[key2] = pos1;
+  e->eb.mb.prev_positions[key3] = pos1;
+  newpos1 = e->eb.mb.prev_positions[key4];
+  e->eb.mb.prev_positions[key4] = pos1;
+  chain[cyclic_pos] = newpos1;
+  if( !pairs ) return num_pairs;
+
+  for( count = e->cycles; newpos1 > min_pos && --count >= 0; )
+    {
+    const int delta = pos1 - newpos1;
+    if( data[maxlen-delta] == data[maxlen] )
+      {
+      const int len = match_len( data, delta, 0, len_limit );
+      if( maxlen < len )
+        {
+        pairs[num_pairs].dis = delta - 1;
+        pairs[num_pairs].len = maxlen = len;
+        ++num_pairs;
+        if( len >= len_limit ) break;
+        }
+      }
+    newpos1 = chain[cyclic_pos - delta +
+                    ( ( cyclic_pos >= delta ) ? 0 : e->eb.mb.dictionary_size + 1 )];
+    }
+  if( e->eb.stats ) e->eb.stats->mf_cycles += e->cycles - max( count, 0 );
+  return num_pairs;
+  }
+
+
+/* Binary tree match finder. The tree is sorted on the first 'sorted_len'
+   bytes of each position, which is the lowest match length limit used
+   since it was cleared. The search only trusts that many bytes of the
+   lengths matched by the parent nodes, so that the matches reported
+   remain correct if --target-speed raises the limit again.
+*/
+static int LZe_get_match_pairs_bt( struct LZ_encoder * const e,
+                                   struct Pair * pairs )
   {
   int32_t * ptr0 = e->eb.mb.pos_array + ( e->eb.mb.cyclic_pos << 1 );
   int32_t * ptr1 = ptr0 + 1;
@@ -53,12 +160,12 @@ int LZe_get_match_pairs( struct LZ_encoder * const e, struct Pair * pairs )
     if( len_limit < 4 ) return 0;
     }
 
-  tmp = crc32[data[0]] ^ data[1];
+  tmp = crc32_table[data[0]] ^ data[1];
   key2 = tmp & ( num_prev_positions2 - 1 );
   tmp ^= (unsigned)data[2] << 8;
   key3 = num_prev_positions2 + ( tmp & ( num_prev_positions3 - 1 ) );
   key4 = num_prev_positions2 + num_prev_positions3 +
-         ( ( tmp ^ ( crc32[data[3]] << 5 ) ) & e->eb.mb.key4_mask );
+         ( ( tmp ^ ( crc32_table[data[3]] << 5 ) ) & e->eb.mb.key4_mask );
 
   if( pairs )
     {
@@ -78,8 +185,7 @@ int LZe_get_match_pairs( struct LZ_encoder * const e, struct Pair * pairs )
     if( num_pairs > 0 )
       {
       const int delta = pairs[num_pairs-1].dis + 1;
-      while( maxlen < len_limit && data[maxlen-delta] == data[maxlen] )
-        ++maxlen;
+      maxlen = match_len( data, delta, maxlen, len_limit );
       pairs[num_pairs-1].len = maxlen;
       if( maxlen < 3 ) maxlen = 3;
       if( maxlen >= len_limit ) pairs = 0;	/* done. now just skip */
@@ -102,7 +208,7 @@ int LZe_get_match_pairs( struct LZ_encoder * const e, struct Pair * pairs )
           ( (e->eb.mb.cyclic_pos >= delta) ? 0 : e->eb.mb.dictionary_size + 1 ) ) << 1 );
     if( data[len-delta] == data[len] )
       {
-      while( ++len < len_limit && data[len-delta] == data[len] ) {}
+      len = match_len( data, delta, len + 1, len_limit );
       if( pairs && maxlen < len )
         {
         pairs[num_pairs].dis = delta - 1;
@@ -130,11 +236,36 @@ int LZe_get_match_pairs( struct LZ_encoder * const e, struct Pair * pairs )
       newpos1 = *ptr1;
       len1 = len; if( len0 < len ) len = len0;
       }
+    if( len > e->sorted_len ) len = e->sorted_len;
     }
+  if( e->eb.stats ) e->eb.stats->mf_cycles += e->cycles - max( count, 0 );
   return num_pairs;
   }
 
 
+int LZe_get_match_pairs( struct LZ_encoder * const e, struct Pair * pairs )
+  {
+  if( e->eb.stats ) ++e->eb.stats->mf_searches;
+  if( e->hash_chain ) return LZe_get_match_pairs_hc( e, pairs );
+  return LZe_get_match_pairs_bt( e, pairs );
+  }
+
+
+/* Add the current position to the match finder without searching for
+   matches. With no cycles, the binary tree match finder makes the position
+   the root of a new tree for its hash key, dropping the older positions
+   with the same key instead of sorting them below it, which is what takes
+   most of the time. The position can still be found later, so a repeated
+   copy of an incompressible block is still coded as a match. */
+static void LZe_add_position( struct LZ_encoder * const e )
+  {
+  const int cycles = e->cycles;
+  e->cycles = 0;
+  LZe_get_match_pairs( e, 0 );
+  e->cycles = cycles;
+  }
+
+
 static void LZe_update_distance_prices( struct LZ_encoder * const e )
   {
   int dis, len_state;
@@ -222,9 +353,9 @@ static int LZe_sequence_optimizer( struct LZ_encoder * const e,
 
   e->trials[1].price = price0( e->eb.bm_match[state][pos_state] );
   if( St_is_char( state ) )
-    e->trials[1].price += LZeb_price_literal( &e->eb, prev_byte, cur_byte );
+    e->trials[1].price += LZe_price_literal( e, prev_byte, cur_byte );
   else
-    e->trials[1].price += LZeb_price_matched( &e->eb, prev_byte, cur_byte, match_byte );
+    e->trials[1].price += LZe_price_matched( e, prev_byte, cur_byte, match_byte );
   e->trials[1].dis4 = -1;				/* literal */
 
   if( match_byte == cur_byte )
@@ -339,9 +470,9 @@ static int LZe_sequence_optimizer( struct LZ_encoder * const e,
     next_price = cur_trial->price +
                  price0( e->eb.bm_match[cur_state][pos_state] );
     if( St_is_char( cur_state ) )
-      next_price += LZeb_price_literal( &e->eb, prev_byte, cur_byte );
+      next_price += LZe_price_literal( e, prev_byte, cur_byte );
     else
-      next_price += LZeb_price_matched( &e->eb, prev_byte, cur_byte, match_byte );
+      next_price += LZe_price_matched( e, prev_byte, cur_byte, match_byte );
 
     /* try last updates to next trial */
     next_trial = &e->trials[cur+1];
@@ -376,8 +507,7 @@ static int LZe_sequence_optimizer( struct LZ_encoder * const e,
       const uint8_t * const data = Mb_ptr_to_current_pos( &e->eb.mb );
       const int dis = cur_trial->reps[0] + 1;
       const int limit = min( e->match_len_limit + 1, triable_bytes );
-      int len = 1;
-      while( len < limit && data[len-dis] == data[len] ) ++len;
+      int len = match_len( data, dis, 1, limit );
       if( --len >= min_match_len )
         {
         const int pos_state2 = ( pos_state + 1 ) & pos_state_mask;
@@ -400,8 +530,7 @@ static int LZe_sequence_optimizer( struct LZ_encoder * const e,
       int price;
 
       if( data[0-dis] != data[0] || data[1-dis] != data[1] ) continue;
-      for( len = min_match_len; len < len_limit; ++len )
-        if( data[len-dis] != data[len] ) break;
+      len = match_len( data, dis, min_match_len, len_limit );
       while( num_trials < cur + len )
         e->trials[++num_trials].price = infinite_price;
       price = rep_match_price + LZeb_price_rep( &e->eb, rep, cur_state, pos_state );
@@ -417,7 +546,7 @@ static int LZe_sequence_optimizer( struct LZ_encoder * const e,
       const int limit = min( e->match_len_limit + len2, triable_bytes );
       int pos_state2;
       State state2;
-      while( len2 < limit && data[len2-dis] == data[len2] ) ++len2;
+      len2 = match_len( data, dis, len2, limit );
       len2 -= len + 1;
       if( len2 < min_match_len ) continue;
 
@@ -425,7 +554,7 @@ static int LZe_sequence_optimizer( struct LZ_encoder * const e,
       state2 = St_set_rep( cur_state );
       price += Lp_price( &e->rep_len_prices, len, pos_state ) +
                price0( e->eb.bm_match[state2][pos_state2] ) +
-               LZeb_price_matched( &e->eb, data[len-1], data[len], data[len-dis] );
+               LZe_price_matched( e, data[len-1], data[len], data[len-dis] );
       pos_state2 = ( pos_state2 + 1 ) & pos_state_mask;
       state2 = St_set_char( state2 );
       price += price1( e->eb.bm_match[state2][pos_state2] ) +
@@ -462,14 +591,14 @@ static int LZe_sequence_optimizer( struct LZ_encoder * const e,
           const int dis2 = dis + 1;
           int len2 = len + 1;
           const int limit = min( e->match_len_limit + len2, triable_bytes );
-          while( len2 < limit && data[len2-dis2] == data[len2] ) ++len2;
+          len2 = match_len( data, dis2, len2, limit );
           len2 -= len + 1;
           if( len2 >= min_match_len )
             {
             int pos_state2 = ( pos_state + len ) & pos_state_mask;
             State state2 = St_set_match( cur_state );
             price += price0( e->eb.bm_match[state2][pos_state2] ) +
-                     LZeb_price_matched( &e->eb, data[len-1], data[len], data[len-dis2] );
+                     LZe_price_matched( e, data[len-1], data[len], data[len-dis2] );
             pos_state2 = ( pos_state2 + 1 ) & pos_state_mask;
             state2 = St_set_char( state2 );
             price += price1( e->eb.bm_match[state2][pos_state2] ) +
@@ -490,53 +619,153 @@ static int LZe_sequence_optimizer( struct LZ_encoder * const e,
   }
 
 
+/* match length limits of levels -1 to -9 */
+static const int effort_len_limits[num_effort_steps] =
+  { 5, 6, 8, 12, 20, 36, 68, 132, 273 };
+
+static double cpu_time( void )
+  {
+  struct timespec ts;
+  if( clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts ) != 0 ) return 0;
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+
+/* Make LZe_encode_member adjust the effort to encode at least 'target'
+   bytes per second of processor time, or keep the effort fixed if
+   'target' is 0. Processor time is measured instead of elapsed time so
+   that slow input or output does not make the encoder trade ratio for a
+   speed it can't provide. The effort starts at the limit given to
+   LZe_init, which is also the maximum. Call it only before encoding,
+   while the match finder is empty.
+*/
+void LZe_set_target_speed( struct LZ_encoder * const e,
+                           const unsigned long long target )
+  {
+  struct Speed_control * const sc = &e->sc;
+  int i;
+  sc->target = target;
+  for( i = 0; i < num_effort_steps; ++i ) sc->speed[i] = 0;
+  sc->top_step = 0;
+  while( sc->top_step < num_effort_steps - 1 &&
+         effort_len_limits[sc->top_step] < e->max_len_limit ) ++sc->top_step;
+  sc->step = sc->top_step;
+  e->sorted_len = e->max_len_limit;
+  LZe_set_len_limit( e, e->max_len_limit );
+  }
+
+
+/* Measure the speed of the last block and move one effort step down if
+   it was too slow, or one step up if it was so fast that the next step
+   will probably meet the target too, or if the next step was fast enough
+   the last time it was used. */
+static void LZe_adjust_effort( struct LZ_encoder * const e )
+  {
+  struct Speed_control * const sc = &e->sc;
+  const unsigned long long pos = Mb_data_position( &e->eb.mb );
+  const double now = cpu_time();
+  const double elapsed = now - sc->start_time;
+  const double bytes = pos - ( sc->next_pos - speed_block_size );
+  const unsigned long long speed = ( elapsed > 0 ) ?
+    bytes / elapsed : 2 * sc->target;
+  int step = sc->step;
+
+  sc->next_pos = pos + speed_block_size;
+  sc->start_time = now;
+  sc->speed[step] = speed;
+  if( speed < sc->target ) { if( step > 0 ) --step; }
+  else if( step < sc->top_step &&
+           ( speed / 2 >= sc->target || sc->speed[step+1] >= sc->target ) )
+    ++step;
+  if( step == sc->step ) return;
+  sc->step = step;
+  LZe_set_len_limit( e, ( step < sc->top_step ) ?
+                        effort_len_limits[step] : e->max_len_limit );
+  }
+
+
 bool LZe_encode_member( struct LZ_encoder * const e,
                         const unsigned long long member_size )
   {
   const unsigned long long member_size_limit =
     member_size - Lt_size - max_marker_size;
-  const bool best = ( e->match_len_limit > 12 );
-  const int dis_price_count = best ? 1 : 512;
-  const int align_price_count = best ? 1 : dis_align_size;
-  const int price_count = ( e->match_len_limit > 36 ) ? 1013 : 4093;
   int price_counter = 0;		/* counters may decrement below 0 */
   int dis_price_counter = 0;
   int align_price_counter = 0;
   int ahead, i;
   int reps[num_rep_distances];
   State state = 0;
+  struct Coder_stats * const stats = e->eb.stats;
+  struct Op_log * const log = e->eb.log;
   for( i = 0; i < num_rep_distances; ++i ) reps[i] = 0;
 
+  /* Add the preset to the match finder; the data start right after it.
+     This is done for every member, and costs about as much as compressing
+     the preset. Copying the state left by a previous member is not an
+     option: the last positions of the preset are inserted in the trees
+     comparing them with the data that follow, and the size of the hash
+     table depends on the dictionary size, which shrinks for small members. */
+  for( ; e->eb.mb.preset_pending > 0; --e->eb.mb.preset_pending )
+    { LZe_get_match_pairs( e, 0 ); Mb_move_pos( &e->eb.mb ); }
   if( Mb_data_position( &e->eb.mb ) != 0 ||
-      Re_member_position( &e->eb.renc ) != Lh_size )
+      Re_member_position( &e->eb.renc ) != Re_header_size( &e->eb.renc ) )
     return false;				/* can be called only once */
+  if( e->sc.target )
+    { e->sc.next_pos = speed_block_size; e->sc.start_time = cpu_time(); }
 
-  if( !Mb_data_finished( &e->eb.mb ) )		/* encode first byte */
+  /* encode first byte, unless it follows a preset */
+  if( e->eb.mb.pos == 0 && !Mb_data_finished( &e->eb.mb ) )
     {
     const uint8_t prev_byte = 0;
     const uint8_t cur_byte = Mb_peek( &e->eb.mb, 0 );
     Re_encode_bit( &e->eb.renc, &e->eb.bm_match[state][0], 0 );
     LZeb_encode_literal( &e->eb, prev_byte, cur_byte );
     CRC32_update_byte( &e->eb.crc, cur_byte );
+    if( stats ) ++stats->literals;
+    if( log ) Ol_add( log, -1, 1 );
     LZe_get_match_pairs( e, 0 );
     Mb_move_pos( &e->eb.mb );
     }
 
   while( !Mb_data_finished( &e->eb.mb ) )
     {
+    if( Mb_data_position( &e->eb.mb ) >= e->eb.lr.next_pos &&
+        e->pending_num_pairs == 0 )
+      Lr_update( &e->eb.lr, Mb_data_position( &e->eb.mb ),
+                 Re_member_position( &e->eb.renc ) );
+    if( e->eb.lr.active )			/* literal run */
+      {
+      LZeb_encode_run_literal( &e->eb, &state, reps[0] );
+      LZe_add_position( e );
+      Mb_move_pos( &e->eb.mb );
+      if( Re_member_position( &e->eb.renc ) >= member_size_limit )
+        { LZeb_full_flush( &e->eb, state ); return true; }
+      continue;
+      }
     if( price_counter <= 0 && e->pending_num_pairs == 0 )
       {
-      price_counter = price_count;	/* recalculate prices every these bytes */
+      bool best;
+      if( e->sc.target && Mb_data_position( &e->eb.mb ) >= e->sc.next_pos )
+        LZe_adjust_effort( e );
+      best = ( e->match_len_limit > 12 );
+      /* recalculate prices every these bytes */
+      price_counter = ( e->match_len_limit > 36 ) ? 1013 : 4093;
       if( dis_price_counter <= 0 )
-        { dis_price_counter = dis_price_count; LZe_update_distance_prices( e ); }
+        {
+        dis_price_counter = best ? 1 : 512; LZe_update_distance_prices( e );
+        if( stats ) ++stats->dis_price_updates;
+        }
       if( align_price_counter <= 0 )
         {
-        align_price_counter = align_price_count;
+        align_price_counter = best ? 1 : dis_align_size;
         for( i = 0; i < dis_align_size; ++i )
           e->align_prices[i] = price_symbol_reversed( e->eb.bm_align, i, dis_align_bits );
+        if( stats ) ++stats->align_price_updates;
         }
       Lp_update_prices( &e->match_len_prices );
       Lp_update_prices( &e->rep_len_prices );
+      LZe_check_lit_versions( e );
+      if( stats ) ++stats->price_updates;
       }
 
     ahead = LZe_sequence_optimizer( e, reps, state );
@@ -564,15 +793,20 @@ bool LZe_encode_member( struct LZ_encoder * const e,
           LZeb_encode_matched( &e->eb, prev_byte, cur_byte, match_byte );
           }
         state = St_set_char( state );
+        if( stats ) ++stats->literals;
+        if( log ) Ol_add( log, -1, 1 );
         }
       else					/* match or repeated match */
         {
         CRC32_update_buf( &e->eb.crc, Mb_ptr_to_current_pos( &e->eb.mb ) - ahead, len );
+        e->eb.lr.matched += len;
         mtf_reps( dis, reps );
+        if( log ) Ol_add( log, reps[0], len );
         bit = ( dis < num_rep_distances );
         Re_encode_bit( &e->eb.renc, &e->eb.bm_rep[state], bit );
         if( bit )				/* repeated match */
           {
+          if( stats ) Cst_add_rep( stats, dis, len );
           bit = ( dis == 0 );
           Re_encode_bit( &e->eb.renc, &e->eb.bm_rep0[state], !bit );
           if( bit )
@@ -595,6 +829,7 @@ bool LZe_encode_member( struct LZ_encoder * const e,
           {
           dis -= num_rep_distances;
           LZeb_encode_pair( &e->eb, dis, len, pos_state );
+          if( stats ) Cst_add_match( stats, len, get_slot( dis ) );
           if( dis >= modeled_distances ) --align_price_counter;
           --dis_price_counter;
           Lp_decrement_counter( &e->match_len_prices, pos_state );
@@ -15,6 +15,17 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+struct Lzma_options
+  {
+  int dictionary_size;		/* 4 KiB .. 512 MiB */
+  int match_len_limit;		/* 5 .. 273 */
+  bool hash_chain;		/* use the hash chain match finder */
+  };
+
+/* Mapping from gzip/bzip2 style 0..9 compression levels to the
+   corresponding LZMA compression options. Level 0 uses the fast encoder. */
+extern const struct Lzma_options option_mapping[10];
+
 struct Len_prices
   {
   const struct Len_model * lm;
@@ -133,11 +144,44 @@ static inline void Tr_update3( struct Trial * const trial, const int pr,
   }
 
 
+/* Adaptive effort for --target-speed. The encoder measures the processor
+   time used to encode each block of data and moves between the effort
+   steps (the match length limits of levels -1 to -9, up to the limit
+   given to LZe_init) to keep its speed above 'target'.
+*/
+enum { num_effort_steps = 9,
+       speed_block_size = 1 << 16 };	/* bytes between measurements */
+
+struct Speed_control
+  {
+  unsigned long long target;	/* bytes per second; 0 = fixed effort */
+  unsigned long long speed[num_effort_steps];	/* last speed; 0 = unknown */
+  unsigned long long next_pos;	/* data position of next measurement */
+  double start_time;		/* processor time at the last measurement */
+  int step;			/* current effort step */
+  int top_step;			/* step of the limit given to LZe_init */
+  };
+
+/* Prices of literals already computed by the optimizer. An entry is valid
+   while its version equals the lit_version of its literal context, which
+   changes every time a literal is coded in that context. Matched literals
+   are kept in a direct-mapped table indexed by the symbol and the low bits
+   of the match byte, with the full pair in 'key'. */
+enum { matched_cache_bits = 9,
+       matched_cache_size = 1 << matched_cache_bits };
+
+struct Lit_price { uint32_t version; int price; };
+struct Matched_price { uint32_t version; uint16_t key; int16_t price; };
+
 struct LZ_encoder
   {
   struct LZ_encoder_base eb;
   int cycles;
   int match_len_limit;
+  int max_len_limit;		/* match_len_limit given to LZe_init */
+  int sorted_len;		/* lowest match_len_limit since Mb_reset */
+  bool hash_chain;		/* use hash chain instead of binary tree */
+  struct Speed_control sc;
   struct Len_prices match_len_prices;
   struct Len_prices rep_len_prices;
   int pending_num_pairs;
@@ -148,6 +192,8 @@ struct LZ_encoder
   int dis_prices[len_states][modeled_distances];
   int align_prices[dis_align_size];
   int num_dis_slots;
+  struct Lit_price lit_prices[1<<literal_context_bits][256];
+  struct Matched_price matched_prices[1<<literal_context_bits][matched_cache_size];
   };
 
 static inline bool Mb_dec_pos( struct Matchfinder_base * const mb,
@@ -210,6 +256,55 @@ static inline int LZe_price_rep0_len( const struct LZ_encoder * const e,
          Lp_price( &e->rep_len_prices, len, pos_state );
   }
 
+static inline int LZe_price_literal( struct LZ_encoder * const e,
+                            const uint8_t prev_byte, const uint8_t symbol )
+  {
+  const int lit_state = get_lit_state( prev_byte );
+  struct Lit_price * const lp = &e->lit_prices[lit_state][symbol];
+  if( lp->version != e->eb.lit_version[lit_state] )
+    {
+    lp->version = e->eb.lit_version[lit_state];
+    lp->price = price_symbol8( e->eb.bm_literal[lit_state], symbol );
+    }
+  return lp->price;
+  }
+
+static inline int LZe_price_matched( struct LZ_encoder * const e,
+  const uint8_t prev_byte, const uint8_t symbol, const uint8_t match_byte )
+  {
+  const int lit_state = get_lit_state( prev_byte );
+  const unsigned key = ( match_byte << 8 ) | symbol;
+  struct Matched_price * const mp = &e->matched_prices[lit_state]
+    [( symbol ^ ( match_byte << ( matched_cache_bits - 8 ) ) ) &
+     ( matched_cache_size - 1 )];
+  if( mp->version != e->eb.lit_version[lit_state] || mp->key != key )
+    {
+    mp->version = e->eb.lit_version[lit_state];
+    mp->key = key;
+    mp->price = price_matched( e->eb.bm_literal[lit_state], symbol,
+                               match_byte );
+    }
+  return mp->price;
+  }
+
+/* Invalidate all the cached literal prices. Called by LZe_init, and
+   before the versions can wrap around and match again a stale entry. */
+static inline void LZe_clear_lit_prices( struct LZ_encoder * const e )
+  {
+  int i;
+  memset( e->lit_prices, 0, sizeof e->lit_prices );
+  memset( e->matched_prices, 0, sizeof e->matched_prices );
+  for( i = 0; i < 1 << literal_context_bits; ++i ) e->eb.lit_version[i] = 1;
+  }
+
+static inline void LZe_check_lit_versions( struct LZ_encoder * const e )
+  {
+  int i;
+  for( i = 0; i < 1 << literal_context_bits; ++i )
+    if( e->eb.lit_version[i] >= 1U << 31 )
+      { LZe_clear_lit_prices( e ); return; }
+  }
+
 static inline int LZe_price_pair( const struct LZ_encoder * const e,
                                   const int dis, const int len,
                                   const int pos_state )
@@ -276,34 +371,71 @@ static inline void LZe_backward( struct LZ_encoder * const e, int cur )
 enum { num_prev_positions3 = 1 << 16,
        num_prev_positions2 = 1 << 10 };
 
+/* Set the effort parameters that depend on the match length limit. */
+static inline void LZe_set_len_limit( struct LZ_encoder * const e,
+                                      const int len_limit )
+  {
+  e->cycles = ( len_limit < max_match_len ) ? 16 + ( len_limit / 2 ) : 256;
+  e->match_len_limit = len_limit;
+  if( e->sorted_len > len_limit ) e->sorted_len = len_limit;
+  Lp_init( &e->match_len_prices, &e->eb.match_len_model, len_limit );
+  Lp_init( &e->rep_len_prices, &e->eb.rep_len_model, len_limit );
+  }
+
+void LZe_set_target_speed( struct LZ_encoder * const e,
+                           const unsigned long long target );
+
+static inline void LZe_init_prices( struct LZ_encoder * const e )
+  {
+  e->sorted_len = e->match_len_limit;
+  LZe_set_len_limit( e, e->match_len_limit );
+  e->pending_num_pairs = 0;
+  e->num_dis_slots = 2 * real_bits( e->eb.mb.dictionary_size - 1 );
+  e->trials[1].prev_index = 0;
+  e->trials[1].prev_index2 = single_step_trial;
+  }
+
 static inline bool LZe_init( struct LZ_encoder * const e,
                              const int dict_size, const int len_limit,
-                             const int ifd, const int outfd )
+                             const bool hash_chain,
+                             const struct Preset_dict * const preset,
+                             const int ifd, const uint8_t * const idata,
+                             const long long idata_size, const int outfd )
   {
   enum { before_size = max_num_trials,
          /* bytes to keep in buffer after pos */
          after_size = ( 2 * max_match_len ) + 1,
          dict_factor = 2,
-         num_prev_positions23 = num_prev_positions2 + num_prev_positions3,
-         pos_array_factor = 2 };
+         num_prev_positions23 = num_prev_positions2 + num_prev_positions3 };
+  const int pos_array_factor = hash_chain ? 1 : 2;
 
   if( !LZeb_init( &e->eb, before_size, dict_size, after_size, dict_factor,
-                  num_prev_positions23, pos_array_factor, ifd, outfd ) )
+                  num_prev_positions23, pos_array_factor, preset, ifd,
+                  idata, idata_size, outfd ) )
     return false;
-  e->cycles = ( len_limit < max_match_len ) ? 16 + ( len_limit / 2 ) : 256;
-  e->match_len_limit = len_limit;
-  Lp_init( &e->match_len_prices, &e->eb.match_len_model, e->match_len_limit );
-  Lp_init( &e->rep_len_prices, &e->eb.rep_len_model, e->match_len_limit );
-  e->pending_num_pairs = 0;
-  e->num_dis_slots = 2 * real_bits( e->eb.mb.dictionary_size - 1 );
-  e->trials[1].prev_index = 0;
-  e->trials[1].prev_index2 = single_step_trial;
+  e->hash_chain = hash_chain;
+  e->match_len_limit = e->max_len_limit = len_limit;
+  e->sc.target = 0;
+  LZe_init_prices( e );
+  LZe_clear_lit_prices( e );
+  return true;
+  }
+
+/* Like LZeb_reinit. The options given to LZe_init are kept, and so are
+   the target speed and the effort reached. */
+static inline bool LZe_reinit( struct LZ_encoder * const e, const int ifd,
+                               const uint8_t * const idata,
+                               const long long idata_size, const int outfd )
+  {
+  if( !LZeb_reinit( &e->eb, ifd, idata, idata_size, outfd ) ) return false;
+  LZe_init_prices( e );
   return true;
   }
 
 static inline void LZe_reset( struct LZ_encoder * const e )
   {
   LZeb_reset( &e->eb );
+  e->sorted_len = e->match_len_limit;
   Lp_reset( &e->match_len_prices );
   Lp_reset( &e->rep_len_prices );
   e->pending_num_pairs = 0;
@@ -22,6 +22,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "lzip.h"
 #include "encoder_base.h"
@@ -31,15 +34,65 @@ Dis_slots dis_slots;
 Prob_prices prob_prices;
 
 
+/* Fail if the mapped file has been truncated below 'end'. Touching the
+   missing pages would raise SIGBUS. */
+static void Mb_check_map( const struct Matchfinder_base * const mb,
+                          const long long end )
+  {
+  struct stat st;
+  if( fstat( mb->map_fd, &st ) != 0 || st.st_size < end )
+    { show_error( "Read error: input file has shrunk.", 0, false );
+      cleanup_and_fail( 1 ); }
+  }
+
+
+/* Give back to the system the mapped pages behind the window, so that
+   RSS stays near the size of the window instead of growing to the size
+   of the file. Done in steps of at least 1 MiB to save system calls. */
+static void Mb_release_map( struct Matchfinder_base * const mb )
+  {
+#ifdef MADV_DONTNEED
+  static long page_size = 0;
+  long long end;
+  if( page_size <= 0 ) page_size = max( 1, sysconf( _SC_PAGESIZE ) );
+  end = ( mb->buffer - mb->idata ) / page_size * page_size;
+  if( end - mb->idata_released >= 1 << 20 )
+    {
+    madvise( (void *)( mb->idata + mb->idata_released ),
+             end - mb->idata_released, MADV_DONTNEED );
+    mb->idata_released = end;
+    }
+#endif
+  }
+
+
 bool Mb_read_block( struct Matchfinder_base * const mb )
   {
   if( !mb->at_stream_end && mb->stream_pos < mb->buffer_size )
     {
     const int size = mb->buffer_size - mb->stream_pos;
-    const int rd = readblock( mb->infd, mb->buffer + mb->stream_pos, size );
+    int rd;
+    if( mb->infd >= 0 )
+      {
+      rd = readblock( mb->infd, mb->buffer + mb->stream_pos, size );
+      if( rd != size && errno )
+        { show_error( "Read error", errno, false ); cleanup_and_fail( 1 ); }
+      }
+    else if( !Mb_owns_buffer( mb ) )
+      {		/* the data are already in place; just extend the window */
+      rd = min( size, mb->idata_size - mb->idata_pos );
+      if( mb->map_fd >= 0 && rd > 0 ) Mb_check_map( mb, mb->idata_pos + rd );
+      mb->idata_pos += rd;
+      }
+    else if( mb->idata )
+      {
+      rd = min( size, mb->idata_size - mb->idata_pos );
+      memcpy( mb->buffer + mb->stream_pos, mb->idata + mb->idata_pos, rd );
+      mb->idata_pos += rd;
+      }
+    else
+      rd = mb->read_fn( mb->read_arg, mb->buffer + mb->stream_pos, size );
     mb->stream_pos += rd;
-    if( rd != size && errno )
-      { show_error( "Read error", errno, false ); cleanup_and_fail( 1 ); }
     if( rd < size )
       { mb->at_stream_end = true; mb->pos_limit = mb->buffer_size; }
     }
@@ -57,7 +110,10 @@ void Mb_normalize_pos( struct Matchfinder_base * const mb )
     /* offset is int32_t for the min below */
     const int32_t offset = mb->pos - mb->before_size - mb->dictionary_size;
     const int size = mb->stream_pos - offset;
-    memmove( mb->buffer, mb->buffer + offset, size );
+    if( Mb_owns_buffer( mb ) ) memmove( mb->buffer, mb->buffer + offset, size );
+    else
+      { mb->buffer += offset;		/* slide the window */
+        if( mb->map_fd >= 0 ) Mb_release_map( mb ); }
     mb->partial_data_pos += offset;
     mb->pos -= offset;		/* pos = before_size + dictionary_size */
     mb->stream_pos -= offset;
@@ -70,85 +126,259 @@ void Mb_normalize_pos( struct Matchfinder_base * const mb )
   }
 
 
-bool Mb_init( struct Matchfinder_base * const mb, const int before_size,
-              const int dict_size, const int after_size,
-              const int dict_factor, const int num_prev_positions23,
-              const int pos_array_factor, const int ifd )
+/* Tables of at least one huge page are mapped directly instead of being
+   allocated with malloc, aligned to a huge page boundary, and marked as
+   candidates for transparent huge pages. Walking the binary tree of a
+   large dictionary touches a different page at almost every step, and
+   with small pages almost every step misses the TLB. Explicit huge pages
+   of 2 MiB are used instead if the system has enough of them reserved.
+   Their size is requested explicitly because the default huge page size
+   may be larger (1 GiB), and table_free unmaps the size rounded to 2 MiB.
+   Pages are placed on the NUMA node of the thread that first touches
+   them, which for the tables is the thread that uses them.
+*/
+enum { huge_page_size = 1 << 21 };
+
+#if defined MAP_HUGETLB && defined MAP_HUGE_2MB
+#define HUGETLB_2MB ( MAP_HUGETLB | MAP_HUGE_2MB )
+#elif defined MAP_HUGETLB && defined MAP_HUGE_SHIFT	/* glibc */
+#define HUGETLB_2MB ( MAP_HUGETLB | ( 21 << MAP_HUGE_SHIFT ) )
+#endif
+
+static size_t table_map_size( const size_t size )
+  { return ( size + huge_page_size - 1 ) & ~(size_t)( huge_page_size - 1 ); }
+
+void * table_alloc( const size_t size )
+  {
+  const size_t msize = table_map_size( size );
+  uint8_t * p;
+  size_t head;
+  if( size < huge_page_size ) return malloc( size );
+#ifdef HUGETLB_2MB
+  p = (uint8_t *)mmap( 0, msize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | HUGETLB_2MB, -1, 0 );
+  if( p != MAP_FAILED ) return p;
+#endif
+  /* map one huge page more and trim the mapping to an aligned address */
+  p = (uint8_t *)mmap( 0, msize + huge_page_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if( p == MAP_FAILED ) return 0;
+  head = ( huge_page_size - (uintptr_t)p % huge_page_size ) % huge_page_size;
+  if( head > 0 ) munmap( p, head );
+  munmap( p + head + msize, huge_page_size - head );
+  p += head;
+#ifdef MADV_HUGEPAGE
+  madvise( p, msize, MADV_HUGEPAGE );
+#endif
+  return p;
+  }
+
+/* Like table_alloc, but the table is returned cleared. Mapped tables are
+   cleared by the kernel one page at a time as they are first touched, so
+   the pages never used are never cleared. */
+void * table_calloc( const size_t size )
+  {
+  if( size < huge_page_size ) return calloc( size, 1 );
+  return table_alloc( size );
+  }
+
+/* 'size' must be the size given to table_alloc or table_calloc. */
+void table_free( void * const p, const size_t size )
+  {
+  if( size < huge_page_size ) free( p );
+  else if( p ) munmap( p, table_map_size( size ) );
+  }
+
+
+/* Make own_buffer at least 'size' bytes long, keeping its contents. */
+static bool Mb_reserve_buffer( struct Matchfinder_base * const mb,
+                               const int size )
+  {
+  if( mb->own_buffer_size < size )
+    {
+    uint8_t * const tmp = (uint8_t *)table_alloc( size );
+    if( !tmp ) return false;
+    if( mb->own_buffer )
+      {
+      memcpy( tmp, mb->own_buffer, mb->own_buffer_size );
+      table_free( mb->own_buffer, mb->own_buffer_size );
+      }
+    mb->own_buffer = tmp;
+    mb->own_buffer_size = size;
+    }
+  mb->buffer = mb->own_buffer;
+  return true;
+  }
+
+
+/* Give back the buffer kept from a previous input if the new input needs
+   less than half of it. The data already read are kept. If the smaller
+   buffer can't be allocated, the large one is kept instead. */
+static void Mb_trim_buffer( struct Matchfinder_base * const mb )
+  {
+  uint8_t * tmp;
+  if( !Mb_owns_buffer( mb ) || mb->own_buffer_size / 2 <= mb->buffer_size )
+    return;
+  tmp = (uint8_t *)table_alloc( mb->buffer_size );
+  if( !tmp ) return;
+  memcpy( tmp, mb->own_buffer, mb->stream_pos );
+  table_free( mb->own_buffer, mb->own_buffer_size );
+  mb->own_buffer = mb->buffer = tmp;
+  mb->own_buffer_size = mb->buffer_size;
+  }
+
+
+static bool Mb_fail( struct Matchfinder_base * const mb )
+  {
+  Mb_free( mb );
+  mb->own_buffer = 0; mb->own_buffer_size = 0;
+  mb->prev_positions = 0; mb->prev_positions_size = 0;
+  return false;
+  }
+
+
+/* Size the table of 4-byte keys for the dictionary, at one entry for every
+   4 positions, and never smaller than 65536 entries, even for a dictionary
+   shrunk to fit a small input; a smaller table costs ratio, mostly at -0.
+   A table just allocated is already clear, and Mb_reset does not clear it
+   again. */
+static void Mb_set_key4_size( struct Matchfinder_base * const mb )
+  {
+  int size = 1 << max( 16, real_bits( mb->dictionary_size - 1 ) - 2 );
+  if( mb->dictionary_size > 1 << 26 )		/* 64 MiB */
+    size >>= 1;
+  mb->key4_mask = size - 1;		/* increases with dictionary size */
+  mb->num_prev_positions = size + mb->num_prev_positions23;
+  }
+
+
+/* Prepare 'mb' to read new input, reusing the buffers already allocated
+   if they are large enough, and shrinking those more than twice as large
+   as needed, so that a small file does not keep the memory used by a
+   large one that preceded it. On error, all the buffers are freed.
+   prev_positions is cleared by Mb_reset, which is called after this by
+   LZeb_reset, unless it has just been allocated. Input of unknown size is
+   first read into a small buffer, which only grows if the input does not
+   fit in it. The data are read after room for the preset, which Mb_reset
+   fills, and the dictionary covers both. */
+bool Mb_reinit( struct Matchfinder_base * const mb, const int ifd,
+                const uint8_t * const idata, const long long idata_size )
   {
+  const int dict_size = mb->max_dictionary_size;
   const int buffer_size_limit =
-    ( dict_factor * dict_size ) + before_size + after_size;
+    ( mb->dict_factor * dict_size ) + mb->before_size + mb->after_size;
+  const int preset_size = Mb_preset_size( mb );
   unsigned size;
-  int i;
 
   mb->partial_data_pos = 0;
-  mb->before_size = before_size;
-  mb->pos = 0;
+  mb->pos = preset_size;
   mb->cyclic_pos = 0;
-  mb->stream_pos = 0;
-  mb->num_prev_positions23 = num_prev_positions23;
+  mb->stream_pos = preset_size;
   mb->infd = ifd;
+  mb->idata = idata;
+  mb->idata_size = idata_size;
+  mb->idata_pos = 0;
+  mb->idata_released = 0;
+  mb->map_fd = -1;
   mb->at_stream_end = false;
 
-  mb->buffer_size = max( 65536, dict_size );
-  mb->buffer = (uint8_t *)malloc( mb->buffer_size );
-  if( !mb->buffer ) return false;
-  if( Mb_read_block( mb ) && !mb->at_stream_end &&
+  if( ifd < 0 && idata && !mb->preset )	/* use idata in place */
+    {
+    mb->buffer_size = buffer_size_limit;
+    mb->buffer = (uint8_t *)idata;
+    Mb_read_block( mb );
+    }
+  else
+    {
+    mb->buffer_size = preset_size + 65536;
+    if( !Mb_reserve_buffer( mb, mb->buffer_size ) ) return Mb_fail( mb );
+    }
+  if( Mb_owns_buffer( mb ) && Mb_read_block( mb ) && !mb->at_stream_end &&
       mb->buffer_size < buffer_size_limit )
     {
-    uint8_t * const tmp = (uint8_t *)realloc( mb->buffer, buffer_size_limit );
-    if( !tmp ) { free( mb->buffer ); return false; }
-    mb->buffer = tmp;
+    if( !Mb_reserve_buffer( mb, buffer_size_limit ) ) return Mb_fail( mb );
     mb->buffer_size = buffer_size_limit;
     Mb_read_block( mb );
     }
+  Mb_trim_buffer( mb );
   if( mb->at_stream_end && mb->stream_pos < dict_size )
     mb->dictionary_size = max( min_dictionary_size, mb->stream_pos );
   else
     mb->dictionary_size = dict_size;
   mb->pos_limit = mb->buffer_size;
-  if( !mb->at_stream_end ) mb->pos_limit -= after_size;
-  size = 1 << max( 16, real_bits( mb->dictionary_size - 1 ) - 2 );
-  if( mb->dictionary_size > 1 << 26 )		/* 64 MiB */
-    size >>= 1;
-  mb->key4_mask = size - 1;		/* increases with dictionary size */
-  size += num_prev_positions23;
-  mb->num_prev_positions = size;
+  if( !mb->at_stream_end ) mb->pos_limit -= mb->after_size;
+  Mb_set_key4_size( mb );
+  size = mb->num_prev_positions;
 
-  mb->pos_array_size = pos_array_factor * ( mb->dictionary_size + 1 );
+  mb->pos_array_size = mb->pos_array_factor * ( mb->dictionary_size + 1 );
   size += mb->pos_array_size;
-  if( size * sizeof mb->prev_positions[0] <= size ) mb->prev_positions = 0;
-  else mb->prev_positions =
-    (int32_t *)malloc( size * sizeof mb->prev_positions[0] );
-  if( !mb->prev_positions ) { free( mb->buffer ); return false; }
+  if( size * sizeof mb->prev_positions[0] <= size ) return Mb_fail( mb );
+  if( mb->prev_positions_size < size || mb->prev_positions_size / 2 > size )
+    {
+    table_free( mb->prev_positions,
+                mb->prev_positions_size * sizeof mb->prev_positions[0] );
+    mb->prev_positions =
+      (int32_t *)table_calloc( size * sizeof mb->prev_positions[0] );
+    mb->prev_positions_size = mb->prev_positions ? size : 0;
+    if( !mb->prev_positions ) return Mb_fail( mb );
+    mb->prev_positions_clear = true;
+    }
   mb->pos_array = mb->prev_positions + mb->num_prev_positions;
-  for( i = 0; i < mb->num_prev_positions; ++i ) mb->prev_positions[i] = 0;
   return true;
   }
 
 
+bool Mb_init( struct Matchfinder_base * const mb, const int before_size,
+              const int dict_size, const int after_size,
+              const int dict_factor, const int num_prev_positions23,
+              const int pos_array_factor,
+              const struct Preset_dict * const preset, const int ifd,
+              const uint8_t * const idata, const long long idata_size )
+  {
+  mb->own_buffer = 0;
+  mb->own_buffer_size = 0;
+  mb->prev_positions = 0;
+  mb->prev_positions_size = 0;
+  mb->prev_positions_clear = false;
+  mb->before_size = before_size;
+  mb->after_size = after_size;
+  mb->dict_factor = dict_factor;
+  mb->pos_array_factor = pos_array_factor;
+  mb->max_dictionary_size = dict_size;
+  mb->num_prev_positions23 = num_prev_positions23;
+  mb->preset = preset;
+  return Mb_reinit( mb, ifd, idata, idata_size );
+  }
+
+
+/* Drop the data before pos and place the preset, if any, before the rest.
+   pos is never smaller than the preset size here, so that the data moved
+   still fit in the buffer. */
 void Mb_reset( struct Matchfinder_base * const mb )
   {
-  int i;
-  if( mb->stream_pos > mb->pos )
-    memmove( mb->buffer, mb->buffer + mb->pos, mb->stream_pos - mb->pos );
-  mb->partial_data_pos = 0;
-  mb->stream_pos -= mb->pos;
+  const int preset_size = Mb_preset_size( mb );
+  if( !Mb_owns_buffer( mb ) ) mb->buffer += mb->pos;	/* slide the window */
+  else if( mb->stream_pos > mb->pos && mb->pos != preset_size )
+    memmove( mb->buffer + preset_size, mb->buffer + mb->pos,
+             mb->stream_pos - mb->pos );
+  if( preset_size > 0 )
+    memcpy( mb->buffer, mb->preset->data + mb->preset->size - preset_size,
+            preset_size );
+  mb->partial_data_pos = -(unsigned long long)preset_size;
+  mb->stream_pos -= mb->pos - preset_size;
   mb->pos = 0;
+  mb->preset_pending = preset_size;
   mb->cyclic_pos = 0;
   Mb_read_block( mb );
   if( mb->at_stream_end && mb->stream_pos < mb->dictionary_size )
     {
-    int size;
     mb->dictionary_size = max( min_dictionary_size, mb->stream_pos );
-    size = 1 << max( 16, real_bits( mb->dictionary_size - 1 ) - 2 );
-    if( mb->dictionary_size > 1 << 26 )		/* 64 MiB */
-      size >>= 1;
-    mb->key4_mask = size - 1;
-    size += mb->num_prev_positions23;
-    mb->num_prev_positions = size;
+    Mb_set_key4_size( mb );
     mb->pos_array = mb->prev_positions + mb->num_prev_positions;
     }
-  for( i = 0; i < mb->num_prev_positions; ++i ) mb->prev_positions[i] = 0;
+  if( mb->prev_positions_clear ) mb->prev_positions_clear = false;
+  else memset( mb->prev_positions, 0,
+               mb->num_prev_positions * sizeof mb->prev_positions[0] );
   }
 
 
@@ -156,12 +386,30 @@ void Re_flush_data( struct Range_encoder * const renc )
   {
   if( renc->pos > 0 )
     {
-    if( renc->outfd >= 0 &&
-        writeblock( renc->outfd, renc->buffer, renc->pos ) != renc->pos )
-      { show_error( "Write error", errno, false ); cleanup_and_fail( 1 ); }
+    if( renc->flush_fn )
+      {
+      renc->flush_fn( renc->flush_arg, renc->buffer, renc->pos );
+      show_cprogress( 0, 0, 0, 0 );
+      }
+    else if( renc->outfd >= 0 )
+      {
+      if( writeblock( renc->outfd, renc->buffer, renc->pos ) != renc->pos )
+        { show_error( "Write error", errno, false ); cleanup_and_fail( 1 ); }
+      show_cprogress( 0, 0, 0, 0 );
+      }
+    else
+      {
+      if( renc->odata_capacity - renc->odata_size < renc->pos )
+        {
+        renc->odata_capacity = max( 2 * renc->odata_capacity,
+                                    renc->odata_size + renc->pos );
+        renc->odata = resize_buffer( renc->odata, renc->odata_capacity );
+        }
+      memcpy( renc->odata + renc->odata_size, renc->buffer, renc->pos );
+      renc->odata_size += renc->pos;
+      }
     renc->partial_member_pos += renc->pos;
     renc->pos = 0;
-    show_cprogress( 0, 0, 0, 0 );
     }
   }
 
@@ -182,14 +430,33 @@ void LZeb_full_flush( struct LZ_encoder_base * const eb, const State state )
   for( i = 0; i < Lt_size; ++i )
     Re_put_byte( &eb->renc, trailer[i] );
   Re_flush_data( &eb->renc );
+  if( eb->stats ) Cst_add_member( eb->stats, Mb_data_position( &eb->mb ),
+                                  Re_member_position( &eb->renc ) );
   }
 
 
-void LZeb_reset( struct LZ_encoder_base * const eb )
+/* Double the capacity of the log, or set its error flag. */
+bool Ol_grow( struct Op_log * const ol )
+  {
+  const long capacity = ol->capacity ? 2 * ol->capacity : 1 << 16;
+  struct Lz_op * tmp = 0;
+  if( (size_t)capacity <= SIZE_MAX / sizeof ol->ops[0] )
+    tmp = (struct Lz_op *)realloc( ol->ops, capacity * sizeof ol->ops[0] );
+  if( !tmp ) { ol->error = true; return false; }
+  ol->ops = tmp;
+  ol->capacity = capacity;
+  return true;
+  }
+
+
+/* Prepare the coder for a new member, without touching the match finder,
+   whose dictionary_size gives the size written in the header. */
+void LZeb_reset_coder( struct LZ_encoder_base * const eb )
   {
-  Mb_reset( &eb->mb );
+  int i;
   eb->crc = 0xFFFFFFFFU;
   Bm_array_init( eb->bm_literal[0], (1 << literal_context_bits) * 0x300 );
+  for( i = 0; i < 1 << literal_context_bits; ++i ) ++eb->lit_version[i];
   Bm_array_init( eb->bm_match[0], states * pos_states );
   Bm_array_init( eb->bm_rep, states );
   Bm_array_init( eb->bm_rep0, states );
@@ -202,4 +469,9 @@ void LZeb_reset( struct LZ_encoder_base * const eb )
   Lm_init( &eb->match_len_model );
   Lm_init( &eb->rep_len_model );
   Re_reset( &eb->renc, eb->mb.dictionary_size );
+  Lr_reset( &eb->lr, Re_member_position( &eb->renc ) );
   }
+
+
+void LZeb_reset( struct LZ_encoder_base * const eb )
+  { Mb_reset( &eb->mb ); LZeb_reset_coder( eb ); }
@@ -15,6 +15,16 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    ( __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ || \
+      __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ )
+#define MATCH_LEN_WORD
+#if defined(__SSE2__)
+#define MATCH_LEN_SSE2
+#include <emmintrin.h>
+#endif
+#endif
+
 enum { price_shift_bits = 6,
        price_step_bits = 2,
        price_step = 1 << price_step_bits };
@@ -159,10 +169,18 @@ static inline int price_matched( const Bit_model bm[], unsigned symbol,
 struct Matchfinder_base
   {
   unsigned long long partial_data_pos;
-  uint8_t * buffer;		/* input buffer */
+  uint8_t * buffer;		/* input buffer, or window into idata */
+  uint8_t * own_buffer;		/* allocated buffer, kept by Mb_reinit */
+  int own_buffer_size;
   int32_t * prev_positions;	/* 1 + last seen position of key. else 0 */
+  unsigned prev_positions_size;	/* allocated elements of prev_positions */
+  bool prev_positions_clear;	/* not yet used since allocated */
   int32_t * pos_array;		/* may be tree or chain */
   int before_size;		/* bytes to keep in buffer before dictionary */
+  int after_size;		/* bytes to keep in buffer after pos */
+  int dict_factor;
+  int pos_array_factor;
+  int max_dictionary_size;	/* as requested to Mb_init */
   int buffer_size;
   int dictionary_size;		/* bytes to keep in buffer before pos */
   int pos;			/* current pos in buffer */
@@ -173,7 +191,27 @@ struct Matchfinder_base
   int num_prev_positions23;
   int num_prev_positions;	/* size of prev_positions */
   int pos_array_size;
+  /* The last bytes of the preset, if any, are copied to the start of the
+     buffer by Mb_reset, before the data of each member. The encoder adds
+     them to the match finder before coding the member. */
+  const struct Preset_dict * preset;	/* or 0 */
+  int preset_pending;		/* bytes at pos not yet in the match finder */
   int infd;			/* input file descriptor */
+  /* If infd < 0, the input data are already in memory (for example a
+     mapped file), and buffer slides over them instead of being a copy,
+     unless a preset is used, which must precede them in the buffer.
+     If infd < 0 and idata is 0, the data are read with read_fn, which the
+     caller must set, along with read_arg, before calling Mb_init. */
+  Read_fn * read_fn;
+  void * read_arg;
+  const uint8_t * idata;
+  long long idata_size;
+  long long idata_pos;		/* idata + idata_pos == buffer + stream_pos */
+  /* If map_fd >= 0, idata is a mapping of the file open on map_fd. Its
+     size is checked before extending the window, and the pages behind
+     the window are given back to the system. Set by Mb_set_map_fd. */
+  long long idata_released;	/* bytes of idata given back */
+  int map_fd;
   bool at_stream_end;		/* stream_pos shows real end of file */
   };
 
@@ -183,10 +221,36 @@ void Mb_normalize_pos( struct Matchfinder_base * const mb );
 bool Mb_init( struct Matchfinder_base * const mb, const int before_size,
               const int dict_size, const int after_size,
               const int dict_factor, const int num_prev_positions23,
-              const int pos_array_factor, const int ifd );
+              const int pos_array_factor,
+              const struct Preset_dict * const preset, const int ifd,
+              const uint8_t * const idata, const long long idata_size );
+bool Mb_reinit( struct Matchfinder_base * const mb, const int ifd,
+                const uint8_t * const idata, const long long idata_size );
+
+static inline bool Mb_owns_buffer( const struct Matchfinder_base * const mb )
+  { return mb->buffer == mb->own_buffer; }
+
+/* Must be called after Mb_init or Mb_reinit, which reset map_fd to -1. */
+static inline void Mb_set_map_fd( struct Matchfinder_base * const mb,
+                                  const int fd )
+  { if( !Mb_owns_buffer( mb ) ) mb->map_fd = fd; }
+
+/* Bytes of the preset placed before the data. Matches never reach farther
+   back than the dictionary size. */
+static inline int Mb_preset_size( const struct Matchfinder_base * const mb )
+  { return mb->preset ?
+           min( mb->preset->size, mb->max_dictionary_size - 1 ) : 0; }
+
+void * table_alloc( const size_t size );
+void * table_calloc( const size_t size );
+void table_free( void * const p, const size_t size );
 
 static inline void Mb_free( struct Matchfinder_base * const mb )
-  { free( mb->prev_positions ); free( mb->buffer ); }
+  {
+  table_free( mb->prev_positions,
+              mb->prev_positions_size * sizeof mb->prev_positions[0] );
+  table_free( mb->own_buffer, mb->own_buffer_size );
+  }
 
 static inline uint8_t Mb_peek( const struct Matchfinder_base * const mb,
                                const int distance )
@@ -206,14 +270,50 @@ static inline const uint8_t *
 Mb_ptr_to_current_pos( const struct Matchfinder_base * const mb )
   { return mb->buffer + mb->pos; }
 
+/* Return the length of the match between 'data' and 'data - distance',
+   starting at 'len' and not exceeding 'len_limit'. Compares 16 or 8 bytes
+   at a time when possible, and locates the first mismatching byte by
+   counting the trailing (or leading) zero bits of the XOR of the words.
+   Never reads past data[len_limit-1].
+*/
+static inline int match_len( const uint8_t * const data, const int distance,
+                             int len, const int len_limit )
+  {
+#ifdef MATCH_LEN_SSE2
+  while( len + 16 <= len_limit )
+    {
+    const __m128i a = _mm_loadu_si128( (const __m128i *)( data + len ) );
+    const __m128i b =
+      _mm_loadu_si128( (const __m128i *)( data + len - distance ) );
+    const unsigned ne = _mm_movemask_epi8( _mm_cmpeq_epi8( a, b ) ) ^ 0xFFFFU;
+    if( ne ) return len + __builtin_ctz( ne );
+    len += 16;
+    }
+#endif
+#ifdef MATCH_LEN_WORD
+  while( len + 8 <= len_limit )
+    {
+    uint64_t a, b;
+    memcpy( &a, data + len, 8 );
+    memcpy( &b, data + len - distance, 8 );
+    a ^= b;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if( a ) return len + ( __builtin_ctzll( a ) >> 3 );
+#else
+    if( a ) return len + ( __builtin_clzll( a ) >> 3 );
+#endif
+    len += 8;
+    }
+#endif
+  while( len < len_limit && data[len-distance] == data[len] ) ++len;
+  return len;
+  }
+
 static inline int Mb_true_match_len( const struct Matchfinder_base * const mb,
                                      const int index, const int distance )
   {
-  const uint8_t * const data = mb->buffer + mb->pos;
-  int i = index;
   const int len_limit = min( Mb_available_bytes( mb ), max_match_len );
-  while( i < len_limit && data[i-distance] == data[i] ) ++i;
-  return i;
+  return match_len( mb->buffer + mb->pos, distance, index, len_limit );
   }
 
 static inline void Mb_move_pos( struct Matchfinder_base * const mb )
@@ -235,9 +335,15 @@ struct Range_encoder
   int pos;			/* current pos in buffer */
   uint32_t range;
   unsigned ff_count;
+  Flush_fn * flush_fn;		/* output function, or 0 to use outfd */
+  void * flush_arg;
   int outfd;			/* output file descriptor */
+  uint8_t * odata;		/* output data in memory, used if outfd < 0 */
+  long long odata_size;
+  long long odata_capacity;
   uint8_t cache;
   Lzip_header header;
+  const struct Preset_dict * preset;	/* if not 0, its id follows header */
   };
 
 void Re_flush_data( struct Range_encoder * const renc );
@@ -276,21 +382,43 @@ static inline void Re_reset( struct Range_encoder * const renc,
   Lh_set_dictionary_size( renc->header, dictionary_size );
   for( i = 0; i < Lh_size; ++i )
     Re_put_byte( renc, renc->header[i] );
+  if( renc->preset )
+    for( i = 0; i < preset_id_size; ++i )
+      Re_put_byte( renc, renc->preset->id >> ( 8 * i ) );
+  }
+
+/* Size of the header of the member, including the id of the preset. */
+static inline unsigned Re_header_size( const struct Range_encoder * const renc )
+  { return Lh_size + ( renc->preset ? preset_id_size : 0 ); }
+
+/* Prepare 'renc' for new output, keeping its buffers. */
+static inline void Re_reinit( struct Range_encoder * const renc,
+                              const unsigned dictionary_size, const int ofd )
+  {
+  renc->flush_fn = 0;
+  renc->flush_arg = 0;
+  renc->outfd = ofd;
+  renc->odata_size = 0;
+  Re_reset( renc, dictionary_size );
   }
 
 static inline bool Re_init( struct Range_encoder * const renc,
-                            const unsigned dictionary_size, const int ofd )
+                            const unsigned dictionary_size, const int ofd,
+                            const struct Preset_dict * const preset )
   {
   renc->buffer = (uint8_t *)malloc( re_buffer_size );
   if( !renc->buffer ) return false;
-  renc->outfd = ofd;
+  renc->odata = 0;
+  renc->odata_capacity = 0;
+  renc->preset = preset;
   Lh_set_magic( renc->header );
-  Re_reset( renc, dictionary_size );
+  Lh_set_preset( renc->header, preset != 0 );
+  Re_reinit( renc, dictionary_size, ofd );
   return true;
   }
 
 static inline void Re_free( struct Range_encoder * const renc )
-  { free( renc->buffer ); }
+  { free( renc->odata ); free( renc->buffer ); }
 
 static inline unsigned long long
 Re_member_position( const struct Range_encoder * const renc )
@@ -426,12 +554,108 @@ static inline void Re_encode_len( struct Range_encoder * const renc,
 enum { max_marker_size = 16,
        num_rep_distances = 4 };		/* must be 4 */
 
+/* Detection of incompressible data. The encoder codes a sample of
+   'lr_sample_size' bytes as usual, counting the bytes coded as matches.
+   If less than 1/16 of the sample is matched, and the sample does not
+   compress to less than 15/16 of its size, searching for matches is not
+   worth its cost, and the next bytes are coded as a run of literals
+   without using the match finder. The run ends early if its literals
+   compress to less than 15/16 of their size, which means that the data
+   have changed. Else it is followed by another sample. Runs double in
+   size, from 'lr_min_run' up to 'lr_max_run', while the samples remain
+   incompressible.
+*/
+enum { lr_sample_size = 1 << 14,
+       lr_check_size = 1 << 12,		/* literals between checks */
+       lr_min_run = 1 << 16,
+       lr_max_run = 1 << 20 };
+
+struct Literal_run
+  {
+  unsigned long long next_pos;	/* data position of the next decision */
+  unsigned long long start_pos;	/* data position of the last decision */
+  unsigned long long end_pos;	/* data position of the end of the run */
+  unsigned long long out_pos;	/* member position of the last decision */
+  int matched;			/* bytes coded as matches in the sample */
+  int run_size;			/* size of the next run */
+  bool active;			/* coding a run of literals */
+  };
+
+static inline void Lr_start_sample( struct Literal_run * const lr,
+                                    const unsigned long long dpos,
+                                    const unsigned long long mpos )
+  {
+  lr->start_pos = dpos;
+  lr->next_pos = dpos + lr_sample_size;
+  lr->out_pos = mpos;
+  lr->matched = 0;
+  lr->active = false;
+  }
+
+static inline void Lr_reset( struct Literal_run * const lr,
+                             const unsigned long long mpos )
+  { Lr_start_sample( lr, 0, mpos ); lr->run_size = lr_min_run; }
+
+/* Decide how to code the data from 'dpos' on. Call it when the data
+   position reaches 'next_pos'. 'mpos' is the current member position. */
+static inline void Lr_update( struct Literal_run * const lr,
+                              const unsigned long long dpos,
+                              const unsigned long long mpos )
+  {
+  const unsigned long long size = dpos - lr->start_pos;
+  const bool compressible = ( mpos - lr->out_pos ) * 16 < size * 15;
+  if( !lr->active )				/* end of sample */
+    {
+    if( lr->matched * 16ULL >= size || compressible )
+      { lr->run_size = lr_min_run; Lr_start_sample( lr, dpos, mpos ); return; }
+    lr->active = true;
+    lr->end_pos = dpos + lr->run_size;
+    if( lr->run_size < lr_max_run ) lr->run_size *= 2;
+    }
+  else if( compressible )
+    { lr->run_size = lr_min_run; Lr_start_sample( lr, dpos, mpos ); return; }
+  else if( dpos >= lr->end_pos )
+    { Lr_start_sample( lr, dpos, mpos ); return; }
+  lr->start_pos = dpos;
+  lr->next_pos = dpos + lr_check_size;
+  lr->out_pos = mpos;
+  }
+
+
+/* Decisions taken by an encoder that parses a block of data for another
+   encoder to code (see compress_mt.c). A literal has dis < 0, and 'len'
+   consecutive literals are kept in one entry. Else the entry is a match
+   of 'len' bytes at distance 'dis' + 1, whether coded as a rep or not. */
+struct Lz_op { int dis, len; };
+
+struct Op_log
+  {
+  struct Lz_op * ops;
+  long size;			/* entries in ops */
+  long capacity;		/* allocated entries */
+  bool error;			/* an entry could not be added */
+  };
+
+bool Ol_grow( struct Op_log * const ol );
+
+static inline void Ol_add( struct Op_log * const ol, const int dis,
+                           const int len )
+  {
+  if( dis < 0 && ol->size > 0 && ol->ops[ol->size-1].dis < 0 )
+    { ++ol->ops[ol->size-1].len; return; }
+  if( ol->size >= ol->capacity && !Ol_grow( ol ) ) return;
+  ol->ops[ol->size].dis = dis; ol->ops[ol->size].len = len; ++ol->size;
+  }
+
+
 struct LZ_encoder_base
   {
   struct Matchfinder_base mb;
+  struct Literal_run lr;
   uint32_t crc;
 
   Bit_model bm_literal[1<<literal_context_bits][0x300];
+  uint32_t lit_version[1<<literal_context_bits];  /* changes with bm_literal */
   Bit_model bm_match[states][pos_states];
   Bit_model bm_rep[states];
   Bit_model bm_rep0[states];
@@ -444,8 +668,11 @@ struct LZ_encoder_base
   struct Len_model match_len_model;
   struct Len_model rep_len_model;
   struct Range_encoder renc;
+  struct Coder_stats * stats;	/* counters for --stats, or 0 */
+  struct Op_log * log;		/* if not 0, the decisions are added to it */
   };
 
+void LZeb_reset_coder( struct LZ_encoder_base * const eb );
 void LZeb_reset( struct LZ_encoder_base * const eb );
 
 static inline bool LZeb_init( struct LZ_encoder_base * const eb,
@@ -453,11 +680,34 @@ static inline bool LZeb_init( struct LZ_encoder_base * const eb,
                               const int after_size, const int dict_factor,
                               const int num_prev_positions23,
                               const int pos_array_factor,
-                              const int ifd, const int outfd )
+                              const struct Preset_dict * const preset,
+                              const int ifd, const uint8_t * const idata,
+                              const long long idata_size, const int outfd )
   {
   if( !Mb_init( &eb->mb, before_size, dict_size, after_size, dict_factor,
-                num_prev_positions23, pos_array_factor, ifd ) ) return false;
-  if( !Re_init( &eb->renc, eb->mb.dictionary_size, outfd ) ) return false;
+                num_prev_positions23, pos_array_factor, preset, ifd, idata,
+                idata_size ) ) return false;
+  if( !Re_init( &eb->renc, eb->mb.dictionary_size, outfd, preset ) )
+    { Mb_free( &eb->mb ); return false; }
+  eb->stats = 0;
+  eb->log = 0;
+  memset( eb->lit_version, 0, sizeof eb->lit_version );
+  LZeb_reset( eb );
+  return true;
+  }
+
+/* Prepare an encoder initialized with LZeb_init to compress new input with
+   the same options and preset, reusing its buffers so that they are allocated and
+   page-faulted only once. On error, the buffers are freed. */
+static inline bool LZeb_reinit( struct LZ_encoder_base * const eb,
+                                const int ifd, const uint8_t * const idata,
+                                const long long idata_size, const int outfd )
+  {
+  if( !Mb_reinit( &eb->mb, ifd, idata, idata_size ) )
+    { Re_free( &eb->renc ); return false; }
+  Re_reinit( &eb->renc, eb->mb.dictionary_size, outfd );
+  eb->stats = 0;
+  eb->log = 0;
   LZeb_reset( eb );
   return true;
   }
@@ -479,13 +729,41 @@ static inline int LZeb_price_matched( const struct LZ_encoder_base * const eb,
 
 static inline void LZeb_encode_literal( struct LZ_encoder_base * const eb,
                             const uint8_t prev_byte, const uint8_t symbol )
-  { Re_encode_tree8( &eb->renc, eb->bm_literal[get_lit_state(prev_byte)],
-                     symbol ); }
+  {
+  const int lit_state = get_lit_state( prev_byte );
+  ++eb->lit_version[lit_state];
+  Re_encode_tree8( &eb->renc, eb->bm_literal[lit_state], symbol );
+  }
 
 static inline void LZeb_encode_matched( struct LZ_encoder_base * const eb,
   const uint8_t prev_byte, const uint8_t symbol, const uint8_t match_byte )
-  { Re_encode_matched( &eb->renc, eb->bm_literal[get_lit_state(prev_byte)],
-                       symbol, match_byte ); }
+  {
+  const int lit_state = get_lit_state( prev_byte );
+  ++eb->lit_version[lit_state];
+  Re_encode_matched( &eb->renc, eb->bm_literal[lit_state], symbol,
+                     match_byte );
+  }
+
+/* Code the byte at the current position as a literal, as part of a
+   literal run. The caller moves the match finder past it. */
+static inline void LZeb_encode_run_literal( struct LZ_encoder_base * const eb,
+                                            State * const statep,
+                                            const int rep0 )
+  {
+  const int pos_state = Mb_data_position( &eb->mb ) & pos_state_mask;
+  const uint8_t prev_byte = Mb_peek( &eb->mb, 1 );
+  const uint8_t cur_byte = Mb_peek( &eb->mb, 0 );
+  Re_encode_bit( &eb->renc, &eb->bm_match[*statep][pos_state], 0 );
+  if( St_is_char( *statep ) )
+    LZeb_encode_literal( eb, prev_byte, cur_byte );
+  else
+    LZeb_encode_matched( eb, prev_byte, cur_byte,
+                         Mb_peek( &eb->mb, rep0 + 1 ) );
+  *statep = St_set_char( *statep );
+  CRC32_update_byte( &eb->crc, cur_byte );
+  if( eb->stats ) { ++eb->stats->literals; ++eb->stats->run_literals; }
+  if( eb->log ) Ol_add( eb->log, -1, 1 );
+  }
 
 static inline void LZeb_encode_pair( struct LZ_encoder_base * const eb,
                                      const unsigned dis, const int len,
@@ -55,8 +55,7 @@ int FLZe_longest_match_len( struct FLZ_encoder * const fe, int * const distance
 
     if( data[maxlen-delta] == data[maxlen] )
       {
-      int len = 0;
-      while( len < available && data[len-delta] == data[len] ) ++len;
+      const int len = match_len( data, delta, 0, available );
       if( maxlen < len )
         { maxlen = len; *distance = delta - 1;
           if( maxlen >= len_limit ) { *ptr0 = *newptr; break; } }
@@ -66,6 +65,9 @@ int FLZe_longest_match_len( struct FLZ_encoder * const fe, int * const distance
     ptr0 = newptr;
     newpos1 = *ptr0;
     }
+  if( fe->eb.stats )
+    { ++fe->eb.stats->mf_searches;
+      fe->eb.stats->mf_cycles += 4 - max( count, 0 ); }
   return maxlen;
   }
 
@@ -78,19 +80,32 @@ bool FLZe_encode_member( struct FLZ_encoder * const fe,
   int rep = 0, i;
   int reps[num_rep_distances];
   State state = 0;
+  struct Coder_stats * const stats = fe->eb.stats;
+  struct Op_log * const log = fe->eb.log;
   for( i = 0; i < num_rep_distances; ++i ) reps[i] = 0;
 
+  /* add the preset to the match finder, for every member as in
+     LZe_encode_member */
+  if( fe->eb.mb.preset_pending > 0 )
+    {
+    FLZe_reset_key4( fe );
+    FLZe_update_and_move( fe, fe->eb.mb.preset_pending );
+    fe->eb.mb.preset_pending = 0;
+    }
   if( Mb_data_position( &fe->eb.mb ) != 0 ||
-      Re_member_position( &fe->eb.renc ) != Lh_size )
+      Re_member_position( &fe->eb.renc ) != Re_header_size( &fe->eb.renc ) )
     return false;				/* can be called only once */
 
-  if( !Mb_data_finished( &fe->eb.mb ) )		/* encode first byte */
+  /* encode first byte, unless it follows a preset */
+  if( fe->eb.mb.pos == 0 && !Mb_data_finished( &fe->eb.mb ) )
     {
     const uint8_t prev_byte = 0;
     const uint8_t cur_byte = Mb_peek( &fe->eb.mb, 0 );
     Re_encode_bit( &fe->eb.renc, &fe->eb.bm_match[state][0], 0 );
     LZeb_encode_literal( &fe->eb, prev_byte, cur_byte );
     CRC32_update_byte( &fe->eb.crc, cur_byte );
+    if( stats ) ++stats->literals;
+    if( log ) Ol_add( log, -1, 1 );
     FLZe_reset_key4( fe );
     FLZe_update_and_move( fe, 1 );
     }
@@ -98,10 +113,18 @@ bool FLZe_encode_member( struct FLZ_encoder * const fe,
   while( !Mb_data_finished( &fe->eb.mb ) &&
          Re_member_position( &fe->eb.renc ) < member_size_limit )
     {
-    int match_distance;
-    const int main_len = FLZe_longest_match_len( fe, &match_distance );
-    const int pos_state = Mb_data_position( &fe->eb.mb ) & pos_state_mask;
-    int len = 0;
+    int match_distance, main_len, pos_state, len = 0;
+    if( Mb_data_position( &fe->eb.mb ) >= fe->eb.lr.next_pos )
+      Lr_update( &fe->eb.lr, Mb_data_position( &fe->eb.mb ),
+                 Re_member_position( &fe->eb.renc ) );
+    if( fe->eb.lr.active )			/* literal run */
+      {
+      LZeb_encode_run_literal( &fe->eb, &state, reps[0] );
+      FLZe_update_and_move( fe, 1 );
+      continue;
+      }
+    main_len = FLZe_longest_match_len( fe, &match_distance );
+    pos_state = Mb_data_position( &fe->eb.mb ) & pos_state_mask;
 
     for( i = 0; i < num_rep_distances; ++i )
       {
@@ -127,6 +150,9 @@ bool FLZe_encode_member( struct FLZ_encoder * const fe,
         reps[0] = distance;
         }
       state = St_set_rep( state );
+      fe->eb.lr.matched += len;
+      if( stats ) Cst_add_rep( stats, rep, len );
+      if( log ) Ol_add( log, reps[0], len );
       Re_encode_len( &fe->eb.renc, &fe->eb.rep_len_model, len, pos_state );
       Mb_move_pos( &fe->eb.mb );
       FLZe_update_and_move( fe, len - 1 );
@@ -141,7 +167,10 @@ bool FLZe_encode_member( struct FLZ_encoder * const fe,
       state = St_set_match( state );
       for( i = num_rep_distances - 1; i > 0; --i ) reps[i] = reps[i-1];
       reps[0] = match_distance;
+      fe->eb.lr.matched += main_len;
       LZeb_encode_pair( &fe->eb, match_distance, main_len, pos_state );
+      if( stats ) Cst_add_match( stats, main_len, get_slot( match_distance ) );
+      if( log ) Ol_add( log, match_distance, main_len );
       Mb_move_pos( &fe->eb.mb );
       FLZe_update_and_move( fe, main_len - 1 );
       continue;
@@ -172,6 +201,9 @@ bool FLZe_encode_member( struct FLZ_encoder * const fe,
         Re_encode_bit( &fe->eb.renc, &fe->eb.bm_rep0[state], 0 );
         Re_encode_bit( &fe->eb.renc, &fe->eb.bm_len[state][pos_state], 0 );
         state = St_set_short_rep( state );
+        ++fe->eb.lr.matched;
+        if( stats ) Cst_add_rep( stats, 0, 1 );
+        if( log ) Ol_add( log, reps[0], 1 );
         continue;
         }
       }
@@ -183,6 +215,8 @@ bool FLZe_encode_member( struct FLZ_encoder * const fe,
     else
       LZeb_encode_matched( &fe->eb, prev_byte, cur_byte, match_byte );
     state = St_set_char( state );
+    if( stats ) ++stats->literals;
+    if( log ) Ol_add( log, -1, 1 );
     }
     }
 
@@ -47,7 +47,9 @@ static inline void FLZe_update_and_move( struct FLZ_encoder * const fe, int n )
   }
 
 static inline bool FLZe_init( struct FLZ_encoder * const fe,
-                              const int ifd, const int outfd )
+                              const struct Preset_dict * const preset,
+                              const int ifd, const uint8_t * const idata,
+                              const long long idata_size, const int outfd )
   {
   enum { before_size = 0,
          dict_size = 65536,
@@ -58,9 +60,15 @@ static inline bool FLZe_init( struct FLZ_encoder * const fe,
          pos_array_factor = 1 };
 
   return LZeb_init( &fe->eb, before_size, dict_size, after_size, dict_factor,
-                    num_prev_positions23, pos_array_factor, ifd, outfd );
+                    num_prev_positions23, pos_array_factor, preset, ifd,
+                    idata, idata_size, outfd );
   }
 
+static inline bool FLZe_reinit( struct FLZ_encoder * const fe, const int ifd,
+                                const uint8_t * const idata,
+                                const long long idata_size, const int outfd )
+  { return LZeb_reinit( &fe->eb, ifd, idata, idata_size, outfd ); }
+
 static inline void FLZe_reset( struct FLZ_encoder * const fe )
   { LZeb_reset( &fe->eb ); }
 
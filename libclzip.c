@@ -0,0 +1,816 @@
+/* Libclzip - In-memory streaming interface to the clzip coders
+   Copyright (C) 2010-2021 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+   The coders read and write through Read_fn and Flush_fn hooks, and keep
+   their state on the stack and in the structs they are given. Instead of
+   rewriting them as resumable state machines, each stream runs its coder
+   in a thread of its own, which exchanges data with the caller through
+   two bounded FIFOs. The only global data are the tables of crc32.c and
+   encoder_base.c, which are initialized once and never modified after.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lzip.h"
+#include "decoder.h"
+#include "encoder_base.h"
+#include "encoder.h"
+#include "fast_encoder.h"
+#include "lzip_index.h"
+#include "clzip.h"
+
+
+/* Where a coder goes instead of exiting the program. It is set, as
+   thread-specific data, by each coder thread and by the functions of the
+   interface that run a coder in the thread of the caller. */
+struct Jump_target
+  {
+  jmp_buf jmp;
+  enum CLZ_Errno clz_errno;	/* the reason of the jump */
+  };
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static pthread_key_t target_key;
+static bool target_key_valid = false;
+
+static void init_tables( void )
+  {
+  CRC32_init(); Dis_slots_init(); Prob_prices_init();
+  target_key_valid = ( pthread_key_create( &target_key, 0 ) == 0 );
+  }
+
+static void set_target( struct Jump_target * const target )
+  { if( target_key_valid ) pthread_setspecific( target_key, target ); }
+
+/* Return to the jump target of the calling thread. Without one (which
+   would be a broken invariant), there is nothing better to do than abort. */
+static void fail( const enum CLZ_Errno clz_errno )
+  {
+  struct Jump_target * const target = target_key_valid ?
+    (struct Jump_target *)pthread_getspecific( target_key ) : 0;
+  if( !target ) abort();
+  target->clz_errno = clz_errno;
+  longjmp( target->jmp, 1 );
+  }
+
+
+/* Symbols required by the coders, normally defined in main.c. The library
+   never prints messages. The functions that would exit the program fail
+   instead, and the error is reported by the stream or the index that was
+   being used. As all the I/O of the streams goes through the hooks,
+   cleanup_and_fail can only be reached by a read error on the file of an
+   index. */
+int verbosity = -1;
+
+void * resize_buffer( void * buf, const unsigned min_size )
+  {
+  if( buf ) buf = realloc( buf, min_size );
+  else buf = malloc( min_size );
+  if( !buf ) fail( CLZ_mem_error );
+  return buf;
+  }
+
+void Pp_show_msg( struct Pretty_print * const pp, const char * const msg )
+  { if( pp || msg ) {} }
+
+void show_header( const unsigned dictionary_size )
+  { if( dictionary_size ) {} }
+
+void cleanup_and_fail( const int retval )
+  { fail( ( retval == 2 ) ? CLZ_data_error : CLZ_bad_argument ); }
+
+void show_error( const char * const msg, const int errcode, const bool help )
+  { if( msg || errcode || help ) {} }
+
+void internal_error( const char * const msg )
+  { if( msg ) {} fail( CLZ_data_error ); }
+
+void show_cprogress( const unsigned long long cfile_size,
+                     const unsigned long long partial_size,
+                     const struct Matchfinder_base * const m,
+                     struct Pretty_print * const p )
+  { if( cfile_size || partial_size || m || p ) {} }
+
+void show_dprogress( const unsigned long long cfile_size,
+                     const unsigned long long partial_size,
+                     const struct Range_decoder * const d,
+                     struct Pretty_print * const p )
+  { if( cfile_size || partial_size || d || p ) {} }
+
+
+enum { fifo_size = 1 << 16 };
+
+struct Fifo			/* circular buffer */
+  {
+  uint8_t * buffer;
+  int get;			/* position of the first byte of data */
+  int size;			/* bytes of data in buffer */
+  };
+
+static inline int Fi_free_space( const struct Fifo * const f )
+  { return fifo_size - f->size; }
+
+static int Fi_put( struct Fifo * const f, const uint8_t * const buf,
+                   const int size )
+  {
+  const int n = min( size, Fi_free_space( f ) );
+  const int p = ( f->get + f->size ) % fifo_size;
+  const int n1 = min( n, fifo_size - p );
+  memcpy( f->buffer + p, buf, n1 );
+  memcpy( f->buffer, buf + n1, n - n1 );
+  f->size += n;
+  return n;
+  }
+
+static int Fi_get( struct Fifo * const f, uint8_t * const buf, const int size )
+  {
+  const int n = min( size, f->size );
+  const int n1 = min( n, fifo_size - f->get );
+  memcpy( buf, f->buffer + f->get, n1 );
+  memcpy( buf + n1, f->buffer, n - n1 );
+  f->get = ( f->get + n ) % fifo_size;
+  f->size -= n;
+  return n;
+  }
+
+
+/* State shared by the caller and the coder thread of a stream. */
+struct Stream
+  {
+  pthread_t thread;
+  pthread_mutex_t mutex;	/* protects all the fields below */
+  pthread_cond_t cond;		/* any of the fields below have changed */
+  struct Fifo in, out;
+  unsigned long long total_in, total_out;
+  enum CLZ_Errno clz_errno;
+  bool thread_started;
+  bool in_finished;		/* the caller won't write more data */
+  bool waiting_input;		/* the coder is blocked on an empty 'in' */
+  bool coder_done;		/* the coder thread has finished */
+  bool closing;			/* the caller is closing the stream */
+  bool jmp_ready;		/* target is set; used only by the coder */
+  struct Jump_target target;	/* where the coder goes if closing or failing */
+  };
+
+static bool Sm_init( struct Stream * const sm )
+  {
+  sm->in.buffer = (uint8_t *)malloc( fifo_size );
+  sm->out.buffer = sm->in.buffer ? (uint8_t *)malloc( fifo_size ) : 0;
+  if( !sm->out.buffer ) { free( sm->in.buffer ); return false; }
+  sm->in.get = sm->in.size = 0;
+  sm->out.get = sm->out.size = 0;
+  sm->total_in = sm->total_out = 0;
+  sm->clz_errno = CLZ_ok;
+  sm->thread_started = false;
+  sm->in_finished = false;
+  sm->waiting_input = false;
+  sm->coder_done = false;
+  sm->closing = false;
+  sm->jmp_ready = false;
+  pthread_mutex_init( &sm->mutex, 0 );
+  pthread_cond_init( &sm->cond, 0 );
+  return true;
+  }
+
+static bool Sm_start( struct Stream * const sm, void * (*fn)( void * ),
+                      void * const arg )
+  {
+  pthread_once( &tables_once, init_tables );
+  if( pthread_create( &sm->thread, 0, fn, arg ) != 0 ) return false;
+  sm->thread_started = true;
+  return true;
+  }
+
+/* Stop the coder, if still running, and free the resources of 'sm'. */
+static void Sm_free( struct Stream * const sm )
+  {
+  if( sm->thread_started )
+    {
+    pthread_mutex_lock( &sm->mutex );
+    sm->closing = true;
+    pthread_cond_broadcast( &sm->cond );
+    pthread_mutex_unlock( &sm->mutex );
+    pthread_join( sm->thread, 0 );
+    }
+  pthread_cond_destroy( &sm->cond );
+  pthread_mutex_destroy( &sm->mutex );
+  free( sm->out.buffer ); free( sm->in.buffer );
+  }
+
+/* Return true if the coder can't progress without more input. */
+static inline bool Sm_starved( const struct Stream * const sm )
+  { return sm->waiting_input && sm->in.size == 0 && !sm->in_finished; }
+
+/* Return from the coder to its target if the stream is being closed.
+   Before the target is set (while the coder is initialized), closing is
+   reported as the end of the data instead. */
+static bool Sm_check_closing( struct Stream * const sm )
+  {
+  if( !sm->closing ) return false;
+  if( sm->jmp_ready )
+    { pthread_mutex_unlock( &sm->mutex ); fail( CLZ_ok ); }
+  return true;
+  }
+
+/* Read_fn for the coder. Blocks until 'size' bytes are available or the
+   caller has called finish. */
+static int Sm_input( void * const arg, uint8_t * const buf, const int size )
+  {
+  struct Stream * const sm = (struct Stream *)arg;
+  int sz = 0;
+  pthread_mutex_lock( &sm->mutex );
+  while( sz < size )
+    {
+    if( Sm_check_closing( sm ) ) break;
+    if( sm->in.size > 0 )
+      { sz += Fi_get( &sm->in, buf + sz, size - sz );
+        pthread_cond_broadcast( &sm->cond ); continue; }
+    if( sm->in_finished ) break;
+    sm->waiting_input = true;
+    pthread_cond_broadcast( &sm->cond );
+    pthread_cond_wait( &sm->cond, &sm->mutex );
+    sm->waiting_input = false;
+    }
+  pthread_mutex_unlock( &sm->mutex );
+  return sz;
+  }
+
+/* Flush_fn for the coder. Blocks until all the data fit in 'out'. */
+static void Sm_output( void * const arg, const uint8_t * const buf,
+                       const int size )
+  {
+  struct Stream * const sm = (struct Stream *)arg;
+  int sz = 0;
+  pthread_mutex_lock( &sm->mutex );
+  while( sz < size )
+    {
+    if( Sm_check_closing( sm ) ) break;
+    if( Fi_free_space( &sm->out ) > 0 )
+      { sz += Fi_put( &sm->out, buf + sz, size - sz );
+        pthread_cond_broadcast( &sm->cond ); }
+    else pthread_cond_wait( &sm->cond, &sm->mutex );
+    }
+  pthread_mutex_unlock( &sm->mutex );
+  }
+
+static void Sm_coder_done( struct Stream * const sm,
+                           const enum CLZ_Errno clz_errno )
+  {
+  pthread_mutex_lock( &sm->mutex );
+  if( sm->clz_errno == CLZ_ok ) sm->clz_errno = clz_errno;
+  sm->coder_done = true;
+  pthread_cond_broadcast( &sm->cond );
+  pthread_mutex_unlock( &sm->mutex );
+  }
+
+static int Sm_set_error( struct Stream * const sm,
+                         const enum CLZ_Errno clz_errno )
+  {
+  pthread_mutex_lock( &sm->mutex );
+  if( sm->clz_errno == CLZ_ok ) sm->clz_errno = clz_errno;
+  pthread_mutex_unlock( &sm->mutex );
+  return -1;
+  }
+
+/* Never blocks. Data written after the coder has finished (trailing data
+   in the decoder) are discarded. */
+static int Sm_write( struct Stream * const sm, const uint8_t * const buffer,
+                     const int size )
+  {
+  int n;
+  if( size < 0 || ( size > 0 && !buffer ) )
+    return Sm_set_error( sm, CLZ_bad_argument );
+  pthread_mutex_lock( &sm->mutex );
+  if( sm->in_finished )
+    {
+    if( sm->clz_errno == CLZ_ok ) sm->clz_errno = CLZ_sequence_error;
+    pthread_mutex_unlock( &sm->mutex ); return -1;
+    }
+  if( sm->coder_done ) n = size;
+  else n = Fi_put( &sm->in, buffer, size );
+  sm->total_in += n;
+  if( n > 0 ) pthread_cond_broadcast( &sm->cond );
+  pthread_mutex_unlock( &sm->mutex );
+  return n;
+  }
+
+static int Sm_read( struct Stream * const sm, uint8_t * const buffer,
+                    const int size )
+  {
+  int n;
+  if( size < 0 || ( size > 0 && !buffer ) )
+    return Sm_set_error( sm, CLZ_bad_argument );
+  pthread_mutex_lock( &sm->mutex );
+  while( sm->out.size == 0 && !sm->coder_done && !Sm_starved( sm ) )
+    pthread_cond_wait( &sm->cond, &sm->mutex );
+  if( sm->out.size == 0 && sm->clz_errno != CLZ_ok ) n = -1;
+  else
+    {
+    n = Fi_get( &sm->out, buffer, size );
+    sm->total_out += n;
+    if( n > 0 ) pthread_cond_broadcast( &sm->cond );
+    }
+  pthread_mutex_unlock( &sm->mutex );
+  return n;
+  }
+
+static int Sm_finish( struct Stream * const sm )
+  {
+  pthread_mutex_lock( &sm->mutex );
+  sm->in_finished = true;
+  pthread_cond_broadcast( &sm->cond );
+  pthread_mutex_unlock( &sm->mutex );
+  return 0;
+  }
+
+static int Sm_finished( struct Stream * const sm )
+  {
+  bool finished;
+  pthread_mutex_lock( &sm->mutex );
+  finished = sm->coder_done && sm->out.size == 0 && sm->clz_errno == CLZ_ok;
+  pthread_mutex_unlock( &sm->mutex );
+  return finished;
+  }
+
+static enum CLZ_Errno Sm_errno( struct Stream * const sm )
+  {
+  enum CLZ_Errno clz_errno;
+  pthread_mutex_lock( &sm->mutex );
+  clz_errno = sm->clz_errno;
+  pthread_mutex_unlock( &sm->mutex );
+  return clz_errno;
+  }
+
+static unsigned long long Sm_total( struct Stream * const sm, const bool in )
+  {
+  unsigned long long total;
+  pthread_mutex_lock( &sm->mutex );
+  total = in ? sm->total_in : sm->total_out;
+  pthread_mutex_unlock( &sm->mutex );
+  return total;
+  }
+
+
+const char * CLZ_strerror( const enum CLZ_Errno clz_errno )
+  {
+  switch( clz_errno )
+    {
+    case CLZ_ok            : return "ok";
+    case CLZ_bad_argument  : return "Bad argument";
+    case CLZ_mem_error     : return "Not enough memory";
+    case CLZ_sequence_error: return "Sequence error";
+    case CLZ_header_error  : return "Header error";
+    case CLZ_unexpected_eof: return "Unexpected EOF";
+    case CLZ_data_error    : return "Data error";
+    }
+  return "Invalid error code";
+  }
+
+
+struct CLZ_Dictionary
+  {
+  struct Preset_dict pd;	/* pd.data follows the struct */
+  };
+
+struct CLZ_Dictionary * CLZ_dictionary_open( const uint8_t * const buffer,
+                                             const int size )
+  {
+  struct CLZ_Dictionary * dictionary;
+  if( size < 0 || ( size > 0 && !buffer ) ) return 0;
+  dictionary =
+    (struct CLZ_Dictionary *)malloc( sizeof (struct CLZ_Dictionary) + size );
+  if( !dictionary ) return 0;
+  if( size > 0 ) memcpy( dictionary + 1, buffer, size );
+  dictionary->pd.data = (const uint8_t *)( dictionary + 1 );
+  dictionary->pd.size = size;
+  pthread_once( &tables_once, init_tables );
+  Pd_set_id( &dictionary->pd );
+  return dictionary;
+  }
+
+int CLZ_dictionary_close( struct CLZ_Dictionary * const dictionary )
+  {
+  if( !dictionary ) return -1;
+  free( dictionary );
+  return 0;
+  }
+
+
+struct CLZ_Encoder
+  {
+  struct Stream sm;
+  struct LZ_encoder * e;	/* one of e or fe is used */
+  struct FLZ_encoder * fe;
+  struct LZ_encoder_base * eb;	/* set by the coder when initialized */
+  const struct Preset_dict * preset;	/* or 0 */
+  unsigned long long member_size;
+  int dictionary_size, match_len_limit;
+  bool hash_chain;
+  };
+
+static void * Enc_thread( void * arg )
+  {
+  struct CLZ_Encoder * const encoder = (struct CLZ_Encoder *)arg;
+  struct Stream * const sm = &encoder->sm;
+  struct LZ_encoder_base * eb;
+
+  /* Mb_init reads the first block, so that the dictionary size of small
+     inputs is reduced the same way as in clzip */
+  if( encoder->fe )
+    {
+    encoder->fe->eb.mb.read_fn = Sm_input;
+    encoder->fe->eb.mb.read_arg = sm;
+    if( !FLZe_init( encoder->fe, encoder->preset, -1, 0, 0, -1 ) )
+      { Sm_coder_done( sm, CLZ_mem_error ); return 0; }
+    eb = &encoder->fe->eb;
+    }
+  else
+    {
+    encoder->e->eb.mb.read_fn = Sm_input;
+    encoder->e->eb.mb.read_arg = sm;
+    if( !LZe_init( encoder->e, encoder->dictionary_size,
+                   encoder->match_len_limit, encoder->hash_chain,
+                   encoder->preset, -1, 0, 0, -1 ) )
+      { Sm_coder_done( sm, CLZ_mem_error ); return 0; }
+    eb = &encoder->e->eb;
+    }
+  encoder->eb = eb;
+  eb->renc.flush_fn = Sm_output;
+  eb->renc.flush_arg = sm;
+  sm->jmp_ready = true;
+  sm->target.clz_errno = CLZ_ok;
+  set_target( &sm->target );
+  if( setjmp( sm->target.jmp ) == 0 )
+    while( true )		/* encode one member per iteration */
+      {
+      if( ( encoder->fe &&
+            !FLZe_encode_member( encoder->fe, encoder->member_size ) ) ||
+          ( encoder->e &&
+            !LZe_encode_member( encoder->e, encoder->member_size ) ) )
+        internal_error( "encoder error." );
+      if( Mb_data_finished( &eb->mb ) ) break;
+      if( encoder->fe ) FLZe_reset( encoder->fe ); else LZe_reset( encoder->e );
+      }
+  Sm_coder_done( sm, sm->target.clz_errno );	/* CLZ_ok unless failed */
+  return 0;
+  }
+
+
+struct CLZ_Encoder * CLZ_compress_open( const int level,
+                                        const unsigned long long member_size )
+  { return CLZ_compress_open_dict( level, member_size, 0 ); }
+
+struct CLZ_Encoder *
+CLZ_compress_open_dict( const int level, const unsigned long long member_size,
+                        const struct CLZ_Dictionary * const dictionary )
+  {
+  const unsigned long long max_member_size = 0x0008000000000000ULL;
+  struct CLZ_Encoder * const encoder =
+    (struct CLZ_Encoder *)malloc( sizeof (struct CLZ_Encoder) );
+
+  if( !encoder ) return 0;
+  if( !Sm_init( &encoder->sm ) ) { free( encoder ); return 0; }
+  encoder->e = 0; encoder->fe = 0; encoder->eb = 0;
+  encoder->preset = dictionary ? &dictionary->pd : 0;
+  if( level < 0 || level > 9 || ( member_size != 0 &&
+      ( member_size < 100000 || member_size > max_member_size ) ) )
+    { encoder->sm.clz_errno = CLZ_bad_argument; return encoder; }
+  encoder->member_size = member_size ? member_size : max_member_size;
+  encoder->dictionary_size = option_mapping[level].dictionary_size;
+  encoder->match_len_limit = option_mapping[level].match_len_limit;
+  encoder->hash_chain = option_mapping[level].hash_chain;
+  if( level == 0 )
+    encoder->fe = (struct FLZ_encoder *)malloc( sizeof *encoder->fe );
+  else encoder->e = (struct LZ_encoder *)malloc( sizeof *encoder->e );
+  if( ( !encoder->fe && !encoder->e ) ||
+      !Sm_start( &encoder->sm, Enc_thread, encoder ) )
+    {
+    free( encoder->fe ); free( encoder->e ); encoder->fe = 0; encoder->e = 0;
+    encoder->sm.clz_errno = CLZ_mem_error;
+    }
+  return encoder;
+  }
+
+
+int CLZ_compress_close( struct CLZ_Encoder * const encoder )
+  {
+  if( !encoder ) return -1;
+  Sm_free( &encoder->sm );
+  if( encoder->eb ) LZeb_free( encoder->eb );
+  free( encoder->fe ); free( encoder->e ); free( encoder );
+  return 0;
+  }
+
+int CLZ_compress_finish( struct CLZ_Encoder * const encoder )
+  {
+  if( !encoder || !encoder->sm.thread_started ) return -1;
+  return Sm_finish( &encoder->sm );
+  }
+
+int CLZ_compress_write( struct CLZ_Encoder * const encoder,
+                        const uint8_t * const buffer, const int size )
+  {
+  if( !encoder || !encoder->sm.thread_started ) return -1;
+  return Sm_write( &encoder->sm, buffer, size );
+  }
+
+int CLZ_compress_read( struct CLZ_Encoder * const encoder,
+                       uint8_t * const buffer, const int size )
+  {
+  if( !encoder || !encoder->sm.thread_started ) return -1;
+  return Sm_read( &encoder->sm, buffer, size );
+  }
+
+enum CLZ_Errno CLZ_compress_errno( struct CLZ_Encoder * const encoder )
+  {
+  if( !encoder ) return CLZ_bad_argument;
+  return Sm_errno( &encoder->sm );
+  }
+
+int CLZ_compress_finished( struct CLZ_Encoder * const encoder )
+  {
+  if( !encoder || !encoder->sm.thread_started ) return -1;
+  return Sm_finished( &encoder->sm );
+  }
+
+unsigned long long CLZ_compress_total_in_size( struct CLZ_Encoder * const encoder )
+  {
+  if( !encoder ) return 0;
+  return Sm_total( &encoder->sm, true );
+  }
+
+unsigned long long CLZ_compress_total_out_size( struct CLZ_Encoder * const encoder )
+  {
+  if( !encoder ) return 0;
+  return Sm_total( &encoder->sm, false );
+  }
+
+
+struct CLZ_Decoder
+  {
+  struct Stream sm;
+  struct Range_decoder rdec;
+  struct LZ_decoder lzd;	/* reused for all the members */
+  const struct Preset_dict * preset;	/* or 0 */
+  };
+
+/* Decode members until the end of the input or until trailing data are
+   found, mirroring the checks of 'decompress' in main.c. */
+static enum CLZ_Errno Dec_decode( struct CLZ_Decoder * const decoder )
+  {
+  struct Range_decoder * const rdec = &decoder->rdec;
+  bool first_member;
+
+  for( first_member = true; ; first_member = false )
+    {
+    Lzip_header header;
+    char msg[preset_msg_size];
+    unsigned dictionary_size;
+    int result, size;
+    Rd_reset_member_position( rdec );
+    size = Rd_read_data( rdec, header, Lh_size );
+    if( Rd_finished( rdec ) )			/* End Of File */
+      {
+      if( first_member || ( size > 0 && Lh_verify_prefix( header, size ) ) )
+        return CLZ_unexpected_eof;
+      return CLZ_ok;				/* trailing data are ignored */
+      }
+    if( !Lh_verify_magic( header ) )
+      {
+      if( first_member ) return CLZ_header_error;
+      if( Lh_verify_corrupt( header ) ) return CLZ_data_error;
+      return CLZ_ok;
+      }
+    if( !Lh_accept_version( header, decoder->preset != 0 ) )
+      return CLZ_header_error;
+    dictionary_size = Lh_get_dictionary_size( header );
+    if( !isvalid_ds( dictionary_size ) ) return CLZ_header_error;
+    result = Rd_check_preset( rdec, header, decoder->preset, msg );
+    if( result == 2 ) return CLZ_unexpected_eof;
+    if( result != 0 ) return CLZ_header_error;
+    if( !LZd_reinit( &decoder->lzd, rdec, dictionary_size, -1 ) )
+      return CLZ_mem_error;
+    if( decoder->preset ) LZd_load_preset( &decoder->lzd, decoder->preset );
+    decoder->lzd.flush_fn = Sm_output;
+    decoder->lzd.flush_arg = &decoder->sm;
+    result = LZd_decode_member( &decoder->lzd, 0 );
+    if( result == 2 ) return CLZ_unexpected_eof;
+    if( result != 0 ) return CLZ_data_error;
+    }
+  }
+
+static void * Dec_thread( void * arg )
+  {
+  struct CLZ_Decoder * const decoder = (struct CLZ_Decoder *)arg;
+  decoder->sm.jmp_ready = true;
+  set_target( &decoder->sm.target );
+  if( setjmp( decoder->sm.target.jmp ) == 0 )
+    { Sm_coder_done( &decoder->sm, Dec_decode( decoder ) ); return 0; }
+  /* closed (CLZ_ok) or failed while decoding */
+  Sm_coder_done( &decoder->sm, decoder->sm.target.clz_errno );
+  return 0;
+  }
+
+
+struct CLZ_Decoder * CLZ_decompress_open( void )
+  { return CLZ_decompress_open_dict( 0 ); }
+
+struct CLZ_Decoder *
+CLZ_decompress_open_dict( const struct CLZ_Dictionary * const dictionary )
+  {
+  struct CLZ_Decoder * const decoder =
+    (struct CLZ_Decoder *)malloc( sizeof (struct CLZ_Decoder) );
+
+  if( !decoder ) return 0;
+  if( !Sm_init( &decoder->sm ) ) { free( decoder ); return 0; }
+  decoder->lzd.buffer = 0; decoder->lzd.buffer_size = 0;
+  decoder->preset = dictionary ? &dictionary->pd : 0;
+  if( !Rd_init( &decoder->rdec, -1 ) )
+    { decoder->rdec.buffer = 0; decoder->sm.clz_errno = CLZ_mem_error;
+      return decoder; }
+  decoder->rdec.read_fn = Sm_input;
+  decoder->rdec.read_arg = &decoder->sm;
+  if( !Sm_start( &decoder->sm, Dec_thread, decoder ) )
+    { Rd_free( &decoder->rdec ); decoder->rdec.buffer = 0;
+      decoder->sm.clz_errno = CLZ_mem_error; }
+  return decoder;
+  }
+
+
+int CLZ_decompress_close( struct CLZ_Decoder * const decoder )
+  {
+  if( !decoder ) return -1;
+  Sm_free( &decoder->sm );
+  LZd_free( &decoder->lzd );
+  if( decoder->rdec.buffer ) Rd_free( &decoder->rdec );
+  free( decoder );
+  return 0;
+  }
+
+int CLZ_decompress_finish( struct CLZ_Decoder * const decoder )
+  {
+  if( !decoder || !decoder->sm.thread_started ) return -1;
+  return Sm_finish( &decoder->sm );
+  }
+
+int CLZ_decompress_write( struct CLZ_Decoder * const decoder,
+                          const uint8_t * const buffer, const int size )
+  {
+  if( !decoder || !decoder->sm.thread_started ) return -1;
+  return Sm_write( &decoder->sm, buffer, size );
+  }
+
+int CLZ_decompress_read( struct CLZ_Decoder * const decoder,
+                         uint8_t * const buffer, const int size )
+  {
+  if( !decoder || !decoder->sm.thread_started ) return -1;
+  return Sm_read( &decoder->sm, buffer, size );
+  }
+
+enum CLZ_Errno CLZ_decompress_errno( struct CLZ_Decoder * const decoder )
+  {
+  if( !decoder ) return CLZ_bad_argument;
+  return Sm_errno( &decoder->sm );
+  }
+
+int CLZ_decompress_finished( struct CLZ_Decoder * const decoder )
+  {
+  if( !decoder || !decoder->sm.thread_started ) return -1;
+  return Sm_finished( &decoder->sm );
+  }
+
+unsigned long long CLZ_decompress_total_in_size( struct CLZ_Decoder * const decoder )
+  {
+  if( !decoder ) return 0;
+  return Sm_total( &decoder->sm, true );
+  }
+
+unsigned long long CLZ_decompress_total_out_size( struct CLZ_Decoder * const decoder )
+  {
+  if( !decoder ) return 0;
+  return Sm_total( &decoder->sm, false );
+  }
+
+
+struct CLZ_Index
+  {
+  struct Lzip_index li;
+  struct Range_decoder rdec;
+  struct LZ_decoder lzd;	/* reused for all the reads */
+  struct Jump_target target;
+  enum CLZ_Errno clz_errno;
+  };
+
+/* Return false if there is not enough memory for the index. */
+static bool Ix_init_index( struct CLZ_Index * const index, const int fd )
+  {
+  if( setjmp( index->target.jmp ) != 0 ) return false;
+  set_target( &index->target );
+  if( !Li_init( &index->li, fd, true, false, false ) )
+    {
+    Li_free( &index->li );
+    index->clz_errno =
+      ( index->li.retval == 1 ) ? CLZ_bad_argument : CLZ_header_error;
+    }
+  return true;
+  }
+
+struct CLZ_Index * CLZ_index_open( const int fd )
+  {
+  struct CLZ_Index * const index =
+    (struct CLZ_Index *)malloc( sizeof (struct CLZ_Index) );
+  bool ok;
+
+  if( !index ) return 0;
+  if( !Rd_init( &index->rdec, fd ) ) { free( index ); return 0; }
+  index->lzd.buffer = 0; index->lzd.buffer_size = 0;
+  index->clz_errno = CLZ_ok;
+  pthread_once( &tables_once, init_tables );
+  ok = Ix_init_index( index, fd );
+  set_target( 0 );
+  if( !ok ) { CLZ_index_close( index ); return 0; }
+  return index;
+  }
+
+int CLZ_index_close( struct CLZ_Index * const index )
+  {
+  if( !index ) return -1;
+  Li_free( &index->li );
+  LZd_free( &index->lzd );
+  Rd_free( &index->rdec );
+  free( index );
+  return 0;
+  }
+
+long long CLZ_index_data_size( struct CLZ_Index * const index )
+  {
+  if( !index || index->clz_errno != CLZ_ok ) return -1;
+  return Li_udata_size( &index->li );
+  }
+
+
+struct Range_buffer
+  {
+  uint8_t * buffer;
+  int pos;
+  };
+
+/* Flush_fn for Li_decode_range. It is never given more data than fit in
+   the range requested. */
+static void Rb_output( void * const arg, const uint8_t * const buf,
+                       const int size )
+  {
+  struct Range_buffer * const rb = (struct Range_buffer *)arg;
+  memcpy( rb->buffer + rb->pos, buf, size );
+  rb->pos += size;
+  }
+
+int CLZ_index_read( struct CLZ_Index * const index, const long long pos,
+                    uint8_t * const buffer, const int size )
+  {
+  struct Range_buffer rb;
+  long bad_member = 0;
+  int retval;
+
+  if( !index || index->clz_errno != CLZ_ok ) return -1;
+  if( pos < 0 || size < 0 || ( size > 0 && !buffer ) )
+    { index->clz_errno = CLZ_bad_argument; return -1; }
+  rb.buffer = buffer; rb.pos = 0;
+  if( setjmp( index->target.jmp ) != 0 )
+    { set_target( 0 ); index->clz_errno = index->target.clz_errno;
+      return -1; }
+  set_target( &index->target );
+  retval = Li_decode_range( &index->li, &index->rdec, &index->lzd, -1,
+                            Rb_output, &rb, pos, size, 0, &bad_member );
+  set_target( 0 );
+  if( retval == 0 ) return rb.pos;
+  index->clz_errno = ( retval == 1 ) ? CLZ_mem_error : CLZ_data_error;
+  return -1;
+  }
+
+enum CLZ_Errno CLZ_index_errno( struct CLZ_Index * const index )
+  {
+  if( !index ) return CLZ_bad_argument;
+  return index->clz_errno;
+  }
@@ -17,9 +17,12 @@
 
 #define _FILE_OFFSET_BITS 64
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -42,72 +45,231 @@ static void list_line( const unsigned long long uncomp_size,
   }
 
 
-int list_files( const char * const filenames[], const int num_filenames,
-                const bool ignore_trailing, const bool loose_trailing )
+/* Result of indexing one file. Files are indexed by index_file, maybe
+   concurrently, and reported in order by report_file, which prints all
+   the messages, so that the output does not depend on timing.
+*/
+struct List_item
   {
-  unsigned long long total_comp = 0, total_uncomp = 0;
-  int files = 0, retval = 0;
-  int i;
-  bool first_post = true;
-  bool stdin_used = false;
-  for( i = 0; i < num_filenames; ++i )
+  struct Lzip_index lzip_index;
+  int open_err;			/* 0 if the file was opened */
+  int write_err;		/* 0, errno of Li_write_index_file, or -1 */
+  bool skip;			/* repeated stdin */
+  bool done;			/* indexed, ready to be reported */
+  };
+
+struct List_shared		/* data shared by the indexing threads */
+  {
+  const char * const * filenames;
+  struct List_item * items;
+  pthread_mutex_t mutex;	/* protects the variables below and 'done' */
+  pthread_cond_t cond;		/* a file has been indexed or reported */
+  int num_filenames;
+  int next;			/* next file to be indexed */
+  int reported;			/* files already reported */
+  int window;			/* max files indexed ahead of report */
+  bool ignore_trailing, loose_trailing, write_index;
+  };
+
+
+static bool is_stdin( const char * const filename )
+  { return strcmp( filename, "-" ) == 0; }
+
+static const char * display_name( const char * const filename )
+  { return is_stdin( filename ) ? "(stdin)" : filename; }
+
+
+static void index_file( const struct List_shared * const ls, const int i )
+  {
+  struct List_item * const item = &ls->items[i];
+  const bool from_stdin = is_stdin( ls->filenames[i] );
+  struct stat in_stats;				/* not used */
+  const int infd = from_stdin ? STDIN_FILENO :
+    open_instream_quiet( ls->filenames[i], &in_stats, false, true,
+                         &item->open_err );
+  if( infd < 0 ) return;
+  Li_init_cached( &item->lzip_index, infd, from_stdin ? "" : ls->filenames[i],
+                  ls->ignore_trailing, ls->loose_trailing, false );
+  if( item->lzip_index.retval == 0 && ls->write_index && !from_stdin )
     {
-    const char * input_filename;
-    struct Lzip_index lzip_index;
-    struct stat in_stats;				/* not used */
-    int infd;
-    const bool from_stdin = ( strcmp( filenames[i], "-" ) == 0 );
-    if( from_stdin ) { if( stdin_used ) continue; else stdin_used = true; }
-    input_filename = from_stdin ? "(stdin)" : filenames[i];
-    infd = from_stdin ? STDIN_FILENO :
-      open_instream( input_filename, &in_stats, false, true );
-    if( infd < 0 ) { set_retval( &retval, 1 ); continue; }
-
-    Li_init( &lzip_index, infd, ignore_trailing, loose_trailing );
-    close( infd );
-    if( lzip_index.retval != 0 )
+    if( Li_file_size( &item->lzip_index ) != Li_cdata_size( &item->lzip_index ) )
+      item->write_err = -1;
+    else if( !Li_write_index_file( &item->lzip_index, infd, ls->filenames[i] ) )
+      item->write_err = errno;
+    }
+  close( infd );
+  }
+
+
+static void * list_worker( void * arg )
+  {
+  struct List_shared * const ls = (struct List_shared *)arg;
+  while( true )
+    {
+    int i;
+    pthread_mutex_lock( &ls->mutex );
+    while( ls->next < ls->num_filenames &&
+           ( ls->items[ls->next].skip ||
+             ls->next >= ls->reported + ls->window ) )
       {
-      show_file_error( input_filename, lzip_index.error, 0 );
-      set_retval( &retval, lzip_index.retval );
-      Li_free( &lzip_index ); continue;
+      if( ls->items[ls->next].skip ) ++ls->next;
+      else pthread_cond_wait( &ls->cond, &ls->mutex );
       }
-    if( verbosity >= 0 )
+    i = ls->next;
+    if( i < ls->num_filenames ) ++ls->next;
+    pthread_mutex_unlock( &ls->mutex );
+    if( i >= ls->num_filenames ) break;
+    index_file( ls, i );
+    pthread_mutex_lock( &ls->mutex );
+    ls->items[i].done = true;
+    pthread_cond_broadcast( &ls->cond );
+    pthread_mutex_unlock( &ls->mutex );
+    }
+  return 0;
+  }
+
+
+struct List_totals
+  {
+  unsigned long long comp, uncomp;
+  int files;
+  bool first_post;
+  };
+
+
+static void report_file( struct List_item * const item,
+                         const char * const input_filename,
+                         struct List_totals * const t, int * const retval )
+  {
+  const struct Lzip_index * const lzip_index = &item->lzip_index;
+  if( item->open_err ) { show_instream_error( input_filename, item->open_err );
+                         set_retval( retval, 1 ); return; }
+  if( lzip_index->retval != 0 )
+    {
+    show_file_error( input_filename, lzip_index->error, 0 );
+    set_retval( retval, lzip_index->retval );
+    return;
+    }
+  if( item->write_err < 0 )
+    { show_file_error( input_filename,
+                       "Can't index a file with trailing data.", 0 );
+      set_retval( retval, 1 ); }
+  else if( item->write_err > 0 )
+    { show_file_error( input_filename, "Can't write index file",
+                       item->write_err );
+      set_retval( retval, 1 ); }
+  if( verbosity >= 0 )
+    {
+    const unsigned long long udata_size = Li_udata_size( lzip_index );
+    const unsigned long long cdata_size = Li_cdata_size( lzip_index );
+    t->comp += cdata_size; t->uncomp += udata_size; ++t->files;
+    if( t->first_post )
       {
-      const unsigned long long udata_size = Li_udata_size( &lzip_index );
-      const unsigned long long cdata_size = Li_cdata_size( &lzip_index );
-      total_comp += cdata_size; total_uncomp += udata_size; ++files;
-      if( first_post )
-        {
-        first_post = false;
-        if( verbosity >= 1 ) fputs( "   dict   memb  trail ", stdout );
-        fputs( "  uncompressed     compressed   saved  name\n", stdout );
-        }
-      if( verbosity >= 1 )
-        printf( "%s %5ld %6lld ", format_ds( lzip_index.dictionary_size ),
-                lzip_index.members, Li_file_size( &lzip_index ) - cdata_size );
-      list_line( udata_size, cdata_size, input_filename );
+      t->first_post = false;
+      if( verbosity >= 1 ) fputs( "   dict   memb  trail ", stdout );
+      fputs( "  uncompressed     compressed   saved  name\n", stdout );
+      }
+    if( verbosity >= 1 )
+      printf( "%s %5ld %6lld ", format_ds( lzip_index->dictionary_size ),
+              lzip_index->members, Li_file_size( lzip_index ) - cdata_size );
+    list_line( udata_size, cdata_size, input_filename );
 
-      if( verbosity >= 2 && lzip_index.members > 1 )
+    if( verbosity >= 2 && lzip_index->members > 1 )
+      {
+      long i;
+      fputs( " member      data_pos      data_size     member_pos    member_size\n", stdout );
+      for( i = 0; i < lzip_index->members; ++i )
         {
-        long i;
-        fputs( " member      data_pos      data_size     member_pos    member_size\n", stdout );
-        for( i = 0; i < lzip_index.members; ++i )
-          {
-          const struct Block * db = Li_dblock( &lzip_index, i );
-          const struct Block * mb = Li_mblock( &lzip_index, i );
-          printf( "%6ld %14llu %14llu %14llu %14llu\n",
-                  i + 1, db->pos, db->size, mb->pos, mb->size );
-          }
-        first_post = true;	/* reprint heading after list of members */
+        const struct Block * db = Li_dblock( lzip_index, i );
+        const struct Block * mb = Li_mblock( lzip_index, i );
+        printf( "%6ld %14llu %14llu %14llu %14llu\n",
+                i + 1, db->pos, db->size, mb->pos, mb->size );
         }
-      fflush( stdout );
+      t->first_post = true;	/* reprint heading after list of members */
+      }
+    fflush( stdout );
+    }
+  }
+
+
+/* List the files using up to 'num_workers' threads to index them. Indexing
+   is latency-bound on slow filesystems, so up to 4 * num_workers files are
+   indexed ahead of the one being reported. */
+int list_files( const char * const filenames[], const int num_filenames,
+                const int num_workers, const bool ignore_trailing,
+                const bool loose_trailing, const bool write_index )
+  {
+  struct List_shared ls;
+  struct List_totals totals;
+  pthread_t * threads = 0;
+  int i, num_started = 0, retval = 0;
+  bool stdin_used = false;
+
+  ls.items = (struct List_item *)
+    resize_buffer( 0, num_filenames * sizeof ls.items[0] );
+  for( i = 0; i < num_filenames; ++i )
+    {
+    struct List_item * const item = &ls.items[i];
+    item->lzip_index.member_vector = 0;
+    item->lzip_index.error = 0;
+    item->lzip_index.retval = 0;
+    item->open_err = 0;
+    item->write_err = 0;
+    item->skip = false;
+    item->done = false;
+    if( is_stdin( filenames[i] ) )
+      { if( stdin_used ) item->skip = true; else stdin_used = true; }
+    }
+  ls.filenames = filenames;
+  ls.num_filenames = num_filenames;
+  ls.next = 0;
+  ls.reported = 0;
+  ls.window = 4 * num_workers;
+  ls.ignore_trailing = ignore_trailing;
+  ls.loose_trailing = loose_trailing;
+  ls.write_index = write_index;
+  pthread_mutex_init( &ls.mutex, 0 );
+  pthread_cond_init( &ls.cond, 0 );
+  if( num_workers > 1 && num_filenames > 1 )
+    {
+    const int worker_count = min( num_workers, num_filenames );
+    threads = (pthread_t *)resize_buffer( 0, worker_count * sizeof threads[0] );
+    for( ; num_started < worker_count; ++num_started )
+      if( pthread_create( &threads[num_started], 0, list_worker, &ls ) != 0 )
+        break;
+    }
+
+  totals.comp = 0; totals.uncomp = 0; totals.files = 0;
+  totals.first_post = true;
+  for( i = 0; i < num_filenames; ++i )
+    {
+    struct List_item * const item = &ls.items[i];
+    if( item->skip ) continue;
+    if( num_started == 0 ) index_file( &ls, i );	/* serial */
+    else
+      {
+      pthread_mutex_lock( &ls.mutex );
+      while( !item->done ) pthread_cond_wait( &ls.cond, &ls.mutex );
+      pthread_mutex_unlock( &ls.mutex );
       }
-    Li_free( &lzip_index );
+    report_file( item, display_name( filenames[i] ), &totals, &retval );
+    Li_free( &item->lzip_index );
+    pthread_mutex_lock( &ls.mutex );
+    ls.reported = i + 1;
+    pthread_cond_broadcast( &ls.cond );
+    pthread_mutex_unlock( &ls.mutex );
     }
-  if( verbosity >= 0 && files > 1 )
+  for( i = 0; i < num_started; ++i )
+    if( pthread_join( threads[i], 0 ) != 0 )
+      internal_error( "can't join worker threads." );
+  pthread_cond_destroy( &ls.cond );
+  pthread_mutex_destroy( &ls.mutex );
+  free( threads ); free( ls.items );
+
+  if( verbosity >= 0 && totals.files > 1 )
     {
     if( verbosity >= 1 ) fputs( "                      ", stdout );
-    list_line( total_uncomp, total_comp, "(totals)" );
+    list_line( totals.uncomp, totals.comp, "(totals)" );
     fflush( stdout );
     }
   return retval;
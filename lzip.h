@@ -118,32 +118,26 @@ static inline void Lm_init( struct Len_model * const lm )
 
 typedef uint32_t CRC32[256];	/* Table of CRCs of all 8-bit messages. */
 
-extern CRC32 crc32;
-
-static inline void CRC32_init( void )
-  {
-  unsigned n;
-  for( n = 0; n < 256; ++n )
-    {
-    unsigned c = n;
-    int k;
-    for( k = 0; k < 8; ++k )
-      { if( c & 1 ) c = 0xEDB88320U ^ ( c >> 1 ); else c >>= 1; }
-    crc32[n] = c;
-    }
-  }
+/* defined in crc32.c */
+extern CRC32 crc32_table;
+void CRC32_init( void );
+void CRC32_update_block( uint32_t * const crc, const uint8_t * const buffer,
+                         const int size );
 
 static inline void CRC32_update_byte( uint32_t * const crc, const uint8_t byte )
-  { *crc = crc32[(*crc^byte)&0xFF] ^ ( *crc >> 8 ); }
+  { *crc = crc32_table[(*crc^byte)&0xFF] ^ ( *crc >> 8 ); }
 
+/* Short buffers (like the matches of the encoder) are processed inline.
+   Longer ones use the fastest method available on this machine. */
 static inline void CRC32_update_buf( uint32_t * const crc,
                                      const uint8_t * const buffer,
                                      const int size )
   {
   int i;
   uint32_t c = *crc;
+  if( size >= 16 ) { CRC32_update_block( crc, buffer, size ); return; }
   for( i = 0; i < size; ++i )
-    c = crc32[(c^buffer[i])&0xFF] ^ ( c >> 8 );
+    c = crc32_table[(c^buffer[i])&0xFF] ^ ( c >> 8 );
   *crc = c;
   }
 
@@ -194,9 +188,27 @@ static inline bool Lh_verify_corrupt( const Lzip_header data )
 static inline uint8_t Lh_version( const Lzip_header data )
   { return data[4]; }
 
+/* Members coded with a preset dictionary have version 2, and the id of the
+   preset (4 bytes) right after the header, so that decoders can tell the
+   preset needed before decoding anything. Version 2 is only accepted where
+   a preset is in effect; everywhere else those members are rejected as of
+   an unsupported version, as other lzip decoders do. */
+enum { preset_id_size = 4 };
+
 static inline bool Lh_verify_version( const Lzip_header data )
   { return ( data[4] == 1 ); }
 
+/* Like Lh_verify_version, but also accept version 2 if 'preset'. */
+static inline bool Lh_accept_version( const Lzip_header data,
+                                      const bool preset )
+  { return ( data[4] == 1 || ( preset && data[4] == 2 ) ); }
+
+static inline bool Lh_has_preset( const Lzip_header data )
+  { return ( data[4] == 2 ); }
+
+static inline void Lh_set_preset( Lzip_header data, const bool preset )
+  { data[4] = preset ? 2 : 1; }
+
 static inline unsigned Lh_get_dictionary_size( const Lzip_header data )
   {
   unsigned sz = ( 1 << ( data[5] & 0x1F ) );
@@ -221,9 +233,9 @@ static inline bool Lh_set_dictionary_size( Lzip_header data, const unsigned sz )
   return true;
   }
 
-static inline bool Lh_verify( const Lzip_header data )
+static inline bool Lh_verify( const Lzip_header data, const bool preset )
   {
-  return Lh_verify_magic( data ) && Lh_verify_version( data ) &&
+  return Lh_verify_magic( data ) && Lh_accept_version( data, preset ) &&
          isvalid_ds( Lh_get_dictionary_size( data ) );
   }
 
@@ -264,13 +276,15 @@ static inline unsigned long long Lt_get_member_size( const Lzip_trailer data )
 static inline void Lt_set_member_size( Lzip_trailer data, unsigned long long sz )
   { int i; for( i = 12; i <= 19; ++i ) { data[i] = (uint8_t)sz; sz >>= 8; } }
 
-/* check internal consistency */
-static inline bool Lt_verify_consistency( const Lzip_trailer data )
+/* check internal consistency, leaving room for a preset id if 'preset' */
+static inline bool Lt_verify_consistency( const Lzip_trailer data,
+                                          const bool preset )
   {
   const unsigned crc = Lt_get_data_crc( data );
   const unsigned long long dsize = Lt_get_data_size( data );
   const unsigned long long msize = Lt_get_member_size( data );
-  const unsigned long long mlimit = ( 9 * dsize + 7 ) / 8 + min_member_size;
+  const unsigned long long mlimit = ( 9 * dsize + 7 ) / 8 + min_member_size +
+                                    ( preset ? preset_id_size : 0 );
   const unsigned long long dlimit = 7090 * ( msize - 26 ) - 1;
   if( ( crc == 0 ) != ( dsize == 0 ) ) return false;
   if( msize < min_member_size ) return false;
@@ -291,21 +305,189 @@ static const char * const mem_msg = "Not enough memory.";
 
 /* defined in decoder.c */
 int readblock( const int fd, uint8_t * const buf, const int size );
+int preadblock( const int fd, uint8_t * const buf, const int size,
+                const long long pos );
 int writeblock( const int fd, const uint8_t * const buf, const int size );
+int pwriteblock( const int fd, const uint8_t * const buf, const int size,
+                 const long long pos );
+
+/* Output function called, if set, by the coders instead of writing to
+   their output file descriptor. */
+typedef void Flush_fn( void * const arg, const uint8_t * const buf,
+                       const int size );
+
+/* Input function called, if set, by the coders instead of reading from
+   their input file descriptor. Like readblock, it returns less than 'size'
+   bytes only at the end of the input data. */
+typedef int Read_fn( void * const arg, uint8_t * const buf, const int size );
+
+/* Preset dictionary. Data known to both the encoder and the decoder, and
+   taken by both as if they preceded the data of every member, so that
+   small inputs similar to them can be coded as matches from the start.
+   The members record the id of the preset (see Lh_has_preset) and can only
+   be decoded with a preset of the same id. Only the last bytes of 'data'
+   that fit in the dictionary are used. The coders only read the data,
+   which may be shared by any number of them. */
+struct Preset_dict
+  {
+  const uint8_t * data;
+  int size;
+  uint32_t id;			/* CRC32 of data, set by Pd_set_id */
+  };
+
+static inline void Pd_set_id( struct Preset_dict * const preset )
+  {
+  uint32_t crc = 0xFFFFFFFFU;
+  CRC32_update_buf( &crc, preset->data, preset->size );
+  preset->id = crc ^ 0xFFFFFFFFU;
+  }
+
+/* Counters of the work done by the coders, collected for --stats only if
+   the 'stats' pointer of the coder is set. The times are those spent by
+   the coder waiting for its input or output, and are only measured by
+   the serial (de)compressor. */
+struct Coder_stats
+  {
+  unsigned long long members;
+  unsigned long long data_size;		/* uncompressed bytes */
+  unsigned long long member_size;	/* compressed bytes */
+  unsigned long long literals;		/* including the run literals */
+  unsigned long long run_literals;	/* coded inside literal runs */
+  unsigned long long matches;
+  unsigned long long reps[4];		/* by rep distance, excluding short */
+  unsigned long long short_reps;	/* 1-byte matches at rep0 */
+  unsigned long long match_lens[max_match_len-min_match_len+1];
+  unsigned long long dis_slots[1<<dis_slot_bits];
+  unsigned long long mf_searches;	/* calls to the match finder */
+  unsigned long long mf_cycles;		/* candidate positions examined */
+  unsigned long long price_updates;	/* of the length prices */
+  unsigned long long dis_price_updates;
+  unsigned long long align_price_updates;
+  double read_wait;			/* seconds */
+  double write_wait;
+  };
+
+static inline void Cst_init( struct Coder_stats * const cs )
+  { memset( cs, 0, sizeof *cs ); }
+
+static inline void Cst_add_match( struct Coder_stats * const cs,
+                                  const int len, const int dis_slot )
+  { ++cs->matches; ++cs->match_lens[len-min_match_len];
+    ++cs->dis_slots[dis_slot]; }
+
+/* 'len' == 1 means a short rep. */
+static inline void Cst_add_rep( struct Coder_stats * const cs,
+                                const int rep, const int len )
+  {
+  if( len == 1 ) ++cs->short_reps;
+  else { ++cs->reps[rep]; ++cs->match_lens[len-min_match_len]; }
+  }
+
+static inline void Cst_add_member( struct Coder_stats * const cs,
+                                   const unsigned long long data_size,
+                                   const unsigned long long member_size )
+  { ++cs->members; cs->data_size += data_size;
+    cs->member_size += member_size; }
+
+/* defined in writer.c */
+enum { aw_block_size = 1 << 20 };	/* default size of output blocks */
+struct Async_writer;
+struct Async_writer * Aw_open( const int fd, const int block_size );
+void Aw_write( void * const arg, const uint8_t * const buf, const int size );
+void Aw_close( struct Async_writer * const aw );
+
+/* defined in reader.c */
+enum { ar_block_size = 1 << 20 };	/* default size of input blocks */
+struct Async_reader;
+typedef void Produce_fn( void * const arg, struct Async_reader * const ar );
+struct Async_reader * Ar_open( const int fd, const int block_size,
+                               const int num_buffers );
+struct Async_reader * Ar_open_fn( Produce_fn * const produce_fn,
+                                  void * const produce_arg,
+                                  const int block_size, const int num_buffers );
+void Ar_write( void * const arg, const uint8_t * const buf, const int size );
+int Ar_read( void * const arg, uint8_t * const buf, const int size );
+void Ar_close( struct Async_reader * const ar );
+
+/* defined in compress_mt.c */
+struct Cmt_options
+  {
+  unsigned long long member_size;
+  int data_size;		/* size of the input blocks */
+  int dictionary_size;
+  int match_len_limit;
+  bool hash_chain;		/* use the hash chain match finder */
+  int num_workers;		/* number of compression threads */
+  unsigned long long target_speed;	/* bytes/s per thread; 0 = fixed */
+  struct Coder_stats * stats;	/* if not 0, add the workers' stats */
+  const struct Preset_dict * preset;	/* or 0 */
+  int overlap;			/* chained mode if >= 0, see compress_mt.c */
+  bool zero;			/* use the fast encoder (-0) */
+  };
+
+struct Pretty_print;
+int compress_mt( const struct Cmt_options * const options,
+                 const int infd, const int outfd,
+                 struct Pretty_print * const pp,
+                 unsigned long long * const in_sizep,
+                 unsigned long long * const out_sizep );
+
+/* defined in decompress_mt.c */
+int decompress_mt( const int num_workers,
+                   const unsigned long long mem_limit,
+                   const int infd, const int outfd, const char * const filename,
+                   struct Pretty_print * const pp, const bool ignore_trailing,
+                   const bool loose_trailing, const bool testing,
+                   const struct Preset_dict * const preset,
+                   struct Coder_stats * const stats,
+                   long long * const bad_posp );
+
+/* defined in recompress.c */
+int recompress_mt( const struct Cmt_options * const options,
+                   const int infd, const int outfd, const char * const filename,
+                   struct Pretty_print * const pp, const bool ignore_trailing,
+                   const bool loose_trailing,
+                   unsigned long long * const in_sizep,
+                   unsigned long long * const out_sizep );
+
+/* defined in range_dec.c */
+struct Lzip_index;
+struct Range_decoder;
+struct LZ_decoder;
+int Li_decode_range( const struct Lzip_index * const li,
+                     struct Range_decoder * const rdec,
+                     struct LZ_decoder * const decoder,
+                     const int outfd, Flush_fn * const flush_fn,
+                     void * const flush_arg,
+                     const long long udata_pos, const long long udata_size,
+                     struct Pretty_print * const pp,
+                     long * const bad_memberp );
+int decompress_range( const int infd, const int outfd,
+                      const char * const filename,
+                      struct Pretty_print * const pp,
+                      const long long udata_pos, const long long udata_size,
+                      const bool ignore_trailing, const bool loose_trailing );
 
 /* defined in list.c */
 int list_files( const char * const filenames[], const int num_filenames,
-                const bool ignore_trailing, const bool loose_trailing );
+                const int num_workers, const bool ignore_trailing,
+                const bool loose_trailing, const bool write_index );
 
 /* defined in main.c */
 struct stat;
 struct Pretty_print;
 extern int verbosity;
 void * resize_buffer( void * buf, const unsigned min_size );
+void Cst_merge( struct Coder_stats * const dst,
+                const struct Coder_stats * const src );
 void Pp_show_msg( struct Pretty_print * const pp, const char * const msg );
 const char * bad_version( const unsigned version );
 const char * format_ds( const unsigned dictionary_size );
 void show_header( const unsigned dictionary_size );
+int open_instream_quiet( const char * const name, struct stat * const in_statsp,
+                         const bool one_to_one, const bool reg_only,
+                         int * const errp );
+void show_instream_error( const char * const name, const int err );
 int open_instream( const char * const name, struct stat * const in_statsp,
                    const bool one_to_one, const bool reg_only );
 void cleanup_and_fail( const int retval );
@@ -18,16 +18,23 @@
 #define _FILE_OFFSET_BITS 64
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "lzip.h"
 #include "lzip_index.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 
 static int seek_read( const int fd, uint8_t * const buf, const int size,
                       const long long pos )
@@ -93,9 +100,13 @@ static bool Li_check_header_error( struct Lzip_index * const li,
   {
   if( !Lh_verify_magic( header ) )
     { add_error( li, bad_magic_msg ); li->retval = 2; return true; }
-  if( !Lh_verify_version( header ) )
-    { add_error( li, bad_version( Lh_version( header ) ) ); li->retval = 2;
-      return true; }
+  if( !Lh_accept_version( header, li->preset ) )
+    {
+    char buf[80];		/* bad_version is not thread-safe */
+    snprintf( buf, sizeof buf, "Version %u member format not supported.",
+              Lh_version( header ) );
+    add_error( li, buf ); li->retval = 2; return true;
+    }
   if( !isvalid_ds( Lh_get_dictionary_size( header ) ) )
     { add_error( li, bad_dict_msg ); li->retval = 2; return true; }
   return false;
@@ -164,11 +175,11 @@ static bool Li_skip_trailing_data( struct Lzip_index * const li, const int fd,
         bool full_h2;
         if( member_size == 0 )			/* skip trailing zeros */
           { while( i > Lt_size && buffer[i-9] == 0 ) --i; continue; }
-        if( member_size > ipos + i || !Lt_verify_consistency( *trailer ) )
+        if( member_size > ipos + i || !Lt_verify_consistency( *trailer, li->preset ) )
           continue;
         if( !Li_read_header( li, fd, header, ipos + i - member_size ) )
           return false;
-        if( !Lh_verify( header ) ) continue;
+        if( !Lh_verify( header, li->preset ) ) continue;
         header2 = (const Lzip_header *)( buffer + i );
         full_h2 = bsize - i >= Lh_size;
         if( Lh_verify_prefix( *header2, bsize - i ) )	/* last member */
@@ -202,11 +213,13 @@ static bool Li_skip_trailing_data( struct Lzip_index * const li, const int fd,
 
 
 bool Li_init( struct Lzip_index * const li, const int infd,
-              const bool ignore_trailing, const bool loose_trailing )
+              const bool ignore_trailing, const bool loose_trailing,
+              const bool preset )
   {
   Lzip_header header;
   unsigned long long pos;
   long i;
+  li->preset = preset;
   li->member_vector = 0;
   li->error = 0;
   li->insize = lseek( infd, 0, SEEK_END );
@@ -235,7 +248,7 @@ bool Li_init( struct Lzip_index * const li, const int infd,
     if( seek_read( infd, trailer, Lt_size, pos - Lt_size ) != Lt_size )
       { Li_set_errno_error( li, "Error reading member trailer: " ); break; }
     member_size = Lt_get_member_size( trailer );
-    if( member_size > pos || !Lt_verify_consistency( trailer ) )
+    if( member_size > pos || !Lt_verify_consistency( trailer, li->preset ) )
       {							/* bad trailer */
       if( li->members <= 0 )
         { if( Li_skip_trailing_data( li, infd, &pos, ignore_trailing,
@@ -244,7 +257,7 @@ bool Li_init( struct Lzip_index * const li, const int infd,
       break;
       }
     if( !Li_read_header( li, infd, header, pos - member_size ) ) break;
-    if( !Lh_verify( header ) )				/* bad header */
+    if( !Lh_verify( header, li->preset ) )				/* bad header */
       {
       if( li->members <= 0 )
         { if( Li_skip_trailing_data( li, infd, &pos, ignore_trailing,
@@ -290,3 +303,209 @@ void Li_free( struct Lzip_index * const li )
   if( li->error ) { free( li->error ); li->error = 0; }
   li->error_size = 0;
   }
+
+
+/* Return the index of the member containing the uncompressed position
+   'pos', or li->members if pos >= udata_size. */
+long Li_find_member( const struct Lzip_index * const li, const long long pos )
+  {
+  long begin = 0, end = li->members;		/* search in [begin, end) */
+  if( pos >= Li_udata_size( li ) ) return li->members;
+  while( end - begin > 1 )
+    {
+    const long mid = ( begin + end ) / 2;
+    if( pos < li->member_vector[mid].dblock.pos ) end = mid;
+    else begin = mid;
+    }
+  return begin;
+  }
+
+
+/* The sidecar index file 'file.lz.idx' stores the member vector of
+   'file.lz' so that it can be loaded with a single read:
+
+   magic "LZIX" | version (2) | 3 bytes reserved (0) |
+   file size (8) | file mtime (8) | nanoseconds of file mtime (4) |
+   4 bytes reserved (0) | file inode number (8) | number of members (8) |
+   for each member: data size (8) | member pos (8) | member size (8) |
+                    dictionary size (4) |
+   CRC32 of all the preceding bytes (4)
+
+   All the numbers are stored least significant byte first. The index is
+   only valid if the size, mtime, and inode number of the lzip file match
+   the ones stored. The nanoseconds are stored as 0 on systems where they
+   are not available.
+*/
+enum { ix_header_size = 48, ix_member_size = 28, ix_version = 2 };
+static const uint8_t ix_magic[4] = { 0x4C, 0x5A, 0x49, 0x58 }; /* "LZIX" */
+
+static void put_le( uint8_t * const buf, unsigned long long value,
+                    const int size )
+  { int i; for( i = 0; i < size; ++i ) { buf[i] = value; value >>= 8; } }
+
+static unsigned long long get_le( const uint8_t * const buf, const int size )
+  {
+  unsigned long long value = 0;
+  int i;
+  for( i = size - 1; i >= 0; --i ) { value <<= 8; value += buf[i]; }
+  return value;
+  }
+
+
+static unsigned mtime_nsec( const struct stat * const st )
+  {
+#if defined __APPLE__
+  return st->st_mtimespec.tv_nsec;
+#elif defined __linux__ || defined __CYGWIN__ || defined __FreeBSD__ || \
+      defined __NetBSD__ || defined __OpenBSD__ || defined __sun
+  return st->st_mtim.tv_nsec;
+#else
+  if( st ) {}
+  return 0;
+#endif
+  }
+
+/* Return true if the header of the index file in 'buf' matches 'st'. */
+static bool check_stats( const uint8_t * const buf,
+                         const struct stat * const st )
+  {
+  return (long long)get_le( buf + 8, 8 ) == st->st_size &&
+         get_le( buf + 16, 8 ) == (unsigned long long)st->st_mtime &&
+         get_le( buf + 24, 4 ) == mtime_nsec( st ) &&
+         get_le( buf + 32, 8 ) == (unsigned long long)st->st_ino;
+  }
+
+
+static char * index_filename( const char * const filename )
+  {
+  const int len = strlen( filename );
+  char * const name = (char *)resize_buffer( 0, len + 5 );
+  memcpy( name, filename, len ); strcpy( name + len, ".idx" );
+  return name;
+  }
+
+
+/* Load the index of 'filename' (open on infd) from 'filename'.idx.
+   Return false if the index file does not exist or does not match. */
+static bool Li_read_index_file( struct Lzip_index * const li, const int infd,
+                                const char * const filename )
+  {
+  char * const name = index_filename( filename );
+  const int fd = open( name, O_RDONLY | O_BINARY );
+  struct stat in_stats, ix_stats;
+  uint8_t * buf = 0;
+  long long size = 0, dpos = 0, mpos = 0;
+  long i, members;
+  uint32_t crc = 0xFFFFFFFFU;
+  bool ok = false;
+  free( name );
+  if( fd < 0 ) return false;
+  if( fstat( infd, &in_stats ) != 0 || fstat( fd, &ix_stats ) != 0 ||
+      ix_stats.st_size < ix_header_size + ix_member_size + 4 ||
+      ix_stats.st_size > INT_MAX ) { close( fd ); return false; }
+  size = ix_stats.st_size;
+  buf = (uint8_t *)malloc( size );
+  if( buf && readblock( fd, buf, size ) == size &&
+      memcmp( buf, ix_magic, 4 ) == 0 && buf[4] == ix_version &&
+      check_stats( buf, &in_stats ) &&
+      ( members = get_le( buf + 40, 8 ) ) > 0 &&
+      ( size - ix_header_size - 4 ) / ix_member_size == members &&
+      ( size - ix_header_size - 4 ) % ix_member_size == 0 )
+    {
+    CRC32_update_buf( &crc, buf, size - 4 );
+    if( ( crc ^ 0xFFFFFFFFU ) == get_le( buf + size - 4, 4 ) ) ok = true;
+    }
+  close( fd );
+  if( !ok ) { free( buf ); return false; }
+
+  li->preset = false;
+  li->member_vector = 0;
+  li->error = 0;
+  li->insize = in_stats.st_size;
+  li->members = 0;
+  li->error_size = 0;
+  li->retval = 0;
+  li->dictionary_size = 0;
+  for( i = 0; i < members && ok; ++i )
+    {
+    const uint8_t * const p = buf + ix_header_size + i * ix_member_size;
+    const long long dsize = get_le( p, 8 );
+    const long long msize = get_le( p + 16, 8 );
+    const unsigned dictionary_size = get_le( p + 24, 4 );
+    if( get_le( p + 8, 8 ) != (unsigned long long)mpos || dsize < 0 ||
+        msize < min_member_size || msize > li->insize - mpos ||
+        dsize > INT64_MAX - dpos || !isvalid_ds( dictionary_size ) ||
+        !push_back_member( li, dpos, dsize, mpos, msize, dictionary_size ) )
+      { ok = false; break; }
+    if( li->dictionary_size < dictionary_size )
+      li->dictionary_size = dictionary_size;
+    dpos += dsize; mpos += msize;
+    }
+  free( buf );
+  if( !ok || mpos != li->insize ) { Li_free( li ); return false; }
+  return true;
+  }
+
+
+/* Like Li_init, but first try to load the index from the sidecar file
+   'filename'.idx, if filename is not empty. Only files without trailing
+   data are indexed in sidecar files.
+*/
+bool Li_init_cached( struct Lzip_index * const li, const int infd,
+                     const char * const filename,
+                     const bool ignore_trailing, const bool loose_trailing,
+                     const bool preset )
+  {
+  if( filename && filename[0] && Li_read_index_file( li, infd, filename ) )
+    return true;
+  return Li_init( li, infd, ignore_trailing, loose_trailing, preset );
+  }
+
+
+/* Write the index of 'filename' (open on infd) to 'filename'.idx.
+   Return false and set errno if the index file can't be written. */
+bool Li_write_index_file( const struct Lzip_index * const li, const int infd,
+                          const char * const filename )
+  {
+  const long long size =
+    ix_header_size + (long long)li->members * ix_member_size + 4;
+  char * name;
+  struct stat in_stats;
+  uint8_t * buf;
+  uint32_t crc = 0xFFFFFFFFU;
+  long i;
+  int fd;
+  bool ok;
+  if( li->members <= 0 || Li_file_size( li ) != Li_cdata_size( li ) ||
+      size > INT_MAX ) { errno = EINVAL; return false; }
+  if( fstat( infd, &in_stats ) != 0 ) return false;
+  buf = (uint8_t *)malloc( size );
+  if( !buf ) { errno = ENOMEM; return false; }
+  memcpy( buf, ix_magic, 4 );
+  buf[4] = ix_version; buf[5] = buf[6] = buf[7] = 0;
+  put_le( buf + 8, in_stats.st_size, 8 );
+  put_le( buf + 16, in_stats.st_mtime, 8 );
+  put_le( buf + 24, mtime_nsec( &in_stats ), 4 );
+  put_le( buf + 28, 0, 4 );
+  put_le( buf + 32, in_stats.st_ino, 8 );
+  put_le( buf + 40, li->members, 8 );
+  for( i = 0; i < li->members; ++i )
+    {
+    uint8_t * const p = buf + ix_header_size + i * ix_member_size;
+    put_le( p, Li_dblock( li, i )->size, 8 );
+    put_le( p + 8, Li_mblock( li, i )->pos, 8 );
+    put_le( p + 16, Li_mblock( li, i )->size, 8 );
+    put_le( p + 24, Li_dictionary_size( li, i ), 4 );
+    }
+  CRC32_update_buf( &crc, buf, size - 4 );
+  put_le( buf + size - 4, crc ^ 0xFFFFFFFFU, 4 );
+  name = index_filename( filename );
+  fd = open( name, O_CREAT | O_WRONLY | O_TRUNC | O_BINARY,
+             S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH );
+  ok = ( fd >= 0 && writeblock( fd, buf, size ) == size );
+  if( fd >= 0 && close( fd ) != 0 ) ok = false;
+  if( !ok && fd >= 0 ) { const int saved_errno = errno;
+                         unlink( name ); errno = saved_errno; }
+  free( name ); free( buf );
+  return ok;
+  }
@@ -55,13 +55,27 @@ struct Lzip_index
   int error_size;
   int retval;
   unsigned dictionary_size;	/* largest dictionary size in the file */
+  bool preset;			/* version 2 members accepted */
   };
 
+/* If 'preset', members of version 2 (coded with a preset dictionary) are
+   accepted. */
 bool Li_init( struct Lzip_index * const li, const int infd,
-              const bool ignore_trailing, const bool loose_trailing );
+              const bool ignore_trailing, const bool loose_trailing,
+              const bool preset );
+
+bool Li_init_cached( struct Lzip_index * const li, const int infd,
+                     const char * const filename,
+                     const bool ignore_trailing, const bool loose_trailing,
+                     const bool preset );
+
+bool Li_write_index_file( const struct Lzip_index * const li, const int infd,
+                          const char * const filename );
 
 void Li_free( struct Lzip_index * const li );
 
+long Li_find_member( const struct Lzip_index * const li, const long long pos );
+
 static inline long long Li_udata_size( const struct Lzip_index * const li )
   {
   if( li->members <= 0 ) return 0;
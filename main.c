@@ -27,12 +27,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <utime.h>
 #include <sys/stat.h>
@@ -55,6 +57,9 @@
 #define S_ISSOCK(x) 0
 #define S_ISVTX 0
 #endif
+#else
+#include <sys/mman.h>
+#define HAVE_MMAP
 #endif
 
 #include "carg_parser.h"
@@ -83,12 +88,6 @@ static const struct { const char * from; const char * to; } known_extensions[] =
   { ".tlz", ".tar" },
   { 0,      0      } };
 
-struct Lzma_options
-  {
-  int dictionary_size;		/* 4 KiB .. 512 MiB */
-  int match_len_limit;		/* 5 .. 273 */
-  };
-
 enum Mode { m_compress, m_decompress, m_list, m_test };
 
 /* Variables used in signal handler context.
@@ -96,6 +95,11 @@ enum Mode { m_compress, m_decompress, m_list, m_test };
 static char * output_filename = 0;
 static int outfd = -1;
 static bool delete_output_on_interrupt = false;
+struct Batch;
+static struct Batch * running_batch = 0;
+static void Bt_delete_outputs( struct Batch * const b );
+static int read_ahead = 2 * ar_block_size;	/* bytes, 0 = don't */
+static int write_block = aw_block_size;		/* bytes, 0 = don't */
 
 
 static void show_help( void )
@@ -119,6 +123,7 @@ static void show_help( void )
           "  -V, --version                  output version information and exit\n"
           "  -a, --trailing-error           exit with error status if trailing data\n"
           "  -b, --member-size=<bytes>      set member size limit in bytes\n"
+          "  -B, --data-size=<bytes>        set size of input data blocks [2x8=16 MiB]\n"
           "  -c, --stdout                   write to standard output, keep input files\n"
           "  -d, --decompress               decompress\n"
           "  -f, --force                    overwrite existing output files\n"
@@ -126,6 +131,8 @@ static void show_help( void )
           "  -k, --keep                     keep (don't delete) input files\n"
           "  -l, --list                     print (un)compressed file sizes\n"
           "  -m, --match-length=<bytes>     set match length limit in bytes [36]\n"
+          "  -n, --threads=<n>              set number of (de)compression threads [1]\n"
+          "                                 (-t and -l use all the processors)\n"
           "  -o, --output=<file>            write to <file>, keep input files\n"
           "  -q, --quiet                    suppress all messages\n"
           "  -s, --dictionary-size=<bytes>  set dictionary size limit in bytes [8 MiB]\n"
@@ -135,7 +142,18 @@ static void show_help( void )
           "  -0 .. -9                       set compression level [default 6]\n"
           "      --fast                     alias for -0\n"
           "      --best                     alias for -9\n"
+          "      --jobs=<n>                 (de)compress up to <n> files at a time [1]\n"
           "      --loose-trailing           allow trailing data seeming corrupt header\n"
+          "      --mem-limit=<bytes>        limit dictionaries of parallel decoding\n"
+          "      --overlap=<bytes>          compress blocks in parallel as a single member\n"
+          "      --preset-dict=<file>       (de)compress using <file> as preset dictionary\n"
+          "      --range=<pos>,<size>       decompress only <size> bytes from <pos>\n"
+          "      --read-ahead=<bytes>       size of input to read in advance [2MiB]\n"
+          "      --reencode                 decompress and compress again .lz files\n"
+          "      --stats                    print coder statistics as JSON to stderr\n"
+          "      --target-speed=<bytes>     lower the level to compress <bytes> per second\n"
+          "      --write-block=<bytes>      output block size of background writes [1MiB]\n"
+          "      --write-index              list files and write a .idx index of each\n"
           "\nIf no file names are given, or if a file is '-', clzip compresses or\n"
           "decompresses from standard input to standard output.\n"
           "Numbers may be followed by a multiplier: k = kB = 10^3 = 1000,\n"
@@ -250,6 +268,8 @@ void Pp_show_msg( struct Pretty_print * const pp, const char * const msg )
   }
 
 
+/* Not thread-safe. Li_init, which runs in worker threads, formats this
+   message itself. */
 const char * bad_version( const unsigned version )
   {
   static char buf[80];
@@ -347,6 +367,23 @@ static int get_dict_size( const char * const arg )
   }
 
 
+/* Parse a range argument of the form "pos,size". */
+static void parse_range( const char * const arg, long long * const posp,
+                         long long * const sizep )
+  {
+  const char * const comma = strchr( arg, ',' );
+  char * buf;
+  if( !comma || comma == arg )
+    { show_error( "Bad range argument. Use '--range=<pos>,<size>'.", 0, true );
+      exit( 1 ); }
+  buf = (char *)resize_buffer( 0, comma - arg + 1 );
+  memcpy( buf, arg, comma - arg ); buf[comma-arg] = 0;
+  *posp = getnum( buf, 0, INT64_MAX );
+  free( buf );
+  *sizep = getnum( comma + 1, 1, INT64_MAX );
+  }
+
+
 static void set_mode( enum Mode * const program_modep, const enum Mode new_mode )
   {
   if( *program_modep != m_compress && *program_modep != new_mode )
@@ -374,22 +411,33 @@ static int extension_index( const char * const name )
   }
 
 
-static void set_c_outname( const char * const name, const bool filenames_given,
-                           const bool force_ext, const bool multifile )
+static char * make_c_outname( char * outname, const char * const name,
+                              const bool filenames_given, const bool force_ext,
+                              const bool multifile )
   {
   /* zupdate < 1.9 depends on lzip adding the extension '.lz' to name when
      reading from standard input. */
-  output_filename = resize_buffer( output_filename, strlen( name ) + 5 +
-                                   strlen( known_extensions[0].from ) + 1 );
-  strcpy( output_filename, name );
-  if( multifile ) strcat( output_filename, "00001" );
+  outname = resize_buffer( outname, strlen( name ) + 5 +
+                           strlen( known_extensions[0].from ) + 1 );
+  strcpy( outname, name );
+  if( multifile ) strcat( outname, "00001" );
   if( force_ext || multifile ||
-      ( !filenames_given && extension_index( output_filename ) < 0 ) )
-    strcat( output_filename, known_extensions[0].from );
+      ( !filenames_given && extension_index( outname ) < 0 ) )
+    strcat( outname, known_extensions[0].from );
+  return outname;
+  }
+
+static void set_c_outname( const char * const name, const bool filenames_given,
+                           const bool force_ext, const bool multifile )
+  {
+  output_filename = make_c_outname( output_filename, name, filenames_given,
+                                    force_ext, multifile );
   }
 
 
-static void set_d_outname( const char * const name, const int eindex )
+/* 'eindex' < 0 means that the original name can't be guessed. */
+static char * make_d_outname( char * outname, const char * const name,
+                              const int eindex )
   {
   const unsigned name_len = strlen( name );
   if( eindex >= 0 )
@@ -398,28 +446,38 @@ static void set_d_outname( const char * const name, const int eindex )
     const unsigned from_len = strlen( from );
     if( name_len > from_len )
       {
-      output_filename = resize_buffer( output_filename, name_len +
-                                       strlen( known_extensions[eindex].to ) + 1 );
-      strcpy( output_filename, name );
-      strcpy( output_filename + name_len - from_len, known_extensions[eindex].to );
-      return;
+      outname = resize_buffer( outname, name_len +
+                               strlen( known_extensions[eindex].to ) + 1 );
+      strcpy( outname, name );
+      strcpy( outname + name_len - from_len, known_extensions[eindex].to );
+      return outname;
       }
     }
-  output_filename = resize_buffer( output_filename, name_len + 4 + 1 );
-  strcpy( output_filename, name );
-  strcat( output_filename, ".out" );
-  if( verbosity >= 1 )
+  outname = resize_buffer( outname, name_len + 4 + 1 );
+  strcpy( outname, name );
+  strcat( outname, ".out" );
+  return outname;
+  }
+
+static void set_d_outname( const char * const name, const int eindex )
+  {
+  output_filename = make_d_outname( output_filename, name, eindex );
+  if( eindex < 0 && verbosity >= 1 )
     fprintf( stderr, "%s: Can't guess original name for '%s' -- using '%s'\n",
              program_name, name, output_filename );
   }
 
 
-int open_instream( const char * const name, struct stat * const in_statsp,
-                   const bool one_to_one, const bool reg_only )
+/* Like open_instream, but without messages, so that it can be called from
+   any thread. On error return -1 and set '*errp' to the errno of open, or
+   to a negative value if the file is not a regular file; pass '*errp' to
+   show_instream_error to print the message. */
+int open_instream_quiet( const char * const name, struct stat * const in_statsp,
+                         const bool one_to_one, const bool reg_only,
+                         int * const errp )
   {
   int infd = open( name, O_RDONLY | O_BINARY );
-  if( infd < 0 )
-    show_file_error( name, "Can't open input file", errno );
+  if( infd < 0 ) *errp = ( errno > 0 ) ? errno : EIO;
   else
     {
     const int i = fstat( infd, in_statsp );
@@ -429,10 +487,7 @@ int open_instream( const char * const name, struct stat * const in_statsp,
                               S_ISFIFO( mode ) || S_ISSOCK( mode ) ) );
     if( i != 0 || ( !S_ISREG( mode ) && ( !can_read || one_to_one ) ) )
       {
-      if( verbosity >= 0 )
-        fprintf( stderr, "%s: Input file '%s' is not a regular file%s.\n",
-                 program_name, name, ( can_read && one_to_one ) ?
-                 ",\n       and neither '-c' nor '-o' were specified" : "" );
+      *errp = ( can_read && one_to_one ) ? -2 : -1;
       close( infd );
       infd = -1;
       }
@@ -441,6 +496,27 @@ int open_instream( const char * const name, struct stat * const in_statsp,
   }
 
 
+void show_instream_error( const char * const name, const int err )
+  {
+  if( err > 0 ) show_file_error( name, "Can't open input file", err );
+  else if( verbosity >= 0 )
+    fprintf( stderr, "%s: Input file '%s' is not a regular file%s.\n",
+             program_name, name, ( err == -2 ) ?
+             ",\n       and neither '-c' nor '-o' were specified" : "" );
+  }
+
+
+int open_instream( const char * const name, struct stat * const in_statsp,
+                   const bool one_to_one, const bool reg_only )
+  {
+  int err = 0;
+  const int infd =
+    open_instream_quiet( name, in_statsp, one_to_one, reg_only, &err );
+  if( infd < 0 ) show_instream_error( name, err );
+  return infd;
+  }
+
+
 static int open_instream2( const char * const name, struct stat * const in_statsp,
                            const enum Mode program_mode, const int eindex,
                            const bool one_to_one, const bool recompress )
@@ -490,6 +566,7 @@ static void set_signals( void (*action)(int) )
 void cleanup_and_fail( const int retval )
   {
   set_signals( SIG_IGN );			/* ignore signals */
+  if( running_batch ) Bt_delete_outputs( running_batch );
   if( delete_output_on_interrupt )
     {
     delete_output_on_interrupt = false;
@@ -512,6 +589,18 @@ static void signal_handler( int sig )
   }
 
 
+#ifdef HAVE_MMAP
+/* Reading a page of a mapped input file that has been truncated after
+   the match finder checked its size raises SIGBUS. */
+static void sigbus_handler( int sig )
+  {
+  if( sig ) {}				/* keep compiler happy */
+  show_error( "Read error: input file has shrunk.", 0, false );
+  cleanup_and_fail( 1 );
+  }
+#endif
+
+
 static bool check_tty_in( const char * const input_filename, const int infd,
                           const enum Mode program_mode, int * const retval )
   {
@@ -536,35 +625,48 @@ static bool check_tty_out( const enum Mode program_mode )
   }
 
 
-/* Set permissions, owner, and times. */
-static void close_and_set_permissions( const struct stat * const in_statsp )
+/* Set permissions, owner, and times of the output file 'name', open on
+   'fd', and close it. Set '*warningp' if the attributes can't be set.
+   Return 0, or the errno of close if the file can't be closed. */
+static int close_and_copy_attributes( const int fd, const char * const name,
+                                      const struct stat * const in_statsp,
+                                      bool * const warningp )
   {
-  bool warning = false;
   if( in_statsp )
     {
     const mode_t mode = in_statsp->st_mode;
     /* fchown will in many cases return with EPERM, which can be safely ignored. */
-    if( fchown( outfd, in_statsp->st_uid, in_statsp->st_gid ) == 0 )
-      { if( fchmod( outfd, mode ) != 0 ) warning = true; }
+    if( fchown( fd, in_statsp->st_uid, in_statsp->st_gid ) == 0 )
+      { if( fchmod( fd, mode ) != 0 ) *warningp = true; }
     else
       if( errno != EPERM ||
-          fchmod( outfd, mode & ~( S_ISUID | S_ISGID | S_ISVTX ) ) != 0 )
-        warning = true;
-    }
-  if( close( outfd ) != 0 )
-    {
-    show_error( "Error closing output file", errno, false );
-    cleanup_and_fail( 1 );
+          fchmod( fd, mode & ~( S_ISUID | S_ISGID | S_ISVTX ) ) != 0 )
+        *warningp = true;
     }
-  outfd = -1;
-  delete_output_on_interrupt = false;
+  if( close( fd ) != 0 ) return ( errno > 0 ) ? errno : EIO;
   if( in_statsp )
     {
     struct utimbuf t;
     t.actime = in_statsp->st_atime;
     t.modtime = in_statsp->st_mtime;
-    if( utime( output_filename, &t ) != 0 ) warning = true;
+    if( utime( name, &t ) != 0 ) *warningp = true;
+    }
+  return 0;
+  }
+
+
+static void close_and_set_permissions( const struct stat * const in_statsp )
+  {
+  bool warning = false;
+  const int err =
+    close_and_copy_attributes( outfd, output_filename, in_statsp, &warning );
+  if( err )
+    {
+    show_error( "Error closing output file", err, false );
+    cleanup_and_fail( 1 );
     }
+  outfd = -1;
+  delete_output_on_interrupt = false;
   if( warning && verbosity >= 1 )
     show_error( "Can't change output file attributes.", 0, false );
   }
@@ -592,26 +694,371 @@ struct Poly_encoder
   struct FLZ_encoder * fe;
   };
 
+/* Coders kept across files (and members), so that their buffers are
+   allocated and page-faulted only once per run. The encoder options don't
+   change between files. A zeroed LZ_decoder is valid for LZd_reinit. */
+static struct Poly_encoder pooled_encoder = { 0, 0, 0 };
+static struct LZ_decoder pooled_decoder;
 
-static int compress( const unsigned long long cfile_size,
-                     const unsigned long long member_size,
-                     const unsigned long long volume_size, const int infd,
-                     const struct Lzma_options * const encoder_options,
-                     struct Pretty_print * const pp,
-                     const struct stat * const in_statsp, const bool zero )
+static void free_pooled_coders( void )
   {
-  unsigned long long in_size = 0, out_size = 0, partial_volume_size = 0;
-  int retval = 0;
-  struct Poly_encoder encoder = { 0, 0, 0 };	/* polymorphic encoder */
-  if( verbosity >= 1 ) Pp_show_msg( pp, 0 );
+  if( pooled_encoder.eb ) LZeb_free( pooled_encoder.eb );
+  free( pooled_encoder.fe ); free( pooled_encoder.e );
+  pooled_encoder.eb = 0; pooled_encoder.fe = 0; pooled_encoder.e = 0;
+  LZd_free( &pooled_decoder );
+  pooled_decoder.buffer = 0; pooled_decoder.buffer_size = 0;
+  }
+
+
+/* Map into memory the regular file open on 'infd', so that the match
+   finder can read it without copying. The match finder gives back the
+   pages already read (see Mb_set_map_fd), so the file does not stay in
+   memory. Return 0 if the file can't be mapped.
+*/
+static const uint8_t * map_infile( const int infd, long long * const sizep )
+  {
+#ifdef HAVE_MMAP
+  struct stat st;
+  void * map;
+  if( fstat( infd, &st ) != 0 || !S_ISREG( st.st_mode ) || st.st_size <= 0 ||
+      (unsigned long long)st.st_size > (size_t)-1 ||
+      lseek( infd, 0, SEEK_CUR ) != 0 ) return 0;
+  map = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, infd, 0 );
+  if( map == MAP_FAILED ) return 0;
+  madvise( map, st.st_size, MADV_SEQUENTIAL );
+  *sizep = st.st_size;
+  return (const uint8_t *)map;
+#else
+  return 0;
+#endif
+  }
+
+
+static void unmap_infile( const uint8_t * const map, const long long size )
+  {
+#ifdef HAVE_MMAP
+  if( map ) munmap( (void *)map, size );
+#endif
+  }
+
+
+/* Number of processors online, used as the default number of threads for
+   testing and listing. Return 1 if it can't be determined. */
+static int online_processors( const int max_workers )
+  {
+#ifdef _SC_NPROCESSORS_ONLN
+  const long n = sysconf( _SC_NPROCESSORS_ONLN );
+  if( n > 1 ) return min( n, max_workers );
+#endif
+  return 1;
+  }
+
+
+/* Default limit of the memory used by the dictionaries of the parallel
+   decoder: half the physical memory, or 0 (no limit) if it is unknown. */
+static unsigned long long default_mem_limit( void )
+  {
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+  const long pages = sysconf( _SC_PHYS_PAGES );
+  const long page_size = sysconf( _SC_PAGESIZE );
+  if( pages > 0 && page_size > 0 )
+    return (unsigned long long)pages * page_size / 2;
+#endif
+  return 0;
+  }
+
+
+/* Read the preset dictionary from file 'name'. It is read once and shared
+   by all the coders. */
+static bool read_preset( const char * const name,
+                         struct Preset_dict * const preset )
+  {
+  uint8_t * data = 0;
+  int size = 0, capacity = 0;
+  const int infd = open( name, O_RDONLY | O_BINARY );
+  if( infd < 0 )
+    { show_file_error( name, "Can't open preset dictionary", errno );
+      return false; }
+  while( true )
+    {
+    int rd, rest;
+    if( size >= capacity )
+      {
+      if( capacity >= max_dictionary_size )
+        { show_file_error( name, "Preset dictionary is too large.", 0 );
+          close( infd ); free( data ); return false; }
+      capacity = capacity ? 2 * capacity : 65536;
+      data = (uint8_t *)resize_buffer( data, capacity );
+      }
+    rest = capacity - size;
+    rd = readblock( infd, data + size, rest );
+    size += rd;
+    if( rd < rest )
+      {
+      if( errno )
+        { show_file_error( name, "Error reading preset dictionary", errno );
+          close( infd ); free( data ); return false; }
+      break;
+      }
+    }
+  close( infd );
+  preset->data = data;
+  preset->size = size;
+  Pd_set_id( preset );
+  return true;
+  }
+
+
+static double clock_time( const clockid_t clock )
+  {
+  struct timespec ts;
+  if( clock_gettime( clock, &ts ) != 0 ) return 0;
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+
+/* Wrapper around the input or output function of a coder, measuring the
+   time the coder waits for it for --stats. */
+struct Timed_io
+  {
+  Read_fn * read_fn;		/* wrapped functions, or 0 to use fd */
+  Flush_fn * flush_fn;
+  void * arg;
+  double * wait;		/* the time spent is added here */
+  int fd;
+  };
+
+static int timed_read( void * const arg, uint8_t * const buf, const int size )
+  {
+  struct Timed_io * const tio = (struct Timed_io *)arg;
+  const double start = clock_time( CLOCK_MONOTONIC );
+  int rd;
+  if( tio->read_fn ) rd = tio->read_fn( tio->arg, buf, size );
+  else
+    {
+    rd = readblock( tio->fd, buf, size );
+    if( rd != size && errno )
+      { show_error( "Read error", errno, false ); cleanup_and_fail( 1 ); }
+    }
+  *tio->wait += clock_time( CLOCK_MONOTONIC ) - start;
+  return rd;
+  }
+
+static void timed_flush( void * const arg, const uint8_t * const buf,
+                         const int size )
+  {
+  struct Timed_io * const tio = (struct Timed_io *)arg;
+  const double start = clock_time( CLOCK_MONOTONIC );
+  if( tio->flush_fn ) tio->flush_fn( tio->arg, buf, size );
+  else if( writeblock( tio->fd, buf, size ) != size )
+    { show_error( "Write error", errno, false ); cleanup_and_fail( 1 ); }
+  *tio->wait += clock_time( CLOCK_MONOTONIC ) - start;
+  }
+
+/* Replace the input function and argument of a coder, which reads from
+   'fd' if '*fnp' is 0, with 'tio'. 'tio->wait' must be already set. */
+static void time_reads( Read_fn ** const fnp, void ** const argp,
+                        struct Timed_io * const tio, const int fd )
+  {
+  tio->read_fn = *fnp; tio->flush_fn = 0; tio->arg = *argp; tio->fd = fd;
+  *fnp = timed_read; *argp = tio;
+  }
+
+static void time_flushes( Flush_fn ** const fnp, void ** const argp,
+                          struct Timed_io * const tio, const int fd )
+  {
+  tio->read_fn = 0; tio->flush_fn = *fnp; tio->arg = *argp; tio->fd = fd;
+  *fnp = timed_flush; *argp = tio;
+  }
+
+
+void Cst_merge( struct Coder_stats * const dst,
+                const struct Coder_stats * const src )
+  {
+  int i;
+  dst->members += src->members;
+  dst->data_size += src->data_size;
+  dst->member_size += src->member_size;
+  dst->literals += src->literals;
+  dst->run_literals += src->run_literals;
+  dst->matches += src->matches;
+  for( i = 0; i < 4; ++i ) dst->reps[i] += src->reps[i];
+  dst->short_reps += src->short_reps;
+  for( i = 0; i <= max_match_len - min_match_len; ++i )
+    dst->match_lens[i] += src->match_lens[i];
+  for( i = 0; i < 1 << dis_slot_bits; ++i )
+    dst->dis_slots[i] += src->dis_slots[i];
+  dst->mf_searches += src->mf_searches;
+  dst->mf_cycles += src->mf_cycles;
+  dst->price_updates += src->price_updates;
+  dst->dis_price_updates += src->dis_price_updates;
+  dst->align_price_updates += src->align_price_updates;
+  dst->read_wait += src->read_wait;
+  dst->write_wait += src->write_wait;
+  }
+
+
+static void show_json_array( const char * const name,
+                             const unsigned long long * const array,
+                             const int size )
+  {
+  int i;
+  fprintf( stderr, ",\"%s\":[", name );
+  for( i = 0; i < size; ++i )
+    fprintf( stderr, "%s%llu", ( i > 0 ) ? "," : "", array[i] );
+  fputc( ']', stderr );
+  }
+
+
+/* Print the stats of a file as a JSON object in one line. The I/O waits
+   are negative if they were not measured (parallel coding); then they,
+   and the compute time derived from them, are printed as null. */
+static void show_stats( const char * const name, const enum Mode mode,
+                        const struct Coder_stats * const cs,
+                        const double wall_time, const double cpu_time )
+  {
+  const bool encoder = ( mode == m_compress );
+  const bool timed = ( cs->read_wait >= 0 && cs->write_wait >= 0 );
+  const char * p;
+  fputs( "{\"file\":\"", stderr );
+  for( p = name; *p; ++p )
+    {
+    const unsigned char ch = *p;
+    if( ch == '"' || ch == '\\' ) { fputc( '\\', stderr ); fputc( ch, stderr ); }
+    else if( ch < 0x20 ) fprintf( stderr, "\\u%04X", ch );
+    else fputc( ch, stderr );
+    }
+  fprintf( stderr, "\",\"mode\":\"%s\",\"members\":%llu,"
+           "\"uncompressed_bytes\":%llu,\"compressed_bytes\":%llu,"
+           "\"wall_time\":%.6f,\"cpu_time\":%.6f",
+           encoder ? "compress" : ( mode == m_test ) ? "test" : "decompress",
+           cs->members, cs->data_size, cs->member_size, wall_time, cpu_time );
+  if( timed )
+    fprintf( stderr, ",\"read_wait\":%.6f,\"write_wait\":%.6f,"
+             "\"compute_time\":%.6f", cs->read_wait, cs->write_wait,
+             max( 0.0, wall_time - cs->read_wait - cs->write_wait ) );
+  else
+    fputs( ",\"read_wait\":null,\"write_wait\":null,\"compute_time\":null",
+           stderr );
+  fprintf( stderr, ",\"literals\":%llu", cs->literals );
+  if( encoder ) fprintf( stderr, ",\"run_literals\":%llu", cs->run_literals );
+  fprintf( stderr, ",\"matches\":%llu", cs->matches );
+  show_json_array( "reps", cs->reps, 4 );
+  fprintf( stderr, ",\"short_reps\":%llu", cs->short_reps );
+  show_json_array( "match_lengths", cs->match_lens,
+                   max_match_len - min_match_len + 1 );
+  show_json_array( "distance_slots", cs->dis_slots, 1 << dis_slot_bits );
+  if( encoder )
+    fprintf( stderr, ",\"match_finder_searches\":%llu,"
+             "\"match_finder_cycles\":%llu,\"price_updates\":%llu,"
+             "\"distance_price_updates\":%llu,\"align_price_updates\":%llu",
+             cs->mf_searches, cs->mf_cycles, cs->price_updates,
+             cs->dis_price_updates, cs->align_price_updates );
+  fputs( "}\n", stderr );
+  }
+
+
+/* Start reading 'fd' ahead in the background, in a ring of at least two
+   blocks of at most ar_block_size bytes, 'read_ahead' bytes in total.
+   Return 0 if read-ahead is disabled, if 'fd' is a regular file not larger
+   than one block (the kernel already reads it ahead, and starting a thread
+   would cost more than it saves), or if the reader can't be started. */
+static struct Async_reader * open_reader( const int fd )
+  {
+  struct stat st;
+  int num_blocks, block_size;
+  if( read_ahead <= 0 ) return 0;
+  num_blocks = max( 2, read_ahead / ar_block_size );
+  block_size = max( 4096, read_ahead / num_blocks );
+  if( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) &&
+      st.st_size <= block_size ) return 0;
+  return Ar_open( fd, block_size, num_blocks );
+  }
+
+
+/* Start writing to 'fd' in the background, in two blocks of 'write_block'
+   bytes. Return 0 if it is disabled, if the output is known to fit in one
+   block ('max_size' >= 0 bounds its size; starting a thread for it would
+   cost more than it saves), or if the writer can't be started. */
+static struct Async_writer * open_writer( const int fd,
+                                          const long long max_size )
+  {
+  const int block_size = max( 4096, write_block );
+  if( write_block <= 0 || ( max_size >= 0 && max_size <= block_size ) )
+    return 0;
+  return Aw_open( fd, block_size );
+  }
 
+
+/* Return the size of the decompressed data of 'fd' if it is a regular file
+   holding a single member, as most small files do, or -1. */
+static long long single_member_data_size( const int fd )
+  {
+  struct stat st;
+  Lzip_trailer trailer;
+  if( fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) ||
+      st.st_size < min_member_size ||
+      preadblock( fd, trailer, Lt_size, st.st_size - Lt_size ) != Lt_size ||
+      Lt_get_member_size( trailer ) != (unsigned long long)st.st_size ||
+      Lt_get_data_size( trailer ) > LLONG_MAX )
+    return -1;
+  return Lt_get_data_size( trailer );
+  }
+
+
+/* Make the match finder read its input from 'ar', if any, through 'tio'
+   if it is not 0. Must be called before initializing the encoder. */
+static void set_reader( struct Matchfinder_base * const mb,
+                        struct Async_reader * const ar, const int infd,
+                        struct Timed_io * const tio )
+  {
+  mb->read_fn = ar ? Ar_read : 0;
+  mb->read_arg = ar;
+  if( tio ) time_reads( &mb->read_fn, &mb->read_arg, tio, infd );
+  }
+
+
+/* Make the range encoder write its output through 'aw', if any, and
+   through 'tio' if it is not 0. */
+static void set_writer( struct Range_encoder * const renc,
+                        struct Async_writer * const aw,
+                        struct Timed_io * const tio )
+  {
+  renc->flush_fn = aw ? Aw_write : 0;
+  renc->flush_arg = aw;
+  if( tio ) time_flushes( &renc->flush_fn, &renc->flush_arg, tio, renc->outfd );
+  }
+
+
+/* Initialize 'encoder' to compress from 'map' if it is not 0, else from
+   'ar' if it is not 0, else from 'infd', to 'ofd'. If 'encoder' is
+   already initialized, reuse its buffers. Reads are timed through 'tinp'
+   if it is not 0. On error free the encoder, zero it, and return false. */
+static bool init_encoder( struct Poly_encoder * const encoder,
+                          const struct Lzma_options * const encoder_options,
+                          const bool zero,
+                          const struct Preset_dict * const preset,
+                          struct Async_reader * const ar, const int infd,
+                          const uint8_t * const map, const long long map_size,
+                          const int ofd, struct Timed_io * const tinp )
   {
+  const int ifd = ( map || ar || tinp ) ? -1 : infd;
   bool error = false;
-  if( zero )
+  if( encoder->eb )
     {
-    encoder.fe = (struct FLZ_encoder *)malloc( sizeof *encoder.fe );
-    if( !encoder.fe || !FLZe_init( encoder.fe, infd, outfd ) ) error = true;
-    else encoder.eb = &encoder.fe->eb;
+    set_reader( &encoder->eb->mb, ar, infd, tinp );
+    if( ( zero && !FLZe_reinit( encoder->fe, ifd, map, map_size, ofd ) ) ||
+        ( !zero && !LZe_reinit( encoder->e, ifd, map, map_size, ofd ) ) )
+      { encoder->eb = 0; error = true; }
+    }
+  else if( zero )
+    {
+    encoder->fe = (struct FLZ_encoder *)malloc( sizeof *encoder->fe );
+    if( encoder->fe ) set_reader( &encoder->fe->eb.mb, ar, infd, tinp );
+    if( !encoder->fe ||
+        !FLZe_init( encoder->fe, preset, ifd, map, map_size, ofd ) )
+      error = true;
+    else encoder->eb = &encoder->fe->eb;
     }
   else
     {
@@ -619,19 +1066,113 @@ static int compress( const unsigned long long cfile_size,
     if( Lh_set_dictionary_size( header, encoder_options->dictionary_size ) &&
         encoder_options->match_len_limit >= min_match_len_limit &&
         encoder_options->match_len_limit <= max_match_len )
-      encoder.e = (struct LZ_encoder *)malloc( sizeof *encoder.e );
+      encoder->e = (struct LZ_encoder *)malloc( sizeof *encoder->e );
     else internal_error( "invalid argument to encoder." );
-    if( !encoder.e || !LZe_init( encoder.e, Lh_get_dictionary_size( header ),
-                                 encoder_options->match_len_limit, infd, outfd ) )
+    if( encoder->e ) set_reader( &encoder->e->eb.mb, ar, infd, tinp );
+    if( !encoder->e || !LZe_init( encoder->e, Lh_get_dictionary_size( header ),
+                                  encoder_options->match_len_limit,
+                                  encoder_options->hash_chain, preset,
+                                  ifd, map, map_size, ofd ) )
       error = true;
-    else encoder.eb = &encoder.e->eb;
+    else encoder->eb = &encoder->e->eb;
     }
   if( error )
     {
+    free( encoder->fe ); free( encoder->e );
+    encoder->eb = 0; encoder->fe = 0; encoder->e = 0;
+    return false;
+    }
+  if( map ) Mb_set_map_fd( &encoder->eb->mb, infd );
+  return true;
+  }
+
+
+static void show_cstats( const unsigned long long in_size,
+                         const unsigned long long out_size )
+  {
+  if( in_size == 0 || out_size == 0 )
+    fputs( " no data compressed.\n", stderr );
+  else
+    fprintf( stderr, "%6.3f:1, %5.2f%% ratio, %5.2f%% saved, "
+                     "%llu in, %llu out.\n",
+             (double)in_size / out_size,
+             ( 100.0 * out_size ) / in_size,
+             100.0 - ( ( 100.0 * out_size ) / in_size ),
+             in_size, out_size );
+  }
+
+
+static int compress( const unsigned long long cfile_size,
+                     const unsigned long long member_size,
+                     const unsigned long long volume_size, const int infd,
+                     const struct Lzma_options * const encoder_options,
+                     struct Pretty_print * const pp,
+                     const struct stat * const in_statsp,
+                     const int num_workers, const int data_size,
+                     const int overlap,
+                     const unsigned long long target_speed, const bool zero,
+                     const struct Preset_dict * const preset,
+                     struct Coder_stats * const stats )
+  {
+  unsigned long long in_size = 0, out_size = 0, partial_volume_size = 0;
+  long long map_size = 0;
+  const uint8_t * map = 0;
+  struct Async_reader * ar = 0;
+  struct Async_writer * aw = 0;
+  struct Timed_io tin, tout;		/* used if stats != 0 */
+  struct Timed_io * const tinp = stats ? &tin : 0;
+  struct Timed_io * const toutp = stats ? &tout : 0;
+  int retval = 0;
+  struct Poly_encoder encoder = pooled_encoder;	/* polymorphic encoder */
+  if( verbosity >= 1 ) Pp_show_msg( pp, 0 );
+
+  if( num_workers > 1 && volume_size == 0 )	/* compress blocks in parallel */
+    {
+    struct Cmt_options mt_options;
+    Lzip_header header;
+    if( !Lh_set_dictionary_size( header, encoder_options->dictionary_size ) ||
+        encoder_options->match_len_limit < min_match_len_limit ||
+        encoder_options->match_len_limit > max_match_len )
+      internal_error( "invalid argument to encoder." );
+    mt_options.member_size = member_size;
+    mt_options.data_size = data_size;
+    mt_options.dictionary_size = Lh_get_dictionary_size( header );
+    mt_options.match_len_limit = encoder_options->match_len_limit;
+    mt_options.hash_chain = encoder_options->hash_chain;
+    mt_options.num_workers = num_workers;
+    mt_options.target_speed =			/* share among the workers */
+      ( target_speed + num_workers - 1 ) / num_workers;
+    mt_options.zero = zero;
+    mt_options.stats = stats;
+    mt_options.preset = preset;
+    mt_options.overlap = ( overlap < 0 ) ? -1 :
+                         min( overlap, mt_options.dictionary_size - 1 );
+    retval = compress_mt( &mt_options, infd, outfd, pp, &in_size, &out_size );
+    if( stats ) stats->read_wait = stats->write_wait = -1;
+    if( retval == 0 && verbosity >= 1 ) show_cstats( in_size, out_size );
+    return retval;
+    }
+
+  if( stats )
+    { tin.wait = &stats->read_wait; tout.wait = &stats->write_wait; }
+  map = map_infile( infd, &map_size );
+  if( !map ) ar = open_reader( infd );
+  const bool encoder_ok = init_encoder( &encoder, encoder_options, zero,
+                                       preset, ar, infd, map, map_size,
+                                       outfd, tinp );
+  pooled_encoder = encoder;			/* zeroed on error */
+  if( !encoder_ok )
+    {
+    Ar_close( ar );
+    unmap_infile( map, map_size );
     Pp_show_msg( pp, "Not enough memory. Try a smaller dictionary size." );
     return 1;
     }
-  }
+  if( !zero ) LZe_set_target_speed( encoder.e, target_speed );
+  encoder.eb->stats = stats;
+  /* the output of a mapped file of half a block fits in one block */
+  aw = open_writer( outfd, ( map && map_size <= write_block / 2 ) ? 0 : -1 );
+  set_writer( &encoder.eb->renc, aw, toutp );
 
   while( true )			/* encode one member per iteration */
     {
@@ -652,30 +1193,23 @@ static int compress( const unsigned long long cfile_size,
         partial_volume_size = 0;
         if( delete_output_on_interrupt )
           {
+          Aw_close( aw ); aw = 0;
           close_and_set_permissions( in_statsp );
           if( !next_filename() )
             { Pp_show_msg( pp, "Too many volume files." ); retval = 1; break; }
           if( !open_outstream( true, in_statsp ) ) { retval = 1; break; }
+          aw = open_writer( outfd, -1 );
+          set_writer( &encoder.eb->renc, aw, toutp );
           }
         }
       }
     if( zero ) FLZe_reset( encoder.fe ); else LZe_reset( encoder.e );
     }
 
-  if( retval == 0 && verbosity >= 1 )
-    {
-    if( in_size == 0 || out_size == 0 )
-      fputs( " no data compressed.\n", stderr );
-    else
-      fprintf( stderr, "%6.3f:1, %5.2f%% ratio, %5.2f%% saved, "
-                       "%llu in, %llu out.\n",
-               (double)in_size / out_size,
-               ( 100.0 * out_size ) / in_size,
-               100.0 - ( ( 100.0 * out_size ) / in_size ),
-               in_size, out_size );
-    }
-  LZeb_free( encoder.eb );
-  if( zero ) free( encoder.fe ); else free( encoder.e );
+  Aw_close( aw );
+  Ar_close( ar );
+  if( retval == 0 && verbosity >= 1 ) show_cstats( in_size, out_size );
+  unmap_infile( map, map_size );
   return retval;
   }
 
@@ -717,22 +1251,59 @@ static bool show_trailing_data( const uint8_t * const data, const int size,
 
 
 static int decompress( const unsigned long long cfile_size, const int infd,
-                struct Pretty_print * const pp, const bool ignore_trailing,
-                const bool loose_trailing, const bool testing )
+                struct Pretty_print * const pp, const int num_workers,
+                const unsigned long long mem_limit,
+                const bool ignore_trailing, const bool loose_trailing,
+                const bool testing, const struct Preset_dict * const preset,
+                struct Coder_stats * const stats )
   {
   unsigned long long partial_file_pos = 0;
   struct Range_decoder rdec;
+  int ofd = outfd;
+  struct Async_writer * aw;
+  struct Timed_io tin, tout;		/* used if stats != 0 */
+  struct Async_reader * ar = 0;
   int retval = 0;
-  bool first_member;
+  bool first_member = true;
+  bool mt_failed = false;	/* decode again the member that failed */
+
+  if( num_workers > 1 && verbosity < 2 )	/* -vv shows each member */
+    {
+    long long bad_pos = 0;
+    const char * const filename = ( pp->name != pp->stdin_name ) ? pp->name : "";
+    retval = decompress_mt( num_workers, mem_limit, infd, outfd, filename, pp,
+                            ignore_trailing, loose_trailing, testing, preset,
+                            stats, &bad_pos );
+    if( retval >= 0 && retval != 2 )
+      { if( stats ) stats->read_wait = stats->write_wait = -1;
+        return retval; }
+    if( retval == 2 )		/* show the diagnostic of the serial decoder */
+      {
+      if( lseek( infd, bad_pos, SEEK_SET ) != bad_pos )
+        { show_file_error( pp->name, "Seek error", errno ); return 1; }
+      partial_file_pos = bad_pos; first_member = ( bad_pos == 0 );
+      ofd = -1; mt_failed = true;
+      }
+    retval = 0;
+    }
   if( !Rd_init( &rdec, infd ) )
     { show_error( mem_msg, 0, false ); cleanup_and_fail( 1 ); }
+  ar = open_reader( infd );
+  if( ar ) { rdec.read_fn = Ar_read; rdec.read_arg = ar; }
+  aw = ( ofd >= 0 ) ? open_writer( ofd, single_member_data_size( infd ) ) : 0;
+  if( stats )
+    {
+    tin.wait = &stats->read_wait; tout.wait = &stats->write_wait;
+    time_reads( &rdec.read_fn, &rdec.read_arg, &tin, infd );
+    }
 
-  for( first_member = true; ; first_member = false )
+  for( ; ; first_member = false )
     {
     int result, size;
     unsigned dictionary_size;
     Lzip_header header;
-    struct LZ_decoder decoder;
+    char msg[preset_msg_size];
+    struct LZ_decoder * const decoder = &pooled_decoder;
     Rd_reset_member_position( &rdec );
     size = Rd_read_data( &rdec, header, Lh_size );
     if( Rd_finished( &rdec ) )			/* End Of File */
@@ -761,22 +1332,31 @@ static int decompress( const unsigned long long cfile_size, const int infd,
         retval = 2;
       break;
       }
-    if( !Lh_verify_version( header ) )
+    if( !Lh_accept_version( header, preset != 0 ) )
       { Pp_show_msg( pp, bad_version( Lh_version( header ) ) );
         retval = 2; break; }
     dictionary_size = Lh_get_dictionary_size( header );
     if( !isvalid_ds( dictionary_size ) )
       { Pp_show_msg( pp, bad_dict_msg ); retval = 2; break; }
+    if( Rd_check_preset( &rdec, header, preset, msg ) != 0 )
+      { Pp_show_msg( pp, msg ); retval = 2; break; }
 
     if( verbosity >= 2 || ( verbosity == 1 && first_member ) )
       Pp_show_msg( pp, 0 );
 
-    if( !LZd_init( &decoder, &rdec, dictionary_size, outfd ) )
+    if( !LZd_reinit( decoder, &rdec, dictionary_size, ofd ) )
       { Pp_show_msg( pp, mem_msg ); retval = 1; break; }
+    if( preset ) LZd_load_preset( decoder, preset );
+    if( aw ) { decoder->flush_fn = Aw_write; decoder->flush_arg = aw; }
+    if( stats )
+      {
+      decoder->stats = stats;
+      if( ofd >= 0 )
+        time_flushes( &decoder->flush_fn, &decoder->flush_arg, &tout, ofd );
+      }
     show_dprogress( cfile_size, partial_file_pos, &rdec, pp );	/* init */
-    result = LZd_decode_member( &decoder, pp );
+    result = LZd_decode_member( decoder, pp );
     partial_file_pos += Rd_member_position( &rdec );
-    LZd_free( &decoder );
     if( result != 0 )
       {
       if( verbosity >= 0 && result <= 2 )
@@ -788,9 +1368,13 @@ static int decompress( const unsigned long long cfile_size, const int infd,
         }
       retval = 2; break;
       }
+    if( mt_failed )
+      internal_error( "member decoded serially but not in parallel." );
     if( verbosity >= 2 )
       { fputs( testing ? "ok\n" : "done\n", stderr ); Pp_reset( pp ); }
     }
+  Aw_close( aw );
+  Ar_close( ar );
   Rd_free( &rdec );
   if( verbosity == 1 && retval == 0 )
     fputs( testing ? "ok\n" : "done\n", stderr );
@@ -798,6 +1382,453 @@ static int decompress( const unsigned long long cfile_size, const int infd,
   }
 
 
+/* Decode the lzip file open on 'infd' and compress its data again with
+   'encoder_options', member by member. If a member is corrupt, test the
+   file serially to show the diagnostic of the decoder. */
+static int reencode( const unsigned long long cfile_size,
+                     const unsigned long long member_size, const int infd,
+                     const struct Lzma_options * const encoder_options,
+                     struct Pretty_print * const pp, const int num_workers,
+                     const unsigned long long target_speed, const bool zero,
+                     const bool ignore_trailing, const bool loose_trailing,
+                     struct Coder_stats * const stats )
+  {
+  struct Cmt_options mt_options;
+  const char * const filename = ( pp->name != pp->stdin_name ) ? pp->name : "";
+  unsigned long long in_size = 0, out_size = 0;
+  int retval;
+  Lzip_header header;
+  if( !Lh_set_dictionary_size( header, encoder_options->dictionary_size ) ||
+      encoder_options->match_len_limit < min_match_len_limit ||
+      encoder_options->match_len_limit > max_match_len )
+    internal_error( "invalid argument to encoder." );
+  mt_options.member_size = member_size;
+  mt_options.data_size = 0;			/* the members of the input */
+  mt_options.dictionary_size = Lh_get_dictionary_size( header );
+  mt_options.match_len_limit = encoder_options->match_len_limit;
+  mt_options.hash_chain = encoder_options->hash_chain;
+  mt_options.num_workers = num_workers;
+  mt_options.target_speed =			/* share among the workers */
+    ( target_speed + num_workers - 1 ) / num_workers;
+  mt_options.zero = zero;
+  mt_options.stats = stats;
+  mt_options.preset = 0;
+  mt_options.overlap = -1;
+  retval = recompress_mt( &mt_options, infd, outfd, filename, pp,
+                          ignore_trailing, loose_trailing, &in_size, &out_size );
+  if( stats ) stats->read_wait = stats->write_wait = -1;
+  if( retval == 2 )
+    {
+    if( lseek( infd, 0, SEEK_SET ) != 0 )
+      { show_file_error( pp->name, "Can't rewind input file", errno );
+        return 1; }
+    retval = decompress( cfile_size, infd, pp, num_workers, 0,
+                         ignore_trailing, loose_trailing, true, 0, 0 );
+    if( retval == 0 )
+      internal_error( "member decoded serially but not in parallel." );
+    }
+  if( retval == 0 && verbosity >= 1 ) show_cstats( in_size, out_size );
+  return retval;
+  }
+
+
+/* Batch mode: several files coded at a time, each one by a single thread,
+   from their names to their own output files. The workers code the files
+   without printing anything, and main reports them in order. A file that
+   a worker can't code is coded again serially, which prints the messages
+   in the right place.
+*/
+struct Batch_item
+  {
+  char * outname;		/* 0 if the file must be coded serially */
+  struct Coder_stats * stats;	/* if --stats */
+  unsigned long long in_size, out_size;
+  double wall_time, cpu_time;
+  int retval;			/* 0 = done, -1 = code it serially */
+  bool attr_warning;		/* can't change output file attributes */
+  bool done;			/* coded, ready to be reported */
+  };
+
+struct Batch			/* data shared by the batch workers */
+  {
+  const char * const * filenames;
+  struct Batch_item * items;
+  const struct Lzma_options * encoder_options;
+  const struct Preset_dict * preset;
+  char ** outputs;		/* being written by each worker, or 0 */
+  pthread_t * threads;
+  unsigned long long member_size;
+  unsigned long long target_speed;	/* per worker */
+  pthread_mutex_t mutex;	/* protects the variables below, 'outputs',
+				   and 'retval' and 'done' of the items */
+  pthread_cond_t cond;		/* a file has been coded or reported */
+  int num_filenames;
+  int num_workers;
+  int next;			/* next file to be coded */
+  int reported;			/* files already reported */
+  int window;			/* max files coded ahead of report */
+  enum Mode mode;
+  bool aborted;			/* set by Bt_delete_outputs */
+  bool force, ignore_trailing, loose_trailing, print_stats, zero;
+  };
+
+struct Batch_worker
+  {
+  struct Batch * batch;
+  struct Poly_encoder encoder;	/* reused across files */
+  struct LZ_decoder decoder;
+  int id;			/* index in batch->outputs */
+  };
+
+
+static int batch_compress( struct Batch_worker * const bw, const int infd,
+                           const int ofd, struct Batch_item * const item )
+  {
+  const struct Batch * const b = bw->batch;
+  struct Poly_encoder * const encoder = &bw->encoder;
+  long long map_size = 0;
+  const uint8_t * const map = map_infile( infd, &map_size );
+  struct Timed_io tin, tout;		/* used if item->stats != 0 */
+  int retval = 0;
+
+  if( item->stats )
+    { tin.wait = &item->stats->read_wait; tout.wait = &item->stats->write_wait; }
+  if( !init_encoder( encoder, b->encoder_options, b->zero, b->preset, 0,
+                     infd, map, map_size, ofd, item->stats ? &tin : 0 ) )
+    { unmap_infile( map, map_size ); return 1; }
+  if( !b->zero ) LZe_set_target_speed( encoder->e, b->target_speed );
+  encoder->eb->stats = item->stats;
+  set_writer( &encoder->eb->renc, 0, item->stats ? &tout : 0 );
+  while( true )			/* encode one member per iteration */
+    {
+    if( ( b->zero && !FLZe_encode_member( encoder->fe, b->member_size ) ) ||
+        ( !b->zero && !LZe_encode_member( encoder->e, b->member_size ) ) )
+      { retval = 1; break; }
+    item->in_size += Mb_data_position( &encoder->eb->mb );
+    item->out_size += Re_member_position( &encoder->eb->renc );
+    if( Mb_data_finished( &encoder->eb->mb ) ) break;
+    if( b->zero ) FLZe_reset( encoder->fe ); else LZe_reset( encoder->e );
+    }
+  unmap_infile( map, map_size );
+  return retval;
+  }
+
+
+/* Like decompress, but without messages. Return 0 if the file would be
+   decompressed by decompress without error. */
+static int batch_decompress( struct Batch_worker * const bw, const int infd,
+                             const int ofd, struct Coder_stats * const stats )
+  {
+  const struct Batch * const b = bw->batch;
+  struct LZ_decoder * const decoder = &bw->decoder;
+  struct Range_decoder rdec;
+  struct Timed_io tin, tout;		/* used if stats != 0 */
+  int retval = 0;
+  bool first_member;
+
+  if( !Rd_init( &rdec, infd ) ) return 1;
+  if( stats )
+    {
+    tin.wait = &stats->read_wait; tout.wait = &stats->write_wait;
+    time_reads( &rdec.read_fn, &rdec.read_arg, &tin, infd );
+    }
+  for( first_member = true; ; first_member = false )
+    {
+    int size;
+    unsigned dictionary_size;
+    Lzip_header header;
+    char msg[preset_msg_size];
+    Rd_reset_member_position( &rdec );
+    size = Rd_read_data( &rdec, header, Lh_size );
+    if( Rd_finished( &rdec ) )			/* End Of File */
+      {
+      if( first_member || Lh_verify_prefix( header, size ) ||
+          ( size > 0 && !b->ignore_trailing ) ) retval = 2;
+      break;
+      }
+    if( !Lh_verify_magic( header ) )
+      {
+      if( first_member || !b->ignore_trailing ||
+          ( !b->loose_trailing && Lh_verify_corrupt( header ) ) ) retval = 2;
+      break;
+      }
+    dictionary_size = Lh_get_dictionary_size( header );
+    if( !Lh_accept_version( header, b->preset != 0 ) ||
+        !isvalid_ds( dictionary_size ) )
+      { retval = 2; break; }
+    if( Rd_check_preset( &rdec, header, b->preset, msg ) != 0 )
+      { retval = 2; break; }
+    if( !LZd_reinit( decoder, &rdec, dictionary_size, ofd ) )
+      { retval = 1; break; }
+    if( b->preset ) LZd_load_preset( decoder, b->preset );
+    if( stats )
+      {
+      decoder->stats = stats;
+      if( ofd >= 0 )
+        time_flushes( &decoder->flush_fn, &decoder->flush_arg, &tout, ofd );
+      }
+    if( LZd_decode_member( decoder, 0 ) != 0 ) { retval = 2; break; }
+    }
+  Rd_free( &rdec );
+  return retval;
+  }
+
+
+static void batch_file( struct Batch_worker * const bw, const int i )
+  {
+  struct Batch * const b = bw->batch;
+  struct Batch_item * const item = &b->items[i];
+  const bool testing = ( b->mode == m_test );
+  struct stat in_stats;
+  double wall_time = 0, cpu_time = 0;
+  int err = 0, infd, ofd = -1, retval;
+
+  item->retval = -1;
+  if( !testing && !item->outname ) return;
+  infd = open_instream_quiet( b->filenames[i], &in_stats, true, false, &err );
+  if( infd < 0 ) return;
+  if( !testing )
+    {
+    const int flags = O_CREAT | O_WRONLY | O_BINARY |
+                      ( b->force ? O_TRUNC : O_EXCL );
+    pthread_mutex_lock( &b->mutex );	/* create no outputs once aborted */
+    ofd = b->aborted ? -1 : open( item->outname, flags, S_IRUSR | S_IWUSR );
+    if( ofd >= 0 ) b->outputs[bw->id] = item->outname;
+    pthread_mutex_unlock( &b->mutex );
+    if( ofd < 0 ) { close( infd ); return; }
+    }
+  if( b->print_stats )
+    {
+    item->stats = (struct Coder_stats *)resize_buffer( 0, sizeof *item->stats );
+    Cst_init( item->stats );
+    wall_time = clock_time( CLOCK_MONOTONIC );
+    cpu_time = clock_time( CLOCK_THREAD_CPUTIME_ID );
+    }
+  retval = ( b->mode == m_compress ) ?
+    batch_compress( bw, infd, ofd, item ) :
+    batch_decompress( bw, infd, ofd, item->stats );
+  if( item->stats )
+    { item->wall_time = clock_time( CLOCK_MONOTONIC ) - wall_time;
+      item->cpu_time = clock_time( CLOCK_THREAD_CPUTIME_ID ) - cpu_time; }
+  if( close( infd ) != 0 ) retval = 1;
+  if( ofd >= 0 )
+    {
+    if( retval == 0 )
+      retval = close_and_copy_attributes( ofd, item->outname, &in_stats,
+                                          &item->attr_warning );
+    else close( ofd );
+    if( retval != 0 ) remove( item->outname );
+    }
+  if( retval == 0 ) item->retval = 0;
+  else { free( item->stats ); item->stats = 0; }
+  }
+
+
+static void * batch_worker( void * arg )
+  {
+  struct Batch_worker * const bw = (struct Batch_worker *)arg;
+  struct Batch * const b = bw->batch;
+  while( true )
+    {
+    int i;
+    pthread_mutex_lock( &b->mutex );
+    while( b->next < b->num_filenames && b->next >= b->reported + b->window )
+      pthread_cond_wait( &b->cond, &b->mutex );
+    i = b->next;
+    if( i < b->num_filenames ) ++b->next;
+    pthread_mutex_unlock( &b->mutex );
+    if( i >= b->num_filenames ) break;
+    batch_file( bw, i );
+    pthread_mutex_lock( &b->mutex );	/* the output passes to the item */
+    b->outputs[bw->id] = 0;
+    b->items[i].done = true;
+    pthread_cond_broadcast( &b->cond );
+    pthread_mutex_unlock( &b->mutex );
+    }
+  if( bw->encoder.eb ) LZeb_free( bw->encoder.eb );
+  free( bw->encoder.fe ); free( bw->encoder.e );
+  LZd_free( &bw->decoder );
+  free( bw );
+  return 0;
+  }
+
+
+/* Return true if two of the input or output files have the same name, in
+   which case the files can't be coded concurrently. */
+static int compare_names( const void * const a, const void * const b )
+  { return strcmp( *(const char * const *)a, *(const char * const *)b ); }
+
+static bool repeated_names( const struct Batch * const b )
+  {
+  const char ** names = (const char **)
+    resize_buffer( 0, 2 * b->num_filenames * sizeof names[0] );
+  int i, num_names = 0;
+  bool repeated = false;
+  for( i = 0; i < b->num_filenames; ++i )
+    {
+    names[num_names++] = b->filenames[i];
+    if( b->items[i].outname ) names[num_names++] = b->items[i].outname;
+    }
+  qsort( names, num_names, sizeof names[0], compare_names );
+  for( i = 1; i < num_names && !repeated; ++i )
+    if( strcmp( names[i-1], names[i] ) == 0 ) repeated = true;
+  free( names );
+  return repeated;
+  }
+
+
+/* Start coding the files with up to 'num_workers' threads. The options in
+   'b' must be already set. Return false, after freeing all, if the files
+   can't be coded in batch mode. */
+static bool Bt_open( struct Batch * const b, const char * const filenames[],
+                     const int num_filenames, const int num_workers,
+                     const enum Mode mode, const bool recompress )
+  {
+  pthread_mutexattr_t attr;
+  sigset_t mask, old_mask;
+  int i;
+  b->filenames = filenames;
+  b->num_filenames = num_filenames;
+  b->items = (struct Batch_item *)
+    resize_buffer( 0, num_filenames * sizeof b->items[0] );
+  for( i = 0; i < num_filenames; ++i )
+    {
+    struct Batch_item * const item = &b->items[i];
+    const char * const name = filenames[i];
+    const int eindex = extension_index( name );
+    item->outname = 0;
+    item->stats = 0;
+    item->in_size = 0; item->out_size = 0;
+    item->wall_time = 0; item->cpu_time = 0;
+    item->retval = -1;
+    item->attr_warning = false;
+    item->done = false;
+    if( mode == m_compress && ( recompress || eindex < 0 ) )
+      item->outname = make_c_outname( 0, name, true, true, false );
+    else if( mode == m_decompress && eindex >= 0 )
+      item->outname = make_d_outname( 0, name, eindex );
+    }
+  if( mode != m_test && repeated_names( b ) )
+    {
+    for( i = 0; i < num_filenames; ++i ) free( b->items[i].outname );
+    free( b->items ); b->items = 0;
+    return false;
+    }
+  b->mode = mode;
+  b->next = 0;
+  b->reported = 0;
+  b->window = 4 * num_workers;
+  b->threads = (pthread_t *)
+    resize_buffer( 0, num_workers * sizeof b->threads[0] );
+  b->outputs = (char **)resize_buffer( 0, num_workers * sizeof b->outputs[0] );
+  for( i = 0; i < num_workers; ++i ) b->outputs[i] = 0;
+  b->aborted = false;
+  /* recursive, so that Bt_delete_outputs, which may run in a signal handler
+     of the main thread, can't deadlock if the main thread holds it */
+  pthread_mutexattr_init( &attr );
+  pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+  pthread_mutex_init( &b->mutex, &attr );
+  pthread_mutexattr_destroy( &attr );
+  pthread_cond_init( &b->cond, 0 );
+
+  /* let the main thread alone handle the signals that delete the outputs */
+  sigemptyset( &mask );
+  sigaddset( &mask, SIGHUP );
+  sigaddset( &mask, SIGINT );
+  sigaddset( &mask, SIGTERM );
+  pthread_sigmask( SIG_BLOCK, &mask, &old_mask );
+  for( b->num_workers = 0; b->num_workers < num_workers; ++b->num_workers )
+    {
+    struct Batch_worker * const bw =
+      (struct Batch_worker *)resize_buffer( 0, sizeof *bw );
+    bw->batch = b;
+    bw->encoder.eb = 0; bw->encoder.e = 0; bw->encoder.fe = 0;
+    bw->decoder.buffer = 0; bw->decoder.buffer_size = 0;
+    bw->id = b->num_workers;
+    if( pthread_create( &b->threads[b->num_workers], 0, batch_worker, bw ) != 0 )
+      { free( bw ); break; }
+    }
+  pthread_sigmask( SIG_SETMASK, &old_mask, 0 );
+  if( b->num_workers == 0 )	/* only the main thread; code serially */
+    {
+    pthread_cond_destroy( &b->cond );
+    pthread_mutex_destroy( &b->mutex );
+    for( i = 0; i < num_filenames; ++i ) free( b->items[i].outname );
+    free( b->outputs ); free( b->threads ); free( b->items ); b->items = 0;
+    return false;
+    }
+  running_batch = b;
+  return true;
+  }
+
+
+/* Wait until file 'i' has been coded, and allow the workers to code the
+   files after it. */
+static struct Batch_item * Bt_wait( struct Batch * const b, const int i )
+  {
+  struct Batch_item * const item = &b->items[i];
+  pthread_mutex_lock( &b->mutex );
+  while( !item->done ) pthread_cond_wait( &b->cond, &b->mutex );
+  b->reported = i + 1;
+  pthread_cond_broadcast( &b->cond );
+  pthread_mutex_unlock( &b->mutex );
+  return item;
+  }
+
+
+static void Bt_free_item( struct Batch_item * const item )
+  {
+  free( item->outname ); item->outname = 0;
+  free( item->stats ); item->stats = 0;
+  }
+
+
+/* Wait for the workers, which have coded all the files, and free all. */
+static void Bt_close( struct Batch * const b )
+  {
+  int i;
+  for( i = 0; i < b->num_workers; ++i )
+    if( pthread_join( b->threads[i], 0 ) != 0 )
+      internal_error( "can't join worker threads." );
+  pthread_cond_destroy( &b->cond );
+  pthread_mutex_destroy( &b->mutex );
+  for( i = 0; i < b->num_filenames; ++i ) Bt_free_item( &b->items[i] );
+  free( b->outputs ); free( b->threads ); free( b->items ); b->items = 0;
+  running_batch = 0;
+  }
+
+
+static void delete_output( const char * const name )
+  {
+  if( verbosity >= 0 )
+    fprintf( stderr, "%s: Deleting output file '%s', if it exists.\n",
+             program_name, name );
+  if( remove( name ) != 0 && errno != ENOENT )
+    show_error( "WARNING: deletion of output file (apparently) failed.", 0, false );
+  }
+
+
+/* Called by cleanup_and_fail. Delete the output files being written, and
+   also those already written but not reported, so that, as when coding
+   serially, the files after the one that failed are left untouched.
+   Once 'aborted' is set the workers create no more outputs, and a worker
+   publishes each output in 'outputs' as soon as it creates it, and moves
+   it to its item (done) at once, so that none escapes the deletion. The
+   workers still writing to deleted outputs end with the exit that follows. */
+static void Bt_delete_outputs( struct Batch * const b )
+  {
+  int i;
+  pthread_mutex_lock( &b->mutex );
+  b->aborted = true;
+  for( i = 0; i < b->num_workers; ++i )
+    if( b->outputs[i] ) delete_output( b->outputs[i] );
+  for( i = b->reported; i < b->num_filenames; ++i )
+    if( b->items[i].done && b->items[i].retval == 0 && b->items[i].outname )
+      delete_output( b->items[i].outname );
+  pthread_mutex_unlock( &b->mutex );
+  }
+
+
 void show_error( const char * const msg, const int errcode, const bool help )
   {
   if( verbosity < 0 ) return;
@@ -891,28 +1922,25 @@ void show_dprogress( const unsigned long long cfile_size,
 
 int main( const int argc, const char * const argv[] )
   {
-  /* Mapping from gzip/bzip2 style 1..9 compression modes
-     to the corresponding LZMA compression modes. */
-  const struct Lzma_options option_mapping[] =
-    {
-    { 1 << 16,  16 },		/* -0 */
-    { 1 << 20,   5 },		/* -1 */
-    { 3 << 19,   6 },		/* -2 */
-    { 1 << 21,   8 },		/* -3 */
-    { 3 << 20,  12 },		/* -4 */
-    { 1 << 22,  20 },		/* -5 */
-    { 1 << 23,  36 },		/* -6 */
-    { 1 << 24,  68 },		/* -7 */
-    { 3 << 23, 132 },		/* -8 */
-    { 1 << 25, 273 } };		/* -9 */
   struct Lzma_options encoder_options = option_mapping[6];  /* default = "-6" */
   const unsigned long long max_member_size = 0x0008000000000000ULL; /* 2 PiB */
   const unsigned long long max_volume_size = 0x4000000000000000ULL; /* 4 EiB */
   unsigned long long member_size = max_member_size;
   unsigned long long volume_size = 0;
+  const int max_workers = 1024;
+  int num_workers = 0;			/* 0 = default (1, or all for -t, -l) */
+  int num_jobs = 1;			/* files coded at a time */
+  unsigned long long mem_limit = default_mem_limit();	/* 0 = no limit */
+  unsigned long long target_speed = 0;	/* 0 = fixed compression level */
+  long long range_pos = 0, range_size = 0;	/* range_size 0 = no range */
+  int data_size = 0;			/* 0 = default */
+  int overlap = -1;			/* -1 = independent members */
   const char * default_output_filename = "";
+  const char * preset_filename = 0;
+  struct Preset_dict preset;
   static struct Arg_parser parser;	/* static because valgrind complains */
   static struct Pretty_print pp;	/* and memory management in C sucks */
+  struct Batch batch;			/* used if batch.items != 0 */
   static const char ** filenames = 0;
   int num_filenames = 0;
   enum Mode program_mode = m_compress;
@@ -925,12 +1953,16 @@ int main( const int argc, const char * const argv[] )
   bool ignore_trailing = true;
   bool keep_input_files = false;
   bool loose_trailing = false;
+  bool print_stats = false;
   bool recompress = false;
+  bool reencode_files = false;
   bool stdin_used = false;
   bool to_stdout = false;
+  bool write_index = false;
   bool zero = false;
 
-  enum { opt_lt = 256 };
+  enum { opt_jb = 256, opt_lt, opt_ml, opt_ov, opt_pd, opt_ra, opt_range,
+         opt_re, opt_st, opt_ts, opt_wb, opt_wi };
   const struct ap_Option options[] =
     {
     { '0', "fast",              ap_no  },
@@ -945,6 +1977,7 @@ int main( const int argc, const char * const argv[] )
     { '9', "best",              ap_no  },
     { 'a', "trailing-error",    ap_no  },
     { 'b', "member-size",       ap_yes },
+    { 'B', "data-size",         ap_yes },
     { 'c', "stdout",            ap_no  },
     { 'd', "decompress",        ap_no  },
     { 'f', "force",             ap_no  },
@@ -961,7 +1994,18 @@ int main( const int argc, const char * const argv[] )
     { 't', "test",              ap_no  },
     { 'v', "verbose",           ap_no  },
     { 'V', "version",           ap_no  },
+    { opt_jb, "jobs",           ap_yes },
     { opt_lt, "loose-trailing", ap_no  },
+    { opt_ml, "mem-limit",      ap_yes },
+    { opt_ov, "overlap",        ap_yes },
+    { opt_pd, "preset-dict",    ap_yes },
+    { opt_range, "range",       ap_yes },
+    { opt_ra,    "read-ahead",  ap_yes },
+    { opt_re,    "reencode",    ap_no  },
+    { opt_st,    "stats",       ap_no  },
+    { opt_ts,    "target-speed", ap_yes },
+    { opt_wb,    "write-block", ap_yes },
+    { opt_wi,    "write-index", ap_no  },
     {  0, 0,                    ap_no  } };
 
   if( argc > 0 ) invocation_name = argv[0];
@@ -985,6 +2029,8 @@ int main( const int argc, const char * const argv[] )
                 encoder_options = option_mapping[code-'0']; break;
       case 'a': ignore_trailing = false; break;
       case 'b': member_size = getnum( arg, 100000, max_member_size ); break;
+      case 'B': data_size = getnum( arg, 2 * min_dictionary_size,
+                                    max_dictionary_size ); break;
       case 'c': to_stdout = true; break;
       case 'd': set_mode( &program_mode, m_decompress ); break;
       case 'f': force = true; break;
@@ -995,7 +2041,7 @@ int main( const int argc, const char * const argv[] )
       case 'm': encoder_options.match_len_limit =
                   getnum( arg, min_match_len_limit, max_match_len );
                 zero = false; break;
-      case 'n': break;
+      case 'n': num_workers = getnum( arg, 1, max_workers ); break;
       case 'o': if( strcmp( arg, "-" ) == 0 ) to_stdout = true;
                 else { default_output_filename = arg; } break;
       case 'q': verbosity = -1; break;
@@ -1005,7 +2051,20 @@ int main( const int argc, const char * const argv[] )
       case 't': set_mode( &program_mode, m_test ); break;
       case 'v': if( verbosity < 4 ) ++verbosity; break;
       case 'V': show_version(); return 0;
+      case opt_jb: num_jobs = getnum( arg, 1, max_workers ); break;
       case opt_lt: loose_trailing = true; break;
+      case opt_ml: mem_limit = getnum( arg, 0, INT64_MAX ); break;
+      case opt_ov: overlap = getnum( arg, 0, max_dictionary_size ); break;
+      case opt_pd: preset_filename = arg; break;
+      case opt_ra: read_ahead = getnum( arg, 0, 1 << 30 ); break;
+      case opt_wb: write_block = getnum( arg, 0, 1 << 28 ); break;
+      case opt_re: reencode_files = true; break;
+      case opt_st: print_stats = true; break;
+      case opt_ts: target_speed = getnum( arg, 0, INT64_MAX ); break;
+      case opt_wi: set_mode( &program_mode, m_list ); write_index = true;
+                   break;
+      case opt_range: parse_range( arg, &range_pos, &range_size );
+                      set_mode( &program_mode, m_decompress ); break;
       default : internal_error( "uncaught option." );
       }
     } /* end process options */
@@ -1025,8 +2084,21 @@ int main( const int argc, const char * const argv[] )
     if( strcmp( filenames[i], "-" ) != 0 ) filenames_given = true;
     }
 
+  if( num_workers <= 0 )
+    num_workers = ( program_mode == m_test || program_mode == m_list ) ?
+                  online_processors( max_workers ) : 1;
+
   if( program_mode == m_list )
-    return list_files( filenames, num_filenames, ignore_trailing, loose_trailing );
+    return list_files( filenames, num_filenames, num_workers, ignore_trailing,
+                       loose_trailing, write_index );
+
+  if( preset_filename )
+    {
+    if( range_size > 0 )
+      { show_error( "--preset-dict can't be used with --range.", 0, true );
+        return 1; }
+    if( !read_preset( preset_filename, &preset ) ) return 1;
+    }
 
   if( program_mode == m_compress )
     {
@@ -1034,10 +2106,35 @@ int main( const int argc, const char * const argv[] )
         num_filenames > 1 )
       { show_error( "Only can compress one file when using '-o' and '-S'.",
                     0, true ); return 1; }
+    if( overlap >= 0 && member_size < max_member_size )
+      { show_error( "--overlap can't be used with '-b'.", 0, true );
+        return 1; }
+    if( overlap >= 0 && preset_filename )
+      { show_error( "--overlap can't be used with --preset-dict.", 0, true );
+        return 1; }
+    if( reencode_files && ( volume_size > 0 || preset_filename ) )
+      { show_error( "--reencode can't be used with '-S' or --preset-dict.",
+                    0, true ); return 1; }
+    if( reencode_files && keep_input_files && !to_stdout &&
+        !default_output_filename[0] )
+      { show_error( "--reencode replaces the input files; use '-c' or '-o' "
+                    "to keep them.", 0, true ); return 1; }
+    if( num_workers > 1 && !reencode_files )
+      {
+      if( data_size <= 0 )
+        data_size = zero ? 1 << 20 :
+                    2 * max( 65536, encoder_options.dictionary_size );
+      else if( data_size + max( 0, overlap ) <
+               encoder_options.dictionary_size )	/* reachable data */
+        encoder_options.dictionary_size =
+          max( data_size + max( 0, overlap ), min_dictionary_size );
+      }
     Dis_slots_init();
     Prob_prices_init();
     }
   else volume_size = 0;
+  /* never delete the input file when decompressing a range */
+  if( range_size > 0 && !default_output_filename[0] ) to_stdout = true;
   if( program_mode == m_test ) to_stdout = false;	/* apply overrides */
   if( program_mode == m_test || to_stdout ) default_output_filename = "";
 
@@ -1051,10 +2148,35 @@ int main( const int argc, const char * const argv[] )
                        default_output_filename[0];
   if( !to_stdout && program_mode != m_test && ( filenames_given || to_file ) )
     set_signals( signal_handler );
+#ifdef HAVE_MMAP
+  if( program_mode == m_compress ) signal( SIGBUS, sigbus_handler );
+#endif
 
   Pp_init( &pp, filenames, num_filenames );
 
   const bool one_to_one = !to_stdout && program_mode != m_test && !to_file;
+  batch.items = 0;
+  if( num_jobs > 1 && num_filenames > 1 && filenames_given &&
+      ( one_to_one || program_mode == m_test ) && volume_size == 0 &&
+      range_size == 0 && !reencode_files &&
+      verbosity <= 1 )				/* -vv shows each member */
+    {
+    for( i = 0; i < num_filenames; ++i )
+      if( strcmp( filenames[i], "-" ) == 0 ) break;
+    batch.encoder_options = &encoder_options;
+    batch.preset = preset_filename ? &preset : 0;
+    batch.member_size = member_size;
+    batch.target_speed = ( target_speed + num_jobs - 1 ) / num_jobs;
+    batch.force = force;
+    batch.ignore_trailing = ignore_trailing;
+    batch.loose_trailing = loose_trailing;
+    batch.print_stats = print_stats;
+    batch.zero = zero;
+    if( i >= num_filenames &&
+        Bt_open( &batch, filenames, num_filenames,
+                 min( num_jobs, num_filenames ), program_mode, recompress ) )
+      num_workers = 1;		/* code each file with one thread */
+    }
   for( i = 0; i < num_filenames; ++i )
     {
     unsigned long long cfile_size;
@@ -1063,8 +2185,34 @@ int main( const int argc, const char * const argv[] )
     int tmp;
     struct stat in_stats;
     const struct stat * in_statsp;
+    struct Coder_stats stats;
+    double wall_time = 0, cpu_time = 0;
 
     Pp_set_name( &pp, filenames[i] );
+    if( batch.items )
+      {
+      struct Batch_item * const item = Bt_wait( &batch, i );
+      if( item->retval == 0 )
+        {
+        if( verbosity >= 1 )
+          {
+          Pp_show_msg( &pp, 0 );
+          if( program_mode == m_compress )
+            show_cstats( item->in_size, item->out_size );
+          else fputs( ( program_mode == m_test ) ? "ok\n" : "done\n", stderr );
+          }
+        if( item->stats )
+          show_stats( pp.name, program_mode, item->stats, item->wall_time,
+                      item->cpu_time );
+        if( item->attr_warning && verbosity >= 1 )
+          show_error( "Can't change output file attributes.", 0, false );
+        if( !keep_input_files && program_mode != m_test )
+          remove( filenames[i] );
+        Bt_free_item( item );
+        continue;
+        }
+      Bt_free_item( item );			/* code it serially */
+      }
     if( strcmp( filenames[i], "-" ) == 0 )
       {
       if( stdin_used ) continue; else stdin_used = true;
@@ -1076,12 +2224,18 @@ int main( const int argc, const char * const argv[] )
       {
       const int eindex = extension_index( input_filename = filenames[i] );
       infd = open_instream2( input_filename, &in_stats, program_mode,
-                             eindex, one_to_one, recompress );
+                             eindex, one_to_one,
+                             recompress || reencode_files );
       if( infd < 0 ) { set_retval( &retval, 1 ); continue; }
       if( !check_tty_in( pp.name, infd, program_mode, &retval ) ) continue;
       if( one_to_one )			/* open outfd after verifying infd */
         {
-        if( program_mode == m_compress )
+        if( program_mode == m_compress && reencode_files )
+          { output_filename = resize_buffer( output_filename,
+                              strlen( input_filename ) + 4 + 1 );
+            strcpy( output_filename, input_filename );
+            strcat( output_filename, ".tmp" ); }	/* renamed at the end */
+        else if( program_mode == m_compress )
           set_c_outname( input_filename, true, true, volume_size > 0 );
         else set_d_outname( input_filename, eindex );
         if( !open_outstream( force, true ) )
@@ -1107,12 +2261,32 @@ int main( const int argc, const char * const argv[] )
     in_statsp = ( input_filename[0] && one_to_one ) ? &in_stats : 0;
     cfile_size = ( input_filename[0] && S_ISREG( in_stats.st_mode ) ) ?
       ( in_stats.st_size + 99 ) / 100 : 0;
-    if( program_mode == m_compress )
+    if( print_stats )
+      { Cst_init( &stats ); wall_time = clock_time( CLOCK_MONOTONIC );
+        cpu_time = clock_time( CLOCK_PROCESS_CPUTIME_ID ); }
+    if( program_mode == m_compress && reencode_files )
+      tmp = reencode( cfile_size, member_size, infd, &encoder_options, &pp,
+                      num_workers, target_speed, zero, ignore_trailing,
+                      loose_trailing, print_stats ? &stats : 0 );
+    else if( program_mode == m_compress )
       tmp = compress( cfile_size, member_size, volume_size, infd,
-                      &encoder_options, &pp, in_statsp, zero );
+                      &encoder_options, &pp, in_statsp, num_workers,
+                      data_size, overlap, target_speed, zero,
+                      preset_filename ? &preset : 0,
+                      print_stats ? &stats : 0 );
+    else if( range_size > 0 )
+      tmp = decompress_range( infd, outfd, input_filename, &pp, range_pos,
+                              range_size, ignore_trailing, loose_trailing );
     else
-      tmp = decompress( cfile_size, infd, &pp, ignore_trailing,
-                        loose_trailing, program_mode == m_test );
+      tmp = decompress( cfile_size, infd, &pp, num_workers, mem_limit,
+                        ignore_trailing, loose_trailing,
+                        program_mode == m_test,
+                        preset_filename ? &preset : 0,
+                        print_stats ? &stats : 0 );
+    if( print_stats && tmp == 0 && range_size == 0 )
+      show_stats( pp.name, program_mode, &stats,
+                  clock_time( CLOCK_MONOTONIC ) - wall_time,
+                  clock_time( CLOCK_PROCESS_CPUTIME_ID ) - cpu_time );
     if( close( infd ) != 0 )
       { show_file_error( pp.name, "Error closing input file", errno );
         set_retval( &tmp, 1 ); }
@@ -1123,10 +2297,19 @@ int main( const int argc, const char * const argv[] )
 
     if( delete_output_on_interrupt && one_to_one )
       close_and_set_permissions( in_statsp );
-    if( input_filename[0] && !keep_input_files && one_to_one &&
+    if( input_filename[0] && one_to_one && reencode_files &&
+        program_mode == m_compress )		/* replace the input file */
+      {
+      if( rename( output_filename, input_filename ) != 0 )
+        { show_file_error( output_filename, "Can't rename output file",
+                           errno );
+          delete_output_on_interrupt = true; cleanup_and_fail( 1 ); }
+      }
+    else if( input_filename[0] && !keep_input_files && one_to_one &&
         ( program_mode != m_compress || volume_size == 0 ) )
       remove( input_filename );
     }
+  if( batch.items ) Bt_close( &batch );
   if( delete_output_on_interrupt ) close_and_set_permissions( 0 );	/* -o */
   else if( outfd >= 0 && close( outfd ) != 0 )				/* -c */
     {
@@ -1137,6 +2320,8 @@ int main( const int argc, const char * const argv[] )
     fprintf( stderr, "%s: warning: %d %s failed the test.\n",
              program_name, failed_tests,
              ( failed_tests == 1 ) ? "file" : "files" );
+  free_pooled_coders();
+  if( preset_filename ) free( (void *)preset.data );
   free( output_filename );
   free( filenames );
   ap_free( &parser );
@@ -0,0 +1,126 @@
+/* Clzip - LZMA lossless data compressor
+   Copyright (C) 2010-2021 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lzip.h"
+#include "decoder.h"
+#include "lzip_index.h"
+
+
+/* Decode the members of 'li' overlapping the uncompressed range
+   [udata_pos, udata_pos + udata_size), and write to 'outfd' (or pass to
+   flush_fn if not 0) only the data inside the range. 'rdec' must have been
+   initialized on infd, and 'decoder' as required by LZd_reinit; its buffer
+   is reused for all the members, and may be reused by the next call. If pp
+   is 0, no messages are printed. The file offset of infd is not changed.
+   Return value: 0 = OK, 1 = not enough memory,
+                 2 = the member at index '*bad_memberp' is corrupt.
+*/
+int Li_decode_range( const struct Lzip_index * const li,
+                     struct Range_decoder * const rdec,
+                     struct LZ_decoder * const decoder,
+                     const int outfd, Flush_fn * const flush_fn,
+                     void * const flush_arg,
+                     const long long udata_pos, const long long udata_size,
+                     struct Pretty_print * const pp,
+                     long * const bad_memberp )
+  {
+  const long long end = ( udata_size < Li_udata_size( li ) - udata_pos ) ?
+                        udata_pos + udata_size : Li_udata_size( li );
+  long i;
+
+  if( udata_pos >= end ) return 0;		/* empty range */
+  for( i = Li_find_member( li, udata_pos ); i < li->members; ++i )
+    {
+    const struct Block * const db = Li_dblock( li, i );
+    const struct Block * const mb = Li_mblock( li, i );
+    Lzip_header header;
+    int result;
+    if( db->pos >= end ) break;
+    Rd_set_block( rdec, mb->pos, mb->size );
+    if( Rd_read_data( rdec, header, Lh_size ) != Lh_size ||
+        !Lh_verify_magic( header ) || !Lh_verify_version( header ) )
+      { if( pp ) Pp_show_msg( pp, "Bad member header." );
+        *bad_memberp = i; return 2; }
+    if( !LZd_reinit( decoder, rdec, Li_dictionary_size( li, i ), outfd ) )
+      return 1;
+    decoder->flush_fn = flush_fn;
+    decoder->flush_arg = flush_arg;
+    if( udata_pos > db->pos ) decoder->outskip = udata_pos - db->pos;
+    decoder->outend = end - db->pos;
+    result = LZd_decode_member( decoder, pp );
+    if( result != 0 )
+      {
+      if( pp && verbosity >= 0 && result <= 2 )
+        {
+        Pp_show_msg( pp, 0 );
+        fprintf( stderr, "%s at pos %llu\n", ( result == 2 ) ?
+                 "File ends unexpectedly" : "Decoder error",
+                 mb->pos + Rd_member_position( rdec ) );
+        }
+      *bad_memberp = i; return 2;
+      }
+    }
+  return 0;
+  }
+
+
+/* Write to 'outfd' the 'udata_size' bytes of decompressed data starting at
+   'udata_pos', decoding only the members that overlap the range.
+   'filename' is used to find the sidecar index, if any.
+   Return value: 0 = OK, 1 = error, 2 = corrupt or invalid input file.
+*/
+int decompress_range( const int infd, const int outfd,
+                      const char * const filename,
+                      struct Pretty_print * const pp,
+                      const long long udata_pos, const long long udata_size,
+                      const bool ignore_trailing, const bool loose_trailing )
+  {
+  struct Lzip_index li;
+  struct Range_decoder rdec;
+  struct LZ_decoder decoder;
+  long bad_member = 0;
+  int retval;
+
+  if( !Li_init_cached( &li, infd, filename, ignore_trailing, loose_trailing,
+                       false ) )
+    {
+    Pp_show_msg( pp, li.error );
+    retval = li.retval; Li_free( &li ); return retval;
+    }
+  if( verbosity >= 1 ) Pp_show_msg( pp, 0 );
+  decoder.buffer = 0; decoder.buffer_size = 0;
+  if( !Rd_init( &rdec, infd ) ) retval = 1;
+  else
+    {
+    retval = Li_decode_range( &li, &rdec, &decoder, outfd, 0, 0, udata_pos,
+                              udata_size, pp, &bad_member );
+    LZd_free( &decoder );
+    Rd_free( &rdec );
+    }
+  if( retval == 1 ) Pp_show_msg( pp, mem_msg );
+  else if( retval == 0 && verbosity >= 1 ) fputs( "done\n", stderr );
+  Li_free( &li );
+  return retval;
+  }
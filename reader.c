@@ -0,0 +1,302 @@
+/* Clzip - LZMA lossless data compressor
+   Copyright (C) 2010-2021 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "lzip.h"
+
+
+/* Read-ahead input. A separate thread fills a ring of 'num_buffers'
+   blocks from the file while the coder consumes them, so that computation
+   overlaps with I/O, and a slow input (a pipe or a socket) may stall for
+   as long as it takes the coder to consume the blocks already read before
+   the coder has to wait. A block shorter than 'block_size' marks the end
+   of the input.
+   The thread reads whatever is available and polls the input together
+   with 'wake', so that Ar_close does not have to wait for a slow input to
+   fill the block being read. A read error is not reported by the reader
+   thread; it records errno and ends the input there, and the error is
+   reported by the thread calling Ar_read when it reaches that point.
+   Opened with Ar_open_fn, the thread runs a producer function instead,
+   which passes its data to Ar_write as they are produced, for example a
+   decoder feeding an encoder without a pipe between them.
+*/
+struct Async_reader
+  {
+  pthread_t thread;
+  pthread_mutex_t mutex;	/* protects 'full' and 'stop' */
+  pthread_cond_t cond;		/* 'full' or 'stop' have changed */
+  uint8_t ** buffer;		/* num_buffers blocks */
+  int * size;			/* bytes of data in each buffer */
+  bool * full;			/* buffer waiting to be consumed */
+  int num_buffers;
+  int block_size;		/* capacity of each buffer */
+  int use;			/* buffer being consumed by the coder */
+  int pos;			/* bytes of buffer[use] already consumed */
+  bool stop;			/* the coder wants no more data */
+  bool at_eof;			/* the coder has consumed all the data */
+  int error;			/* errno of the failed read, or -1 */
+  int fd;			/* input file, or -1 if produce_fn is set */
+  int wake[2];			/* pipe written by Ar_close if fd >= 0 */
+  Produce_fn * produce_fn;
+  void * produce_arg;
+  int fill;			/* buffer being filled by Ar_write */
+  int fill_size;		/* bytes of data already in buffer[fill] */
+  };
+
+
+static void Ar_free( struct Async_reader * const ar )
+  {
+  int i;
+  if( ar->wake[0] >= 0 ) { close( ar->wake[0] ); close( ar->wake[1] ); }
+  if( ar->buffer )
+    for( i = 0; i < ar->num_buffers; ++i ) free( ar->buffer[i] );
+  free( ar->full ); free( ar->size ); free( ar->buffer ); free( ar );
+  }
+
+
+/* Wait until buffer 'i' has been consumed. Return false if the coder
+   wants no more data. */
+static bool Ar_wait_empty( struct Async_reader * const ar, const int i )
+  {
+  bool stop;
+  pthread_mutex_lock( &ar->mutex );
+  while( ar->full[i] && !ar->stop )
+    pthread_cond_wait( &ar->cond, &ar->mutex );
+  stop = ar->stop;
+  pthread_mutex_unlock( &ar->mutex );
+  return !stop;
+  }
+
+
+static void Ar_set_full( struct Async_reader * const ar, const int i,
+                         const int size )
+  {
+  pthread_mutex_lock( &ar->mutex );
+  ar->size[i] = size;
+  ar->full[i] = true;
+  pthread_cond_signal( &ar->cond );
+  pthread_mutex_unlock( &ar->mutex );
+  }
+
+
+/* Fill buffer 'i' from the input, stopping early at end of file or on
+   error. Return the number of bytes read, or -1 if Ar_close has woken the
+   thread. */
+static int Ar_fill( struct Async_reader * const ar, const int i )
+  {
+  struct pollfd fds[2];
+  int sz = 0;
+  fds[0].fd = ar->fd; fds[0].events = POLLIN;
+  fds[1].fd = ar->wake[0]; fds[1].events = POLLIN;
+  while( sz < ar->block_size )
+    {
+    int n;
+    if( poll( fds, 2, -1 ) < 0 )
+      { if( errno == EINTR ) continue; ar->error = errno; break; }
+    if( fds[1].revents ) return -1;
+    n = read( ar->fd, ar->buffer[i] + sz, ar->block_size - sz );
+    if( n > 0 ) sz += n;
+    else if( n == 0 ) break;				/* end of file */
+    else if( errno != EINTR && errno != EAGAIN ) { ar->error = errno; break; }
+    }
+  return sz;
+  }
+
+
+static void * Ar_thread( void * arg )
+  {
+  struct Async_reader * const ar = (struct Async_reader *)arg;
+  int i = 0;
+  while( true )
+    {
+    int rd;
+    if( !Ar_wait_empty( ar, i ) ) break;
+    rd = Ar_fill( ar, i );
+    if( rd < 0 ) break;				/* closed */
+    Ar_set_full( ar, i, rd );
+    if( rd < ar->block_size ) break;		/* end of file or error */
+    if( ++i >= ar->num_buffers ) i = 0;
+    }
+  return 0;
+  }
+
+
+/* Flush_fn for the producer function. 'arg' is the Async_reader. The data
+   are discarded if the coder wants no more data. */
+void Ar_write( void * const arg, const uint8_t * const buf, const int size )
+  {
+  struct Async_reader * const ar = (struct Async_reader *)arg;
+  int sz = 0;
+  while( sz < size )
+    {
+    const int i = ar->fill;
+    const int n = min( size - sz, ar->block_size - ar->fill_size );
+    if( ar->fill_size == 0 && !Ar_wait_empty( ar, i ) ) return;
+    memcpy( ar->buffer[i] + ar->fill_size, buf + sz, n );
+    ar->fill_size += n;
+    sz += n;
+    if( ar->fill_size < ar->block_size ) break;
+    Ar_set_full( ar, i, ar->block_size );
+    if( ++ar->fill >= ar->num_buffers ) ar->fill = 0;
+    ar->fill_size = 0;
+    }
+  }
+
+
+static void * Ar_produce_thread( void * arg )
+  {
+  struct Async_reader * const ar = (struct Async_reader *)arg;
+  ar->fill = 0;
+  ar->fill_size = 0;
+  ar->produce_fn( ar->produce_arg, ar );
+  /* the last buffer, maybe empty, is shorter than block_size */
+  if( ar->fill_size > 0 || Ar_wait_empty( ar, ar->fill ) )
+    Ar_set_full( ar, ar->fill, ar->fill_size );
+  return 0;
+  }
+
+
+static struct Async_reader * Ar_start( const int fd,
+                                       Produce_fn * const produce_fn,
+                                       void * const produce_arg,
+                                       const int block_size,
+                                       const int num_buffers )
+  {
+  struct Async_reader * const ar =
+    (struct Async_reader *)calloc( 1, sizeof (struct Async_reader) );
+  sigset_t mask, old_mask;
+  int i, err;
+  if( !ar ) return 0;
+  ar->wake[0] = ar->wake[1] = -1;
+  ar->num_buffers = num_buffers;
+  ar->buffer = (uint8_t **)calloc( num_buffers, sizeof ar->buffer[0] );
+  ar->size = (int *)calloc( num_buffers, sizeof ar->size[0] );
+  ar->full = (bool *)calloc( num_buffers, sizeof ar->full[0] );
+  if( !ar->buffer || !ar->size || !ar->full ) { Ar_free( ar ); return 0; }
+  for( i = 0; i < num_buffers; ++i )
+    if( !( ar->buffer[i] = (uint8_t *)malloc( block_size ) ) )
+      { Ar_free( ar ); return 0; }
+  ar->block_size = block_size;
+  ar->use = 0;
+  ar->pos = 0;
+  ar->stop = false;
+  ar->at_eof = false;
+  ar->error = -1;
+  ar->fd = fd;
+  ar->produce_fn = produce_fn;
+  ar->produce_arg = produce_arg;
+  if( fd >= 0 && pipe( ar->wake ) != 0 )
+    { ar->wake[0] = ar->wake[1] = -1; Ar_free( ar ); return 0; }
+  pthread_mutex_init( &ar->mutex, 0 );
+  pthread_cond_init( &ar->cond, 0 );
+
+  /* let the main thread alone handle the signals that delete the output */
+  sigemptyset( &mask );
+  sigaddset( &mask, SIGHUP );
+  sigaddset( &mask, SIGINT );
+  sigaddset( &mask, SIGTERM );
+  pthread_sigmask( SIG_BLOCK, &mask, &old_mask );
+  err = pthread_create( &ar->thread, 0,
+                        produce_fn ? Ar_produce_thread : Ar_thread, ar );
+  pthread_sigmask( SIG_SETMASK, &old_mask, 0 );
+  if( err != 0 )
+    {
+    pthread_cond_destroy( &ar->cond );
+    pthread_mutex_destroy( &ar->mutex );
+    Ar_free( ar );
+    return 0;
+    }
+  return ar;
+  }
+
+
+/* Return 0 if not enough memory or if the thread or its wake pipe can't
+   be created. The caller should then read from 'fd' directly. 'num_buffers' must be at
+   least 2. */
+struct Async_reader * Ar_open( const int fd, const int block_size,
+                               const int num_buffers )
+  { return Ar_start( fd, 0, 0, block_size, num_buffers ); }
+
+
+/* Like Ar_open, but the data are produced by 'produce_fn', called once
+   from the reader thread with 'produce_arg' and the reader, to which it
+   must pass the data with Ar_write. The data end when it returns. */
+struct Async_reader * Ar_open_fn( Produce_fn * const produce_fn,
+                                  void * const produce_arg,
+                                  const int block_size, const int num_buffers )
+  { return Ar_start( -1, produce_fn, produce_arg, block_size, num_buffers ); }
+
+
+/* Read_fn for the coders. 'arg' is the Async_reader. */
+int Ar_read( void * const arg, uint8_t * const buf, const int size )
+  {
+  struct Async_reader * const ar = (struct Async_reader *)arg;
+  int sz = 0;
+  while( sz < size && !ar->at_eof )
+    {
+    const int i = ar->use;
+    int n;
+    pthread_mutex_lock( &ar->mutex );
+    while( !ar->full[i] ) pthread_cond_wait( &ar->cond, &ar->mutex );
+    pthread_mutex_unlock( &ar->mutex );
+    if( ar->error >= 0 && ar->size[i] < ar->block_size )
+      { show_error( "Read error", ar->error, false ); cleanup_and_fail( 1 ); }
+    n = min( size - sz, ar->size[i] - ar->pos );
+    memcpy( buf + sz, ar->buffer[i] + ar->pos, n );
+    ar->pos += n;
+    sz += n;
+    if( ar->pos < ar->size[i] ) break;		/* request satisfied */
+    if( ar->size[i] < ar->block_size ) { ar->at_eof = true; break; }
+    pthread_mutex_lock( &ar->mutex );		/* give the buffer back */
+    ar->full[i] = false;
+    pthread_cond_signal( &ar->cond );
+    pthread_mutex_unlock( &ar->mutex );
+    if( ++ar->use >= ar->num_buffers ) ar->use = 0;
+    ar->pos = 0;
+    }
+  return sz;
+  }
+
+
+/* Stop the reader thread and free the reader. Any data not yet consumed
+   are discarded. */
+void Ar_close( struct Async_reader * const ar )
+  {
+  if( !ar ) return;
+  pthread_mutex_lock( &ar->mutex );
+  ar->stop = true;
+  pthread_cond_signal( &ar->cond );
+  pthread_mutex_unlock( &ar->mutex );
+  if( ar->wake[1] >= 0 )		/* interrupt a read in progress */
+    while( write( ar->wake[1], "", 1 ) < 0 && errno == EINTR ) {}
+  if( pthread_join( ar->thread, 0 ) != 0 )
+    internal_error( "can't join reader thread." );
+  pthread_cond_destroy( &ar->cond );
+  pthread_mutex_destroy( &ar->mutex );
+  Ar_free( ar );
+  }
@@ -0,0 +1,391 @@
+/* Clzip - LZMA lossless data compressor
+   Copyright (C) 2010-2021 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lzip.h"
+#include "decoder.h"
+#include "encoder_base.h"
+#include "encoder.h"
+#include "fast_encoder.h"
+#include "lzip_index.h"
+
+
+/* Recompression of a seekable lzip file with new encoder options. The
+   members are located with Li_init_cached, and each one is decoded and
+   encoded again by a worker thread. The decoder of the worker runs in the
+   thread of an Async_reader opened with Ar_open_fn, and feeds its data to
+   the match finder of the encoder through the blocks of the reader, so
+   the data never cross a file descriptor. A member is encoded again as
+   one member, or as several if it is longer than the member size limit.
+   The new members are written in order; as in decompress_mt, a worker
+   that is not yet allowed to write keeps up to 'pending_limit' bytes in
+   memory and then waits for its turn. Trailing data, if any, are copied
+   unchanged after the last member.
+*/
+enum { pending_limit = 1 << 25,		/* 32 MiB */
+       feed_block_size = 1 << 16, feed_blocks = 8 };
+
+struct Rshared			/* data shared by all the worker threads */
+  {
+  const struct Lzip_index * li;
+  const struct Cmt_options * options;
+  pthread_mutex_t mutex;	/* protects the variables below */
+  pthread_cond_t oturn;		/* next_out or bad_member have changed */
+  long next_member;		/* next member to be recoded */
+  long next_out;		/* member allowed to write */
+  long bad_member;		/* first member that failed, or li->members */
+  bool mem_error;
+  int infd, outfd;
+  };
+
+struct Rworker
+  {
+  struct Rshared * rs;
+  struct Range_decoder rdec;
+  struct LZ_decoder decoder;	/* reused for all the members */
+  struct LZ_encoder * e;	/* reused for all the members */
+  struct FLZ_encoder * fe;
+  uint8_t * pending;		/* data waiting for our turn to be written */
+  int pending_size;
+  int pending_capacity;
+  long member;			/* member being recoded */
+  unsigned long long out_size;	/* bytes written by this worker */
+  struct Coder_stats stats;	/* added to options->stats at the end */
+  int dresult;			/* of LZd_decode_member; -1 = no memory */
+  bool my_turn;
+  bool discard;			/* a previous member failed; drop the data */
+  };
+
+
+static long Rs_next_member( struct Rshared * const rs )
+  {
+  long i = -1;
+  pthread_mutex_lock( &rs->mutex );
+  if( rs->next_member < rs->bad_member && !rs->mem_error )
+    i = rs->next_member++;
+  pthread_mutex_unlock( &rs->mutex );
+  return i;
+  }
+
+
+static void Rs_set_bad_member( struct Rshared * const rs, const long i,
+                               const bool mem_error )
+  {
+  pthread_mutex_lock( &rs->mutex );
+  if( mem_error ) rs->mem_error = true;
+  else if( rs->bad_member > i ) rs->bad_member = i;
+  pthread_cond_broadcast( &rs->oturn );		/* wake up waiting workers */
+  pthread_mutex_unlock( &rs->mutex );
+  }
+
+
+static void Rw_write( struct Rworker * const w,
+                      const uint8_t * const buf, const int size )
+  {
+  if( writeblock( w->rs->outfd, buf, size ) != size )
+    { show_error( "Write error", errno, false ); cleanup_and_fail( 1 ); }
+  w->out_size += size;
+  }
+
+
+/* Wait until the previous members have been written, then write the
+   pending data. If a previous member fails, discard the data instead. */
+static void Rw_wait_turn( struct Rworker * const w )
+  {
+  struct Rshared * const rs = w->rs;
+  pthread_mutex_lock( &rs->mutex );
+  while( rs->next_out != w->member && rs->bad_member > w->member &&
+         !rs->mem_error )
+    pthread_cond_wait( &rs->oturn, &rs->mutex );
+  w->my_turn = ( rs->next_out == w->member );
+  pthread_mutex_unlock( &rs->mutex );
+  if( !w->my_turn ) w->discard = true;
+  else if( w->pending_size > 0 ) Rw_write( w, w->pending, w->pending_size );
+  w->pending_size = 0;
+  }
+
+
+static void ordered_flush( void * const arg, const uint8_t * const buf,
+                           const int size )
+  {
+  struct Rworker * const w = (struct Rworker *)arg;
+  if( w->discard ) return;
+  if( !w->my_turn && w->pending_size + size > pending_limit )
+    Rw_wait_turn( w );
+  if( w->discard ) return;
+  if( w->my_turn ) { Rw_write( w, buf, size ); return; }
+  if( w->pending_size + size > w->pending_capacity )
+    {
+    const int new_capacity =
+      min( pending_limit, max( 2 * w->pending_capacity, w->pending_size + size ) );
+    w->pending = (uint8_t *)resize_buffer( w->pending, new_capacity );
+    w->pending_capacity = new_capacity;
+    }
+  memcpy( w->pending + w->pending_size, buf, size );
+  w->pending_size += size;
+  }
+
+
+/* Produce_fn run in the thread of the Async_reader 'ar'. Decode the member
+   'w->member' into 'ar'. */
+static void decode_member( void * const arg, struct Async_reader * const ar )
+  {
+  struct Rworker * const w = (struct Rworker *)arg;
+  const struct Lzip_index * const li = w->rs->li;
+  const struct Block * const mb = Li_mblock( li, w->member );
+  Lzip_header header;
+  Rd_set_block( &w->rdec, mb->pos, mb->size );
+  if( Rd_read_data( &w->rdec, header, Lh_size ) != Lh_size ||
+      !Lh_verify_magic( header ) || !Lh_verify_version( header ) )
+    { w->dresult = 2; return; }
+  if( !LZd_reinit( &w->decoder, &w->rdec,
+                   Li_dictionary_size( li, w->member ), -1 ) )
+    { w->dresult = -1; return; }
+  w->decoder.flush_fn = Ar_write;
+  w->decoder.flush_arg = ar;
+  w->dresult = LZd_decode_member( &w->decoder, 0 );
+  }
+
+
+/* Prepare the encoder of 'w', creating it if needed, to read from 'ar'.
+   Return 0 if not enough memory. */
+static struct LZ_encoder_base * Rw_init_encoder( struct Rworker * const w,
+                                                 struct Async_reader * const ar )
+  {
+  const struct Cmt_options * const options = w->rs->options;
+  struct LZ_encoder_base * eb;
+  if( options->zero )
+    {
+    if( w->fe )
+      {
+      w->fe->eb.mb.read_fn = Ar_read; w->fe->eb.mb.read_arg = ar;
+      if( !FLZe_reinit( w->fe, -1, 0, 0, -1 ) )
+        { free( w->fe ); w->fe = 0; return 0; }
+      }
+    else
+      {
+      struct FLZ_encoder * const fe =
+        (struct FLZ_encoder *)malloc( sizeof *fe );
+      if( !fe ) return 0;
+      fe->eb.mb.read_fn = Ar_read; fe->eb.mb.read_arg = ar;
+      if( !FLZe_init( fe, 0, -1, 0, 0, -1 ) ) { free( fe ); return 0; }
+      w->fe = fe;
+      }
+    eb = &w->fe->eb;
+    }
+  else
+    {
+    if( w->e )
+      {
+      w->e->eb.mb.read_fn = Ar_read; w->e->eb.mb.read_arg = ar;
+      if( !LZe_reinit( w->e, -1, 0, 0, -1 ) )
+        { free( w->e ); w->e = 0; return 0; }
+      }
+    else
+      {
+      struct LZ_encoder * const e = (struct LZ_encoder *)malloc( sizeof *e );
+      if( !e ) return 0;
+      e->eb.mb.read_fn = Ar_read; e->eb.mb.read_arg = ar;
+      if( !LZe_init( e, options->dictionary_size, options->match_len_limit,
+                     options->hash_chain, 0, -1, 0, 0, -1 ) )
+        { free( e ); return 0; }
+      LZe_set_target_speed( e, options->target_speed );
+      w->e = e;
+      }
+    eb = &w->e->eb;
+    }
+  eb->stats = options->stats ? &w->stats : 0;
+  eb->renc.flush_fn = ordered_flush;
+  eb->renc.flush_arg = w;
+  return eb;
+  }
+
+
+static void * rworker( void * arg )
+  {
+  struct Rworker * const w = (struct Rworker *)arg;
+  struct Rshared * const rs = w->rs;
+  const unsigned long long member_size = rs->options->member_size;
+  long i;
+
+  while( ( i = Rs_next_member( rs ) ) >= 0 )
+    {
+    struct Async_reader * ar;
+    struct LZ_encoder_base * eb;
+    w->member = i;
+    w->pending_size = 0;
+    w->my_turn = false;
+    w->discard = false;
+    w->dresult = 0;
+    ar = Ar_open_fn( decode_member, w, feed_block_size, feed_blocks );
+    if( !ar ) { Rs_set_bad_member( rs, i, true ); break; }
+    eb = Rw_init_encoder( w, ar );
+    if( !eb ) { Ar_close( ar ); Rs_set_bad_member( rs, i, true ); break; }
+    while( true )		/* encode one member per iteration */
+      {
+      if( ( w->fe && !FLZe_encode_member( w->fe, member_size ) ) ||
+          ( w->e && !LZe_encode_member( w->e, member_size ) ) )
+        internal_error( "encoder error in recompress_mt." );
+      if( Mb_data_finished( &eb->mb ) ) break;
+      if( w->fe ) FLZe_reset( w->fe ); else LZe_reset( w->e );
+      }
+    Ar_close( ar );		/* the decoder has already finished */
+    if( w->dresult != 0 )
+      { Rs_set_bad_member( rs, i, w->dresult < 0 ); break; }
+    if( !w->my_turn && !w->discard ) Rw_wait_turn( w );
+    if( w->discard ) break;
+    pthread_mutex_lock( &rs->mutex );
+    ++rs->next_out;
+    pthread_cond_broadcast( &rs->oturn );
+    pthread_mutex_unlock( &rs->mutex );
+    }
+  if( w->fe ) LZeb_free( &w->fe->eb );
+  if( w->e ) LZeb_free( &w->e->eb );
+  free( w->fe ); free( w->e );
+  LZd_free( &w->decoder );
+  Rd_free( &w->rdec );
+  return 0;
+  }
+
+
+/* Copy the trailing data of the file, if any, after the new members. */
+static bool copy_trailing_data( const struct Lzip_index * const li,
+                                const int infd, const int outfd,
+                                unsigned long long * const out_sizep )
+  {
+  enum { buffer_size = 65536 };
+  uint8_t buffer[buffer_size];
+  long long pos = Li_cdata_size( li );
+  while( pos < Li_file_size( li ) )
+    {
+    const int size = min( (long long)buffer_size, Li_file_size( li ) - pos );
+    if( preadblock( infd, buffer, size, pos ) != size )
+      { show_error( "Read error", errno, false ); return false; }
+    if( writeblock( outfd, buffer, size ) != size )
+      { show_error( "Write error", errno, false ); return false; }
+    pos += size; *out_sizep += size;
+    }
+  return true;
+  }
+
+
+/* Decode the members of a seekable file and encode their data again,
+   using up to 'options->num_workers' threads. 'filename' is used to find
+   the sidecar index, if any. The sizes of the data recoded and of the
+   output are returned in '*in_sizep' and '*out_sizep'.
+   Return value: 0 = OK, 1 = error already reported, 2 = a member failed
+   to decode; the caller must decode the file again to report why.
+*/
+int recompress_mt( const struct Cmt_options * const options,
+                   const int infd, const int outfd, const char * const filename,
+                   struct Pretty_print * const pp, const bool ignore_trailing,
+                   const bool loose_trailing,
+                   unsigned long long * const in_sizep,
+                   unsigned long long * const out_sizep )
+  {
+  struct Lzip_index li;
+  struct Rshared rs;
+  struct Rworker * workers;
+  pthread_t * threads;
+  struct stat st;
+  sigset_t mask, old_mask;
+  int i, num_started = 0, worker_count, retval = 0;
+
+  *in_sizep = 0; *out_sizep = 0;
+  if( fstat( infd, &st ) != 0 || !S_ISREG( st.st_mode ) ||
+      lseek( infd, 0, SEEK_CUR ) != 0 )
+    { Pp_show_msg( pp, "Only a regular file can be reencoded." ); return 1; }
+  if( !Li_init_cached( &li, infd, filename, ignore_trailing, loose_trailing,
+                       false ) )
+    { Pp_show_msg( pp, li.error ); retval = li.retval; Li_free( &li );
+      return retval; }
+  worker_count = max( 1, min( options->num_workers, li.members ) );
+  workers = (struct Rworker *)malloc( worker_count * sizeof workers[0] );
+  threads = (pthread_t *)malloc( worker_count * sizeof threads[0] );
+  if( !workers || !threads )
+    { free( threads ); free( workers ); Li_free( &li );
+      Pp_show_msg( pp, mem_msg ); return 1; }
+
+  rs.li = &li;
+  rs.options = options;
+  rs.next_member = 0;
+  rs.next_out = 0;
+  rs.bad_member = li.members;
+  rs.mem_error = false;
+  rs.infd = infd;
+  rs.outfd = outfd;
+  pthread_mutex_init( &rs.mutex, 0 );
+  pthread_cond_init( &rs.oturn, 0 );
+  if( verbosity >= 1 ) Pp_show_msg( pp, 0 );
+
+  /* let the main thread alone handle the signals that delete the output */
+  sigemptyset( &mask );
+  sigaddset( &mask, SIGHUP );
+  sigaddset( &mask, SIGINT );
+  sigaddset( &mask, SIGTERM );
+  pthread_sigmask( SIG_BLOCK, &mask, &old_mask );
+  for( i = 0; i < worker_count; ++i )
+    {
+    struct Rworker * const w = &workers[i];
+    w->rs = &rs;
+    if( !Rd_init( &w->rdec, infd ) ) break;
+    w->decoder.buffer = 0; w->decoder.buffer_size = 0;
+    w->e = 0; w->fe = 0;
+    w->pending = 0;
+    w->pending_size = 0;
+    w->pending_capacity = 0;
+    w->out_size = 0;
+    Cst_init( &w->stats );
+    if( pthread_create( &threads[i], 0, rworker, w ) != 0 )
+      { Rd_free( &w->rdec ); break; }
+    ++num_started;
+    }
+  pthread_sigmask( SIG_SETMASK, &old_mask, 0 );
+  if( num_started == 0 ) Rs_set_bad_member( &rs, 0, true );
+
+  for( i = 0; i < num_started; ++i )
+    {
+    if( pthread_join( threads[i], 0 ) != 0 )
+      internal_error( "can't join worker threads." );
+    free( workers[i].pending );
+    *out_sizep += workers[i].out_size;
+    if( options->stats ) Cst_merge( options->stats, &workers[i].stats );
+    }
+  if( rs.mem_error )
+    { Pp_show_msg( pp, "Not enough memory. Try a smaller dictionary size." );
+      retval = 1; }
+  else if( rs.bad_member < li.members ) retval = 2;
+  else if( !copy_trailing_data( &li, infd, outfd, out_sizep ) ) retval = 1;
+  else *in_sizep = Li_udata_size( &li );
+  pthread_cond_destroy( &rs.oturn );
+  pthread_mutex_destroy( &rs.mutex );
+  free( threads ); free( workers );
+  Li_free( &li );
+  return retval;
+  }
@@ -10,6 +10,7 @@ export LC_ALL
 objdir=`pwd`
 testdir=`cd "$1" ; pwd`
 LZIP="${objdir}"/clzip
+LZCHECK="${objdir}"/clzcheck
 framework_failure() { echo "failure in testing framework" ; exit 1 ; }
 
 if [ ! -f "${LZIP}" ] || [ ! -x "${LZIP}" ] ; then
@@ -201,10 +202,51 @@ rm -f copy2 || framework_failure
 "${LZIP}" -d "${in_lz}" "${in_lz}" -o copy2 || test_failed $LINENO
 cmp in2 copy2 || test_failed $LINENO
 rm -f copy2 || framework_failure
+cat "${in_lz}" "${in_lz}" > copy2.lz || framework_failure
+"${LZIP}" -t -n2 copy2.lz || test_failed $LINENO
+"${LZIP}" -cd -n2 copy2.lz | cmp in2 - || test_failed $LINENO
+"${LZIP}" -d -n2 copy2.lz -o copy2 || test_failed $LINENO
+cmp in2 copy2 || test_failed $LINENO
+"${LZIP}" -t -n3 --mem-limit=1 copy2.lz || test_failed $LINENO
+"${LZIP}" -cd -n3 --mem-limit=1 copy2.lz | cmp in2 - || test_failed $LINENO
+"${LZIP}" -t --mem-limit=0 copy2.lz || test_failed $LINENO
+dd if=in2 of=copy2 bs=1000 skip=36 count=2 2> /dev/null || framework_failure
+"${LZIP}" --range=36000,2000 copy2.lz > out || test_failed $LINENO
+cmp copy2 out || test_failed $LINENO
+"${LZIP}" -f --range=36000,2k copy2.lz -o out || test_failed $LINENO
+cmp copy2 out || test_failed $LINENO
+[ -e copy2.lz ] || test_failed $LINENO
+"${LZIP}" --range=0,100000 copy2.lz | cmp in2 - || test_failed $LINENO
+"${LZIP}" -q --range=36000 copy2.lz
+[ $? = 1 ] || test_failed $LINENO
+cat copy2.lz | "${LZIP}" -q --range=0,100 > out	# not seekable
+[ $? = 1 ] || test_failed $LINENO
+"${LZIP}" -q --write-index copy2.lz || test_failed $LINENO
+[ -e copy2.lz.idx ] || test_failed $LINENO
+"${LZIP}" -lq copy2.lz || test_failed $LINENO
+"${LZIP}" -t -n2 copy2.lz || test_failed $LINENO
+"${LZIP}" -cd -n2 copy2.lz | cmp in2 - || test_failed $LINENO
+"${LZIP}" --range=36000,2000 copy2.lz | cmp copy2 - || test_failed $LINENO
+printf "\377" | dd of=copy2.lz.idx bs=1 seek=40 conv=notrunc 2> /dev/null ||
+	framework_failure					# bad index
+"${LZIP}" -cd -n2 copy2.lz | cmp in2 - || test_failed $LINENO
+"${LZIP}" --range=36000,2000 copy2.lz | cmp copy2 - || test_failed $LINENO
+"${LZIP}" -q --write-index copy2.lz || test_failed $LINENO
+touch -r copy2.lz out || framework_failure
+cp copy2.lz copy || framework_failure		# same size and mtime, new inode
+printf "\377" | dd of=copy bs=1 seek=`expr \`wc -c < "${in_lz}"\` - 8` \
+	conv=notrunc 2> /dev/null || framework_failure	# bad first trailer
+mv -f copy copy2.lz && touch -r out copy2.lz || framework_failure
+"${LZIP}" -q --range=40000,100 copy2.lz > out	# stale index not used
+[ $? = 2 ] || test_failed $LINENO
+rm -f copy2 copy2.lz copy2.lz.idx out || framework_failure
 
 cat "${in_lz}" "${in_lz}" > copy2.lz || framework_failure
 printf "\ngarbage" >> copy2.lz || framework_failure
 "${LZIP}" -tvvvv copy2.lz 2> /dev/null || test_failed $LINENO
+"${LZIP}" -q --write-index copy2.lz
+[ $? = 1 ] || test_failed $LINENO
+[ ! -e copy2.lz.idx ] || test_failed $LINENO
 "${LZIP}" -alq copy2.lz
 [ $? = 2 ] || test_failed $LINENO
 "${LZIP}" -atq copy2.lz
@@ -222,6 +264,14 @@ printf "to be overwritten" > copy2 || framework_failure
 cmp in2 copy2 || test_failed $LINENO
 rm -f copy2 || framework_failure
 
+# parallel listing prints the same as serial listing, in the same order
+"${LZIP}" -lvv -n1 "${in_em}" nx_file.lz "${in_lz}" in "${in_em}" > out 2>&1
+[ $? = 2 ] || test_failed $LINENO
+"${LZIP}" -lvv -n3 "${in_em}" nx_file.lz "${in_lz}" in "${in_em}" > copy 2>&1
+[ $? = 2 ] || test_failed $LINENO
+cmp out copy || test_failed $LINENO
+rm -f out copy || framework_failure
+
 printf "\ntesting   compression..."
 
 "${LZIP}" -c -0 in in in -S100k -o out3.lz > copy2.lz || test_failed $LINENO
@@ -291,7 +341,186 @@ rm -f out out.lz00001.lz out.lz00002.lz || framework_failure
 "${LZIP}" -t in8.lz || test_failed $LINENO
 "${LZIP}" -cd in8.lz -o out | cmp in8 - || test_failed $LINENO	# override -o
 [ ! -e out ] || test_failed $LINENO
-rm -f in8 || framework_failure
+# a failed member writes the same partial output in parallel and serially
+cp in8.lz bad.lz || framework_failure
+printf "\377\377\377" | dd of=bad.lz bs=1 seek=50000 conv=notrunc 2> /dev/null ||
+	framework_failure
+"${LZIP}" -cdq -n1 bad.lz > copy
+[ $? = 2 ] || test_failed $LINENO
+"${LZIP}" -cdq -n3 bad.lz > out
+[ $? = 2 ] || test_failed $LINENO
+cmp copy out || test_failed $LINENO
+"${LZIP}" -cdq -n3 bad.lz | cmp copy - || test_failed $LINENO
+rm -f bad.lz copy out || framework_failure
+"${LZIP}" -c -n2 -B60k -s12 in8 > out.lz || test_failed $LINENO
+"${LZIP}" -cd out.lz | cmp in8 - || test_failed $LINENO
+"${LZIP}" -c -n3 -0 -B100k in8 > out.lz || test_failed $LINENO
+"${LZIP}" -cd out.lz | cmp in8 - || test_failed $LINENO
+"${LZIP}" -c --target-speed=1T in8 > out.lz || test_failed $LINENO
+"${LZIP}" -cd out.lz | cmp in8 - || test_failed $LINENO
+for i in -0 -1 -6 ; do
+	"${LZIP}" -c $i -n3 -B30KiB --overlap=20KiB in8 > out.lz ||
+		test_failed $LINENO $i
+	memb="`"${LZIP}" -lv out.lz | sed -n '2s/^ *[0-9]* [KMG]iB *\([0-9]*\) .*/\1/p'`"
+	[ "${memb}" = 1 ] || test_failed $LINENO "$i ${memb}"
+	"${LZIP}" -cd out.lz | cmp in8 - || test_failed $LINENO $i
+done
+"${LZIP}" -c -6 -n2 -B64KiB in8 > copy.lz || test_failed $LINENO
+"${LZIP}" -c -6 -n2 -B64KiB --overlap=64KiB in8 > out.lz || test_failed $LINENO
+[ "`wc -c < out.lz`" -lt "`wc -c < copy.lz`" ] || test_failed $LINENO
+"${LZIP}" -c -n2 --overlap=0 < /dev/null > out.lz || test_failed $LINENO
+"${LZIP}" -cd out.lz | cmp /dev/null - || test_failed $LINENO
+"${LZIP}" -cq -n2 -b100k --overlap=0 in > out.lz
+[ $? = 1 ] || test_failed $LINENO
+rm -f copy.lz out || framework_failure
+"${LZIP}" -c -9 -n2 -B100k --target-speed=1T in8 > out.lz ||
+	test_failed $LINENO
+"${LZIP}" -cd out.lz | cmp in8 - || test_failed $LINENO
+"${LZIP}" -c -9 in8 > copy.lz || test_failed $LINENO
+"${LZIP}" -c -9 --target-speed=1 in8 | cmp copy.lz - || test_failed $LINENO
+"${LZIP}" -c -9 --stats in8 2> cstats | cmp copy.lz - || test_failed $LINENO
+"${LZIP}" -t --stats copy.lz 2> dstats || test_failed $LINENO
+grep -q '^{"file":"in8","mode":"compress","members":1,' cstats ||
+	test_failed $LINENO
+grep -q '^{"file":"copy.lz","mode":"test","members":1,' dstats ||
+	test_failed $LINENO
+# the decoder must count the same symbols that the encoder coded
+sym='s/.*\("matches".*"distance_slots":\[[0-9,]*\]\).*/\1/'
+[ "`sed -e "${sym}" cstats`" = "`sed -e "${sym}" dstats`" ] ||
+	test_failed $LINENO
+rm -f copy.lz cstats dstats || framework_failure
+for i in 0 1 100KiB 4MiB ; do
+	cat in8.lz | "${LZIP}" -d --read-ahead=$i | cmp in8 - ||
+		test_failed $LINENO $i
+	cat in8 | "${LZIP}" -1 --read-ahead=$i | "${LZIP}" -d | cmp in8 - ||
+		test_failed $LINENO $i
+done
+cat in8.lz in8.lz | "${LZIP}" -t --read-ahead=64KiB || test_failed $LINENO
+# the reader must not wait for the rest of the input once it is not needed
+rm -f late || framework_failure
+( cat in8.lz in ; sleep 2 ; : > late ) |
+	{ "${LZIP}" -t --read-ahead=64KiB && [ ! -e late ] ; } ||
+	test_failed $LINENO
+rm -f late || framework_failure
+for i in 0 1 100KiB ; do
+	"${LZIP}" -cd --write-block=$i in8.lz | cmp in8 - || test_failed $LINENO $i
+	"${LZIP}" -c --write-block=$i in8 | "${LZIP}" -d | cmp in8 - ||
+		test_failed $LINENO $i
+done
+if [ -c /dev/full ] ; then		# the main thread reports write errors
+	"${LZIP}" -cdq in8.lz > /dev/full
+	[ $? = 1 ] || test_failed $LINENO
+	"${LZIP}" -cq in8 > /dev/full
+	[ $? = 1 ] || test_failed $LINENO
+fi
+# batch mode writes the same files and messages as coding one at a time
+cat in in > in2 || framework_failure
+cat in2 in2 > in4 || framework_failure
+for i in in in2 in4 ; do
+	"${LZIP}" -c $i > $i.ref || test_failed $LINENO $i
+done
+"${LZIP}" -k --jobs=3 -n2 in in2 in4 || test_failed $LINENO
+for i in in in2 in4 ; do
+	cmp $i.ref $i.lz || test_failed $LINENO $i
+	rm -f $i.ref || framework_failure
+done
+"${LZIP}" -kv -n1 in in2 nx_file in4 > out 2>&1	# outputs exist
+[ $? = 1 ] || test_failed $LINENO
+"${LZIP}" -kv --jobs=2 in in2 nx_file in4 > copy 2>&1
+[ $? = 1 ] || test_failed $LINENO
+cmp out copy || test_failed $LINENO
+cp in2.lz bad.lz || framework_failure
+printf "\377" | dd of=bad.lz bs=1 seek=1000 conv=notrunc 2> /dev/null ||
+	framework_failure
+"${LZIP}" -tv -n1 in.lz bad.lz nx_file.lz in2.lz > out 2>&1
+[ $? = 2 ] || test_failed $LINENO
+"${LZIP}" -tv --jobs=3 in.lz bad.lz nx_file.lz in2.lz > copy 2>&1
+[ $? = 2 ] || test_failed $LINENO
+cmp out copy || test_failed $LINENO
+rm -f in2 in4 || framework_failure
+"${LZIP}" -d --jobs=2 in2.lz in4.lz || test_failed $LINENO
+cat in in | cmp in2 - || test_failed $LINENO
+cat in2 in2 | cmp in4 - || test_failed $LINENO
+[ ! -e in2.lz ] || test_failed $LINENO
+"${LZIP}" -k in2 || test_failed $LINENO
+rm -f in2 || framework_failure
+"${LZIP}" -dq --jobs=2 bad.lz in2.lz
+[ $? = 2 ] || test_failed $LINENO
+[ ! -e bad ] || test_failed $LINENO
+[ ! -e in2 ] || test_failed $LINENO	# files after the error are untouched
+[ -e in2.lz ] || test_failed $LINENO
+rm -f in.lz in2.lz in4 bad.lz out copy || framework_failure
+# reencode
+"${LZIP}" -c -9 in8 > copy.lz || test_failed $LINENO
+"${LZIP}" -c -0 in8 > out.lz || test_failed $LINENO
+"${LZIP}" -9 --reencode out.lz || test_failed $LINENO
+cmp copy.lz out.lz || test_failed $LINENO
+[ ! -e out.lz.tmp ] || test_failed $LINENO
+"${LZIP}" -c -6 -n1 --reencode in8.lz > copy.lz || test_failed $LINENO
+"${LZIP}" -c -6 -n3 --reencode in8.lz > out.lz || test_failed $LINENO
+cmp copy.lz out.lz || test_failed $LINENO
+"${LZIP}" -cd out.lz | cmp in8 - || test_failed $LINENO
+printf "garbage" > trail || framework_failure
+cat in8.lz trail > copy.lz || framework_failure
+"${LZIP}" -c -n2 --reencode copy.lz > out.lz || test_failed $LINENO
+tail -c 7 out.lz | cmp trail - || test_failed $LINENO
+"${LZIP}" -cd out.lz | cmp in8 - || test_failed $LINENO
+printf "\377" | dd of=copy.lz bs=1 seek=1000 conv=notrunc 2> /dev/null ||
+	framework_failure
+cp copy.lz bad.lz || framework_failure
+"${LZIP}" -q -n2 --reencode bad.lz
+[ $? = 2 ] || test_failed $LINENO
+cmp copy.lz bad.lz || test_failed $LINENO	# input untouched
+[ ! -e bad.lz.tmp ] || test_failed $LINENO
+cat in8.lz | "${LZIP}" -q --reencode > out.lz
+[ $? = 1 ] || test_failed $LINENO
+"${LZIP}" -q -k --reencode in8.lz
+[ $? = 1 ] || test_failed $LINENO
+rm -f copy.lz out.lz bad.lz trail || framework_failure
+# preset dictionary
+head -c 20000 in > dict || framework_failure
+for i in -0 -6 ; do
+	"${LZIP}" -c $i --preset-dict=dict in > copy.lz || test_failed $LINENO $i
+	"${LZIP}" -cd --preset-dict=dict copy.lz | cmp in - ||
+		test_failed $LINENO $i
+	"${LZIP}" -t -n2 --preset-dict=dict copy.lz || test_failed $LINENO $i
+	"${LZIP}" -t -q copy.lz
+	[ $? = 2 ] || test_failed $LINENO $i
+	"${LZIP}" -t -q --preset-dict=in copy.lz
+	[ $? = 2 ] || test_failed $LINENO $i
+	rm -f out || framework_failure
+	"${LZIP}" -cdq copy.lz > out
+	[ $? = 2 ] || test_failed $LINENO $i
+	[ ! -s out ] || test_failed $LINENO $i
+	"${LZIP}" -lq copy.lz
+	[ $? = 2 ] || test_failed $LINENO $i
+	"${LZIP}" -cdq --range=0,1 copy.lz
+	[ $? = 2 ] || test_failed $LINENO $i
+	"${LZIP}" -q --reencode -c copy.lz > out
+	[ $? = 2 ] || test_failed $LINENO $i
+done
+"${LZIP}" -cdq --preset-dict=dict "${in_lz}" > out
+[ $? = 2 ] || test_failed $LINENO
+[ ! -s out ] || test_failed $LINENO
+"${LZIP}" -c -6 in > out.lz || test_failed $LINENO
+"${LZIP}" -c -6 --preset-dict=dict in > copy.lz || test_failed $LINENO
+[ "`wc -c < copy.lz`" -lt "`wc -c < out.lz`" ] || test_failed $LINENO
+"${LZIP}" -c -0 -n2 -B10KiB --preset-dict=in8 in8 > copy.lz ||
+	test_failed $LINENO
+"${LZIP}" -cd -n2 --preset-dict=in8 copy.lz | cmp in8 - ||
+	test_failed $LINENO
+"${LZIP}" -cdq -n2 copy.lz > out
+[ $? = 2 ] || test_failed $LINENO
+[ ! -s out ] || test_failed $LINENO
+"${LZIP}" -c --preset-dict=dict < /dev/null > copy.lz || test_failed $LINENO
+"${LZIP}" -cd --preset-dict=dict copy.lz | cmp /dev/null - ||
+	test_failed $LINENO
+"${LZIP}" -cdq --preset-dict=nx_file copy.lz
+[ $? = 1 ] || test_failed $LINENO
+"${LZIP}" -cdq --preset-dict=dict --range=0,1 copy.lz
+[ $? = 1 ] || test_failed $LINENO
+rm -f copy.lz || framework_failure
+rm -f in8 out.lz || framework_failure
 "${LZIP}" -0 -S100k -o out < in8.lz || test_failed $LINENO
 "${LZIP}" -t out00001.lz out00002.lz || test_failed $LINENO
 "${LZIP}" -cd out00001.lz out00002.lz | cmp in8.lz - || test_failed $LINENO
@@ -311,6 +540,18 @@ rm -f in8.lz00001.lz in8.lz00002.lz || framework_failure
 "${LZIP}" -t in8.lz.lz || test_failed $LINENO
 "${LZIP}" -cd in8.lz.lz | cmp in8.lz - || test_failed $LINENO
 rm -f in8.lz in8.lz.lz || framework_failure
+# incompressible data followed by text (literal runs)
+for i in 0 1 2 3 4 5 6 7 8 9 ; do
+	"${LZIP}" -$i -s16KiB < in || framework_failure
+done > in.lzs
+cat in.lzs in in.lzs in > mix || framework_failure
+for i in 0 1 6 ; do
+	"${LZIP}" -c -$i mix > out.lz || test_failed $LINENO $i
+	"${LZIP}" -cd out.lz | cmp mix - || test_failed $LINENO $i
+	"${LZIP}" -c -$i -b100k mix > out.lz || test_failed $LINENO $i
+	"${LZIP}" -cd out.lz | cmp mix - || test_failed $LINENO $i
+done
+rm -f in.lzs mix out.lz || framework_failure
 
 printf "\ntesting bad input..."
 
@@ -374,6 +615,8 @@ for i in fox_v2.lz fox_s11.lz fox_de20.lz \
 	"${LZIP}" -tq "${testdir}"/$i
 	[ $? = 2 ] || test_failed $LINENO $i
 done
+"${LZIP}" -lq "${testdir}"/fox_v2.lz
+[ $? = 2 ] || test_failed $LINENO
 
 "${LZIP}" -cd "${fox_lz}" > fox || test_failed $LINENO
 for i in fox_bcrc.lz fox_crc0.lz fox_das46.lz fox_mes81.lz ; do
@@ -381,6 +624,10 @@ for i in fox_bcrc.lz fox_crc0.lz fox_das46.lz fox_mes81.lz ; do
 	[ $? = 2 ] || test_failed $LINENO $i
 	cmp fox out || test_failed $LINENO $i
 done
+cat "${in_lz}" "${testdir}"/fox_bcrc.lz > in2.lz || framework_failure
+"${LZIP}" -tq -n2 in2.lz
+[ $? = 2 ] || test_failed $LINENO
+rm -f in2.lz || framework_failure
 rm -f fox out || framework_failure
 
 cat "${in_lz}" "${in_lz}" > in2.lz || framework_failure
@@ -426,6 +673,55 @@ cmp in copy || test_failed $LINENO
 cmp in copy || test_failed $LINENO
 rm -f copy ingin.lz out || framework_failure
 
+printf "\ntesting libclzip..."
+
+"${LZCHECK}" in || test_failed $LINENO
+for i in 0 2 6 9 ; do
+	"${LZCHECK}" -c $i < in > out.lz || test_failed $LINENO $i
+	"${LZIP}" -c -$i in > copy.lz || test_failed $LINENO $i
+	cmp out.lz copy.lz || test_failed $LINENO $i
+done
+"${LZCHECK}" -d < "${in_lz}" > copy || test_failed $LINENO
+cmp in copy || test_failed $LINENO
+"${LZCHECK}" -d < "${in_em}" > copy || test_failed $LINENO
+cmp in copy || test_failed $LINENO
+cat "${in_lz}" "${in_lz}" > out.lz || framework_failure
+printf "garbage" >> out.lz || framework_failure
+"${LZCHECK}" -d < out.lz > copy || test_failed $LINENO
+cat in in | cmp - copy || test_failed $LINENO
+"${LZCHECK}" -d < in 2> /dev/null
+[ $? = 2 ] || test_failed $LINENO
+"${LZCHECK}" -d < /dev/null 2> /dev/null
+[ $? = 2 ] || test_failed $LINENO
+for i in fox_bcrc.lz fox_crc0.lz fox_das46.lz fox_mes81.lz fox_s11.lz ; do
+	"${LZCHECK}" -d < "${testdir}"/$i > /dev/null 2>&1
+	[ $? = 2 ] || test_failed $LINENO $i
+done
+for i in 0 6 ; do
+	"${LZCHECK}" -c $i dict < in > out.lz || test_failed $LINENO $i
+	"${LZIP}" -c -$i --preset-dict=dict in > copy.lz || test_failed $LINENO $i
+	cmp out.lz copy.lz || test_failed $LINENO $i
+	"${LZCHECK}" -d dict < out.lz | cmp in - || test_failed $LINENO $i
+	"${LZCHECK}" -d < out.lz > /dev/null 2>&1
+	[ $? = 2 ] || test_failed $LINENO $i
+done
+cat "${in_lz}" "${in_lz}" > out.lz || framework_failure
+cat in in > in2 || framework_failure
+for i in 0,36000 36000,2000 70000,30000 100000,100 ; do
+	"${LZIP}" --range=$i out.lz > copy || test_failed $LINENO $i
+	"${LZCHECK}" -r `echo $i | tr , ' '` out.lz | cmp copy - ||
+		test_failed $LINENO $i
+done
+"${LZCHECK}" -r 0 100000 out.lz | cmp in2 - || test_failed $LINENO
+"${LZCHECK}" -r 0 10 in 2> /dev/null
+[ $? = 2 ] || test_failed $LINENO
+cat "${in_lz}" > out.lz || framework_failure
+printf "\377" | dd of=out.lz bs=1 seek=1000 conv=notrunc 2> /dev/null ||
+	framework_failure
+"${LZCHECK}" -r 0 10 out.lz 2> /dev/null
+[ $? = 2 ] || test_failed $LINENO
+rm -f copy copy.lz out.lz in2 dict || framework_failure
+
 echo
 if [ ${fail} = 0 ] ; then
 	echo "tests completed successfully."
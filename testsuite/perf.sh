@@ -0,0 +1,203 @@
+#! /bin/sh
+# performance regression suite for Clzip - LZMA lossless data compressor
+# Copyright (C) 2010-2021 Antonio Diaz Diaz.
+#
+# This script is free software: you have unlimited permission
+# to copy, distribute, and modify it.
+#
+# Usage: perf.sh testdir baseline_file version [update|update-sizes]
+#
+# Compresses and decompresses a fixed corpus at several levels and in
+# several modes, and compares the compressed size, the times, and the peak
+# memory of each case with those stored in baseline_file. A case is a
+# regression if any of them is worse than in the baseline by more than its
+# tolerance. With 'update', the baseline is replaced by the new results.
+# The baseline records the host and the number of CPUs that measured it;
+# on any other machine only the compressed sizes are compared. With
+# 'update-sizes', only the sizes are stored, with 0 as times and memory,
+# which are never compared. The testsuite/perf.base distributed is made
+# this way; type 'make perf-baseline' to measure your machine.
+#
+# The corpus is test.txt ("real"), synthetic text, binary, and random
+# files of each size in PERF_SIZES made by 'clzip_bench --generate', and a
+# set of 256 small files of 4 KiB ("small"). The modes are "file" (a
+# regular file, which is mapped when compressing, with -n1), "pipe" (the
+# same file read from a pipe, with -n1), and "mt" (a regular file with
+# -n PERF_THREADS and -B1MiB, so that the files of 4 MiB are split at all
+# levels, or --jobs=PERF_THREADS for the small files).
+#
+# Variables, with their defaults:
+#   PERF_SIZES="64KiB 1MiB 4MiB"  PERF_LEVELS="0 1 3 6 9"
+#   PERF_MODES="file pipe mt"     PERF_THREADS=4  PERF_RUNS=3 (best of)
+#   PERF_SIZE_TOL=0.5  PERF_TIME_TOL=15  PERF_MEM_TOL=10  (percent)
+# Times within 5 ms and peak RSS within 1 MiB of the baseline are never
+# regressions.
+
+LC_ALL=C
+export LC_ALL
+objdir=`pwd`
+testdir=`cd "$1" ; pwd`
+baseline="$2"
+LZIP="${objdir}"/clzip
+BENCH="${objdir}"/clzip_bench
+framework_failure() { echo "failure in testing framework" ; exit 1 ; }
+
+: ${PERF_SIZES="64KiB 1MiB 4MiB"}
+: ${PERF_LEVELS="0 1 3 6 9"}
+: ${PERF_MODES="file pipe mt"}
+: ${PERF_THREADS=4}
+: ${PERF_RUNS=3}
+: ${PERF_SIZE_TOL=0.5}
+: ${PERF_TIME_TOL=15}
+: ${PERF_MEM_TOL=10}
+
+for i in "${LZIP}" "${BENCH}" ; do
+	if [ ! -f "$i" ] || [ ! -x "$i" ] ; then
+		echo "$i: cannot execute"
+		exit 1
+	fi
+done
+case "${baseline}" in /*) ;; *) baseline="${objdir}/${baseline}" ;; esac
+compare="${baseline}"
+[ -f "${baseline}" ] && [ -z "$4" ] || compare=/dev/null
+machine="`uname -nsm` cpus=`getconf _NPROCESSORS_ONLN 2> /dev/null`"
+sizes_only=0
+if [ "${compare}" != /dev/null ] ; then
+	base_machine=`sed -n 's/^# machine: //p' "${compare}"`
+	if [ "${base_machine}" != "${machine}" ] ; then
+		sizes_only=1
+		echo "baseline made on '${base_machine}', not on '${machine}';"
+		echo "comparing only the compressed sizes."
+	fi
+fi
+
+if [ -d tmp_perf ] ; then rm -rf tmp_perf ; fi
+mkdir tmp_perf
+cd "${objdir}"/tmp_perf || framework_failure
+
+printf "building corpus..."
+cat "${testdir}"/test.txt > real-36KiB || framework_failure
+files=real-36KiB
+for kind in text binary random ; do
+	for size in ${PERF_SIZES} ; do
+		"${BENCH}" --generate=${kind} ${size} 1 "${testdir}"/test.txt \
+			> ${kind}-${size} || framework_failure
+		files="${files} ${kind}-${size}"
+	done
+done
+mkdir small smallz || framework_failure
+i=100
+while [ $i -lt 228 ] ; do
+	"${BENCH}" --generate=text 4KiB $i "${testdir}"/test.txt > small/t$i &&
+	"${BENCH}" --generate=binary 4KiB $i "${testdir}"/test.txt \
+		> small/b$i || framework_failure
+	i=`expr $i + 1`
+done
+echo
+
+# run the command given PERF_RUNS times; set 'secs' to the shortest
+# elapsed time and 'kib' to the smallest peak RSS
+measure() {
+	secs= ; kib= ; run=0
+	while [ ${run} -lt ${PERF_RUNS} ] ; do
+		"$@" || return 1
+		read t m < timing || return 1
+		if [ -z "${secs}" ] ; then secs=$t ; kib=$m
+		else secs=`echo "${secs} $t" | awk '{ print ($2 < $1) ? $2 : $1 }'`
+		     [ $m -lt ${kib} ] && kib=$m
+		fi
+		run=`expr ${run} + 1`
+	done
+	return 0
+}
+
+timed() { "${BENCH}" --run=timing "${LZIP}" -q "$@" ; }
+enc_file() { timed -c -${level} -n1 "$1" > out.lz ; }
+enc_pipe() { cat "$1" | timed -c -${level} -n1 > out.lz ; }
+enc_mt() { timed -c -${level} -n${PERF_THREADS} -B1MiB "$1" > out.lz ; }
+dec_file() { timed -cd -n1 out.lz > out ; }
+dec_pipe() { cat out.lz | timed -cd -n1 > out ; }
+dec_mt() { timed -cd -n${PERF_THREADS} out.lz > out ; }
+enc_small() { timed -kf -${level} ${jobs} small/[bt]??? ; }
+dec_small() { timed -dkf ${jobs} smallz/[bt]???.lz ; }
+
+# compare a result with the baseline, print it, and append it to results
+regressions=0
+report() {
+	echo "$1 $2 ${enc_secs} ${secs} ${enc_kib} ${kib}" >> results
+	status=`awk -v key="$1" -v csize="$2" -v esecs="${enc_secs}" \
+	  -v dsecs="${secs}" -v ekib="${enc_kib}" -v dkib="${kib}" \
+	  -v size_tol="${PERF_SIZE_TOL}" -v time_tol="${PERF_TIME_TOL}" \
+	  -v mem_tol="${PERF_MEM_TOL}" -v sizes_only="${sizes_only}" '
+	  function worse( new, old, tol, floor, name ) {
+	    if( old > 0 && new > old * ( 1 + tol / 100 ) + floor )
+	      msg = msg sprintf( " %s%+.1f%%", name, ( new - old ) * 100 / old )
+	  }
+	  $1 == key { found = 1
+	    worse( csize, $2, size_tol, 0, "size" )
+	    if( sizes_only ) next
+	    worse( esecs, $3, time_tol, 0.005, "enc" )
+	    worse( dsecs, $4, time_tol, 0.005, "dec" )
+	    worse( ekib, $5, mem_tol, 1024, "enc_mem" )
+	    worse( dkib, $6, mem_tol, 1024, "dec_mem" ) }
+	  END { if( !found ) print "new"
+	        else if( msg != "" ) print "REGRESSION:" msg
+	        else print "ok" }' "${compare}"`
+	case "${status}" in REGRESSION*) regressions=`expr ${regressions} + 1` ;;
+	esac
+	echo "$1 $2 $3 ${enc_secs} ${secs} ${enc_kib} ${kib}" | awk '
+	  function mbs( secs ) { return $3 / ( ( secs > 0 ) ? secs : 1e-6 ) / 1e6 }
+	  { printf "%-22s %7.3f%% %9.2f %9.2f %8d %8d  ", $1, $2 * 100 / $3,
+	    mbs( $4 ), mbs( $5 ), $6, $7 }'
+	echo "${status}"
+}
+
+printf "%-22s %8s %9s %9s %8s %8s  %s\n" "case" "ratio" "enc MB/s" \
+	"dec MB/s" "enc KiB" "dec KiB" "status"
+rm -f results
+for level in ${PERF_LEVELS} ; do
+	for mode in ${PERF_MODES} ; do
+		for file in ${files} ; do
+			measure enc_${mode} ${file} || framework_failure
+			enc_secs=${secs} ; enc_kib=${kib}
+			measure dec_${mode} ${file} || framework_failure
+			cmp ${file} out || framework_failure
+			report `echo ${file} | sed 's,-,/,'`/${mode}/${level} \
+				`wc -c < out.lz` `wc -c < ${file}`
+		done
+		[ "${mode}" = pipe ] && continue
+		jobs= ; [ "${mode}" = mt ] && jobs=--jobs=${PERF_THREADS}
+		measure enc_small || framework_failure
+		enc_secs=${secs} ; enc_kib=${kib}
+		rm -f smallz/* || framework_failure
+		mv small/*.lz smallz || framework_failure
+		measure dec_small || framework_failure
+		for i in small/[bt]??? ; do
+			cmp $i smallz/${i#small/} || framework_failure
+		done
+		report small/256x4KiB/${mode}/${level} `cat smallz/*.lz | wc -c` \
+			`cat small/[bt]??? | wc -c`
+	done
+done
+
+if [ "$4" = update ] || [ "$4" = update-sizes ] ; then
+	if [ "$4" = update-sizes ] ; then
+		awk '{ print $1, $2, 0, 0, 0, 0 }' results > sizes &&
+		mv sizes results || framework_failure
+		machine=none
+	fi
+	{ echo "# clzip-$3 performance baseline"
+	  echo "# machine: ${machine}"
+	  echo "# case compressed_size enc_secs dec_secs enc_kib dec_kib"
+	  cat results ; } > "${baseline}" || framework_failure
+	echo "baseline written to ${baseline}"
+	fail=0
+elif [ ${regressions} = 0 ] ; then
+	echo "no performance regressions."
+	fail=0
+else
+	echo "${regressions} performance regressions."
+	fail=1
+fi
+cd "${objdir}" && rm -r tmp_perf
+exit ${fail}
@@ -0,0 +1,181 @@
+/* Clzip - LZMA lossless data compressor
+   Copyright (C) 2010-2021 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lzip.h"
+
+
+/* Double-buffered output. The coder fills one buffer while a separate
+   thread writes the other one to the file, so that computation overlaps
+   with I/O. Buffers are written in the same order as they are filled.
+   A write error is not reported by the writer thread; it records errno,
+   discards the rest of the data, and the error is reported (and the
+   output deleted) by the thread calling Aw_write or Aw_close.
+*/
+struct Async_writer
+  {
+  pthread_t thread;
+  pthread_mutex_t mutex;	/* protects 'full' and 'finished' */
+  pthread_cond_t cond;		/* 'full' or 'finished' have changed */
+  uint8_t * buffer[2];
+  int size[2];			/* bytes of data in each buffer */
+  int block_size;		/* capacity of each buffer */
+  int fill;			/* buffer being filled by the coder */
+  bool full[2];			/* buffer waiting to be written */
+  bool finished;		/* no more data will be produced */
+  int error;			/* errno of the first failed write, or -1 */
+  int fd;
+  };
+
+
+static void * Aw_thread( void * arg )
+  {
+  struct Async_writer * const aw = (struct Async_writer *)arg;
+  int i = 0;
+  while( true )
+    {
+    pthread_mutex_lock( &aw->mutex );
+    while( !aw->full[i] && !aw->finished )
+      pthread_cond_wait( &aw->cond, &aw->mutex );
+    pthread_mutex_unlock( &aw->mutex );
+    if( !aw->full[i] ) break;			/* finished */
+    while( aw->error < 0 &&	/* error is only written by this thread */
+           writeblock( aw->fd, aw->buffer[i], aw->size[i] ) != aw->size[i] )
+      {
+      pthread_mutex_lock( &aw->mutex );
+      aw->error = errno ? errno : EIO;
+      pthread_mutex_unlock( &aw->mutex );
+      }
+    pthread_mutex_lock( &aw->mutex );
+    aw->size[i] = 0;
+    aw->full[i] = false;
+    pthread_cond_signal( &aw->cond );
+    pthread_mutex_unlock( &aw->mutex );
+    i ^= 1;
+    }
+  return 0;
+  }
+
+
+static void Aw_check_error( const int error )
+  {
+  if( error >= 0 )
+    { show_error( "Write error", error, false ); cleanup_and_fail( 1 ); }
+  }
+
+
+/* Pass the buffer being filled to the writer thread, and wait until the
+   other buffer has been written. */
+static void Aw_submit( struct Async_writer * const aw )
+  {
+  int error;
+  pthread_mutex_lock( &aw->mutex );
+  aw->full[aw->fill] = true;
+  pthread_cond_signal( &aw->cond );
+  aw->fill ^= 1;
+  while( aw->full[aw->fill] ) pthread_cond_wait( &aw->cond, &aw->mutex );
+  error = aw->error;
+  pthread_mutex_unlock( &aw->mutex );
+  Aw_check_error( error );
+  }
+
+
+/* Return 0 if not enough memory or if the thread can't be created. The
+   caller should then write to 'fd' directly. */
+struct Async_writer * Aw_open( const int fd, const int block_size )
+  {
+  struct Async_writer * const aw =
+    (struct Async_writer *)malloc( sizeof (struct Async_writer) );
+  sigset_t mask, old_mask;
+  int err;
+  if( !aw ) return 0;
+  aw->buffer[0] = (uint8_t *)malloc( block_size );
+  aw->buffer[1] = aw->buffer[0] ? (uint8_t *)malloc( block_size ) : 0;
+  if( !aw->buffer[1] ) { free( aw->buffer[0] ); free( aw ); return 0; }
+  aw->size[0] = aw->size[1] = 0;
+  aw->block_size = block_size;
+  aw->fill = 0;
+  aw->full[0] = aw->full[1] = false;
+  aw->finished = false;
+  aw->error = -1;
+  aw->fd = fd;
+  pthread_mutex_init( &aw->mutex, 0 );
+  pthread_cond_init( &aw->cond, 0 );
+
+  /* let the main thread alone handle the signals that delete the output */
+  sigemptyset( &mask );
+  sigaddset( &mask, SIGHUP );
+  sigaddset( &mask, SIGINT );
+  sigaddset( &mask, SIGTERM );
+  pthread_sigmask( SIG_BLOCK, &mask, &old_mask );
+  err = pthread_create( &aw->thread, 0, Aw_thread, aw );
+  pthread_sigmask( SIG_SETMASK, &old_mask, 0 );
+  if( err != 0 )
+    {
+    pthread_cond_destroy( &aw->cond );
+    pthread_mutex_destroy( &aw->mutex );
+    free( aw->buffer[1] ); free( aw->buffer[0] ); free( aw );
+    return 0;
+    }
+  return aw;
+  }
+
+
+/* Flush_fn for the coders. 'arg' is the Async_writer. */
+void Aw_write( void * const arg, const uint8_t * const buf, const int size )
+  {
+  struct Async_writer * const aw = (struct Async_writer *)arg;
+  int sz = 0;
+  while( sz < size )
+    {
+    const int i = aw->fill;
+    const int n = min( size - sz, aw->block_size - aw->size[i] );
+    memcpy( aw->buffer[i] + aw->size[i], buf + sz, n );
+    aw->size[i] += n;
+    sz += n;
+    if( aw->size[i] >= aw->block_size ) Aw_submit( aw );
+    }
+  }
+
+
+/* Write the remaining data and free the writer. */
+void Aw_close( struct Async_writer * const aw )
+  {
+  int error;
+  if( !aw ) return;
+  if( aw->size[aw->fill] > 0 ) Aw_submit( aw );
+  pthread_mutex_lock( &aw->mutex );
+  aw->finished = true;
+  pthread_cond_signal( &aw->cond );
+  pthread_mutex_unlock( &aw->mutex );
+  if( pthread_join( aw->thread, 0 ) != 0 )
+    internal_error( "can't join writer thread." );
+  error = aw->error;
+  pthread_cond_destroy( &aw->cond );
+  pthread_mutex_destroy( &aw->mutex );
+  free( aw->buffer[1] ); free( aw->buffer[0] ); free( aw );
+  Aw_check_error( error );
+  }